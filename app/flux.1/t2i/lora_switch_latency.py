@@ -0,0 +1,65 @@
+import argparse
+import time
+
+import torch
+
+from nunchaku import NunchakuFluxTransformer2dModel
+from nunchaku.utils import fetch_or_download, get_precision
+
+
+def get_args() -> argparse.Namespace:
+    parser = argparse.ArgumentParser()
+    parser.add_argument(
+        "-p", "--precision", type=str, default="auto", choices=["auto", "int4", "fp4"], help="Which precision to use"
+    )
+    parser.add_argument(
+        "--loras",
+        type=str,
+        nargs="+",
+        default=[
+            "XLabs-AI/flux-RealismLora/lora.safetensors",
+            "aleksa-codes/flux-ghibsky-illustration/lora.safetensors",
+        ],
+        help="LoRAs to switch between",
+    )
+    parser.add_argument("--on-device", action="store_true", help="Keep LoRA slots in device memory")
+    parser.add_argument("--test-times", type=int, default=10, help="Number of switches per LoRA")
+    return parser.parse_args()
+
+
+def measure(fn, times: int) -> float:
+    torch.cuda.synchronize()
+    start_time = time.time()
+    for _ in range(times):
+        fn()
+    torch.cuda.synchronize()
+    return (time.time() - start_time) / times
+
+
+def main():
+    args = get_args()
+    precision = get_precision(args.precision)
+    transformer = NunchakuFluxTransformer2dModel.from_pretrained(f"mit-han-lab/svdq-{precision}-flux.1-dev")
+
+    paths = [fetch_or_download(lora) for lora in args.loras]
+
+    transformer.save_lora_slot("base", on_device=args.on_device)
+    for i, path in enumerate(paths):
+        transformer.update_lora_params(path)
+        transformer.save_lora_slot(f"lora{i}", on_device=args.on_device)
+
+    names = ["base"] + [f"lora{i}" for i in range(len(paths))]
+
+    for i, path in enumerate(paths):
+        latency = measure(lambda: transformer.update_lora_params(path), args.test_times)
+        print(f"update_lora_params {args.loras[i]}: {latency * 1000:.2f} ms")
+    latency = measure(transformer.reset_lora, args.test_times)
+    print(f"reset_lora: {latency * 1000:.2f} ms")
+
+    for name in names:
+        latency = measure(lambda: transformer.activate_lora_slot(name), args.test_times)
+        print(f"activate_lora_slot {name}: {latency * 1000:.2f} ms")
+
+
+if __name__ == "__main__":
+    main()
@@ -9,6 +9,7 @@
 
 class QuantizedFluxModel : public ModuleWrapper<FluxModel> { // : public torch::CustomClassHolder {
 public:
+    // a negative deviceId keeps the model in host memory, forward then runs the CPU kernels
     void init(bool use_fp4, bool offload, bool bf16, int8_t deviceId) {
         spdlog::info("Initializing QuantizedFluxModel on device {}", deviceId);
         if (!bf16) {
@@ -19,8 +20,8 @@ public:
         }
         ModuleWrapper::init(deviceId);
 
-        CUDADeviceContext ctx(this->deviceId);
-        net = std::make_unique<FluxModel>(use_fp4, offload, bf16 ? Tensor::BF16 : Tensor::FP16, Device::cuda((int)deviceId));
+        DeviceContext ctx(this->deviceId);
+        net = std::make_unique<FluxModel>(use_fp4, offload, bf16 ? Tensor::BF16 : Tensor::FP16, deviceId < 0 ? Device::cpu() : Device::cuda((int)deviceId));
     }
 
     bool isBF16() {
@@ -40,7 +41,7 @@ public:
         bool skip_first_layer = false)
     {
         checkModel();
-        CUDADeviceContext ctx(deviceId);
+        DeviceContext ctx(deviceId);
 
         spdlog::debug("QuantizedFluxModel forward");
 
@@ -64,7 +65,7 @@ public:
         );
 
         torch::Tensor output = to_torch(result);
-        Tensor::synchronizeDevice();
+        synchronizeDevice();
 
         return output;
     }
@@ -79,7 +80,7 @@ public:
         std::optional<torch::Tensor> controlnet_block_samples = std::nullopt,
         std::optional<torch::Tensor> controlnet_single_block_samples = std::nullopt)
     {
-        CUDADeviceContext ctx(deviceId);
+        DeviceContext ctx(deviceId);
 
         spdlog::debug("QuantizedFluxModel forward_layer {}", idx);
 
@@ -102,7 +103,7 @@ public:
 
         hidden_states = to_torch(hidden_states_);
         encoder_hidden_states = to_torch(encoder_hidden_states_);
-        Tensor::synchronizeDevice();
+        synchronizeDevice();
 
         return { hidden_states, encoder_hidden_states };
     }
@@ -113,7 +114,7 @@ public:
         torch::Tensor temb,
         torch::Tensor rotary_emb_single)
     {
-        CUDADeviceContext ctx(deviceId);
+        DeviceContext ctx(deviceId);
 
         spdlog::debug("QuantizedFluxModel forward_single_layer {}", idx);
 
@@ -128,7 +129,7 @@ public:
         );
 
         hidden_states = to_torch(result);
-        Tensor::synchronizeDevice();
+        synchronizeDevice();
 
         return hidden_states;
     }
@@ -141,10 +142,12 @@ public:
             throw std::invalid_argument("skipRanks must be multiples of 16");
         }
 
-        CUDADeviceContext ctx(deviceId);
+        DeviceContext ctx(deviceId);
 
         spdlog::info("Set lora scale to {} (skip {} ranks)", scale, skipRanks);
 
+        net->clearPlans();
+
         net->traverse([&](Module *module) {
             if (auto *m = dynamic_cast<GEMV_AWQ *>(module)) {
                 m->lora_scale = scale;
@@ -159,6 +162,62 @@ public:
         });
     }
 
+    // prefetchDepth: layers loaded ahead of compute (1 = double buffering, 2 = triple buffering)
+    // adaptive: size the window from the timings of the previous forward, bounded by maxPrefetchDepth and memoryBudget
+    void setOffloadConfig(int prefetchDepth, bool adaptive, int maxPrefetchDepth, int64_t memoryBudget) {
+        checkModel();
+        if (prefetchDepth < 1 || maxPrefetchDepth < 1) {
+            throw std::invalid_argument("prefetch depth must be at least 1");
+        }
+
+        spdlog::info("Set offload prefetch depth to {} (adaptive={}, max={}, budget={})", prefetchDepth, adaptive, maxPrefetchDepth, memoryBudget);
+
+        net->offloadConfig.prefetchDepth = prefetchDepth;
+        net->offloadConfig.adaptive = adaptive;
+        net->offloadConfig.maxPrefetchDepth = maxPrefetchDepth;
+        net->offloadConfig.memoryBudget = std::max<int64_t>(0, memoryBudget);
+    }
+
+    LayerOffloadStats getOffloadStats() {
+        checkModel();
+        return net->getOffloadStats(true);
+    }
+
+    // pin as many layers on device as fit in memoryBudget bytes, the rest are loaded on demand
+    ResidentLayerPlan setOffloadBudget(int64_t memoryBudget, double linkBandwidth) {
+        checkModel();
+        // the staging thread of a pending update reads the lazy-load state of the params
+        checkNoPendingUpdate();
+        DeviceContext ctx(deviceId);
+
+        ResidentLayerPlan plan = net->planResidentLayers(std::max<int64_t>(0, memoryBudget), linkBandwidth);
+        net->setResidentLayers(plan.resident);
+        synchronizeDevice();
+        return plan;
+    }
+
+    void setResidentLayers(std::vector<bool> resident) {
+        checkModel();
+        checkNoPendingUpdate();
+        DeviceContext ctx(deviceId);
+
+        net->setResidentLayers(resident);
+        synchronizeDevice();
+    }
+
+    // bytes of offloadable weights of each layer, joint blocks first
+    std::vector<int64_t> getLayerBytes() {
+        checkModel();
+        std::vector<int64_t> result;
+        for (auto &&block : net->transformer_blocks) {
+            result.push_back(block->getLazyParamsBytes(true));
+        }
+        for (auto &&block : net->single_transformer_blocks) {
+            result.push_back(block->getLazyParamsBytes(true));
+        }
+        return result;
+    }
+
     void setAttentionImpl(std::string name) {
         if (name.empty() || name == "default") {
             name = "flashattn2";
@@ -0,0 +1,32 @@
+#pragma once
+
+#include "interop/torch.h"
+#include "Serialization.h"
+#include "Linear.h"
+#include "debug.h"
+#include "module.h"
+
+class QuantizedGEMV : public ModuleWrapper<GEMV_AWQ> {
+public:
+    // a negative deviceId keeps the weights in host memory, forward then runs the CPU kernels
+    void init(int64_t in_features, int64_t out_features, bool bias, bool bf16, int8_t deviceId) {
+        spdlog::info("Initializing QuantizedGEMV");
+
+        ModuleWrapper::init(deviceId);
+        net = std::make_unique<GEMV_AWQ>((int)in_features, (int)out_features, bias, bf16 ? Tensor::BF16 : Tensor::FP16, deviceId < 0 ? Device::cpu() : Device::cuda((int)deviceId));
+    }
+
+    torch::Tensor forward(torch::Tensor x) {
+        checkModel();
+
+        x = x.contiguous();
+
+        DeviceContext ctx(this->deviceId);
+        Tensor result = net->forward(from_torch(x));
+
+        torch::Tensor output = to_torch(result);
+        synchronizeDevice();
+
+        return output;
+    }
+};
@@ -3,6 +3,8 @@
 #include "interop/torch.h"
 #include "Serialization.h"
 #include "Module.h"
+#include "LoraSlot.h"
+#include "WeightUpdate.h"
 #include "debug.h"
 #include "utils.h"
 
@@ -13,42 +15,158 @@ public:
         this->deviceId = deviceId;
     }
     void reset() {
-        CUDADeviceContext ctx(this->deviceId);
+        DeviceContext ctx(this->deviceId);
 
         debugContext.reset();
+        pendingUpdate.reset();
+        loraSlots.clear();
+        loraArena = Tensor{};
         net.reset();
-        Tensor::synchronizeDevice();
+        synchronizeDevice();
         
-        nunchaku::utils::trim_memory();
-        Tensor::synchronizeDevice();
+        if (this->deviceId >= 0) {
+            nunchaku::utils::trim_memory();
+        }
+        synchronizeDevice();
     }
 
     void load(std::string path, bool partial = false) {
         checkModel();
-        CUDADeviceContext ctx(this->deviceId);
+        DeviceContext ctx(this->deviceId);
+
+        checkNoPendingUpdate();
 
         spdlog::info("{} weights from {}", partial ? "Loading partial" : "Loading", path);
         
         std::shared_ptr<SafeTensors> provider = std::make_shared<SafeTensors>(path);
         net->loadParams(*provider, partial);
-        Tensor::synchronizeDevice();
+        clearPlans();
+        synchronizeDevice();
 
         spdlog::info("Done.");
     }
 
     void loadDict(std::map<std::string, torch::Tensor> dict, bool partial = false) {
         checkModel();
-        CUDADeviceContext ctx(this->deviceId);
+        DeviceContext ctx(this->deviceId);
+
+        checkNoPendingUpdate();
 
         spdlog::info("{} weights from pytorch", partial ? "Loading partial" : "Loading");
         
         std::shared_ptr<TensorsProviderTorch> provider = std::make_shared<TensorsProviderTorch>(std::move(dict));
         net->loadParams(*provider, partial);
-        Tensor::synchronizeDevice();
+        clearPlans();
+        synchronizeDevice();
 
         spdlog::info("Done.");
     }
 
+    // snapshot the currently loaded LoRA params under `name`
+    void saveLoraSlot(std::string name, bool onDevice = false) {
+        checkModel();
+        DeviceContext ctx(this->deviceId);
+
+        loraSlots[name] = std::make_unique<LoraSlot>(*net, onDevice);
+        synchronizeDevice();
+
+        spdlog::info("Saved LoRA slot {} ({} MiB)", name, loraSlots[name]->size() / 1048576);
+    }
+
+    void activateLoraSlot(std::string name) {
+        checkModel();
+        DeviceContext ctx(this->deviceId);
+
+        if (!loraSlots.contains(name)) {
+            throw std::invalid_argument(spdlog::fmt_lib::format("LoRA slot {} not found", name));
+        }
+        checkNoPendingUpdate();
+        loraSlots.at(name)->activate(loraArena);
+        clearPlans();
+        synchronizeDevice();
+
+        spdlog::debug("Activated LoRA slot {}", name);
+    }
+
+    void removeLoraSlot(std::string name) {
+        loraSlots.erase(name);
+    }
+
+    std::vector<std::string> listLoraSlots() {
+        std::vector<std::string> result;
+        for (auto &&[name, slot] : loraSlots) {
+            result.push_back(name);
+        }
+        return result;
+    }
+
+    // start loading a new checkpoint into shadow storage in the background, forwards keep using the current weights
+    void prepareUpdate(std::string path) {
+        checkModel();
+        checkNoPendingUpdate();
+        DeviceContext ctx(this->deviceId);
+
+        spdlog::info("Preparing weight update from {}", path);
+
+        std::shared_ptr<SafeTensors> provider = std::make_shared<SafeTensors>(path);
+        pendingUpdate = std::make_unique<WeightUpdate>(*net, provider, this->deviceId);
+    }
+
+    bool isUpdateReady() {
+        return pendingUpdate && pendingUpdate->ready();
+    }
+
+    // swap in the staged weights, call between forwards
+    WeightUpdate::Result commitUpdate() {
+        checkModel();
+        if (!pendingUpdate) {
+            throw std::runtime_error("No weight update pending");
+        }
+        DeviceContext ctx(this->deviceId);
+
+        std::unique_ptr<WeightUpdate> update = std::move(pendingUpdate);
+        WeightUpdate::Result result = update->commit();
+        clearPlans();
+
+        spdlog::info("Weight update committed: {} tensors changed ({} MiB), {} unchanged", result.numChanged, result.changedBytes / 1048576, result.numUnchanged);
+        return result;
+    }
+
+    // live / peak bytes per module, keyed "<kind>.<tier>.<live|peak>", the root module is ""
+    // allocations made outside of any module are reported under "<unscoped>"
+    std::map<std::string, std::map<std::string, int64_t>> getMemoryStats() {
+        checkModel();
+
+        std::map<std::string, std::map<std::string, int64_t>> result;
+        auto collect = [&](const std::string &name, const MemoryStats &stats) {
+            if (stats.empty()) {
+                return;
+            }
+            auto &entry = result[name];
+            for (int kind = 0; kind < (int)MemoryKind::COUNT; kind++) {
+                for (int tier = 0; tier < (int)MemoryTier::COUNT; tier++) {
+                    const MemoryStats::Counter &c = stats.counters[kind][tier];
+                    const std::string key = spdlog::fmt_lib::format("{}.{}", MemoryStats::name((MemoryKind)kind), MemoryStats::name((MemoryTier)tier));
+                    entry[key + ".live"] = c.live.load();
+                    entry[key + ".peak"] = c.peak.load();
+                }
+            }
+        };
+        net->traverse([&](Module *m) {
+            collect(m->getFullName(), *m->memoryStats);
+        });
+        collect("<unscoped>", *MemoryStats::unscoped());
+        return result;
+    }
+
+    void resetPeakMemory() {
+        checkModel();
+        net->traverse([](Module *m) {
+            m->memoryStats->resetPeak();
+        });
+        MemoryStats::unscoped()->resetPeak();
+    }
+
     void startDebug() {
         debugContext = std::make_unique<DebugContext>();
     }
@@ -57,7 +175,7 @@ public:
     }
 
     auto getDebugResults() {
-        CUDADeviceContext ctx(this->deviceId);
+        DeviceContext ctx(this->deviceId);
 
         std::map<std::string, torch::Tensor> result;
 
@@ -71,15 +189,48 @@ public:
     }
 
 protected:
+    // the CUDA device of the model for the duration of a call, none for a model in host memory (negative deviceId)
+    class DeviceContext {
+    public:
+        explicit DeviceContext(int deviceId) {
+            if (deviceId >= 0) {
+                ctx.emplace(deviceId);
+            }
+        }
+    private:
+        std::optional<CUDADeviceContext> ctx;
+    };
+    void synchronizeDevice() {
+        if (this->deviceId >= 0) {
+            Tensor::synchronizeDevice();
+        }
+    }
+
     void checkModel() {
         if (!net) {
             throw std::runtime_error("Model not initialized");
         }
     }
+    void checkNoPendingUpdate() {
+        if (pendingUpdate) {
+            throw std::runtime_error("A weight update is pending, commit it first");
+        }
+    }
+    // recorded forwards (FluxModel::clearPlans) hold the params they were recorded with
+    void clearPlans() {
+        if constexpr (requires(M &m) { m.clearPlans(); }) {
+            net->clearPlans();
+        }
+    }
 
 protected:
     std::unique_ptr<M> net;
     std::unique_ptr<DebugContext> debugContext;
 
+    std::map<std::string, std::unique_ptr<LoraSlot>> loraSlots;
+    Tensor loraArena;   // device storage shared by all slots, bound params are views into it
+
+    std::unique_ptr<WeightUpdate> pendingUpdate;
+
     int deviceId = -1;
 };
\ No newline at end of file
@@ -2,8 +2,11 @@
 
 #include "interop/torch.h"
 #include "kernels/zgemm/zgemm.h"
+#include "kernels/zgemm/attention_cpu.h"
 #include "kernels/awq/gemv_awq.h"
 #include "kernels/awq/gemm_awq.h"
+#include "kernels/dwconv.h"
+#include "WeightQuantizer.h"
 
 namespace nunchaku::ops {
 
@@ -83,6 +86,92 @@ namespace nunchaku::ops {
         // Tensor::synchronizeDevice();
     }
 
+    void quantize_w4a4_act_fuse_lora(
+        torch::Tensor input,                        // linear     [M, N] (or [M, N * 2] with fuse_glu)
+        torch::Tensor output,                       // packed act [M, N / 2]
+        torch::Tensor oscales,                      // packed as  [N / 64, M]
+        std::optional<torch::Tensor> lora_down,     // packed lora_wgt [N, R]
+        std::optional<torch::Tensor> lora_act_out,  // packed lora_act [M, R]
+        std::optional<torch::Tensor> smooth,        // packed ws  [N]
+        bool fuse_glu,
+        bool fp4
+    ) {
+        auto getTensor = [](std::optional<torch::Tensor> &t) {
+            return t.has_value() ? from_torch(t.value()) : Tensor{};
+        };
+        nunchaku::kernels::quantize_w4a4_act_fuse_lora(
+            from_torch(input),
+            from_torch(output),
+            from_torch(oscales),
+            getTensor(lora_down),
+            getTensor(lora_act_out),
+            getTensor(smooth),
+            fuse_glu,
+            fp4
+        );
+    }
+
+    void quantize_w4a4_act_fuse_norm(
+        torch::Tensor input,                        // linear     [M, N] or [B, tokens, N]
+        torch::Tensor scale,                        // linear     [N] or [B, N]
+        torch::Tensor shift,                        // linear     [N] or [B, N]
+        double eps,
+        torch::Tensor output,                       // packed act [M, N / 2]
+        torch::Tensor oscales,                      // packed as  [N / 64, M]
+        std::optional<torch::Tensor> lora_down,     // packed lora_wgt [N, R]
+        std::optional<torch::Tensor> lora_act_out,  // packed lora_act [M, R]
+        std::optional<torch::Tensor> smooth,        // packed ws  [N]
+        bool fp4
+    ) {
+        auto getTensor = [](std::optional<torch::Tensor> &t) {
+            return t.has_value() ? from_torch(t.value()) : Tensor{};
+        };
+        nunchaku::kernels::quantize_w4a4_act_fuse_norm(
+            from_torch(input),
+            from_torch(scale),
+            from_torch(shift),
+            (float)eps,
+            from_torch(output),
+            from_torch(oscales),
+            getTensor(lora_down),
+            getTensor(lora_act_out),
+            getTensor(smooth),
+            fp4
+        );
+    }
+
+    void gemm_w8a8(
+        torch::Tensor act,                  // packed act [M, K]
+        torch::Tensor wgt,                  // packed wgt [N, K]
+        torch::Tensor out,                  // linear     [M, N]
+        torch::Tensor ascales,              // packed as  [1, M]
+        torch::Tensor wscales,              // packed ws  [1, N]
+        std::optional<torch::Tensor> bias   // packed ws  [N]
+    ) {
+        nunchaku::kernels::gemm_w8a8(
+            from_torch(act),
+            from_torch(wgt),
+            from_torch(out),
+            from_torch(ascales),
+            from_torch(wscales),
+            bias.has_value() ? from_torch(bias.value()) : Tensor{}
+        );
+    }
+
+    void quantize_w8a8_act(
+        torch::Tensor input,    // linear     [M, K] (or [M, K * 2] with fuse_glu)
+        torch::Tensor output,   // packed act [M, K]
+        torch::Tensor oscales,  // packed as  [1, M]
+        bool fuse_glu
+    ) {
+        nunchaku::kernels::quantize_w8a8_act(
+            from_torch(input),
+            from_torch(output),
+            from_torch(oscales),
+            fuse_glu
+        );
+    }
+
     void attention_fp16(
         torch::Tensor q,   // packed [Batch, Head, TokensQ, HEAD_DIM]
         torch::Tensor k,   // packed [Batch, Head, TokensKV, HEAD_DIM]
@@ -99,6 +188,54 @@ namespace nunchaku::ops {
         );
     }
 
+    void linearattn_vk_mul_q(
+        torch::Tensor q,   // linear [Batch, Tokens, Head * 32], replaced in place
+        torch::Tensor vk   // linear [Batch, Head, 33, 32]
+    ) {
+        nunchaku::kernels::linearattn_vk_mul_q(
+            from_torch(q),
+            from_torch(vk)
+        );
+    }
+
+    // CPU only, q / k / v may be strided slices of a linear qkv
+    void attention_cpu(
+        torch::Tensor q,   // [Batch, TokensQ, Head, HEAD_DIM]
+        torch::Tensor k,   // [Batch, TokensKV, Head, HEAD_DIM]
+        torch::Tensor v,   // [Batch, TokensKV, Head, HEAD_DIM]
+        torch::Tensor o,   // linear [Batch, TokensQ, Head * HEAD_DIM]
+        float scale
+    ) {
+        nunchaku::kernels::attention_cpu(
+            from_torch(q),
+            from_torch(k),
+            from_torch(v),
+            from_torch(o),
+            scale
+        );
+    }
+
+    // CPU only, blockmask is [Batch, Head, ceil(TokensQ / block_size), K] INT32 as consumed by mha_fwd_block
+    void attention_blocksparse_cpu(
+        torch::Tensor q,   // [Batch, TokensQ, Head, HEAD_DIM]
+        torch::Tensor k,   // [Batch, TokensKV, Head, HEAD_DIM]
+        torch::Tensor v,   // [Batch, TokensKV, Head, HEAD_DIM]
+        torch::Tensor o,   // linear [Batch, TokensQ, Head * HEAD_DIM]
+        float scale,
+        torch::Tensor blockmask,
+        int block_size
+    ) {
+        nunchaku::kernels::attention_blocksparse_cpu(
+            from_torch(q),
+            from_torch(k),
+            from_torch(v),
+            from_torch(o),
+            scale,
+            from_torch(blockmask),
+            block_size
+        );
+    }
+
     torch::Tensor gemv_awq(
         torch::Tensor _in_feats,
         torch::Tensor _kernel,
@@ -146,6 +283,62 @@ namespace nunchaku::ops {
         return output;
     }
 
+    torch::Tensor dwconv_f16(
+        torch::Tensor input,                // linear [N, H, W, C]
+        torch::Tensor weight,               // linear [C, 3, 3, 1]
+        std::optional<torch::Tensor> bias   // linear [C]
+    ) {
+        torch::Tensor output = torch::empty_like(input, torch::MemoryFormat::Contiguous);
+        ::dwconv_f16(
+            from_torch(input),
+            from_torch(weight.contiguous()),
+            from_torch(output),
+            bias.has_value() ? from_torch(bias.value().contiguous()) : Tensor{}
+        );
+        return output;
+    }
+
+    // host-side packers of nunchaku/lora/flux/packer.py, inputs must be on the CPU
+    torch::Tensor pack_weight(torch::Tensor weight, int bits) {
+        weight = weight.contiguous();
+        torch::Tensor output = torch::empty({weight.size(0), weight.size(1) * bits / 8}, weight.options().dtype(torch::kInt8));
+        packWeightHost(from_torch(weight), from_torch(output), bits);
+        return output;
+    }
+
+    torch::Tensor pack_scale(torch::Tensor scale) {
+        scale = scale.contiguous();
+        const int64_t n = scale.size(0);
+        torch::Tensor output = torch::empty({scale.numel() / n, n}, scale.options());
+        packScaleHost(from_torch(scale), from_torch(output));
+        return output;
+    }
+
+    torch::Tensor pack_micro_scale(torch::Tensor scale) {
+        scale = scale.contiguous();
+        const int64_t n = scale.size(0);
+        scale = scale.view({n, -1});
+        torch::Tensor output = torch::empty({scale.size(1), n}, scale.options().dtype(torch::kFloat8_e4m3fn));
+        packMicroScaleHost(from_torch(scale), from_torch(output));
+        return output;
+    }
+
+    torch::Tensor pack_lowrank_weight(torch::Tensor weight, bool down) {
+        weight = weight.contiguous();
+        const int64_t c = down ? weight.size(1) : weight.size(0);
+        const int64_t r = down ? weight.size(0) : weight.size(1);
+        torch::Tensor output = torch::empty({ceilDiv<int64_t>(c, 16) * 16, ceilDiv<int64_t>(r, 16) * 16}, weight.options());
+        packLowRankWeightHost(from_torch(weight), from_torch(output), down);
+        return output;
+    }
+
+    torch::Tensor unpack_lowrank_weight(torch::Tensor weight, bool down) {
+        weight = weight.contiguous();
+        torch::Tensor output = down ? torch::empty({weight.size(1), weight.size(0)}, weight.options()) : torch::empty_like(weight);
+        unpackLowRankWeightHost(from_torch(weight), from_torch(output), down);
+        return output;
+    }
+
     void test_rmsnorm_rope(
         torch::Tensor input, 
         torch::Tensor output, 
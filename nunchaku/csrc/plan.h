@@ -0,0 +1,60 @@
+#pragma once
+
+#include "interop/torch.h"
+#include "kernels/cpu_plan.h"
+
+#include <thread>
+
+// records the CPU kernels run by the ops called between beginCapture and endCapture (see kernels/cpu_plan.h)
+// the ops must be called on the thread that began the capture, with the tensors given as inputs (or views of them)
+class CpuExecutionPlan {
+public:
+    void beginCapture(std::vector<torch::Tensor> inputs) {
+        if (capture) {
+            throw std::runtime_error("A capture is already running");
+        }
+        std::vector<Tensor> tensors;
+        for (auto &input : inputs) {
+            tensors.push_back(from_torch(input));
+        }
+        capture = std::make_unique<nunchaku::kernels::CpuPlan::Capture>(plan, tensors);
+        captureThread = std::this_thread::get_id();
+    }
+
+    void endCapture(std::vector<torch::Tensor> outputs) {
+        if (!capture) {
+            throw std::runtime_error("No capture running");
+        }
+        if (captureThread != std::this_thread::get_id()) {
+            throw std::runtime_error("The capture must end on the thread that began it");
+        }
+        std::vector<Tensor> tensors;
+        for (auto &output : outputs) {
+            tensors.push_back(from_torch(output.contiguous()));
+        }
+        std::unique_ptr<nunchaku::kernels::CpuPlan::Capture> running = std::move(capture);
+        running->finish(tensors);
+    }
+
+    // new tensors with the outputs of the capture computed from `inputs`
+    std::vector<torch::Tensor> replay(std::vector<torch::Tensor> inputs) {
+        std::vector<Tensor> tensors;
+        for (auto &input : inputs) {
+            tensors.push_back(from_torch(input));
+        }
+        std::vector<torch::Tensor> result;
+        for (auto &output : plan.replay(tensors)) {
+            result.push_back(to_torch(output));
+        }
+        return result;
+    }
+
+    int64_t numSteps() { return plan.numSteps(); }
+    int64_t arenaBytes() { return plan.arenaBytes(); }
+    int64_t keptBytes() { return plan.keptBytes(); }
+
+private:
+    nunchaku::kernels::CpuPlan plan;
+    std::unique_ptr<nunchaku::kernels::CpuPlan::Capture> capture;
+    std::thread::id captureThread;
+};
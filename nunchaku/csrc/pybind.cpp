@@ -1,14 +1,49 @@
 #include "gemm.h"
 #include "gemm88.h"
+#include "gemv.h"
 #include "flux.h"
 #include "sana.h"
 #include "ops.h"
 #include "utils.h"
+#include "plan.h"
+#include "BatchScheduler.h"
 #include <torch/extension.h>
 
 #include <pybind11/pybind11.h>
 
 PYBIND11_MODULE(TORCH_EXTENSION_NAME, m) {
+    py::class_<LayerOffloadStats>(m, "LayerOffloadStats")
+        .def_readonly("prefetch_depth", &LayerOffloadStats::prefetchDepth)
+        .def_readonly("load_time", &LayerOffloadStats::loadTime)
+        .def_readonly("compute_time", &LayerOffloadStats::computeTime)
+        .def_readonly("stall_time", &LayerOffloadStats::stallTime)
+        .def_readonly("total_time", &LayerOffloadStats::totalTime)
+        .def("total_stall_time", &LayerOffloadStats::totalStallTime)
+    ;
+    py::class_<WeightUpdate::Result>(m, "WeightUpdateResult")
+        .def_readonly("num_changed", &WeightUpdate::Result::numChanged)
+        .def_readonly("num_unchanged", &WeightUpdate::Result::numUnchanged)
+        .def_readonly("changed_bytes", &WeightUpdate::Result::changedBytes)
+    ;
+    py::class_<ResidentLayerPlan>(m, "ResidentLayerPlan")
+        .def_readonly("resident", &ResidentLayerPlan::resident)
+        .def_readonly("resident_bytes", &ResidentLayerPlan::residentBytes)
+        .def_readonly("transfer_bytes", &ResidentLayerPlan::transferBytes)
+        .def_readonly("saved_time", &ResidentLayerPlan::savedTime)
+    ;
+    py::class_<nunchaku::kernels::CpuRuntimeInfo>(m, "CpuRuntimeInfo")
+        .def_readonly("num_threads", &nunchaku::kernels::CpuRuntimeInfo::numThreads)
+        .def_readonly("num_nodes", &nunchaku::kernels::CpuRuntimeInfo::numNodes)
+        .def_readonly("pinned", &nunchaku::kernels::CpuRuntimeInfo::pinned)
+        .def_readonly("cpus", &nunchaku::kernels::CpuRuntimeInfo::cpus)
+        .def_readonly("nodes", &nunchaku::kernels::CpuRuntimeInfo::nodes)
+    ;
+    py::class_<OffloadSimResult>(m, "OffloadSimResult")
+        .def_readonly("latency", &OffloadSimResult::latency)
+        .def_readonly("peak_memory", &OffloadSimResult::peakMemory)
+        .def_readonly("transfer_bytes", &OffloadSimResult::transferBytes)
+        .def_readonly("stats", &OffloadSimResult::stats)
+    ;
     py::class_<QuantizedFluxModel>(m, "QuantizedFluxModel")
         .def(py::init<>())
         .def("init", &QuantizedFluxModel::init,
@@ -51,8 +86,33 @@ PYBIND11_MODULE(TORCH_EXTENSION_NAME, m) {
         .def("startDebug", &QuantizedFluxModel::startDebug)
         .def("stopDebug", &QuantizedFluxModel::stopDebug)
         .def("getDebugResults", &QuantizedFluxModel::getDebugResults)
+        .def("saveLoraSlot", &QuantizedFluxModel::saveLoraSlot,
+            py::arg("name"),
+            py::arg("on_device") = false
+        )
+        .def("activateLoraSlot", &QuantizedFluxModel::activateLoraSlot)
+        .def("removeLoraSlot", &QuantizedFluxModel::removeLoraSlot)
+        .def("listLoraSlots", &QuantizedFluxModel::listLoraSlots)
+        .def("prepareUpdate", &QuantizedFluxModel::prepareUpdate)
+        .def("isUpdateReady", &QuantizedFluxModel::isUpdateReady)
+        .def("commitUpdate", &QuantizedFluxModel::commitUpdate)
+        .def("getMemoryStats", &QuantizedFluxModel::getMemoryStats)
+        .def("resetPeakMemory", &QuantizedFluxModel::resetPeakMemory)
         .def("setLoraScale", &QuantizedFluxModel::setLoraScale)
         .def("setAttentionImpl", &QuantizedFluxModel::setAttentionImpl)
+        .def("setOffloadConfig", &QuantizedFluxModel::setOffloadConfig,
+            py::arg("prefetch_depth") = 1,
+            py::arg("adaptive") = false,
+            py::arg("max_prefetch_depth") = 2,
+            py::arg("memory_budget") = 0
+        )
+        .def("getOffloadStats", &QuantizedFluxModel::getOffloadStats)
+        .def("getLayerBytes", &QuantizedFluxModel::getLayerBytes)
+        .def("setOffloadBudget", &QuantizedFluxModel::setOffloadBudget,
+            py::arg("memory_budget"),
+            py::arg("link_bandwidth") = 25e9
+        )
+        .def("setResidentLayers", &QuantizedFluxModel::setResidentLayers)
         .def("isBF16", &QuantizedFluxModel::isBF16)
     ;
     py::class_<QuantizedSanaModel>(m, "QuantizedSanaModel")
@@ -78,6 +138,18 @@ PYBIND11_MODULE(TORCH_EXTENSION_NAME, m) {
         .def("startDebug", &QuantizedSanaModel::startDebug)
         .def("stopDebug", &QuantizedSanaModel::stopDebug)
         .def("getDebugResults", &QuantizedSanaModel::getDebugResults)
+        .def("saveLoraSlot", &QuantizedSanaModel::saveLoraSlot,
+            py::arg("name"),
+            py::arg("on_device") = false
+        )
+        .def("activateLoraSlot", &QuantizedSanaModel::activateLoraSlot)
+        .def("removeLoraSlot", &QuantizedSanaModel::removeLoraSlot)
+        .def("listLoraSlots", &QuantizedSanaModel::listLoraSlots)
+        .def("prepareUpdate", &QuantizedSanaModel::prepareUpdate)
+        .def("isUpdateReady", &QuantizedSanaModel::isUpdateReady)
+        .def("commitUpdate", &QuantizedSanaModel::commitUpdate)
+        .def("getMemoryStats", &QuantizedSanaModel::getMemoryStats)
+        .def("resetPeakMemory", &QuantizedSanaModel::resetPeakMemory)
     ;
     py::class_<QuantizedGEMM>(m, "QuantizedGEMM")
         .def(py::init<>())
@@ -100,12 +172,73 @@ PYBIND11_MODULE(TORCH_EXTENSION_NAME, m) {
         .def("stopDebug", &QuantizedGEMM88::stopDebug)
         .def("getDebugResults", &QuantizedGEMM88::getDebugResults)
     ;
+    py::class_<QuantizedGEMV>(m, "QuantizedGEMV")
+        .def(py::init<>())
+        .def("init", &QuantizedGEMV::init)
+        .def("reset", &QuantizedGEMV::reset)
+        .def("loadDict", &QuantizedGEMV::loadDict,
+            py::arg("dict"),
+            py::arg("partial") = false
+        )
+        .def("forward", &QuantizedGEMV::forward)
+    ;
+    py::class_<CpuExecutionPlan>(m, "CpuExecutionPlan")
+        .def(py::init<>())
+        .def("beginCapture", &CpuExecutionPlan::beginCapture)
+        .def("endCapture", &CpuExecutionPlan::endCapture)
+        .def("replay", &CpuExecutionPlan::replay, py::call_guard<py::gil_scoped_release>())
+        .def("numSteps", &CpuExecutionPlan::numSteps)
+        .def("arenaBytes", &CpuExecutionPlan::arenaBytes)
+        .def("keptBytes", &CpuExecutionPlan::keptBytes)
+    ;
+    py::class_<BatchSchedulerStats>(m, "BatchSchedulerStats")
+        .def_readonly("submitted", &BatchSchedulerStats::submitted)
+        .def_readonly("completed", &BatchSchedulerStats::completed)
+        .def_readonly("cancelled", &BatchSchedulerStats::cancelled)
+        .def_readonly("forwards", &BatchSchedulerStats::forwards)
+        .def_readonly("samples", &BatchSchedulerStats::samples)
+        .def_readonly("waiting", &BatchSchedulerStats::waiting)
+        .def_readonly("running", &BatchSchedulerStats::running)
+    ;
+    py::class_<BatchScheduler>(m, "BatchScheduler")
+        .def(py::init<int, int>(),
+            py::arg("max_batch"),
+            py::arg("max_running") = 0
+        )
+        .def("submit", &BatchScheduler::submit,
+            py::arg("shape"),
+            py::arg("num_steps")
+        )
+        .def("cancel", &BatchScheduler::cancel)
+        .def("nextBatch", &BatchScheduler::nextBatch)
+        .def("finishStep", &BatchScheduler::finishStep)
+        .def("waitForWork", &BatchScheduler::waitForWork, py::call_guard<py::gil_scoped_release>(),
+            py::arg("timeout") = -1.0
+        )
+        .def("step", &BatchScheduler::step)
+        .def("stats", &BatchScheduler::stats)
+        .def_readonly("max_batch", &BatchScheduler::maxBatch)
+        .def_readonly("max_running", &BatchScheduler::maxRunning)
+    ;
 
     m.def_submodule("ops")
         .def("gemm_w4a4", nunchaku::ops::gemm_w4a4)
+        .def("quantize_w4a4_act_fuse_lora", nunchaku::ops::quantize_w4a4_act_fuse_lora)
+        .def("quantize_w4a4_act_fuse_norm", nunchaku::ops::quantize_w4a4_act_fuse_norm)
+        .def("gemm_w8a8", nunchaku::ops::gemm_w8a8)
+        .def("quantize_w8a8_act", nunchaku::ops::quantize_w8a8_act)
         .def("attention_fp16", nunchaku::ops::attention_fp16)
+        .def("linearattn_vk_mul_q", nunchaku::ops::linearattn_vk_mul_q)
+        .def("attention_cpu", nunchaku::ops::attention_cpu)
+        .def("attention_blocksparse_cpu", nunchaku::ops::attention_blocksparse_cpu)
         .def("gemm_awq", nunchaku::ops::gemm_awq)
         .def("gemv_awq", nunchaku::ops::gemv_awq)
+        .def("dwconv_f16", nunchaku::ops::dwconv_f16)
+        .def("pack_weight", nunchaku::ops::pack_weight)
+        .def("pack_scale", nunchaku::ops::pack_scale)
+        .def("pack_micro_scale", nunchaku::ops::pack_micro_scale)
+        .def("pack_lowrank_weight", nunchaku::ops::pack_lowrank_weight)
+        .def("unpack_lowrank_weight", nunchaku::ops::unpack_lowrank_weight)
 
         .def("test_rmsnorm_rope", nunchaku::ops::test_rmsnorm_rope)
         .def("test_pack_qkv", nunchaku::ops::test_pack_qkv)
@@ -119,5 +252,30 @@ PYBIND11_MODULE(TORCH_EXTENSION_NAME, m) {
         .def("disable_memory_auto_release", nunchaku::utils::disable_memory_auto_release)
         .def("trim_memory", nunchaku::utils::trim_memory)
         .def("set_faster_i2f_mode", nunchaku::utils::set_faster_i2f_mode)
+        .def("simulate_offload", nunchaku::utils::simulate_offload,
+            py::arg("compute_time"),
+            py::arg("layer_bytes"),
+            py::arg("resident") = std::vector<bool>{},
+            py::arg("link_bandwidth") = 25e9,
+            py::arg("disk_bandwidth") = 0.0,
+            py::arg("host_launch_time") = 0.05f,
+            py::arg("wddm") = false,
+            py::arg("workaround") = false,
+            py::arg("prefetch_depth") = 1,
+            py::arg("adaptive") = false,
+            py::arg("max_prefetch_depth") = 2,
+            py::arg("memory_budget") = 0,
+            py::arg("device_memory") = 0,
+            py::arg("base_memory") = 0
+        )
+        .def("cpu_runtime_info", nunchaku::utils::cpu_runtime_info)
+        .def("benchmark_cpu_parallel_for", nunchaku::utils::benchmark_cpu_parallel_for,
+            py::call_guard<py::gil_scoped_release>(),
+            py::arg("count"),
+            py::arg("grain") = 0,
+            py::arg("item_ns") = 0.0,
+            py::arg("inner") = 0,
+            py::arg("repeat") = 100
+        )
     ;
 }
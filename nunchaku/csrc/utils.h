@@ -2,7 +2,9 @@
 
 #include "common.h"
 #include "Tensor.h"
+#include "OffloadSimulator.h"
 #include "kernels/zgemm/zgemm.h"
+#include "kernels/cpu_runtime.h"
 
 namespace nunchaku::utils {
 
@@ -36,4 +38,74 @@ namespace nunchaku::utils {
         kernels::set_faster_i2f_mode(mode);
     }
 
-};
\ No newline at end of file
+    OffloadSimResult simulate_offload(
+        std::vector<float> compute_time,
+        std::vector<int64_t> layer_bytes,
+        std::vector<bool> resident,
+        double link_bandwidth,
+        double disk_bandwidth,
+        float host_launch_time,
+        bool wddm,
+        bool workaround,
+        int prefetch_depth,
+        bool adaptive,
+        int max_prefetch_depth,
+        int64_t memory_budget,
+        int64_t device_memory,
+        int64_t base_memory)
+    {
+        OffloadSimParams params;
+        params.computeTime = std::move(compute_time);
+        params.layerBytes.assign(layer_bytes.begin(), layer_bytes.end());
+        params.resident = std::move(resident);
+        params.linkBandwidth = link_bandwidth;
+        params.diskBandwidth = disk_bandwidth;
+        params.hostLaunchTime = host_launch_time;
+        params.wddm = wddm;
+        params.workaround = workaround;
+        params.config.prefetchDepth = prefetch_depth;
+        params.config.adaptive = adaptive;
+        params.config.maxPrefetchDepth = max_prefetch_depth;
+        params.config.memoryBudget = memory_budget;
+        params.deviceMemory = device_memory;
+        params.baseMemory = base_memory;
+        return simulateOffload(params);
+    }
+
+    kernels::CpuRuntimeInfo cpu_runtime_info() {
+        return kernels::cpuRuntimeInfo();
+    }
+
+    // average seconds of one parallel_for of the CPU runtime over count items that each busy-wait for item_ns,
+    // with inner > 0 every item runs a nested parallel_for of inner items instead
+    double benchmark_cpu_parallel_for(int count, int grain, double item_ns, int inner, int repeat) {
+        using clock = std::chrono::steady_clock;
+        auto item = [item_ns]() {
+            const auto until = clock::now() + std::chrono::nanoseconds((int64_t)item_ns);
+            while (item_ns > 0 && clock::now() < until) {
+            }
+        };
+        auto run = [&]() {
+            kernels::cpuParallelFor(count, grain, [&](int begin, int end) {
+                for (int i = begin; i < end; i++) {
+                    if (inner > 0) {
+                        kernels::cpuParallelFor(inner, grain, [&](int begin, int end) {
+                            for (int j = begin; j < end; j++) {
+                                item();
+                            }
+                        });
+                    } else {
+                        item();
+                    }
+                }
+            });
+        };
+        run();
+        const auto start = clock::now();
+        for (int i = 0; i < repeat; i++) {
+            run();
+        }
+        return std::chrono::duration<double>(clock::now() - start).count() / std::max(repeat, 1);
+    }
+
+};
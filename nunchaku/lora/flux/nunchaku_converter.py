@@ -8,7 +8,7 @@ from safetensors.torch import save_file
 from tqdm import tqdm
 
 from .diffusers_converter import to_diffusers
-from .packer import NunchakuWeightPacker
+from .packer import NunchakuWeightPacker, native_ops, use_native_packer
 from .utils import is_nunchaku_format, pad
 from ...utils import filter_state_dict, load_state_dict_in_safetensors
 
@@ -40,6 +40,8 @@ def pack_lowrank_weight(weight: torch.Tensor, down: bool) -> torch.Tensor:
             whether the weight is for down projection in low-rank branch.
     """
     assert weight.dtype in (torch.float16, torch.bfloat16), f"Unsupported weight dtype {weight.dtype}."
+    if use_native_packer(weight):
+        return native_ops().pack_lowrank_weight(weight, down)
     lane_n, lane_k = 1, 2  # lane_n is always 1, lane_k is 32 bits // 16 bits = 2
     n_pack_size, k_pack_size = 2, 2
     num_n_lanes, num_k_lanes = 8, 4
@@ -70,6 +72,8 @@ def unpack_lowrank_weight(weight: torch.Tensor, down: bool) -> torch.Tensor:
     """
     c, r = weight.shape
     assert weight.dtype in (torch.float16, torch.bfloat16), f"Unsupported weight dtype {weight.dtype}."
+    if use_native_packer(weight):
+        return native_ops().unpack_lowrank_weight(weight, down)
     lane_n, lane_k = 1, 2  # lane_n is always 1, lane_k is 32 bits // 16 bits = 2
     n_pack_size, k_pack_size = 2, 2
     num_n_lanes, num_k_lanes = 8, 4
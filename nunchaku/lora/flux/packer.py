@@ -1,9 +1,26 @@
 # Copy the packer from https://github.com/mit-han-lab/deepcompressor/
+import os
+
 import torch
 
 from .utils import pad
 from ...utils import ceil_divide
 
+# CPU tensors are packed by the native multithreaded packer in one pass, set NUNCHAKU_NATIVE_PACKER=0 to use torch ops
+USE_NATIVE_PACKER = os.getenv("NUNCHAKU_NATIVE_PACKER", "1") != "0"
+
+
+def use_native_packer(tensor: torch.Tensor, warp_n: int = 128) -> bool:
+    """The native packer follows the tile constants of `gemm_base.cuh` (warp_n = 128) and runs on host memory."""
+    return USE_NATIVE_PACKER and warp_n == 128 and tensor.device.type == "cpu"
+
+
+def native_ops():
+    """The ops of the compiled extension, imported on first use so that the torch packer works without it."""
+    from ..._C import ops
+
+    return ops
+
 
 class MmaWeightPackerBase:
     def __init__(self, bits: int, warp_n: int, comp_n: int = None, comp_k: int = None):
@@ -89,6 +106,8 @@ class NunchakuWeightPacker(MmaWeightPackerBase):
             f"input channel size ({k}) should be divisible by "
             f"mem_k ({self.mem_k}) * num_k_unrolls ({self.num_k_unrolls})."
         )
+        if use_native_packer(weight, self.warp_n):
+            return native_ops().pack_weight(weight, self.bits)
         n_tiles, k_tiles = n // self.mem_n, k // self.mem_k
         weight = weight.reshape(
             n_tiles,
@@ -127,6 +146,9 @@ class NunchakuWeightPacker(MmaWeightPackerBase):
         # note: refer to https://docs.nvidia.com/cuda/parallel-thread-execution/index.html#mma-16864-c
         assert scale.dtype in (torch.float16, torch.bfloat16), "currently nunchaku only supports fp16 and bf16."
         n = scale.shape[0]
+        if use_native_packer(scale, self.warp_n):
+            scale = native_ops().pack_scale(scale)
+            return scale.view(-1) if group_size == -1 else scale.view(-1, n)
         # nunchaku load scales all in one access
         # for `[warp_n, warp_k]` weights, we load `[warp_n, warp_k / group_size]` scales
         # scale loading is parallelized in `n` dimension, that is,
@@ -170,10 +192,13 @@ class NunchakuWeightPacker(MmaWeightPackerBase):
 
     def pack_micro_scale(self, scale: torch.Tensor, group_size: int) -> torch.Tensor:
         assert scale.dtype in (torch.float16, torch.bfloat16), "currently nunchaku only supports fp16 and bf16."
-        assert scale.max() <= 448, "scale should be less than 448."
-        assert scale.min() >= -448, "scale should be greater than -448."
         assert group_size == 16, "currently only support group size 16."
         assert self.insn_k == 64, "insn_k should be 64."
+        if use_native_packer(scale, self.warp_n):
+            # checks the +-448 range while converting
+            return native_ops().pack_micro_scale(scale)
+        assert scale.max() <= 448, "scale should be less than 448."
+        assert scale.min() >= -448, "scale should be greater than -448."
         scale = scale.to(dtype=torch.float8_e4m3fn)
         n = scale.shape[0]
         assert self.warp_n >= 32, "currently only support warp_n >= 32."
@@ -222,6 +247,8 @@ class NunchakuWeightPacker(MmaWeightPackerBase):
                 whether the weight is for down projection in low-rank branch.
         """
         assert weight.dtype in (torch.float16, torch.bfloat16), f"Unsupported weight dtype {weight.dtype}."
+        if use_native_packer(weight):
+            return native_ops().pack_lowrank_weight(weight, down)
         reg_n, reg_k = 1, 2  # reg_n is always 1, reg_k is 32 bits // 16 bits = 2
         pack_n = self.n_pack_size * self.num_n_lanes * reg_n
         pack_k = self.k_pack_size * self.num_k_lanes * reg_k
@@ -254,6 +281,8 @@ class NunchakuWeightPacker(MmaWeightPackerBase):
         """
         c, r = weight.shape
         assert weight.dtype in (torch.float16, torch.bfloat16), f"Unsupported weight dtype {weight.dtype}."
+        if use_native_packer(weight):
+            return native_ops().unpack_lowrank_weight(weight, down)
         reg_n, reg_k = 1, 2  # reg_n is always 1, reg_k is 32 bits // 16 bits = 2
         pack_n = self.n_pack_size * self.num_n_lanes * reg_n
         pack_k = self.k_pack_size * self.num_k_lanes * reg_k
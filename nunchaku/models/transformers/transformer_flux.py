@@ -10,6 +10,7 @@ from diffusers.configuration_utils import register_to_config
 from diffusers.models.modeling_outputs import Transformer2DModelOutput
 from huggingface_hub import utils
 from packaging.version import Version
+from safetensors import safe_open
 from safetensors.torch import load_file, save_file
 from torch import nn
 
@@ -17,7 +18,7 @@ from .utils import NunchakuModelLoaderMixin, pad_tensor
 from ..._C import QuantizedFluxModel, utils as cutils
 from ...lora.flux.nunchaku_converter import fuse_vectors, to_nunchaku
 from ...lora.flux.utils import is_nunchaku_format
-from ...utils import get_precision, load_state_dict_in_safetensors
+from ...utils import ceil_divide, get_precision, load_state_dict_in_safetensors
 
 SVD_RANK = 32
 
@@ -95,6 +96,9 @@ class NunchakuFluxTransformerBlocks(nn.Module):
         assert image_rotary_emb.ndim == 6
         assert image_rotary_emb.shape[0] == 1
         assert image_rotary_emb.shape[1] == 1
+        if batch_size > 1 and image_rotary_emb.shape[2] == txt_tokens + img_tokens:
+            # positions shared by the batch, e.g. requests of one resolution batched at different timesteps
+            image_rotary_emb = image_rotary_emb.repeat(1, 1, batch_size, 1, 1, 1)
         assert image_rotary_emb.shape[2] == batch_size * (txt_tokens + img_tokens)
         # [bs, tokens, head_dim / 2, 1, 2] (sincos)
         image_rotary_emb = image_rotary_emb.reshape([batch_size, txt_tokens + img_tokens, *image_rotary_emb.shape[3:]])
@@ -155,6 +159,9 @@ class NunchakuFluxTransformerBlocks(nn.Module):
         assert image_rotary_emb.ndim == 6
         assert image_rotary_emb.shape[0] == 1
         assert image_rotary_emb.shape[1] == 1
+        if batch_size > 1 and image_rotary_emb.shape[2] == txt_tokens + img_tokens:
+            # positions shared by the batch, e.g. requests of one resolution batched at different timesteps
+            image_rotary_emb = image_rotary_emb.repeat(1, 1, batch_size, 1, 1, 1)
         assert image_rotary_emb.shape[2] == batch_size * (txt_tokens + img_tokens)
         # [bs, tokens, head_dim / 2, 1, 2] (sincos)
         image_rotary_emb = image_rotary_emb.reshape([batch_size, txt_tokens + img_tokens, *image_rotary_emb.shape[3:]])
@@ -222,10 +229,14 @@ def load_quantized_module(
     path: str, device: str | torch.device = "cuda", use_fp4: bool = False, offload: bool = False, bf16: bool = True
 ) -> QuantizedFluxModel:
     device = torch.device(device)
-    assert device.type == "cuda"
+    assert device.type in ("cuda", "cpu")
     m = QuantizedFluxModel()
-    cutils.disable_memory_auto_release()
-    m.init(use_fp4, offload, bf16, 0 if device.index is None else device.index)
+    if device.type == "cpu":
+        # host weights, the forward runs the CPU kernels
+        m.init(use_fp4, offload, bf16, -1)
+    else:
+        cutils.disable_memory_auto_release()
+        m.init(use_fp4, offload, bf16, 0 if device.index is None else device.index)
     m.load(path)
     return m
 
@@ -265,6 +276,11 @@ class NunchakuFluxTransformer2dModel(FluxTransformer2DModel, NunchakuModelLoader
         self._quantized_part_sd: dict[str, torch.Tensor] = {}
         self._quantized_part_vectors: dict[str, torch.Tensor] = {}
         self._original_in_channels = in_channels
+        # strength the unquantized part of the LoRA is applied with
+        self._lora_strength: float = 1
+        # python-side LoRA state and strength of each named slot, the quantized part lives in the C++ module
+        self._lora_slots: dict[str, tuple[dict[str, torch.Tensor], dict[str, torch.Tensor], float]] = {}
+        self._pending_quantized_part_sd: dict[str, torch.Tensor] = {}
 
         # Comfyui LoRA related
         self.comfy_lora_meta_list = []
@@ -292,6 +308,12 @@ class NunchakuFluxTransformer2dModel(FluxTransformer2DModel, NunchakuModelLoader
             elif "qweight" in k:
                 # only the shape information of this tensor is needed
                 new_quantized_part_sd[k] = v.to("meta")
+            elif k.endswith(".weight") and k.removesuffix("weight") + "smooth" in quantized_part_sd:
+                # unquantized W4A4 weight, quantized while loading, record the shape of the packed qweight
+                n_pad, k_pad = (ceil_divide(d, 128) * 128 for d in v.shape)
+                new_quantized_part_sd[k.removesuffix("weight") + "qweight"] = torch.empty(
+                    n_pad, k_pad // 2, dtype=torch.int8, device="meta"
+                )
             elif "lora" in k:
                 new_quantized_part_sd[k] = v
         transformer._quantized_part_sd = new_quantized_part_sd
@@ -326,6 +348,79 @@ class NunchakuFluxTransformer2dModel(FluxTransformer2DModel, NunchakuModelLoader
         assert isinstance(block, NunchakuFluxTransformerBlocks)
         block.m.setAttentionImpl(impl)
 
+    def set_offload_config(
+        self, prefetch_depth: int = 1, adaptive: bool = False, max_prefetch_depth: int = 2, memory_budget: int = 0
+    ):
+        block = self.transformer_blocks[0]
+        assert isinstance(block, NunchakuFluxTransformerBlocks)
+        block.m.setOffloadConfig(prefetch_depth, adaptive, max_prefetch_depth, memory_budget)
+
+    def get_offload_stats(self):
+        block = self.transformer_blocks[0]
+        assert isinstance(block, NunchakuFluxTransformerBlocks)
+        return block.m.getOffloadStats()
+
+    def set_offload_budget(self, memory_budget: int, link_bandwidth: float = 25e9):
+        """Keep as many layers on the GPU as fit in `memory_budget` bytes and offload the rest.
+
+        Layers are chosen by the load time they save. Timings of the last offloaded forward are used when
+        available, otherwise load times are estimated from `link_bandwidth` (bytes/s).
+        Returns the plan, whose `transfer_bytes` is the expected host to device traffic per step.
+        """
+        block = self.transformer_blocks[0]
+        assert isinstance(block, NunchakuFluxTransformerBlocks)
+        plan = block.m.setOffloadBudget(memory_budget, link_bandwidth)
+        logger.info(
+            f"Offload budget {memory_budget / 2**30:.2f} GiB: {sum(plan.resident)} resident layers, "
+            f"{plan.transfer_bytes / 2**30:.2f} GiB transferred per step"
+        )
+        return plan
+
+    def get_memory_stats(self, reset_peak: bool = False) -> dict[str, dict[str, int]]:
+        """Live and peak bytes per module, split into param / lora / activation on device, pinned and host memory.
+
+        Keys of the inner dicts look like `activation.device.peak`; the root module is reported as "".
+        """
+        block = self.transformer_blocks[0]
+        assert isinstance(block, NunchakuFluxTransformerBlocks)
+        stats = block.m.getMemoryStats()
+        if reset_peak:
+            block.m.resetPeakMemory()
+        return stats
+
+    def get_layer_bytes(self) -> list[int]:
+        block = self.transformer_blocks[0]
+        assert isinstance(block, NunchakuFluxTransformerBlocks)
+        return block.m.getLayerBytes()
+
+    def prepare_weight_update(self, transformer_block_path: str):
+        """Start loading a new version of the quantized transformer blocks in the background.
+
+        Only tensors whose content changed are loaded, into shadow storage, while forwards keep running on the
+        current weights. Call `commit_weight_update` between two forwards to switch to the new weights.
+        Saved LoRA slots still hold vectors of the old weights and should be saved again after the update.
+        Loading weights, LoRA changes and changes of the resident layers are rejected until the update is committed.
+        """
+        block = self.transformer_blocks[0]
+        assert isinstance(block, NunchakuFluxTransformerBlocks)
+        block.m.prepareUpdate(transformer_block_path)
+
+        # the default LoRA branch and the vectors are needed for LoRA conversion
+        new_quantized_part_sd = {}
+        with safe_open(transformer_block_path, framework="pt", device="cpu") as f:
+            for k in f.keys():
+                if "lora" in k or len(f.get_slice(k).get_shape()) == 1:
+                    new_quantized_part_sd[k] = f.get_tensor(k)
+        self._pending_quantized_part_sd = new_quantized_part_sd
+
+    def commit_weight_update(self):
+        block = self.transformer_blocks[0]
+        assert isinstance(block, NunchakuFluxTransformerBlocks)
+        result = block.m.commitUpdate()
+        self._quantized_part_sd.update(self._pending_quantized_part_sd)
+        self._pending_quantized_part_sd = {}
+        return result
+
     ### LoRA Related Functions
 
     def _expand_module(self, module_name: str, new_shape: tuple[int, int]):
@@ -441,6 +536,7 @@ class NunchakuFluxTransformer2dModel(FluxTransformer2DModel, NunchakuModelLoader
         if len(self._unquantized_part_loras) > 0 or len(unquantized_part_loras) > 0:
             self._unquantized_part_loras = unquantized_part_loras
             self._update_unquantized_part_lora_params(1)
+        self._lora_strength = 1
 
         quantized_part_vectors = {}
         for k, v in list(state_dict.items()):
@@ -466,10 +562,47 @@ class NunchakuFluxTransformer2dModel(FluxTransformer2DModel, NunchakuModelLoader
         block.m.setLoraScale(SVD_RANK, strength)
         if len(self._unquantized_part_loras) > 0:
             self._update_unquantized_part_lora_params(strength)
+        self._lora_strength = strength
         if len(self._quantized_part_vectors) > 0:
             vector_dict = fuse_vectors(self._quantized_part_vectors, self._quantized_part_sd, strength)
             block.m.loadDict(vector_dict, True)
 
+    def save_lora_slot(self, name: str, on_device: bool = False):
+        """Snapshot the currently loaded LoRA under `name`.
+
+        The quantized part is kept in its packed layout in pinned host memory (or device memory if `on_device`),
+        so `activate_lora_slot` does not need to convert the LoRA again. The strength set by `set_lora_strength` is
+        restored with the slot.
+        """
+        block = self.transformer_blocks[0]
+        assert isinstance(block, NunchakuFluxTransformerBlocks)
+        block.m.saveLoraSlot(name, on_device)
+        self._lora_slots[name] = (
+            dict(self._unquantized_part_loras),
+            dict(self._quantized_part_vectors),
+            self._lora_strength,
+        )
+
+    def activate_lora_slot(self, name: str):
+        if name not in self._lora_slots:
+            raise KeyError(f"LoRA slot {name} not found")
+        block = self.transformer_blocks[0]
+        assert isinstance(block, NunchakuFluxTransformerBlocks)
+        block.m.activateLoraSlot(name)
+
+        unquantized_part_loras, quantized_part_vectors, strength = self._lora_slots[name]
+        if len(self._unquantized_part_loras) > 0 or len(unquantized_part_loras) > 0:
+            self._unquantized_part_loras = dict(unquantized_part_loras)
+            self._update_unquantized_part_lora_params(strength)
+        self._quantized_part_vectors = dict(quantized_part_vectors)
+        self._lora_strength = strength
+
+    def remove_lora_slot(self, name: str):
+        block = self.transformer_blocks[0]
+        assert isinstance(block, NunchakuFluxTransformerBlocks)
+        block.m.removeLoraSlot(name)
+        self._lora_slots.pop(name, None)
+
     def reset_x_embedder(self):
         # if change the model in channels, we need to update the x_embedder
         if self._original_in_channels != self.config.in_channels:
@@ -496,6 +629,7 @@ class NunchakuFluxTransformer2dModel(FluxTransformer2DModel, NunchakuModelLoader
         if len(self._unquantized_part_loras) > 0 or len(unquantized_part_loras) > 0:
             self._unquantized_part_loras = unquantized_part_loras
             self._update_unquantized_part_lora_params(1)
+        self._lora_strength = 1
         state_dict = {k: v for k, v in self._quantized_part_sd.items() if "lora" in k}
         quantized_part_vectors = {}
         if len(self._quantized_part_vectors) > 0 or len(quantized_part_vectors) > 0:
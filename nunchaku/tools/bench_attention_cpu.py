@@ -0,0 +1,85 @@
+"""Measure the CPU attention of the Flux blocks against torch scaled_dot_product_attention.
+
+    NUNCHAKU_CPU_THREADS=16 python -m nunchaku.tools.bench_attention_cpu --isa avx512 avx2 --check
+
+Flux at 1024px attends over 4096 image + 512 text tokens with 24 heads of 128. The linear layout is the qkv
+projection output [B, T, 3 * H * D] sliced into q / k / v (Attention::forward), the packed layout is the
+[B, H, T, D] q / k / v of attention_fp16. Both run the same kernel, they only differ in strides. The torch column
+is F.scaled_dot_product_attention on [B, H, T, D]; set the torch thread count to NUNCHAKU_CPU_THREADS for a fair
+comparison. With --check the output is compared against the attention in FP32.
+"""
+
+import argparse
+
+import torch
+import torch.nn.functional as F
+
+from .._C.ops import attention_cpu, attention_fp16
+from .bench_utils import isas, make_parser, setup, timeit
+
+# (name, tokens)
+SHAPES = [
+    ("flux 1024px", 4096 + 512),
+    ("flux 512px", 1024 + 512),
+]
+HEADS = 24
+HEAD_DIM = 128
+
+
+def make_operands(batch: int, tokens: int, dtype: torch.dtype) -> dict:
+    qkv = torch.randn(batch, tokens, 3 * HEADS, HEAD_DIM).to(dtype)
+    q, k, v = qkv.split(HEADS, dim=2)
+    return {
+        "qkv": qkv,
+        "linear": (q, k, v),
+        "packed": tuple(x.transpose(1, 2).contiguous() for x in (q, k, v)),
+        "output": torch.empty(batch, tokens, HEADS * HEAD_DIM, dtype=dtype),
+    }
+
+
+def run_linear(ops: dict):
+    attention_cpu(*ops["linear"], ops["output"], HEAD_DIM**-0.5)
+
+
+def run_packed(ops: dict):
+    attention_fp16(*ops["packed"], ops["output"], HEAD_DIM**-0.5)
+
+
+def run_torch(ops: dict) -> torch.Tensor:
+    out = F.scaled_dot_product_attention(*ops["packed"])
+    return out.transpose(1, 2).flatten(2)
+
+
+def get_args() -> argparse.Namespace:
+    parser = make_parser(repeat=3, isa="scalar, avx2 or avx512, default: best", check="compare against the attention in FP32")
+    parser.add_argument("-b", "--batch", type=int, default=1)
+    return parser.parse_args()
+
+
+def main():
+    args = get_args()
+    dtype = setup(args)
+
+    print(f"{'shape':>12} {'T':>5} {'isa':>7} {'linear(ms)':>11} {'packed(ms)':>11} {'TFLOPS':>7} {'torch(ms)':>10}")
+    for name, tokens in SHAPES:
+        ops = make_operands(args.batch, tokens, dtype)
+        flops = 4 * args.batch * HEADS * tokens * tokens * HEAD_DIM
+        baseline = timeit(lambda: run_torch(ops), args.repeat)
+        for isa in isas(args):
+            linear = timeit(lambda: run_linear(ops), args.repeat)
+            packed = timeit(lambda: run_packed(ops), args.repeat)
+            print(
+                f"{name:>12} {tokens:>5} {isa or 'auto':>7} {linear * 1e3:>11.1f} {packed * 1e3:>11.1f} "
+                f"{flops / linear / 1e12:>7.2f} {baseline * 1e3:>10.1f}"
+            )
+
+        if args.check:
+            ref = run_torch({"packed": tuple(x.float() for x in ops["packed"])})
+            for run in (run_linear, run_packed):
+                run(ops)
+                diff = (ops["output"].float() - ref).abs().max().item()
+                print(f"{name:>12} {run.__name__[4:]} max |cpu - fp32| = {diff:.4f}")
+
+
+if __name__ == "__main__":
+    main()
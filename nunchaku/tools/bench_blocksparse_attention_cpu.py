@@ -0,0 +1,83 @@
+"""Measure the CPU block-sparse attention against dense attention at several sparsity ratios.
+
+    NUNCHAKU_CPU_THREADS=16 python -m nunchaku.tools.bench_blocksparse_attention_cpu --sparsity 0.5 0.75 0.9 --check
+
+This is the selection of Attention::forward(qkv, pool_qkv, sparsityRatio): q and k are mean-pooled over blocks of
+128 tokens, the pooled scores pick the round(blocks * (1 - sparsity)) key blocks of every query block and only those
+are attended. The time and the speedup over dense attention_cpu are reported next to the density of the mask; a
+kernel that skips blocks for free has a speedup of 1 / density. With --check the output is compared against masked
+attention in FP32.
+"""
+
+import argparse
+
+import torch
+import torch.nn.functional as F
+
+from .._C.ops import attention_blocksparse_cpu, attention_cpu
+from .bench_attention_cpu import HEAD_DIM, HEADS, SHAPES
+from .bench_utils import make_parser, setup, timeit
+
+BLOCK_SIZE = 128
+
+
+def make_blockmask(q: torch.Tensor, k: torch.Tensor, sparsity: float) -> torch.Tensor:
+    """[B, T, H, D] q / k -> INT32 [B, H, blocks, K] key blocks of the top pooled scores, as topk does"""
+    pool_q, pool_k = (
+        F.avg_pool1d(x.float().permute(0, 2, 3, 1).flatten(0, 1), BLOCK_SIZE, ceil_mode=True)
+        .unflatten(0, (x.shape[0], HEADS))
+        .transpose(-1, -2)
+        for x in (q, k)
+    )
+    scores = pool_q @ pool_k.transpose(-1, -2)
+    blocks = scores.shape[-1]
+    return scores.topk(int(blocks * (1 - sparsity)), dim=-1).indices.int()
+
+
+def run_masked_reference(q: torch.Tensor, k: torch.Tensor, v: torch.Tensor, blockmask: torch.Tensor) -> torch.Tensor:
+    tokens = q.shape[1]
+    blocks = blockmask.shape[2]
+    allowed = torch.zeros(q.shape[0], HEADS, blocks, blocks, dtype=torch.bool)
+    allowed.scatter_(-1, blockmask.long(), True)
+    allowed = allowed.repeat_interleave(BLOCK_SIZE, 2).repeat_interleave(BLOCK_SIZE, 3)[:, :, :tokens, :tokens]
+    q, k, v = (x.float().transpose(1, 2) for x in (q, k, v))
+    out = F.scaled_dot_product_attention(q, k, v, attn_mask=allowed)
+    return out.transpose(1, 2).flatten(2)
+
+
+def get_args() -> argparse.Namespace:
+    parser = make_parser(repeat=3, check="compare against masked attention in FP32")
+    parser.add_argument("-b", "--batch", type=int, default=1)
+    parser.add_argument("--sparsity", type=float, nargs="+", default=[0.25, 0.5, 0.75, 0.9])
+    return parser.parse_args()
+
+
+def main():
+    args = get_args()
+    dtype = setup(args)
+
+    print(f"{'shape':>12} {'T':>5} {'sparsity':>8} {'density':>8} {'time(ms)':>9} {'dense(ms)':>10} {'speedup':>8}")
+    for name, tokens in SHAPES:
+        qkv = torch.randn(args.batch, tokens, 3 * HEADS, HEAD_DIM).to(dtype)
+        q, k, v = qkv.split(HEADS, dim=2)
+        out = torch.empty(args.batch, tokens, HEADS * HEAD_DIM, dtype=dtype)
+        scale = HEAD_DIM**-0.5
+        dense = timeit(lambda: attention_cpu(q, k, v, out, scale), args.repeat)
+
+        for sparsity in args.sparsity:
+            blockmask = make_blockmask(q, k, sparsity)
+            density = blockmask.shape[-1] / blockmask.shape[-2]
+            elapsed = timeit(lambda: attention_blocksparse_cpu(q, k, v, out, scale, blockmask, BLOCK_SIZE), args.repeat)
+            print(
+                f"{name:>12} {tokens:>5} {sparsity:>8.2f} {density:>8.2f} {elapsed * 1e3:>9.1f} "
+                f"{dense * 1e3:>10.1f} {dense / elapsed:>7.2f}x"
+            )
+
+            if args.check:
+                attention_blocksparse_cpu(q, k, v, out, scale, blockmask, BLOCK_SIZE)
+                diff = (out.float() - run_masked_reference(q, k, v, blockmask)).abs().max().item()
+                print(f"{name:>12} sparsity {sparsity:.2f} max |cpu - fp32| = {diff:.4f}")
+
+
+if __name__ == "__main__":
+    main()
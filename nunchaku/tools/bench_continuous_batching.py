@@ -0,0 +1,136 @@
+"""Compare continuous batching (BatchScheduler) with synchronised batches under bursty traffic, on a cost model.
+
+    python -m nunchaku.tools.bench_continuous_batching --requests 200 --burst 8 --max-batch 4
+
+Requests arrive in bursts of random size, each with one of a few resolutions and a number of denoising steps. One
+forward of the model costs `--forward-ms` plus `--token-us` per token of every sample in it (measure both on the
+target device, e.g. with a forward at batch sizes 1 and 4).
+
+- synchronised: as a pipeline that batches identical requests, a batch takes requests of one resolution and step count,
+  waits up to `--fill-ms` for it to fill and runs all of its steps before the next batch starts
+- continuous: the BatchScheduler admits requests at every step boundary and runs one step of up to `--max-batch`
+  requests of one resolution, each at its own timestep (the model takes one temb per sample)
+
+Both finish the same work, so under a sustainable load the throughput is set by the arrivals; the difference is in
+the latency, as no request waits for a batch to fill or for the steps of an earlier batch. Raising `--max-running`
+shows the cost of admitting more requests than a batch holds.
+"""
+
+import argparse
+import random
+
+from .._C import BatchScheduler
+
+
+def make_requests(args: argparse.Namespace) -> list[dict]:
+    rng = random.Random(args.seed)
+    requests = []
+    t = 0.0
+    while len(requests) < args.requests:
+        t += rng.expovariate(1.0 / args.burst_interval_ms)
+        for _ in range(min(rng.randint(1, args.burst), args.requests - len(requests))):
+            requests.append(
+                {
+                    "arrival": t + rng.uniform(0, args.burst_spread_ms),
+                    "tokens": rng.choice(args.tokens),
+                    "steps": rng.choice(args.steps),
+                }
+            )
+    requests.sort(key=lambda r: r["arrival"])
+    return requests
+
+
+def forward_cost(args: argparse.Namespace, tokens: list[int]) -> float:
+    return args.forward_ms + sum(tokens) * args.token_us * 1e-3
+
+
+def run_synchronised(args: argparse.Namespace, requests: list[dict]) -> tuple[list[float], int, int]:
+    finish = [0.0] * len(requests)
+    queue = []
+    t = 0.0
+    i = 0
+    forwards = samples = 0
+    while i < len(requests) or queue:
+        while i < len(requests) and requests[i]["arrival"] <= t:
+            queue.append(i)
+            i += 1
+        if not queue:
+            t = requests[i]["arrival"]
+            continue
+        first = requests[queue[0]]
+        batch = [j for j in queue if (requests[j]["tokens"], requests[j]["steps"]) == (first["tokens"], first["steps"])]
+        batch = batch[: args.max_batch]
+        deadline = first["arrival"] + args.fill_ms
+        if len(batch) < args.max_batch:
+            if i < len(requests) and requests[i]["arrival"] <= deadline:
+                t = max(t, requests[i]["arrival"])
+                continue
+            t = max(t, deadline)
+        for j in batch:
+            queue.remove(j)
+        t += first["steps"] * forward_cost(args, [first["tokens"]] * len(batch))
+        for j in batch:
+            finish[j] = t
+        forwards += first["steps"]
+        samples += first["steps"] * len(batch)
+    return finish, forwards, samples
+
+
+def run_continuous(args: argparse.Namespace, requests: list[dict]) -> tuple[list[float], int, int]:
+    scheduler = BatchScheduler(args.max_batch, args.max_running)
+    finish = [0.0] * len(requests)
+    index = {}
+    t = 0.0
+    i = 0
+    while i < len(requests) or scheduler.stats().running + scheduler.stats().waiting > 0:
+        while i < len(requests) and requests[i]["arrival"] <= t:
+            index[scheduler.submit([requests[i]["tokens"]], requests[i]["steps"])] = i
+            i += 1
+        ids = scheduler.nextBatch()
+        if not ids:
+            t = requests[i]["arrival"]
+            continue
+        t += forward_cost(args, [requests[index[id]]["tokens"] for id in ids])
+        for id in scheduler.finishStep(ids):
+            finish[index.pop(id)] = t
+    stats = scheduler.stats()
+    return finish, stats.forwards, stats.samples
+
+
+def report(name: str, requests: list[dict], finish: list[float], forwards: int, samples: int):
+    latency = sorted(f - r["arrival"] for f, r in zip(finish, requests))
+    makespan = max(finish) - requests[0]["arrival"]
+    print(
+        f"{name:>12} {len(requests) / makespan * 1e3:>10.3f} {sum(latency) / len(latency):>10.1f} "
+        f"{latency[int(len(latency) * 0.9)]:>10.1f} {latency[-1]:>10.1f} {samples / forwards:>9.2f}"
+    )
+
+
+def get_args() -> argparse.Namespace:
+    parser = argparse.ArgumentParser()
+    parser.add_argument("--requests", type=int, default=200)
+    parser.add_argument("--burst", type=int, default=8, help="largest number of requests in a burst")
+    parser.add_argument("--burst-interval-ms", type=float, default=4000, help="mean time between bursts")
+    parser.add_argument("--burst-spread-ms", type=float, default=200, help="arrivals of a burst spread over this time")
+    parser.add_argument("--tokens", type=int, nargs="+", default=[4096 + 512], help="image + text tokens per resolution")
+    parser.add_argument("--steps", type=int, nargs="+", default=[20, 28], help="numbers of denoising steps")
+    parser.add_argument("--forward-ms", type=float, default=20, help="cost of a forward independent of its tokens")
+    parser.add_argument("--token-us", type=float, default=10, help="cost of a token in a forward")
+    parser.add_argument("--max-batch", type=int, default=4)
+    parser.add_argument("--max-running", type=int, default=0, help="bound on admitted requests, 0 for max-batch")
+    parser.add_argument("--fill-ms", type=float, default=500, help="time a synchronised batch waits to fill")
+    parser.add_argument("--seed", type=int, default=0)
+    return parser.parse_args()
+
+
+def main():
+    args = get_args()
+    requests = make_requests(args)
+
+    print(f"{'':>12} {'req/s':>10} {'mean(ms)':>10} {'p90(ms)':>10} {'max(ms)':>10} {'avg batch':>9}")
+    report("synchronised", requests, *run_synchronised(args, requests))
+    report("continuous", requests, *run_continuous(args, requests))
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,95 @@
+"""Compare a chain of CPU W4A4 layers run op by op with the replay of its recorded execution plan.
+
+    NUNCHAKU_CPU_THREADS=16 python -m nunchaku.tools.bench_cpu_plan -m 16 256 4096 --layers 16
+
+Each layer quantizes its input (quantize_w4a4_act_fuse_lora with the LoRA down projection) and runs gemm_w4a4 with the
+LoRA up projection into the input of the next layer, as the projections of a transformer block. The eager run goes
+through the Python bindings and the C++ host code of every op, the replay only through the kernels, so the difference
+is the host time per op that a plan saves on every denoising step; it matters most at small token counts.
+The replay of the same input must reproduce the eager output exactly.
+"""
+
+import argparse
+
+import torch
+
+from .._C import CpuExecutionPlan
+from .._C.ops import gemm_w4a4, quantize_w4a4_act_fuse_lora
+from .bench_gemm_w4a4_cpu import make_scales
+from .bench_utils import make_parser, setup, timeit
+
+
+def make_layers(m: int, width: int, rank: int, layers: int, dtype: torch.dtype) -> list[dict]:
+    result = []
+    for _ in range(layers):
+        result.append(
+            {
+                "wgt": torch.randint(-128, 128, (width, width // 2), dtype=torch.int8),
+                "wscales": make_scales(width // 64, width, 0.001, 0.011, False, dtype),
+                "bias": torch.randn(width).to(dtype),
+                "smooth": (torch.rand(width) + 0.5).to(dtype),
+                "lora_down": (torch.randn(width, rank) * 0.01).to(dtype),
+                "lora_up": (torch.randn(width, rank) * 0.01).to(dtype),
+                "act": torch.empty(m, width // 2, dtype=torch.int8),
+                "ascales": torch.empty(width // 64, m, dtype=dtype),
+                "lora_act": torch.empty(m, rank, dtype=torch.float32),
+                "out": torch.empty(m, width, dtype=dtype),
+            }
+        )
+    return result
+
+
+def forward(x: torch.Tensor, layers: list[dict], rank: int) -> torch.Tensor:
+    for layer in layers:
+        quantize_w4a4_act_fuse_lora(
+            x, layer["act"], layer["ascales"], layer["lora_down"], layer["lora_act"], layer["smooth"], False, False
+        )
+        gemm_w4a4(
+            layer["act"], layer["wgt"], layer["out"], None, layer["ascales"], layer["wscales"], None,
+            None, layer["lora_act"], layer["lora_up"], None, None,
+            None, None, None, layer["bias"], None, None, None,
+            False, [0.01] * (rank // 16), False, False, 1.0, None, None, None, None, 0,
+        )
+        x = layer["out"]
+    return x
+
+
+def get_args() -> argparse.Namespace:
+    parser = make_parser(repeat=5)
+    parser.add_argument("-m", type=int, nargs="+", default=[16, 256, 4096], help="numbers of tokens")
+    parser.add_argument("--width", type=int, default=3072)
+    parser.add_argument("--rank", type=int, default=32)
+    parser.add_argument("--layers", type=int, default=16)
+    return parser.parse_args()
+
+
+def main():
+    args = get_args()
+    dtype = setup(args)
+
+    print(f"{'M':>6} {'steps':>5} {'eager(ms)':>10} {'replay(ms)':>10} {'saved/op(us)':>12} {'speedup':>8} {'exact':>5}")
+    for m in args.m:
+        layers = make_layers(m, args.width, args.rank, args.layers, dtype)
+        x = (torch.randn(m, args.width) * 0.5).to(dtype)
+        expected = forward(x, layers, args.rank).clone()
+
+        plan = CpuExecutionPlan()
+        plan.beginCapture([x])
+        output = forward(x, layers, args.rank)
+        plan.endCapture([output])
+
+        x2 = (torch.randn(m, args.width) * 0.5).to(dtype)
+        exact = torch.equal(plan.replay([x2])[0], forward(x2, layers, args.rank))
+        exact = exact and torch.equal(plan.replay([x])[0], expected)
+
+        eager = timeit(lambda: forward(x, layers, args.rank), args.repeat)
+        replay = timeit(lambda: plan.replay([x]), args.repeat)
+        steps = plan.numSteps()
+        print(
+            f"{m:>6} {steps:>5} {eager * 1e3:>10.2f} {replay * 1e3:>10.2f} {(eager - replay) / steps * 1e6:>12.1f} "
+            f"{eager / replay:>7.2f}x {'yes' if exact else 'NO':>5}"
+        )
+
+
+if __name__ == "__main__":
+    main()
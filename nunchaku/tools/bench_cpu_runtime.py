@@ -0,0 +1,121 @@
+"""Measure the scheduling overhead and the scaling of the CPU runtime (the worker pool shared by the CPU kernels).
+
+    python -m nunchaku.tools.bench_cpu_runtime --threads 1 2 4 8 16 32 64 128 --gemm
+
+The pool is sized once per process from NUNCHAKU_CPU_THREADS, so every thread count runs in a subprocess of its own
+(default: powers of 2 up to all cores, which covers both sockets of a dual-socket host). For each count:
+
+    fork-join   one parallel_for of one empty range per thread, the latency of waking the pool and joining it
+    per task    parallel_for of 64 empty ranges per thread divided by the number of ranges, the cost of a stolen task
+    speedup     4096 items of --item-us each against the same work on one thread, with its parallel efficiency
+    nested      the same work as 64 parallel_for of 64 items run from inside a parallel_for
+    callers     the same work split between --callers Python threads issuing parallel_for at once
+    gemm        GFLOP/s of gemm_w4a4 at the Flux qkv projection (with --gemm)
+"""
+
+import argparse
+import json
+import os
+import subprocess
+import sys
+import threading
+import time
+
+ITEMS = 4096
+NESTED = 64
+
+
+def run_child(args: argparse.Namespace):
+    from .._C import utils
+
+    info = utils.cpu_runtime_info()
+    threads = info.num_threads
+    item_ns = args.item_us * 1e3
+    result = {
+        "threads": threads,
+        "nodes": info.num_nodes,
+        "pinned": info.pinned,
+        "fork_join": utils.benchmark_cpu_parallel_for(threads, 1, 0.0, 0, args.repeat * 100),
+        "per_task": utils.benchmark_cpu_parallel_for(threads * 64, 1, 0.0, 0, args.repeat * 10) / (threads * 64),
+        "flat": utils.benchmark_cpu_parallel_for(ITEMS, 0, item_ns, 0, args.repeat),
+        "nested": utils.benchmark_cpu_parallel_for(ITEMS // NESTED, 1, item_ns, NESTED, args.repeat),
+    }
+
+    def caller():
+        utils.benchmark_cpu_parallel_for(ITEMS // args.callers, 0, item_ns, 0, args.repeat)
+
+    callers = [threading.Thread(target=caller) for _ in range(args.callers)]
+    start = time.perf_counter()
+    for thread in callers:
+        thread.start()
+    for thread in callers:
+        thread.join()
+    # each caller also runs one warmup round
+    result["callers"] = (time.perf_counter() - start) / (args.repeat + 1)
+
+    if args.gemm:
+        import torch
+
+        from .bench_gemm_w4a4_cpu import make_operands, run
+
+        torch.set_num_threads(threads)
+        m, n, k = 4096, 9216, 3072
+        ops = make_operands(m, n, k, 32, False, False, torch.bfloat16)
+        run(ops, 32, False)
+        start = time.perf_counter()
+        for _ in range(args.repeat):
+            run(ops, 32, False)
+        result["gemm"] = 2 * m * n * k * args.repeat / (time.perf_counter() - start) / 1e9
+    print(json.dumps(result))
+
+
+def get_args() -> argparse.Namespace:
+    parser = argparse.ArgumentParser()
+    parser.add_argument("--threads", type=int, nargs="+", default=None, help="default: powers of 2 up to all cores")
+    parser.add_argument("--item-us", type=float, default=20.0, help="busy time of one item of the scaling runs")
+    parser.add_argument("--callers", type=int, default=2, help="Python threads issuing parallel_for at once")
+    parser.add_argument("--repeat", type=int, default=5)
+    parser.add_argument("--gemm", action="store_true", help="also measure gemm_w4a4 at the Flux qkv projection")
+    parser.add_argument("--no-pin", action="store_true", help="run with NUNCHAKU_CPU_PIN=0")
+    parser.add_argument("--child", action="store_true", help=argparse.SUPPRESS)
+    return parser.parse_args()
+
+
+def main():
+    args = get_args()
+    if args.child:
+        run_child(args)
+        return
+
+    cores = len(os.sched_getaffinity(0))
+    counts = args.threads
+    if counts is None:
+        counts = [1 << i for i in range(cores.bit_length()) if (1 << i) < cores] + [cores]
+
+    child = [sys.executable, "-m", __spec__.name, "--child", "--item-us", str(args.item_us)]
+    child += ["--callers", str(args.callers), "--repeat", str(args.repeat)] + (["--gemm"] if args.gemm else [])
+
+    print(
+        f"{'threads':>7} {'nodes':>5} {'pin':>3} {'fork-join(us)':>13} {'per task(us)':>12} {'speedup':>8} "
+        f"{'eff':>5} {'nested':>7} {'callers':>8}" + (f" {'gemm(GFLOP/s)':>13}" if args.gemm else "")
+    )
+    # the work of the scaling runs on one thread, without scheduling
+    serial = ITEMS * args.item_us * 1e-6
+    for threads in counts:
+        env = dict(os.environ, NUNCHAKU_CPU_THREADS=str(threads))
+        if args.no_pin:
+            env["NUNCHAKU_CPU_PIN"] = "0"
+        output = subprocess.run(child, env=env, check=True, capture_output=True, text=True).stdout
+        r = json.loads(output.strip().splitlines()[-1])
+        line = (
+            f"{r['threads']:>7} {r['nodes']:>5} {'yes' if r['pinned'] else 'no':>3} {r['fork_join'] * 1e6:>13.2f} "
+            f"{r['per_task'] * 1e6:>12.3f} {serial / r['flat']:>7.2f}x {serial / r['flat'] / r['threads']:>5.2f} "
+            f"{serial / r['nested']:>6.2f}x {serial / r['callers']:>7.2f}x"
+        )
+        if args.gemm:
+            line += f" {r['gemm']:>13.1f}"
+        print(line)
+
+
+if __name__ == "__main__":
+    main()
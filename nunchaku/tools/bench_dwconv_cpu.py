@@ -0,0 +1,73 @@
+"""Measure the CPU dwconv_f16 backend at the depthwise convolutions of SanaGLUMBConv.
+
+    NUNCHAKU_CPU_THREADS=16 python -m nunchaku.tools.bench_dwconv_cpu --isa avx512 avx2 --check
+
+The depthwise 3x3 runs on hidden_features * 2 channels of the latent image: 32 x 32 at 1024px and 128 x 128 at 4K.
+It reads and writes every activation once, so the bandwidth is reported next to the time. The torch column is
+F.conv2d with groups=C on the same NHWC (channels_last) tensor; set the torch thread count to NUNCHAKU_CPU_THREADS
+for a fair comparison. With --check the output is compared against the convolution in FP32.
+"""
+
+import argparse
+import time
+
+import torch
+import torch.nn.functional as F
+
+from .._C.ops import dwconv_f16
+from .bench_utils import isas, make_parser, setup, timeit
+
+# (name, latent size, channels): Sana 1600M (hidden 2240, mlp ratio 2.5) and Sana 600M (hidden 1152)
+SANA_SHAPES = [
+    ("1600M 1024px", 32, 11200),
+    ("1600M 4K", 128, 11200),
+    ("600M 1024px", 32, 5760),
+    ("600M 4K", 128, 5760),
+]
+
+
+def make_operands(batch: int, size: int, channels: int, dtype: torch.dtype) -> dict:
+    return {
+        "input": torch.randn(batch, size, size, channels).to(dtype),
+        "weight": (torch.randn(channels, 3, 3, 1) * 0.3).to(dtype),
+        "bias": torch.randn(channels).to(dtype),
+    }
+
+
+def run_torch(ops: dict) -> torch.Tensor:
+    x = ops["input"].permute(0, 3, 1, 2)
+    weight = ops["weight"].permute(0, 3, 1, 2)
+    return F.conv2d(x, weight, ops["bias"], padding=1, groups=weight.shape[0]).permute(0, 2, 3, 1)
+
+
+def get_args() -> argparse.Namespace:
+    parser = make_parser(repeat=5, isa="scalar, avx2 or avx512, default: best", check="compare against the convolution in FP32")
+    parser.add_argument("-b", "--batch", type=int, default=1)
+    return parser.parse_args()
+
+
+def main():
+    args = get_args()
+    dtype = setup(args)
+
+    print(f"{'shape':>13} {'H x W':>9} {'C':>6} {'isa':>7} {'time(ms)':>9} {'GB/s':>6} {'torch(ms)':>10}")
+    for name, size, channels in SANA_SHAPES:
+        ops = make_operands(args.batch, size, channels, dtype)
+        moved = 2 * ops["input"].numel() * ops["input"].element_size()
+        baseline = timeit(lambda: run_torch(ops), args.repeat)
+        for isa in isas(args):
+            elapsed = timeit(lambda: dwconv_f16(ops["input"], ops["weight"], ops["bias"]), args.repeat)
+            print(
+                f"{name:>13} {f'{size} x {size}':>9} {channels:>6} {isa or 'auto':>7} {elapsed * 1e3:>9.2f} "
+                f"{moved / elapsed / 1e9:>6.1f} {baseline * 1e3:>10.2f}"
+            )
+
+        if args.check:
+            out = dwconv_f16(ops["input"], ops["weight"], ops["bias"])
+            ref = run_torch({key: value.float() for key, value in ops.items()})
+            diff = (out.float() - ref).abs().max().item()
+            print(f"{name:>13} max |cpu - fp32| = {diff:.4f}")
+
+
+if __name__ == "__main__":
+    main()
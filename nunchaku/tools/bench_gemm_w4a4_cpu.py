@@ -0,0 +1,103 @@
+"""Measure GFLOP/s of the CPU gemm_w4a4 backend at Flux shapes.
+
+    NUNCHAKU_CPU_THREADS=16 python -m nunchaku.tools.bench_gemm_w4a4_cpu --isa avx512vnni avx2 --format int4 fp4
+
+The operands are random packed tensors. With --check the same operands are also run through the CUDA kernel
+and the maximum difference of the outputs is reported.
+Each call from Python unpacks the weight again, the modules of a model keep it unpacked between calls, so the
+times here are an upper bound at small M.
+"""
+
+import argparse
+
+import torch
+
+from .._C.ops import gemm_w4a4
+from .bench_utils import isas, make_parser, setup, timeit
+
+# (name, N, K) of the W4A4 layers in a Flux transformer block
+FLUX_SHAPES = [
+    ("qkv", 9216, 3072),
+    ("out_proj", 3072, 3072),
+    ("fc1", 12288, 3072),
+    ("fc2", 3072, 12288),
+]
+
+
+def make_scales(groups: int, count: int, low: float, high: float, fp4: bool, dtype: torch.dtype) -> torch.Tensor:
+    scales = torch.rand(groups, count) * (high - low) + low
+    # NVFP4 micro-scales are e4m3 per 16 elements
+    return scales.to(torch.float8_e4m3fn) if fp4 else scales.to(dtype)
+
+
+def make_operands(m: int, n: int, k: int, rank: int, quantize: bool, fp4: bool, dtype: torch.dtype) -> dict:
+    group = 16 if fp4 else 64
+    ops = {
+        "act": torch.randint(-128, 128, (m, k // 2), dtype=torch.int8),
+        "wgt": torch.randint(-128, 128, (n, k // 2), dtype=torch.int8),
+        "ascales": make_scales(k // group, m, 0.01, 0.06, fp4, dtype),
+        "wscales": make_scales(k // group, n, 0.001, 0.011, fp4, dtype),
+        "bias": torch.randn(n).to(dtype),
+        "out": torch.empty(m, n, dtype=dtype),
+    }
+    if rank > 0:
+        ops["lora_act_in"] = torch.randn(m, rank, dtype=torch.float32)
+        ops["lora_up"] = (torch.randn(n, rank) * 0.01).to(dtype)
+    if quantize:
+        ops["qout"] = torch.empty(m, n // 2, dtype=torch.int8)
+        ops["oscales"] = torch.empty(n // group, m, dtype=torch.float8_e4m3fn if fp4 else dtype)
+        ops["smooth_factor"] = (torch.rand(n) + 0.5).to(dtype)
+        if rank > 0:
+            ops["lora_down"] = (torch.randn(n, rank) * 0.01).to(dtype)
+            ops["lora_act_out"] = torch.empty(m, rank, dtype=torch.float32)
+    return ops
+
+
+def run(ops: dict, rank: int, fp4: bool):
+    get = ops.get
+    gemm_w4a4(
+        get("act"), get("wgt"), get("out"), get("qout"), get("ascales"), get("wscales"), get("oscales"),
+        None, get("lora_act_in"), get("lora_up"), get("lora_down"), get("lora_act_out"),
+        None, None, None, get("bias"), get("smooth_factor"), None, None,
+        False, [1.0] * (rank // 16), False, fp4, 0.5 if fp4 else 1.0, None, None, None, None, 0,
+    )
+
+
+def get_args() -> argparse.Namespace:
+    parser = make_parser(repeat=3, isa="scalar, avx2 or avx512vnni, default: best", check="compare against the CUDA kernel")
+    parser.add_argument("-m", type=int, default=4096 + 512, help="number of tokens")
+    parser.add_argument("--rank", type=int, default=32, help="LoRA rank, 0 to disable the low-rank branch")
+    parser.add_argument("--format", type=str, nargs="+", default=["int4"], choices=["int4", "fp4"])
+    return parser.parse_args()
+
+
+def main():
+    args = get_args()
+    dtype = setup(args)
+
+    print(f"{'layer':>8} {'M':>6} {'N':>6} {'K':>6} {'format':>6} {'isa':>10} {'time(ms)':>9} {'GFLOP/s':>8}")
+    for name, n, k in FLUX_SHAPES:
+        # fc1 feeds the GELU and the quantization of fc2 as in the MLP of a block
+        quantize = name == "fc1"
+        for fmt in args.format:
+            fp4 = fmt == "fp4"
+            ops = make_operands(args.m, n, k, args.rank, quantize, fp4, dtype)
+            for isa in isas(args):
+                elapsed = timeit(lambda: run(ops, args.rank, fp4), args.repeat)
+                gflops = 2 * args.m * n * k / elapsed / 1e9
+                print(
+                    f"{name:>8} {args.m:>6} {n:>6} {k:>6} {fmt:>6} {isa or 'auto':>10} "
+                    f"{elapsed * 1e3:>9.1f} {gflops:>8.1f}"
+                )
+
+            # the FP4 kernel only runs on sm_120a
+            if args.check and torch.cuda.is_available() and (not fp4 or torch.cuda.get_device_capability() >= (12, 0)):
+                ops_cuda = {key: value.cuda() for key, value in ops.items()}
+                run(ops_cuda, args.rank, fp4)
+                torch.cuda.synchronize()
+                diff = (ops_cuda["out"].float().cpu() - ops["out"].float()).abs().max().item()
+                print(f"{name:>8} {fmt:>6} max |cpu - cuda| = {diff:.4f}")
+
+
+if __name__ == "__main__":
+    main()
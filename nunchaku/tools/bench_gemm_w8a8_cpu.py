@@ -0,0 +1,83 @@
+"""Compare the CPU W8A8 backend (quantize_w8a8_act + gemm_w8a8) with the W4A4 path at Flux shapes.
+
+    NUNCHAKU_CPU_THREADS=16 python -m nunchaku.tools.bench_gemm_w8a8_cpu --isa amx avx512vnni avx2
+
+Each layer reports the INT8 quantization of its input, the W8A8 GEMM and the W4A4 GEMM on random packed operands
+(without LoRA, so that only the main GEMMs are compared). The W4A4 quantization is measured by
+bench_quantize_w4a4_cpu. With --check the W8A8 operands are also run through the CUDA kernels and the maximum
+difference of the outputs is reported.
+"""
+
+import argparse
+import os
+
+import torch
+
+from .._C.ops import gemm_w8a8, quantize_w8a8_act
+from . import bench_gemm_w4a4_cpu
+from .bench_utils import isas, make_parser, setup, timeit
+
+FLUX_SHAPES = bench_gemm_w4a4_cpu.FLUX_SHAPES
+
+
+def make_operands(m: int, n: int, k: int, dtype: torch.dtype) -> dict:
+    return {
+        "input": torch.randn(m, k).to(dtype),
+        "act": torch.empty(m, k, dtype=torch.int8),
+        "ascales": torch.empty(m, dtype=dtype),
+        "wgt": torch.randint(-128, 128, (n, k), dtype=torch.int8),
+        "wscales": (torch.rand(n) * 0.001 + 0.0001).to(dtype),
+        "bias": torch.randn(n).to(dtype),
+        "out": torch.empty(m, n, dtype=dtype),
+    }
+
+
+def run_quantize(ops: dict):
+    quantize_w8a8_act(ops["input"], ops["act"], ops["ascales"], False)
+
+
+def run_gemm(ops: dict):
+    gemm_w8a8(ops["act"], ops["wgt"], ops["out"], ops["ascales"], ops["wscales"], ops["bias"])
+
+
+def get_args() -> argparse.Namespace:
+    parser = make_parser(repeat=3, isa="scalar, avx2, avx512vnni or amx, default: best", check="compare against the CUDA kernels")
+    parser.add_argument("-m", type=int, default=4096 + 512, help="number of tokens, a multiple of 256")
+    return parser.parse_args()
+
+
+def main():
+    args = get_args()
+    dtype = setup(args)
+
+    print(
+        f"{'layer':>8} {'M':>6} {'N':>6} {'K':>6} {'isa':>10} {'quant(ms)':>10} "
+        f"{'w8a8(ms)':>9} {'GOP/s':>7} {'w4a4(ms)':>9} {'GOP/s':>7}"
+    )
+    for name, n, k in FLUX_SHAPES:
+        ops = make_operands(args.m, n, k, dtype)
+        ops_w4a4 = bench_gemm_w4a4_cpu.make_operands(args.m, n, k, 0, False, False, dtype)
+        for isa in isas(args):
+            quant = timeit(lambda: run_quantize(ops), args.repeat)
+            w8a8 = timeit(lambda: run_gemm(ops), args.repeat)
+            # the W4A4 kernels stop at avx512vnni
+            os.environ["NUNCHAKU_CPU_GEMM_ISA"] = "avx512vnni" if isa == "amx" else isa
+            w4a4 = timeit(lambda: bench_gemm_w4a4_cpu.run(ops_w4a4, 0, False), args.repeat)
+            flops = 2 * args.m * n * k
+            print(
+                f"{name:>8} {args.m:>6} {n:>6} {k:>6} {isa or 'auto':>10} {quant * 1e3:>10.1f} "
+                f"{w8a8 * 1e3:>9.1f} {flops / w8a8 / 1e9:>7.1f} {w4a4 * 1e3:>9.1f} {flops / w4a4 / 1e9:>7.1f}"
+            )
+
+        if args.check and torch.cuda.is_available():
+            ops_cuda = {key: value.cuda() for key, value in ops.items()}
+            run_quantize(ops_cuda)
+            run_gemm(ops_cuda)
+            torch.cuda.synchronize()
+            for key in ["ascales", "out"]:
+                diff = (ops_cuda[key].float().cpu() - ops[key].float()).abs().max().item()
+                print(f"{name:>8} max |cpu - cuda| of {key} = {diff:.4f}")
+
+
+if __name__ == "__main__":
+    main()
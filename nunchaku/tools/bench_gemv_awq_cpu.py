@@ -0,0 +1,89 @@
+"""Measure the memory bandwidth reached by the CPU gemv_awq backend at the AdaLayerNorm shapes of Flux.
+
+    NUNCHAKU_CPU_THREADS=16 python -m nunchaku.tools.bench_gemv_awq_cpu --isa avx2 scalar --peak-bandwidth 80
+
+gemv_awq reads every packed weight once per call and does 2 FLOPs per weight, it is bound by memory bandwidth.
+The bytes moved are the 4-bit weights, the scales and zeros and the activations; the efficiency is relative to
+--peak-bandwidth (GB/s), or to a large tensor copy measured here if it is not given. With --check the same
+operands are also run through the CUDA kernel and the maximum difference of the outputs is reported.
+"""
+
+import argparse
+
+import torch
+
+from .._C.ops import gemv_awq
+from .bench_utils import isas, make_parser, setup, timeit
+
+# (name, N, K, calls per step) of the AWQ GEMVs of Flux: AdaLayerNormZero of the 19 joint blocks (image and text)
+# and AdaLayerNormZeroSingle of the 38 single blocks
+FLUX_SHAPES = [
+    ("norm1", 18432, 3072, 19),
+    ("norm1_context", 18432, 3072, 19),
+    ("norm_single", 9216, 3072, 38),
+]
+
+GROUP_SIZE = 64
+
+
+def make_operands(m: int, n: int, k: int, dtype: torch.dtype) -> dict:
+    return {
+        "in_feats": torch.randn(m, k).to(dtype),
+        "kernel": torch.randint(-(2**31), 2**31, (n // 4, k // 8 * 4), dtype=torch.int32),
+        "scales": (torch.rand(k // GROUP_SIZE, n) * 0.01 + 0.001).to(dtype),
+        "zeros": (torch.randn(k // GROUP_SIZE, n) * 0.05).to(dtype),
+    }
+
+
+def run(ops: dict, m: int, n: int, k: int) -> torch.Tensor:
+    return gemv_awq(ops["in_feats"], ops["kernel"], ops["scales"], ops["zeros"], m, n, k, GROUP_SIZE)
+
+
+def moved_bytes(m: int, n: int, k: int, dtype: torch.dtype) -> int:
+    elem = torch.finfo(dtype).bits // 8
+    return n * k // 2 + 2 * (k // GROUP_SIZE) * n * elem + m * (k + n) * elem
+
+
+def copy_bandwidth(size: int = 1 << 30, repeat: int = 5) -> float:
+    src = torch.empty(size, dtype=torch.uint8)
+    dst = torch.empty_like(src)
+    elapsed = timeit(lambda: dst.copy_(src), repeat)
+    # a copy reads and writes every byte
+    return 2 * size / elapsed / 1e9
+
+
+def get_args() -> argparse.Namespace:
+    parser = make_parser(repeat=20, isa="scalar or avx2, default: best", check="compare against the CUDA kernel")
+    parser.add_argument("-m", type=int, default=1, help="batch size of the timestep embedding")
+    parser.add_argument("--peak-bandwidth", type=float, default=None, help="GB/s, default: measured copy bandwidth")
+    return parser.parse_args()
+
+
+def main():
+    args = get_args()
+    dtype = setup(args)
+    peak = args.peak_bandwidth
+    if peak is None:
+        peak = copy_bandwidth()
+        print(f"measured copy bandwidth {peak:.1f} GB/s")
+
+    print(f"{'layer':>14} {'M':>4} {'N':>6} {'K':>6} {'isa':>6} {'time(ms)':>9} {'GB/s':>7} {'peak':>6} {'ms/step':>8}")
+    for name, n, k, calls in FLUX_SHAPES:
+        ops = make_operands(args.m, n, k, dtype)
+        for isa in isas(args):
+            elapsed = timeit(lambda: run(ops, args.m, n, k), args.repeat)
+            bandwidth = moved_bytes(args.m, n, k, dtype) / elapsed / 1e9
+            print(
+                f"{name:>14} {args.m:>4} {n:>6} {k:>6} {isa or 'auto':>6} {elapsed * 1e3:>9.2f} "
+                f"{bandwidth:>7.1f} {bandwidth / peak:>6.0%} {elapsed * calls * 1e3:>8.1f}"
+            )
+
+        if args.check and torch.cuda.is_available():
+            out = run(ops, args.m, n, k)
+            out_cuda = run({key: value.cuda() for key, value in ops.items()}, args.m, n, k)
+            diff = (out_cuda.float().cpu() - out.float()).abs().max().item()
+            print(f"{name:>14} max |cpu - cuda| = {diff:.4f}")
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,70 @@
+"""Compare the latency of a Flux joint transformer block with grouped and with separate image / text GEMMs.
+
+    python -m nunchaku.tools.bench_joint_block mit-han-lab/svdq-int4-flux.1-dev --img-tokens 4096 --txt-tokens 512
+
+Each pair of projections of a joint block (qkv, out_proj, fc1, fc2 of the image and text sides) runs as one grouped
+gemm_w4a4 on side CUDA streams with NUNCHAKU_GROUPED_GEMM=1 (off by default on GPU); NUNCHAKU_GROUPED_GEMM=0 runs them
+one after another. The inputs are random, both modes must give the same outputs.
+"""
+
+import argparse
+import math
+import os
+import time
+
+import torch
+
+from ..models.transformers.transformer_flux import NunchakuFluxTransformer2dModel
+
+
+def get_args() -> argparse.Namespace:
+    parser = argparse.ArgumentParser()
+    parser.add_argument("model", type=str, help="path or repo of a quantized Flux transformer")
+    parser.add_argument("--img-tokens", type=int, default=4096, help="4096 at 1024x1024")
+    parser.add_argument("--txt-tokens", type=int, default=512)
+    parser.add_argument("--layer", type=int, default=0, help="index of the joint block")
+    parser.add_argument("--repeat", type=int, default=20)
+    return parser.parse_args()
+
+
+def main():
+    args = get_args()
+    transformer = NunchakuFluxTransformer2dModel.from_pretrained(args.model)
+    blocks = transformer.transformer_blocks[0]
+    dtype, device = blocks.dtype, blocks.device
+
+    hidden_states = torch.randn(1, args.img_tokens, 3072, dtype=dtype, device=device)
+    encoder_hidden_states = torch.randn(1, args.txt_tokens, 3072, dtype=dtype, device=device)
+    temb = torch.randn(1, 3072, dtype=dtype, device=device)
+    # positions of a square latent image after the text, as in the Flux pipeline
+    side = math.isqrt(args.img_tokens - 1) + 1
+    img_ids = torch.zeros(side, side, 3)
+    img_ids[..., 1] = torch.arange(side)[:, None]
+    img_ids[..., 2] = torch.arange(side)[None, :]
+    ids = torch.cat([torch.zeros(args.txt_tokens, 3), img_ids.reshape(-1, 3)[: args.img_tokens]]).to(device, torch.float64)
+    image_rotary_emb = transformer.pos_embed(ids)
+
+    def run():
+        return blocks.forward_layer_at(args.layer, hidden_states, encoder_hidden_states, temb, image_rotary_emb)
+
+    outputs, times = {}, {}
+    for grouped in (False, True):
+        os.environ["NUNCHAKU_GROUPED_GEMM"] = "1" if grouped else "0"
+        outputs[grouped] = run()
+        torch.cuda.synchronize()
+        start = time.perf_counter()
+        for _ in range(args.repeat):
+            run()
+        torch.cuda.synchronize()
+        times[grouped] = (time.perf_counter() - start) / args.repeat
+    os.environ.pop("NUNCHAKU_GROUPED_GEMM")
+
+    diff = max((a.float() - b.float()).abs().max().item() for a, b in zip(outputs[False], outputs[True]))
+    print(f"joint block {args.layer}: {args.img_tokens} image + {args.txt_tokens} text tokens")
+    print(f"separate GEMMs {times[False] * 1e3:8.2f} ms")
+    print(f"grouped GEMMs  {times[True] * 1e3:8.2f} ms ({times[False] / times[True]:.2f}x)")
+    print(f"max |separate - grouped| = {diff:.4f}")
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,88 @@
+"""Measure the fused CPU linear attention of SanaLinearAttention at Sana 1600M shapes.
+
+    NUNCHAKU_CPU_THREADS=16 python -m nunchaku.tools.bench_linear_attention_cpu --isa avx512vnni avx2 --check
+
+The fused path is what SanaLinearAttention::forward runs on CPU: the qkv gemm_w4a4 with the LiteLA epilogue, which
+writes relu(q) and accumulates the per-head vk [33, 32] from the tiles without storing k and v, then
+linearattn_vk_mul_q. The unfused column writes the whole qkv projection and does the ReLU linear attention with
+torch. With --check the outputs of both are compared.
+"""
+
+import argparse
+
+import torch
+
+from .._C.ops import gemm_w4a4, linearattn_vk_mul_q
+from .bench_gemm_w4a4_cpu import make_operands
+from .bench_utils import isas, make_parser, setup, timeit
+
+# (name, latent tokens): Sana 1600M has a hidden size of 2240, padded to 2304 (72 heads of 32)
+SANA_SHAPES = [
+    ("1600M 1024px", 32 * 32),
+    ("1600M 2K", 64 * 64),
+    ("1600M 4K", 128 * 128),
+]
+DIM_PAD = 2304
+HEAD_DIM = 32
+EPS = 1e-6
+
+
+def run_gemm(ops: dict, out_vk=None, out_linearattn=None):
+    get = ops.get
+    gemm_w4a4(
+        get("act"), get("wgt"), None if out_vk is not None else get("out"), None, get("ascales"), get("wscales"),
+        None, None, get("lora_act_in"), get("lora_up"), None, None, None, None, None, get("bias"), None,
+        out_vk, out_linearattn, False, [1.0] * (ops["lora_up"].shape[1] // 16), False, False, 1.0, None,
+        None, None, None, 0,
+    )
+
+
+def run_fused(ops: dict, batch: int, tokens: int) -> torch.Tensor:
+    run_gemm(ops, ops["vk"], ops["q"])
+    linearattn_vk_mul_q(ops["q"], ops["vk"])
+    return ops["q"]
+
+
+def run_unfused(ops: dict, batch: int, tokens: int) -> torch.Tensor:
+    run_gemm(ops)
+    heads = DIM_PAD // HEAD_DIM
+    out = ops["out"][: batch * tokens].float().view(batch, tokens, 3, heads, HEAD_DIM)
+    q = out[:, :, 0].relu()
+    kv = out[:, :, 1:].view(batch, tokens, heads, 2, HEAD_DIM)
+    k, v = kv[:, :, :, 0].relu(), kv[:, :, :, 1]
+    vk = torch.cat([torch.einsum("bthi,bthj->bhij", v, k), k.sum(1).unsqueeze(2)], dim=2)
+    o = torch.einsum("bthj,bhij->bthi", q, vk)
+    return (o[..., :HEAD_DIM] / (o[..., HEAD_DIM:] + EPS)).flatten(2).to(ops["q"].dtype)
+
+
+def get_args() -> argparse.Namespace:
+    parser = make_parser(repeat=3, isa="scalar, avx2 or avx512vnni, default: best", check="compare the fused and unfused outputs")
+    parser.add_argument("-b", "--batch", type=int, default=1)
+    parser.add_argument("--rank", type=int, default=32, help="LoRA rank")
+    return parser.parse_args()
+
+
+def main():
+    args = get_args()
+    dtype = setup(args)
+
+    print(f"{'shape':>13} {'tokens':>6} {'isa':>10} {'fused(ms)':>10} {'unfused(ms)':>12} {'speedup':>8}")
+    for name, tokens in SANA_SHAPES:
+        m = args.batch * tokens
+        # the activation is padded to whole tiles of 256 rows by the quantization, the outputs are not
+        ops = make_operands((m + 255) // 256 * 256, DIM_PAD * 3, DIM_PAD, args.rank, False, False, dtype)
+        ops["q"] = torch.empty(args.batch, tokens, DIM_PAD, dtype=dtype)
+        ops["vk"] = torch.empty(args.batch, DIM_PAD // HEAD_DIM, HEAD_DIM + 1, HEAD_DIM, dtype=torch.float32)
+        for isa in isas(args):
+            fused = timeit(lambda: run_fused(ops, args.batch, tokens), args.repeat)
+            unfused = timeit(lambda: run_unfused(ops, args.batch, tokens), args.repeat)
+            print(f"{name:>13} {tokens:>6} {isa or 'auto':>10} {fused * 1e3:>10.1f} {unfused * 1e3:>12.1f} {unfused / fused:>7.2f}x")
+
+        if args.check:
+            expected = run_unfused(ops, args.batch, tokens).float()
+            diff = ((run_fused(ops, args.batch, tokens).float() - expected).abs() / (expected.abs() + 1e-2)).max().item()
+            print(f"{name:>13} max relative |fused - unfused| = {diff:.4f}")
+
+
+if __name__ == "__main__":
+    main()
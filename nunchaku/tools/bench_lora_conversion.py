@@ -0,0 +1,107 @@
+"""Time the conversion of a Flux LoRA to the Nunchaku format with the native packer and with the torch packer.
+
+    NUNCHAKU_QUANTIZE_THREADS=16 python -m nunchaku.tools.bench_lora_conversion --rank 64
+
+The base model is synthetic: every W4A4 linear layer of the 19 + 38 Flux blocks carries a packed low-rank branch of
+--base-rank, and the LoRA adds --rank to every attention and MLP projection. Both packers must give identical results.
+"""
+
+import argparse
+import time
+
+import torch
+
+from ..lora.flux import packer
+from ..lora.flux.nunchaku_converter import convert_to_nunchaku_flux_lowrank_dict, pack_lowrank_weight
+
+HIDDEN, MLP_HIDDEN = 3072, 12288
+
+# (nunchaku name, in features, out features, diffusers names the LoRA splits it into)
+DOUBLE_BLOCK_LAYERS = [
+    ("qkv_proj", HIDDEN, 3 * HIDDEN, ["attn.to_q", "attn.to_k", "attn.to_v"]),
+    ("qkv_proj_context", HIDDEN, 3 * HIDDEN, ["attn.add_q_proj", "attn.add_k_proj", "attn.add_v_proj"]),
+    ("out_proj", HIDDEN, HIDDEN, ["attn.to_out.0"]),
+    ("out_proj_context", HIDDEN, HIDDEN, ["attn.to_add_out"]),
+    ("mlp_fc1", HIDDEN, MLP_HIDDEN, ["ff.net.0.proj"]),
+    ("mlp_fc2", MLP_HIDDEN, HIDDEN, ["ff.net.2"]),
+    ("mlp_context_fc1", HIDDEN, MLP_HIDDEN, ["ff_context.net.0.proj"]),
+    ("mlp_context_fc2", MLP_HIDDEN, HIDDEN, ["ff_context.net.2"]),
+]
+SINGLE_BLOCK_LAYERS = [
+    ("qkv_proj", HIDDEN, 3 * HIDDEN, ["attn.to_q", "attn.to_k", "attn.to_v"]),
+    ("out_proj", HIDDEN, HIDDEN, []),
+    ("mlp_fc1", HIDDEN, MLP_HIDDEN, ["proj_mlp"]),
+    ("mlp_fc2", MLP_HIDDEN, HIDDEN, []),
+]
+
+
+def make_base_model(rank: int, dtype: torch.dtype, num_double: int = 19, num_single: int = 38) -> dict[str, torch.Tensor]:
+    state_dict = {}
+    blocks = [(f"transformer_blocks.{i}", DOUBLE_BLOCK_LAYERS) for i in range(num_double)]
+    blocks += [(f"single_transformer_blocks.{i}", SINGLE_BLOCK_LAYERS) for i in range(num_single)]
+    for block, layers in blocks:
+        for name, k, n, _ in layers:
+            state_dict[f"{block}.{name}.qweight"] = torch.empty(n, k // 2, dtype=torch.int8)
+            state_dict[f"{block}.{name}.lora_down"] = pack_lowrank_weight(torch.randn(rank, k).to(dtype), down=True)
+            state_dict[f"{block}.{name}.lora_up"] = pack_lowrank_weight(torch.randn(n, rank).to(dtype), down=False)
+    return state_dict
+
+
+def make_lora(rank: int, dtype: torch.dtype, num_double: int = 19, num_single: int = 38) -> dict[str, torch.Tensor]:
+    lora = {}
+
+    def add(name: str, k: int, n: int):
+        lora[f"transformer.{name}.lora_A.weight"] = torch.randn(rank, k).to(dtype)
+        lora[f"transformer.{name}.lora_B.weight"] = torch.randn(n, rank).to(dtype)
+
+    for i in range(num_double):
+        for _, k, n, names in DOUBLE_BLOCK_LAYERS:
+            for name in names:
+                add(f"transformer_blocks.{i}.{name}", k, n // len(names))
+    for i in range(num_single):
+        for _, k, n, names in SINGLE_BLOCK_LAYERS:
+            for name in names:
+                add(f"single_transformer_blocks.{i}.{name}", k, n // len(names))
+        add(f"single_transformer_blocks.{i}.proj_out", HIDDEN + MLP_HIDDEN, HIDDEN)
+    return lora
+
+
+def convert(base: dict[str, torch.Tensor], lora: dict[str, torch.Tensor], native: bool):
+    packer.USE_NATIVE_PACKER = native
+    # the converter splits the fused proj_out of the single blocks in place
+    return convert_to_nunchaku_flux_lowrank_dict(base_model=base, lora=dict(lora))
+
+
+def get_args() -> argparse.Namespace:
+    parser = argparse.ArgumentParser()
+    parser.add_argument("--rank", type=int, default=64, help="rank of the LoRA to convert")
+    parser.add_argument("--base-rank", type=int, default=32, help="rank of the low-rank branch of the base model")
+    parser.add_argument("--dtype", type=str, default="bf16", choices=["fp16", "bf16"])
+    parser.add_argument("--repeat", type=int, default=3)
+    return parser.parse_args()
+
+
+def main():
+    args = get_args()
+    dtype = torch.bfloat16 if args.dtype == "bf16" else torch.float16
+    base = make_base_model(args.base_rank, dtype)
+    lora = make_lora(args.rank, dtype)
+
+    results, times = {}, {}
+    for native in (False, True):
+        results[native] = convert(base, lora, native)
+        start = time.perf_counter()
+        for _ in range(args.repeat):
+            convert(base, lora, native)
+        times[native] = (time.perf_counter() - start) / args.repeat
+    packer.USE_NATIVE_PACKER = True
+
+    mismatches = [key for key, value in results[False].items() if not torch.equal(value, results[True][key])]
+    print(f"converted {len(results[True])} tensors, LoRA rank {args.rank} on base rank {args.base_rank}")
+    print(f"torch packer  {times[False]:8.2f} s")
+    print(f"native packer {times[True]:8.2f} s ({times[False] / times[True]:.2f}x)")
+    print("outputs identical" if not mismatches else f"{len(mismatches)} tensors differ, e.g. {mismatches[0]}")
+
+
+if __name__ == "__main__":
+    main()
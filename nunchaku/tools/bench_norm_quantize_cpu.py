@@ -0,0 +1,75 @@
+"""Compare the fused CPU quantize_w4a4_act_fuse_norm with LayerNorm, modulation and quantization as separate passes.
+
+    NUNCHAKU_CPU_THREADS=16 python -m nunchaku.tools.bench_norm_quantize_cpu --isa avx512vnni avx2
+
+This is the input of the qkv projections and of the MLPs of the Flux blocks: LayerNorm without affine of the hidden
+states, the AdaLN modulation x * scale + shift, then smoothing, INT4 quantization and the LoRA down projection. The
+unfused sequence writes the normalized activation with torch and quantizes it with quantize_w4a4_act_fuse_lora, i.e.
+what the blocks did before the norm was deferred. With --check the quantized outputs of both are compared.
+"""
+
+import argparse
+
+import torch
+import torch.nn.functional as F
+
+from .._C.ops import quantize_w4a4_act_fuse_lora, quantize_w4a4_act_fuse_norm
+from .bench_quantize_w4a4_cpu import make_operands
+from .bench_utils import isas, make_parser, setup, timeit
+
+# (name, tokens)
+SHAPES = [
+    ("flux 1024px", 4096 + 512),
+    ("flux 512px", 1024 + 512),
+]
+DIM = 3072
+EPS = 1e-6
+
+
+def run_fused(ops: dict):
+    quantize_w4a4_act_fuse_norm(
+        ops["input"], ops["scale"], ops["shift"], EPS, ops["output"], ops["oscales"],
+        ops["lora_down"], ops["lora_act_out"], ops["smooth"], False
+    )
+
+
+def run_unfused(ops: dict):
+    x = F.layer_norm(ops["input"], (DIM,), eps=EPS) * ops["scale"] + ops["shift"]
+    quantize_w4a4_act_fuse_lora(
+        x, ops["output"], ops["oscales"], ops["lora_down"], ops["lora_act_out"], ops["smooth"], False, False
+    )
+
+
+def get_args() -> argparse.Namespace:
+    parser = make_parser(repeat=5, isa="scalar, avx2 or avx512vnni, default: best", check="compare the fused and unfused outputs")
+    parser.add_argument("--rank", type=int, default=32, help="LoRA rank")
+    return parser.parse_args()
+
+
+def main():
+    args = get_args()
+    dtype = setup(args)
+
+    print(f"{'shape':>12} {'M':>6} {'isa':>10} {'fused(ms)':>10} {'unfused(ms)':>12} {'speedup':>8}")
+    for name, m in SHAPES:
+        ops = make_operands(m, DIM, False, args.rank, dtype)
+        ops["input"] = (ops["input"] * 3 + 1).to(dtype)
+        ops["scale"] = (1 + torch.randn(DIM) * 0.3).to(dtype)
+        ops["shift"] = (torch.randn(DIM) * 0.5).to(dtype)
+        for isa in isas(args):
+            unfused = timeit(lambda: run_unfused(ops), args.repeat)
+            fused = timeit(lambda: run_fused(ops), args.repeat)
+            print(f"{name:>12} {m:>6} {isa or 'auto':>10} {fused * 1e3:>10.1f} {unfused * 1e3:>12.1f} {unfused / fused:>7.2f}x")
+
+        if args.check:
+            run_unfused(ops)
+            expected = ops["output"].clone(), ops["oscales"].float().clone()
+            run_fused(ops)
+            # the statistics are summed in a different order than torch, so a few values may round differently
+            mismatch = (ops["output"] != expected[0]).float().mean().item()
+            diff = (ops["oscales"].float() - expected[1]).abs().max().item()
+            print(f"{name:>12} mismatched bytes {mismatch:.2e}, max |oscales diff| = {diff:.4f}")
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,113 @@
+"""Measure the fused RMSNorm + RoPE + QKV packing epilogue of the CPU gemm_w4a4 at the Flux qkv projection.
+
+    NUNCHAKU_CPU_THREADS=16 python -m nunchaku.tools.bench_qkv_epilogue_cpu --isa avx512vnni avx2 --check
+
+The linear column is the qkv projection of the FlashAttention2 path: per-head RMSNorm of q / k and the rotary embedding
+applied to each tile before it is written to out [T, 3 * H * D]. The packed column is the NunchakuFP16 path, which also
+writes q / k / v as [1, H, T, D] heads for attention_fp16. The unfused column writes the plain projection and does the
+norm, the rotation and the packing with torch, three more passes over the [T, 9216] output. With --check the packed
+outputs of both are compared.
+"""
+
+import argparse
+import math
+
+import torch
+
+from .._C.ops import gemm_w4a4
+from ..models.transformers.transformer_flux import NunchakuFluxTransformerBlocks
+from .bench_gemm_w4a4_cpu import make_operands
+from .bench_utils import isas, make_parser, setup, timeit
+
+# (name, tokens) of the image side of a joint block
+SHAPES = [
+    ("flux 1024px", 4096),
+    ("flux 512px", 1024),
+]
+HEADS = 24
+HEAD_DIM = 128
+DIM = HEADS * HEAD_DIM
+EPS = 1e-6
+
+
+def make_rotary(tokens: int) -> tuple[torch.Tensor, torch.Tensor]:
+    """the (sin, cos) [T, D / 2, 2] of random angles and the same table packed for the kernel"""
+    theta = torch.rand(1, tokens, HEAD_DIM // 2, 1) * 2 * math.pi
+    rotemb = torch.stack([theta.sin(), theta.cos()], dim=-1)
+    return rotemb[0, :, :, 0], NunchakuFluxTransformerBlocks.pack_rotemb(rotemb)
+
+
+def run_gemm(ops: dict, out=None, rotary=None, packed=(None, None, None), tokens: int = 0):
+    get = ops.get
+    gemm_w4a4(
+        get("act"), get("wgt"), out, None, get("ascales"), get("wscales"), None, None,
+        get("lora_act_in"), get("lora_up"), None, None,
+        get("norm_q") if rotary is not None else None, get("norm_k") if rotary is not None else None, rotary,
+        get("bias"), None, None, None, False, [1.0] * (ops["lora_up"].shape[1] // 16), False, False, 1.0, None,
+        *packed, tokens,
+    )
+
+
+def run_linear(ops: dict, tokens: int):
+    run_gemm(ops, ops["out"], ops["rotary"])
+
+
+def run_packed(ops: dict, tokens: int) -> tuple[torch.Tensor, ...]:
+    run_gemm(ops, rotary=ops["rotary"], packed=ops["packed"], tokens=tokens)
+    return tuple(x[:, :, :tokens] for x in ops["packed"])
+
+
+def run_unfused(ops: dict, tokens: int) -> tuple[torch.Tensor, ...]:
+    run_gemm(ops, ops["out"])
+    qkv = ops["out"].view(tokens, 3, HEADS, HEAD_DIM)
+    sin, cos = ops["sincos"].unbind(-1)
+    results = []
+    for i, weight in enumerate((ops["norm_q"], ops["norm_k"], None)):
+        x = qkv[:, i].float()
+        if weight is not None:
+            x = x * torch.rsqrt(x.square().mean(-1, keepdim=True) + EPS) * weight.float()
+            x0, x1 = x.unflatten(-1, (HEAD_DIM // 2, 2)).unbind(-1)
+            sin_, cos_ = sin[:, None], cos[:, None]
+            x = torch.stack([x0 * cos_ - x1 * sin_, x0 * sin_ + x1 * cos_], dim=-1).flatten(-2)
+        results.append(x.transpose(0, 1).unsqueeze(0).to(torch.float16).contiguous())
+    return tuple(results)
+
+
+def get_args() -> argparse.Namespace:
+    parser = make_parser(repeat=3, isa="scalar, avx2 or avx512vnni, default: best", check="compare the fused and unfused packed outputs")
+    parser.add_argument("--rank", type=int, default=32, help="LoRA rank")
+    return parser.parse_args()
+
+
+def main():
+    args = get_args()
+    dtype = setup(args)
+
+    print(f"{'shape':>12} {'T':>5} {'isa':>10} {'linear(ms)':>11} {'packed(ms)':>11} {'unfused(ms)':>12} {'speedup':>8}")
+    for name, tokens in SHAPES:
+        m = (tokens + 255) // 256 * 256
+        ops = make_operands(m, DIM * 3, DIM, args.rank, False, False, dtype)
+        ops["out"] = torch.empty(tokens, DIM * 3, dtype=dtype)
+        ops["norm_q"] = (torch.rand(HEAD_DIM) + 0.5).to(dtype)
+        ops["norm_k"] = (torch.rand(HEAD_DIM) + 0.5).to(dtype)
+        sincos, ops["rotary"] = make_rotary(m)
+        ops["sincos"] = sincos[:tokens]
+        ops["packed"] = tuple(torch.empty(1, HEADS, m, HEAD_DIM, dtype=torch.float16) for _ in range(3))
+        for isa in isas(args):
+            linear = timeit(lambda: run_linear(ops, tokens), args.repeat)
+            packed = timeit(lambda: run_packed(ops, tokens), args.repeat)
+            unfused = timeit(lambda: run_unfused(ops, tokens), args.repeat)
+            print(
+                f"{name:>12} {tokens:>5} {isa or 'auto':>10} {linear * 1e3:>11.1f} {packed * 1e3:>11.1f} "
+                f"{unfused * 1e3:>12.1f} {unfused / packed:>7.2f}x"
+            )
+
+        if args.check:
+            expected = run_unfused(ops, tokens)
+            for label, fused, ref in zip("qkv", run_packed(ops, tokens), expected):
+                diff = ((fused.float() - ref.float()).abs() / (ref.float().abs() + 1e-2)).max().item()
+                print(f"{name:>12} {label} max relative |fused - unfused| = {diff:.4f}")
+
+
+if __name__ == "__main__":
+    main()
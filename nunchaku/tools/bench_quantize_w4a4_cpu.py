@@ -0,0 +1,85 @@
+"""Compare the fused CPU quantize_w4a4_act_fuse_lora with the unfused sequence at Flux and Sana widths.
+
+    NUNCHAKU_CPU_THREADS=16 python -m nunchaku.tools.bench_quantize_w4a4_cpu --isa avx512vnni avx2
+
+The unfused sequence runs smoothing, per-group INT4 quantization and the LoRA down projection as separate torch ops,
+each of them a full pass over the activation. Set the torch thread count to NUNCHAKU_CPU_THREADS for a fair comparison.
+"""
+
+import argparse
+
+import torch
+import torch.nn.functional as F
+
+from .._C.ops import quantize_w4a4_act_fuse_lora
+from .bench_utils import isas, make_parser, setup, timeit
+
+# (name, M, input width, fuse_glu)
+SHAPES = [
+    ("flux x", 4096 + 512, 3072, False),
+    ("flux single proj_out", 4096 + 512, 3072 + 12288, False),
+    ("sana x", 1024, 2240, False),
+    ("sana point_conv", 1024, 5600 * 2, True),
+]
+
+
+def ceil_div(a: int, b: int) -> int:
+    return (a + b - 1) // b
+
+
+def make_operands(m: int, width: int, fuse_glu: bool, rank: int, dtype: torch.dtype) -> dict:
+    n = ceil_div(width // 2 if fuse_glu else width, 128) * 128
+    m_pad = ceil_div(m, 256) * 256
+    return {
+        "input": torch.randn(m, width).to(dtype),
+        "output": torch.empty(m_pad, n // 2, dtype=torch.int8),
+        "oscales": torch.empty(n // 64, m_pad, dtype=dtype),
+        "lora_down": (torch.randn(n, rank) * 0.01).to(dtype),
+        "lora_act_out": torch.empty(m_pad, rank, dtype=torch.float32),
+        "smooth": (torch.rand(n) + 0.5).to(dtype),
+    }
+
+
+def run_fused(ops: dict, fuse_glu: bool):
+    quantize_w4a4_act_fuse_lora(
+        ops["input"], ops["output"], ops["oscales"], ops["lora_down"], ops["lora_act_out"], ops["smooth"], fuse_glu, False
+    )
+
+
+def run_unfused(ops: dict, fuse_glu: bool):
+    x = ops["input"]
+    if fuse_glu:
+        x = x[:, 0::2] * F.silu(x[:, 1::2])
+    x = F.pad(x, (0, ops["smooth"].numel() - x.shape[1]))
+    smoothed = x / ops["smooth"]
+    groups = smoothed.float().view(x.shape[0], -1, 64)
+    scales = groups.abs().amax(dim=-1, keepdim=True) / 7
+    qact = (groups / scales).round_().clamp_(-8, 7).to(torch.int8)
+    lora_act = x.float() @ ops["lora_down"].float()
+    return qact, scales.to(x.dtype), lora_act
+
+
+def get_args() -> argparse.Namespace:
+    parser = make_parser(repeat=5, isa="scalar, avx2 or avx512vnni, default: best")
+    parser.add_argument("--rank", type=int, default=32, help="LoRA rank")
+    return parser.parse_args()
+
+
+def main():
+    args = get_args()
+    dtype = setup(args)
+
+    print(f"{'shape':>20} {'M':>6} {'width':>6} {'isa':>10} {'fused(ms)':>10} {'unfused(ms)':>12} {'speedup':>8}")
+    for name, m, width, fuse_glu in SHAPES:
+        ops = make_operands(m, width, fuse_glu, args.rank, dtype)
+        unfused = timeit(lambda: run_unfused(ops, fuse_glu), args.repeat)
+        for isa in isas(args):
+            fused = timeit(lambda: run_fused(ops, fuse_glu), args.repeat)
+            print(
+                f"{name:>20} {m:>6} {width:>6} {isa or 'auto':>10} {fused * 1e3:>10.1f} {unfused * 1e3:>12.1f} "
+                f"{unfused / fused:>7.2f}x"
+            )
+
+
+if __name__ == "__main__":
+    main()
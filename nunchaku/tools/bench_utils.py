@@ -0,0 +1,42 @@
+"""Helpers shared by the kernel benchmarks in nunchaku.tools."""
+
+import argparse
+import os
+import time
+
+import torch
+
+
+def timeit(func, repeat: int) -> float:
+    """Seconds per call of `func`, averaged over `repeat` calls after one warm-up call."""
+    func()
+    start = time.perf_counter()
+    for _ in range(repeat):
+        func()
+    return (time.perf_counter() - start) / repeat
+
+
+def make_parser(repeat: int, isa: str | None = None, check: str | None = None) -> argparse.ArgumentParser:
+    """Parser with --dtype and --repeat, plus --isa / --check with the given help texts; callers add their own options."""
+    parser = argparse.ArgumentParser()
+    parser.add_argument("--dtype", type=str, default="bf16", choices=["fp16", "bf16"])
+    if isa is not None:
+        parser.add_argument("--isa", type=str, nargs="+", default=[""], help=isa)
+    parser.add_argument("--repeat", type=int, default=repeat)
+    if check is not None:
+        parser.add_argument("--check", action="store_true", help=check)
+    return parser
+
+
+def setup(args: argparse.Namespace) -> torch.dtype:
+    """The torch dtype of --dtype. torch gets NUNCHAKU_CPU_THREADS threads too, for a fair comparison with the kernels."""
+    if "NUNCHAKU_CPU_THREADS" in os.environ:
+        torch.set_num_threads(int(os.environ["NUNCHAKU_CPU_THREADS"]))
+    return torch.bfloat16 if args.dtype == "bf16" else torch.float16
+
+
+def isas(args: argparse.Namespace):
+    """Yields every --isa with NUNCHAKU_CPU_GEMM_ISA set to it, "" is the best supported."""
+    for isa in args.isa:
+        os.environ["NUNCHAKU_CPU_GEMM_ISA"] = isa
+        yield isa
@@ -0,0 +1,92 @@
+"""Predict step latency and peak memory of layer offloading policies without a GPU.
+
+Record a trace on a machine with the model loaded:
+
+    transformer.set_offload_config(prefetch_depth=1)
+    pipeline(...)
+    save_offload_trace(transformer, "trace.json")
+
+then sweep policies on any machine:
+
+    python -m nunchaku.tools.offload_simulator trace.json --link-bandwidth 12e9 --device-memory 8e9
+"""
+
+import argparse
+import itertools
+import json
+
+from .._C import utils as cutils
+
+
+def save_offload_trace(transformer, path: str):
+    stats = transformer.get_offload_stats()
+    if len(stats.compute_time) == 0:
+        raise ValueError("No offload stats recorded, run a forward with offload enabled first")
+    trace = {
+        "compute_time": list(stats.compute_time),
+        "load_time": list(stats.load_time),
+        "layer_bytes": list(transformer.get_layer_bytes()),
+        "total_time": stats.total_time,
+    }
+    with open(path, "w") as f:
+        json.dump(trace, f, indent=2)
+
+
+def simulate(trace: dict, **kwargs):
+    return cutils.simulate_offload(trace["compute_time"], trace["layer_bytes"], **kwargs)
+
+
+def get_args() -> argparse.Namespace:
+    parser = argparse.ArgumentParser()
+    parser.add_argument("trace", type=str, help="trace recorded by save_offload_trace")
+    parser.add_argument("--link-bandwidth", type=float, default=25e9, help="host to device bytes/s")
+    parser.add_argument("--disk-bandwidth", type=float, default=0, help="bytes/s if weights are read from disk")
+    parser.add_argument("--host-launch-time", type=float, default=0.05, help="ms to submit one layer")
+    parser.add_argument("--device-memory", type=float, default=0, help="device memory in bytes")
+    parser.add_argument("--base-memory", type=float, default=0, help="memory used by activations and other modules")
+    parser.add_argument("--prefetch-depths", type=int, nargs="+", default=[1, 2, 3])
+    parser.add_argument("--num-resident", type=int, nargs="+", default=[1], help="number of leading layers kept on device")
+    parser.add_argument("--wddm", action="store_true", help="model a WDDM driver")
+    parser.add_argument("--budget", type=float, default=0, help="memory budget in bytes for adaptive prefetching")
+    return parser.parse_args()
+
+
+def main():
+    args = get_args()
+    with open(args.trace, "r") as f:
+        trace = json.load(f)
+    num_layers = len(trace["compute_time"])
+
+    workarounds = [False, True] if args.wddm else [False]
+    policies = list(itertools.product(args.num_resident, args.prefetch_depths, workarounds)) + [
+        (n, 0, w) for n, w in itertools.product(args.num_resident, workarounds)
+    ]
+
+    print(f"{'resident':>8} {'prefetch':>8} {'workaround':>10} {'latency(ms)':>12} {'stall(ms)':>10} {'peak(GB)':>9}")
+    for num_resident, depth, workaround in policies:
+        adaptive = depth == 0
+        result = simulate(
+            trace,
+            resident=[i < num_resident for i in range(num_layers)],
+            link_bandwidth=args.link_bandwidth,
+            disk_bandwidth=args.disk_bandwidth,
+            host_launch_time=args.host_launch_time,
+            wddm=args.wddm,
+            workaround=workaround,
+            prefetch_depth=max(depth, 1),
+            adaptive=adaptive,
+            max_prefetch_depth=max(args.prefetch_depths),
+            memory_budget=int(args.budget),
+            device_memory=int(args.device_memory),
+            base_memory=int(args.base_memory),
+        )
+        fits = args.device_memory <= 0 or result.peak_memory <= args.device_memory
+        depth_str = f"auto({result.stats.prefetch_depth})" if adaptive else str(depth)
+        print(
+            f"{num_resident:>8} {depth_str:>8} {str(workaround):>10} {result.latency:>12.1f} "
+            f"{result.stats.total_stall_time():>10.1f} {result.peak_memory / 1e9:>9.2f}{'' if fits else '  (OOM)'}"
+        )
+
+
+if __name__ == "__main__":
+    main()
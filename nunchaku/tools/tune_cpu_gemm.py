@@ -0,0 +1,76 @@
+"""Tune the blocking of the CPU gemm_w4a4 offline for the layers of Flux and Sana.
+
+    NUNCHAKU_CPU_THREADS=16 python -m nunchaku.tools.tune_cpu_gemm --model flux sana --format int4 fp4
+
+Every shape is run once with NUNCHAKU_CPU_GEMM_TUNE set, the winning blocking of each (M bucket, N, K, dtype, ISA,
+thread count) goes to the tuning database that gemm_w4a4 loads at startup (--db or NUNCHAKU_CPU_GEMM_TUNE_DB,
+default ~/.cache/nunchaku/cpu_gemm_tuning.txt). Tune with the thread count used for inference, it is part of the key.
+The T5 encoder runs on the AWQ W4A16 kernels, which have no CPU path, so it has no shapes here.
+"""
+
+import argparse
+import os
+
+import torch
+
+from .bench_gemm_w4a4_cpu import make_operands, run
+
+# (layer, N, K) per model, N and K padded to multiples of 128 as GEMM_W4A4 does
+MODEL_LAYERS = {
+    "flux": [
+        ("qkv", 9216, 3072),
+        ("out_proj", 3072, 3072),
+        ("fc1", 12288, 3072),
+        ("fc2", 3072, 12288),
+    ],
+    "sana": [
+        ("qkv", 6784, 2304),
+        ("out_proj", 2304, 2304),
+        ("inverted_conv", 11264, 2304),
+        ("point_conv", 2304, 5632),
+    ],
+}
+
+# token counts at 1024px: Flux joint blocks run the image and text streams apart, single blocks run them together
+MODEL_TOKENS = {
+    "flux": [512, 4096, 4096 + 512],
+    "sana": [1024],
+}
+
+
+def get_args() -> argparse.Namespace:
+    parser = argparse.ArgumentParser()
+    parser.add_argument("--model", type=str, nargs="+", default=["flux"], choices=list(MODEL_LAYERS))
+    parser.add_argument("-m", type=int, nargs="+", default=None, help="token counts, default: those of the model")
+    parser.add_argument("--dtype", type=str, nargs="+", default=["bf16"], choices=["fp16", "bf16"])
+    parser.add_argument("--isa", type=str, nargs="+", default=[""], help="scalar, avx2 or avx512vnni, default: best")
+    parser.add_argument("--format", type=str, nargs="+", default=["int4"], choices=["int4", "fp4"])
+    parser.add_argument("--db", type=str, default=None, help="tuning database, default: NUNCHAKU_CPU_GEMM_TUNE_DB")
+    parser.add_argument("--force", action="store_true", help="retune shapes that already have an entry")
+    return parser.parse_args()
+
+
+def main():
+    args = get_args()
+    # read by the extension when it first looks up a blocking, set them before any gemm_w4a4 call
+    if args.db is not None:
+        os.environ["NUNCHAKU_CPU_GEMM_TUNE_DB"] = args.db
+    os.environ["NUNCHAKU_CPU_GEMM_TUNE"] = "force" if args.force else "1"
+
+    for model in args.model:
+        for m in args.m or MODEL_TOKENS[model]:
+            # gemm_w4a4 works on whole tiles of 256 rows
+            m = (m + 255) // 256 * 256
+            for name, n, k in MODEL_LAYERS[model]:
+                for dtype_name in args.dtype:
+                    dtype = torch.bfloat16 if dtype_name == "bf16" else torch.float16
+                    for fmt in args.format:
+                        ops = make_operands(m, n, k, 0, False, fmt == "fp4", dtype)
+                        for isa in args.isa:
+                            os.environ["NUNCHAKU_CPU_GEMM_ISA"] = isa
+                            print(f"{model:>5} {name:>14} M={m:<6} N={n:<6} K={k:<6} {dtype_name} {fmt} {isa or 'auto'}")
+                            run(ops, 0, fmt == "fp4")
+
+
+if __name__ == "__main__":
+    main()
@@ -23,6 +23,33 @@ class CustomBuildExtension(BuildExtension):
                 ext.extra_compile_args["cxx"] += ext.extra_compile_args["gcc"]
         super().build_extensions()
 
+    def build_extension(self, ext):
+        if self.compiler.compiler_type == "msvc":
+            return super().build_extension(ext)
+
+        # the host kernels (*_cpu.cpp) and the host weight quantizer / packers are built with -O3, their inner loops
+        # need the accumulators unrolled into registers; the rest of the extension keeps the -Og of GCC_FLAGS
+        compile = self.compiler.compile
+
+        def is_host_kernel(source):
+            return source.endswith(("_cpu.cpp", "WeightQuantizer.cpp"))
+
+        def compile_host_kernels_O3(sources, *args, extra_postargs=None, **kwargs):
+            host = [s for s in sources if is_host_kernel(s)]
+            rest = [s for s in sources if not is_host_kernel(s)]
+            objects = compile(rest, *args, extra_postargs=extra_postargs, **kwargs) if rest else []
+            if host:
+                host_postargs = dict(extra_postargs)
+                host_postargs["cxx"] = host_postargs["cxx"] + ["-O3"]
+                objects += compile(host, *args, extra_postargs=host_postargs, **kwargs)
+            return objects
+
+        self.compiler.compile = compile_host_kernels_O3
+        try:
+            super().build_extension(ext)
+        finally:
+            self.compiler.compile = compile
+
 
 def get_sm_targets() -> list[str]:
     nvcc_path = os.path.join(CUDA_HOME, "bin/nvcc") if CUDA_HOME else "nvcc"
@@ -143,6 +170,11 @@ if __name__ == "__main__":
             *ncond("src/SanaModel.cpp"),
             "src/Serialization.cpp",
             "src/Module.cpp",
+            "src/LoraSlot.cpp",
+            "src/WeightUpdate.cpp",
+            "src/WeightQuantizer.cpp",
+            "src/OffloadSimulator.cpp",
+            "src/BatchScheduler.cpp",
             *ncond("third_party/Block-Sparse-Attention/csrc/block_sparse_attn/src/flash_fwd_hdim64_fp16_sm80.cu"),
             *ncond("third_party/Block-Sparse-Attention/csrc/block_sparse_attn/src/flash_fwd_hdim64_bf16_sm80.cu"),
             *ncond("third_party/Block-Sparse-Attention/csrc/block_sparse_attn/src/flash_fwd_hdim128_fp16_sm80.cu"),
@@ -158,7 +190,12 @@ if __name__ == "__main__":
             "src/kernels/activation_kernels.cu",
             "src/kernels/layernorm_kernels.cu",
             "src/kernels/misc_kernels.cu",
+            "src/kernels/misc_kernels_cpu.cpp",
+            "src/kernels/cpu_runtime.cpp",
+            "src/kernels/cpu_plan.cpp",
             "src/kernels/zgemm/gemm_w4a4.cu",
+            "src/kernels/zgemm/gemm_w4a4_cpu.cpp",
+            "src/kernels/zgemm/gemm_cpu_tuning.cpp",
             "src/kernels/zgemm/gemm_w4a4_test.cu",
             "src/kernels/zgemm/gemm_w4a4_launch_fp16_int4.cu",
             "src/kernels/zgemm/gemm_w4a4_launch_fp16_int4_fasteri2f.cu",
@@ -166,12 +203,17 @@ if __name__ == "__main__":
             "src/kernels/zgemm/gemm_w4a4_launch_bf16_int4.cu",
             "src/kernels/zgemm/gemm_w4a4_launch_bf16_fp4.cu",
             "src/kernels/zgemm/gemm_w8a8.cu",
+            "src/kernels/zgemm/gemm_w8a8_cpu.cpp",
             "src/kernels/zgemm/attention.cu",
+            "src/kernels/zgemm/attention_cpu.cpp",
             "src/kernels/dwconv.cu",
+            "src/kernels/dwconv_cpu.cpp",
             "src/kernels/gemm_batched.cu",
             "src/kernels/gemm_f16.cu",
+            "src/kernels/gemm_f16_cpu.cpp",
             "src/kernels/awq/gemm_awq.cu",
             "src/kernels/awq/gemv_awq.cu",
+            "src/kernels/awq/gemv_awq_cpu.cpp",
             *ncond("third_party/Block-Sparse-Attention/csrc/block_sparse_attn/flash_api.cpp"),
             *ncond("third_party/Block-Sparse-Attention/csrc/block_sparse_attn/flash_api_adapter.cpp"),
         ],
@@ -0,0 +1,160 @@
+#include "BatchScheduler.h"
+
+#include <algorithm>
+
+using spdlog::fmt_lib::format;
+
+BatchScheduler::BatchScheduler(int maxBatch, int maxRunning) : maxBatch(maxBatch), maxRunning(maxRunning == 0 ? maxBatch : maxRunning) {
+    if (maxBatch < 1 || maxRunning < 0) {
+        throw std::invalid_argument(format("BatchScheduler: invalid maxBatch {} or maxRunning {}", maxBatch, maxRunning));
+    }
+}
+
+int64_t BatchScheduler::submit(std::vector<int> shape, int numSteps) {
+    if (numSteps < 1) {
+        throw std::invalid_argument(format("BatchScheduler: a request needs at least one step, got {}", numSteps));
+    }
+    int64_t id;
+    {
+        std::lock_guard lock(mutex);
+        id = nextId++;
+        waiting.push_back(Request{id, std::move(shape), numSteps, 0, 0});
+        counters.submitted++;
+    }
+    cv.notify_all();
+    return id;
+}
+
+bool BatchScheduler::cancel(int64_t id) {
+    std::lock_guard lock(mutex);
+    auto it = std::find_if(waiting.begin(), waiting.end(), [&](const Request &r) { return r.id == id; });
+    if (it != waiting.end()) {
+        waiting.erase(it);
+        counters.cancelled++;
+        return true;
+    }
+    auto found = running.find(id);
+    if (found == running.end() || found->second.cancelled) {
+        return false;
+    }
+    counters.cancelled++;
+    if (found->second.inFlight) {
+        found->second.cancelled = true;
+    } else {
+        running.erase(found);
+    }
+    return true;
+}
+
+void BatchScheduler::admit() {
+    while (!waiting.empty() && (int)running.size() < maxRunning) {
+        Request request = std::move(waiting.front());
+        waiting.pop_front();
+        request.lastServed = boundary;
+        running.emplace(request.id, std::move(request));
+    }
+}
+
+bool BatchScheduler::hasIdle() const {
+    if (!waiting.empty() && (int)running.size() < maxRunning) {
+        return true;
+    }
+    return std::any_of(running.begin(), running.end(), [](auto &&item) { return !item.second.inFlight; });
+}
+
+std::vector<int64_t> BatchScheduler::nextBatch() {
+    std::lock_guard lock(mutex);
+    boundary++;
+    admit();
+
+    // ids grow with the submission, so on ties the older request comes first
+    const Request *oldest = nullptr;
+    for (auto &&[id, request] : running) {
+        if (!request.inFlight && (!oldest || request.lastServed < oldest->lastServed)) {
+            oldest = &request;
+        }
+    }
+    if (!oldest) {
+        return {};
+    }
+
+    std::vector<Request *> batch;
+    for (auto &&[id, request] : running) {
+        if (!request.inFlight && request.shape == oldest->shape) {
+            batch.push_back(&request);
+        }
+    }
+    std::stable_sort(batch.begin(), batch.end(), [](const Request *a, const Request *b) { return a->lastServed < b->lastServed; });
+    if ((int)batch.size() > maxBatch) {
+        batch.resize(maxBatch);
+    }
+
+    std::vector<int64_t> ids;
+    for (Request *request : batch) {
+        request->inFlight = true;
+        request->lastServed = boundary;
+        ids.push_back(request->id);
+    }
+    counters.forwards++;
+    counters.samples += ids.size();
+    return ids;
+}
+
+std::vector<int64_t> BatchScheduler::finishStep(const std::vector<int64_t> &ids) {
+    std::vector<int64_t> retired;
+    {
+        std::lock_guard lock(mutex);
+        // checked up front, a bad id must not leave the rest of the batch half finished
+        for (size_t i = 0; i < ids.size(); i++) {
+            auto it = running.find(ids[i]);
+            if (it == running.end() || !it->second.inFlight || std::find(ids.begin(), ids.begin() + i, ids[i]) != ids.begin() + i) {
+                throw std::invalid_argument(format("BatchScheduler: request {} is not in a running batch", ids[i]));
+            }
+        }
+        for (int64_t id : ids) {
+            auto it = running.find(id);
+            Request &request = it->second;
+            request.inFlight = false;
+            request.step++;
+            if (request.cancelled || request.step >= request.numSteps) {
+                if (!request.cancelled) {
+                    counters.completed++;
+                }
+                retired.push_back(id);
+                running.erase(it);
+            }
+        }
+    }
+    cv.notify_all();
+    return retired;
+}
+
+bool BatchScheduler::waitForWork(double timeout) {
+    std::unique_lock lock(mutex);
+    if (timeout < 0) {
+        cv.wait(lock, [&] { return hasIdle(); });
+        return true;
+    }
+    return cv.wait_for(lock, std::chrono::duration<double>(timeout), [&] { return hasIdle(); });
+}
+
+int BatchScheduler::step(int64_t id) const {
+    std::lock_guard lock(mutex);
+    if (auto it = running.find(id); it != running.end()) {
+        return it->second.step;
+    }
+    for (auto &request : waiting) {
+        if (request.id == id) {
+            return 0;
+        }
+    }
+    return -1;
+}
+
+BatchSchedulerStats BatchScheduler::stats() const {
+    std::lock_guard lock(mutex);
+    BatchSchedulerStats result = counters;
+    result.waiting = waiting.size();
+    result.running = running.size();
+    return result;
+}
@@ -0,0 +1,81 @@
+#pragma once
+
+#include "common.h"
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+
+struct BatchSchedulerStats {
+    int64_t submitted = 0;
+    int64_t completed = 0;
+    int64_t cancelled = 0;
+    int64_t forwards = 0;       // batches handed out by nextBatch
+    int64_t samples = 0;        // denoising steps run in them, samples / forwards is the average batch size
+    int waiting = 0;            // submitted, admitted at the next step boundary
+    int running = 0;
+};
+
+// Continuous batching of denoising requests
+// requests are admitted and retired at step boundaries instead of waiting for a synchronised batch to fill, so every
+// forward of the model runs one step of requests that may be at different timesteps and have different prompts (the
+// model takes one temb per sample). Requests share a forward only if their inputs have the same shape key, e.g. the
+// numbers of image and text tokens. Requests are served in rounds: a batch takes the requests of the shape of the one
+// that waited longest for its next step, so that no shape starves while another keeps arriving.
+// All methods may be called from any thread, e.g. submit from request handlers and the rest from the loop running the
+// model.
+class BatchScheduler {
+public:
+    // maxRunning bounds the requests between admission and retirement (their latents stay in memory), 0 for maxBatch:
+    // a request then joins a batch as soon as another one retires. More lets requests of other shapes start, but every
+    // admitted request shares the steps, which delays all of them when the model is busy
+    explicit BatchScheduler(int maxBatch, int maxRunning = 0);
+
+    // returns the id of the request, which waits for the next step boundary
+    int64_t submit(std::vector<int> shape, int numSteps);
+    // drops a request; one in a batch is retired when its step finishes. false if the id is unknown
+    bool cancel(int64_t id);
+
+    // step boundary: admits waiting requests and returns the ids of the next forward (empty if no request is idle)
+    // the requests stay in flight until finishStep
+    std::vector<int64_t> nextBatch();
+    // the forward of `ids` ran one step of each, returns the ids that completed their last step (or were cancelled)
+    // throws without changing any request if an id is not in flight or repeated
+    std::vector<int64_t> finishStep(const std::vector<int64_t> &ids);
+
+    // blocks until a request can be scheduled or timeout seconds passed (< 0 waits forever), returns whether one can
+    bool waitForWork(double timeout);
+
+    // steps done by a request, -1 if the id is unknown (never submitted or retired)
+    int step(int64_t id) const;
+    BatchSchedulerStats stats() const;
+
+public:
+    const int maxBatch;
+    const int maxRunning;
+
+private:
+    struct Request {
+        int64_t id;
+        std::vector<int> shape;
+        int numSteps;
+        int step = 0;
+        int64_t lastServed;     // step boundary when it last entered a batch (or was admitted)
+        bool inFlight = false;
+        bool cancelled = false;
+    };
+
+    void admit();
+    bool hasIdle() const;
+
+private:
+    mutable std::mutex mutex;
+    std::condition_variable cv;
+
+    std::deque<Request> waiting;
+    std::map<int64_t, Request> running;
+
+    int64_t nextId = 0;
+    int64_t boundary = 0;
+    BatchSchedulerStats counters;
+};
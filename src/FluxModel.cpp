@@ -2,6 +2,7 @@
 #include "kernels/misc_kernels.h"
 #include "kernels/gemm_batched.h"
 #include "kernels/zgemm/zgemm.h"
+#include "kernels/zgemm/attention_cpu.h"
 #include "flash_api.h"
 #include "activation.h"
 
@@ -14,9 +15,16 @@ using namespace nunchaku;
 
 
 
-Tensor forward_mlp(GEMM_W4A4 &fc1, GEMM_W4A4 &fc2, Tensor norm_hidden_states) {
+// with modulation set, norm_hidden_states is the input of the norm (see AdaLayerNormZero::Output)
+Tensor forward_mlp(GEMM_W4A4 &fc1, GEMM_W4A4 &fc2, Tensor norm_hidden_states, GEMM_W4A4::Modulation modulation = {}) {
+    GEMM_W4A4::GroupedProblem problem;
+    problem.gemm = &fc1;
+    problem.x = norm_hidden_states;
+    problem.modulation = modulation;
+    problem.fuse = GEMM_W4A4::FuseOptions::GELU_QUANT;
+    problem.nextGEMM = &fc2;
     Tensor ff_output = fc2.forward_quant(
-        std::get<GEMM_W4A4::QuantizedActivation>(fc1.forward(norm_hidden_states, GEMM_W4A4::FuseOptions::GELU_QUANT, &fc2))
+        std::get<GEMM_W4A4::QuantizedActivation>(GEMM_W4A4::forward_grouped({problem})[0])
     );
     return ff_output;
 }
@@ -32,10 +40,71 @@ Tensor forward_fc(GEMM_W4A4 &fc, Tensor x) {
     // return std::get<Tensor>(fc.forward(x));
 }
 
+// forward_fc of independent layers (the image and text sides of a joint block) as one grouped GEMM
+std::vector<Tensor> forward_fc_grouped(std::vector<std::pair<GEMM_W4A4 *, Tensor>> fcs) {
+    std::vector<GEMM_W4A4::GroupedProblem> problems(fcs.size());
+    for (size_t i = 0; i < fcs.size(); i++) {
+        problems[i].gemm = fcs[i].first;
+        problems[i].x = fcs[i].second;
+    }
+    std::vector<Tensor> outputs;
+    for (auto &&output : GEMM_W4A4::forward_grouped(problems)) {
+        outputs.push_back(std::get<Tensor>(output));
+    }
+    return outputs;
+}
+
+// forward_mlp of independent MLPs, all fc1 run as one grouped GEMM and then all fc2
+std::vector<Tensor> forward_mlp_grouped(std::vector<std::tuple<GEMM_W4A4 *, GEMM_W4A4 *, Tensor, GEMM_W4A4::Modulation>> mlps) {
+    std::vector<GEMM_W4A4::GroupedProblem> problems(mlps.size());
+    for (size_t i = 0; i < mlps.size(); i++) {
+        auto &&[fc1, fc2, x, modulation] = mlps[i];
+        problems[i].gemm = fc1;
+        problems[i].x = x;
+        problems[i].modulation = modulation;
+        problems[i].fuse = GEMM_W4A4::FuseOptions::GELU_QUANT;
+        problems[i].nextGEMM = fc2;
+    }
+    auto hidden = GEMM_W4A4::forward_grouped(problems);
+
+    for (size_t i = 0; i < mlps.size(); i++) {
+        problems[i] = {};
+        problems[i].gemm = std::get<1>(mlps[i]);
+        problems[i].qact = std::get<GEMM_W4A4::QuantizedActivation>(hidden[i]);
+    }
+    std::vector<Tensor> outputs;
+    for (auto &&output : GEMM_W4A4::forward_grouped(problems)) {
+        outputs.push_back(std::get<Tensor>(output));
+    }
+    return outputs;
+}
+
 // Tensor forward_fc(GEMM_W8A8 &fc, Tensor x) {
 //     return fc.forward(x);
 // }
 
+// the LayerNorm + AdaLN modulation of one batch item, a modulation shared by the batch ([1, dim]) is its own
+GEMM_W4A4::Modulation sliceModulation(const GEMM_W4A4::Modulation &modulation, int i) {
+    if (!modulation.scale.valid() || modulation.scale.shape[0] == 1) {
+        return modulation;
+    }
+    return {modulation.scale.slice(0, i, i + 1), modulation.shift.slice(0, i, i + 1), modulation.eps};
+}
+
+// x * scale + bias for the AdaLN outputs scale / bias (and the residuals added with them), given per sample with
+// [batch_size, ...] (requests at different timesteps in one batch) or shared by the batch with [1, ...]
+// mul_add would run the rows of a per-sample scale over the tokens of the first sample instead
+void mul_add_mod(Tensor x, Tensor scale, Tensor bias) {
+    const int batch_size = x.shape[0];
+    kernels::mul_add_batch(x, scale, scale.shape[0] == batch_size, 0, bias, bias.shape[0] == batch_size);
+}
+
+// on CPU the norm and modulation are left to the quantization of the next projections (GEMM_W4A4::quantize_norm),
+// which then read the activation once instead of LayerNorm, mul_add and the quantization each taking a pass over it
+bool deferNorm(Tensor x) {
+    return x.device().type == Device::CPU;
+}
+
 
 AdaLayerNormZeroSingle::AdaLayerNormZeroSingle(int dim, Tensor::ScalarType dtype, Device device) :
     dim(dim),
@@ -57,10 +126,13 @@ AdaLayerNormZeroSingle::Output AdaLayerNormZeroSingle::forward(Tensor x, Tensor
     debug("shift_msa", shift_msa);
 
     debug("x", x);
+    if (deferNorm(x)) {
+        return Output{x, gate_msa, {scale_msa, shift_msa, norm.eps}};
+    }
     Tensor norm_x = norm.forward(x);
     debug("norm_x", norm_x);
 
-    kernels::mul_add(norm_x, scale_msa, shift_msa);
+    mul_add_mod(norm_x, scale_msa, shift_msa);
     return Output{norm_x, gate_msa};
 }
 
@@ -86,10 +158,13 @@ AdaLayerNormZero::Output AdaLayerNormZero::forward(Tensor x, Tensor emb) {
         auto &&[shift_msa, scale_msa] = kernels::split_mod<2>(emb);
         debug("shift_msa", shift_msa);
 
+        if (deferNorm(x)) {
+            return Output{x, {}, {}, {}, {}, {scale_msa, shift_msa, norm.eps}};
+        }
         Tensor norm_x = norm.forward(x);
         debug("norm_x", norm_x);
 
-        kernels::mul_add(norm_x, scale_msa, shift_msa);
+        mul_add_mod(norm_x, scale_msa, shift_msa);
         debug("norm_x_scaled", norm_x);
 
         return Output{norm_x};
@@ -97,10 +172,13 @@ AdaLayerNormZero::Output AdaLayerNormZero::forward(Tensor x, Tensor emb) {
         auto &&[shift_msa, scale_msa, gate_msa, shift_mlp, scale_mlp, gate_mlp] = kernels::split_mod<6>(emb);
         debug("shift_msa", shift_msa);
 
+        if (deferNorm(x)) {
+            return Output{x, gate_msa, shift_mlp, scale_mlp, gate_mlp, {scale_msa, shift_msa, norm.eps}};
+        }
         Tensor norm_x = norm.forward(x);
         debug("norm_x", norm_x);
 
-        kernels::mul_add(norm_x, scale_msa, shift_msa);
+        mul_add_mod(norm_x, scale_msa, shift_msa);
         debug("norm_x_scaled", norm_x);
 
         return Output{norm_x, gate_msa, shift_mlp, scale_mlp, gate_mlp};
@@ -131,6 +209,12 @@ Tensor Attention::forward(Tensor qkv) {
     Tensor k = reshaped.slice(2, num_heads, num_heads * 2);
     Tensor v = reshaped.slice(2, num_heads * 2, num_heads * 3);
 
+    if (device.type == Device::CPU) {
+        Tensor o = Tensor::allocate({batch_size, num_tokens, num_heads, dim_head}, qkv.scalar_type(), device);
+        kernels::attention_cpu(q, k, v, o, pow(dim_head, (-0.5)));
+        return o.view({batch_size * num_tokens, num_heads, dim_head});
+    }
+
     Tensor raw_attn_output = mha_fwd(q, k, v,
         0.0f,
         pow(q.shape[-1], (-0.5)),
@@ -146,6 +230,11 @@ Tensor Attention::forward(Tensor qkv) {
 }
 
 Tensor Attention::forward(Tensor qkv, Tensor pool_qkv, float sparsityRatio) {
+    // without pooled scores to select blocks every block is attended, dense attention does the same with less work
+    if (qkv.device().type == Device::CPU && !(pool_qkv.valid() && sparsityRatio > 0)) {
+        return forward(qkv);
+    }
+
     const bool cast_fp16 = this->force_fp16 && qkv.scalar_type() != Tensor::FP16;
 
     assert(qkv.ndims() == 3);
@@ -181,6 +270,18 @@ Tensor Attention::forward(Tensor qkv, Tensor pool_qkv, float sparsityRatio) {
 
     blockmask = kernels::topk(pool_score, pool_tokens * (1 - sparsityRatio));
 
+    if (device.type == Device::CPU) {
+        Tensor reshaped = qkv.view({batch_size, num_tokens, num_heads * 3, dim_head});
+        Tensor o = Tensor::allocate({batch_size, num_tokens, num_heads, dim_head}, qkv.scalar_type(), device);
+        kernels::attention_blocksparse_cpu(
+            reshaped.slice(2, 0, num_heads),
+            reshaped.slice(2, num_heads, num_heads * 2),
+            reshaped.slice(2, num_heads * 2, num_heads * 3),
+            o, pow(dim_head, (-0.5)), blockmask, POOL_SIZE
+        );
+        return o.view({batch_size * num_tokens, num_heads, dim_head});
+    }
+
     if (cu_seqlens_cpu.valid()) {
         if (cu_seqlens_cpu.shape[0] != batch_size + 1) {
             cu_seqlens_cpu = Tensor{};
@@ -316,11 +417,12 @@ FluxSingleTransformerBlock::FluxSingleTransformerBlock(int dim, int num_attentio
 Tensor FluxSingleTransformerBlock::forward(Tensor hidden_states, Tensor temb, Tensor rotary_emb) {
 
     nvtxRangePushA("FluxSingleTransformerBlock");
+    MemoryScope memoryScope(memoryStats);
 
     const int batch_size = hidden_states.shape[0];
     const int num_tokens = hidden_states.shape[1];
 
-    auto &&[norm_hidden_states, gate] = this->norm.forward(hidden_states, temb);
+    auto &&[norm_hidden_states, gate, modulation] = this->norm.forward(hidden_states, temb);
     debug("norm_hidden_states", norm_hidden_states);
     debug("gate", gate);
 
@@ -330,12 +432,21 @@ Tensor FluxSingleTransformerBlock::forward(Tensor hidden_states, Tensor temb, Te
 
     debug("rotary_emb", rotary_emb);
 
+    GEMM_W4A4::GroupedProblem qkv_problem;
+    qkv_problem.gemm = &qkv_proj;
+    qkv_problem.x = norm_hidden_states;
+    qkv_problem.modulation = modulation;
+    qkv_problem.norm_q = norm_q.weight;
+    qkv_problem.norm_k = norm_k.weight;
+    qkv_problem.rotary_emb = rotary_emb;
+
     if (attnImpl == AttentionImpl::FlashAttention2) {
         Tensor qkv = Tensor::allocate({batch_size, num_tokens, dim * 3}, norm_hidden_states.scalar_type(), norm_hidden_states.device());
         // qkv_proj.forward(norm_hidden_states, qkv, {});
         // debug("qkv_raw", qkv);
 
-        qkv_proj.forward(norm_hidden_states, qkv, {}, norm_q.weight, norm_k.weight, rotary_emb);
+        qkv_problem.out = qkv;
+        GEMM_W4A4::forward_grouped({qkv_problem});
         debug("qkv", qkv);
         // Tensor qkv = forward_fc(qkv_proj, norm_hidden_states);
 
@@ -351,7 +462,11 @@ Tensor FluxSingleTransformerBlock::forward(Tensor hidden_states, Tensor temb, Te
         Tensor k = Tensor::allocate({batch_size, num_heads, num_tokens_pad, dim_head}, Tensor::FP16, norm_hidden_states.device());
         Tensor v = Tensor::allocate({batch_size, num_heads, num_tokens_pad, dim_head}, Tensor::FP16, norm_hidden_states.device());
 
-        qkv_proj.forward(norm_hidden_states, {}, {}, norm_q.weight, norm_k.weight, rotary_emb, q, k, v, num_tokens);
+        qkv_problem.out_q = q;
+        qkv_problem.out_k = k;
+        qkv_problem.out_v = v;
+        qkv_problem.numTokens = num_tokens;
+        GEMM_W4A4::forward_grouped({qkv_problem});
 
         debug("packed_q", q);
         debug("packed_k", k);
@@ -373,13 +488,13 @@ Tensor FluxSingleTransformerBlock::forward(Tensor hidden_states, Tensor temb, Te
     attn_output = forward_fc(out_proj, attn_output);
     debug("attn_output", attn_output);
 
-    Tensor ff_output = forward_mlp(mlp_fc1, mlp_fc2, norm_hidden_states);
+    Tensor ff_output = forward_mlp(mlp_fc1, mlp_fc2, norm_hidden_states, modulation);
     debug("ff_output", ff_output);
 
     hidden_states = kernels::add(attn_output, ff_output);
     debug("attn_ff_output", hidden_states);
 
-    kernels::mul_add(hidden_states, gate, residual);
+    mul_add_mod(hidden_states, gate, residual);
 
     nvtxRangePop();
 
@@ -438,6 +553,7 @@ std::tuple<Tensor, Tensor> JointTransformerBlock::forward(Tensor hidden_states,
     assert(encoder_hidden_states.shape[0] == batch_size);
 
     nvtxRangePushA("JointTransformerBlock");
+    MemoryScope memoryScope(memoryStats);
 
     nvtxRangePushA("AdaNorm");
 
@@ -499,7 +615,7 @@ std::tuple<Tensor, Tensor> JointTransformerBlock::forward(Tensor hidden_states,
                     ? pool.slice(0, i, i + 1).slice(1, 0, num_tokens_img / POOL_SIZE)
                     : Tensor{};
                 Tensor pool_qkv_context = pool.valid()
-                    ? concat.slice(0, i, i + 1).slice(1, num_tokens_img / POOL_SIZE, num_tokens_img / POOL_SIZE + num_tokens_txt / POOL_SIZE)
+                    ? pool.slice(0, i, i + 1).slice(1, num_tokens_img / POOL_SIZE, num_tokens_img / POOL_SIZE + num_tokens_txt / POOL_SIZE)
                     : Tensor{};
 
                 // qkv_proj.forward(norm1_output.x.slice(0, i, i + 1), qkv);
@@ -507,15 +623,33 @@ std::tuple<Tensor, Tensor> JointTransformerBlock::forward(Tensor hidden_states,
 
                 debug("rotary_emb", rotary_emb);
 
-                qkv_proj.forward(norm1_output.x.slice(0, i, i + 1), qkv, pool_qkv, norm_q.weight, norm_k.weight, rotary_emb);
-                debug("qkv", qkv);
-
                 // qkv_proj_context.forward(norm1_context_output.x.slice(0, i, i + 1), qkv_context);
                 // debug("qkv_context_raw", qkv_context);
 
                 debug("rotary_emb_context", rotary_emb_context);
 
-                qkv_proj_context.forward(norm1_context_output.x.slice(0, i, i + 1), qkv_context, pool_qkv_context, norm_added_q.weight, norm_added_k.weight, rotary_emb_context);
+                // the text side is too small to fill the device on its own, run both projections as one grouped GEMM
+                GEMM_W4A4::GroupedProblem img, txt;
+                img.gemm = &qkv_proj;
+                img.x = norm1_output.x.slice(0, i, i + 1);
+                img.modulation = sliceModulation(norm1_output.modulation, i);
+                img.out = qkv;
+                img.pool = pool_qkv;
+                img.norm_q = norm_q.weight;
+                img.norm_k = norm_k.weight;
+                img.rotary_emb = rotary_emb;
+
+                txt.gemm = &qkv_proj_context;
+                txt.x = norm1_context_output.x.slice(0, i, i + 1);
+                txt.modulation = sliceModulation(norm1_context_output.modulation, i);
+                txt.out = qkv_context;
+                txt.pool = pool_qkv_context;
+                txt.norm_q = norm_added_q.weight;
+                txt.norm_k = norm_added_k.weight;
+                txt.rotary_emb = rotary_emb_context;
+
+                GEMM_W4A4::forward_grouped({img, txt});
+                debug("qkv", qkv);
                 debug("qkv_context", qkv_context);
             }
 
@@ -563,15 +697,30 @@ std::tuple<Tensor, Tensor> JointTransformerBlock::forward(Tensor hidden_states,
                     return x.slice(0, i, i+1).slice(2, num_tokens_img_pad, num_tokens_img_pad + num_tokens_txt_pad);
                 };
 
-                qkv_proj.forward(
-                    norm1_output.x.slice(0, i, i + 1), {}, {}, norm_q.weight, norm_k.weight, rotary_emb,
-                    sliceImg(concat_q), sliceImg(concat_k), sliceImg(concat_v), num_tokens_img
-                );
-
-                qkv_proj_context.forward(
-                    norm1_context_output.x.slice(0, i, i + 1), {}, {}, norm_added_q.weight, norm_added_k.weight, rotary_emb_context,
-                    sliceTxt(concat_q), sliceTxt(concat_k), sliceTxt(concat_v), num_tokens_txt
-                );
+                GEMM_W4A4::GroupedProblem img, txt;
+                img.gemm = &qkv_proj;
+                img.x = norm1_output.x.slice(0, i, i + 1);
+                img.modulation = sliceModulation(norm1_output.modulation, i);
+                img.norm_q = norm_q.weight;
+                img.norm_k = norm_k.weight;
+                img.rotary_emb = rotary_emb;
+                img.out_q = sliceImg(concat_q);
+                img.out_k = sliceImg(concat_k);
+                img.out_v = sliceImg(concat_v);
+                img.numTokens = num_tokens_img;
+
+                txt.gemm = &qkv_proj_context;
+                txt.x = norm1_context_output.x.slice(0, i, i + 1);
+                txt.modulation = sliceModulation(norm1_context_output.modulation, i);
+                txt.norm_q = norm_added_q.weight;
+                txt.norm_k = norm_added_k.weight;
+                txt.rotary_emb = rotary_emb_context;
+                txt.out_q = sliceTxt(concat_q);
+                txt.out_k = sliceTxt(concat_k);
+                txt.out_v = sliceTxt(concat_v);
+                txt.numTokens = num_tokens_txt;
+
+                GEMM_W4A4::forward_grouped({img, txt});
             }
 
             debug("concat_q", concat_q);
@@ -596,134 +745,126 @@ std::tuple<Tensor, Tensor> JointTransformerBlock::forward(Tensor hidden_states,
 
     debug("raw_attn_output", raw_attn_output);
 
+    // [batch_size, num_tokens, num_heads * dim_head] of one side of raw_attn_output, starting at token `offset`
+    auto splitAttnOutput = [&](int offset, int num_tokens) {
+        if (batch_size == 1) {
+            return raw_attn_output.slice(1, offset, offset + num_tokens).reshape({batch_size, num_tokens, num_heads * dim_head});
+        }
+        Tensor split = Tensor::allocate({batch_size, num_tokens, num_heads * dim_head}, raw_attn_output.scalar_type(), raw_attn_output.device());
+        if (split.device().type == Device::CPU) {
+            for (int i = 0; i < batch_size; i++) {
+                split.slice(0, i, i + 1).copy_(
+                    raw_attn_output.slice(0, i, i + 1).slice(1, offset, offset + num_tokens).reshape({1, num_tokens, num_heads * dim_head}));
+            }
+            return split;
+        }
+        checkCUDA(cudaMemcpy2DAsync(
+            split.data_ptr(),
+            num_tokens * num_heads * dim_head * split.scalar_size(),
+            raw_attn_output.data_ptr<char>() + offset * num_heads * dim_head * split.scalar_size(),
+            (num_tokens_img_pad + num_tokens_txt_pad) * num_heads * dim_head * raw_attn_output.scalar_size(),
+            num_tokens * num_heads * dim_head * split.scalar_size(),
+            batch_size,
+            cudaMemcpyDeviceToDevice,
+            stream));
+        return split;
+    };
+
+    // the image and text sides run each pair of projections as one grouped GEMM (see GEMM_W4A4::forward_grouped),
+    // the text side (512 tokens) is too small to keep the device busy on its own
     {
         nvtxRangePushA("o_proj");
 
-        auto &&[_, gate_msa, shift_mlp, scale_mlp, gate_mlp] = norm1_output;
-
         // raw_attn_output: [batch_size, num_tokens_img + num_tokens_txt, num_heads * dim_head]
 
-        Tensor raw_attn_output_split;
-        if (batch_size == 1) {
-            raw_attn_output_split = raw_attn_output.slice(1, 0, num_tokens_img).reshape({batch_size, num_tokens_img, num_heads * dim_head});
-        } else {
-            raw_attn_output_split = Tensor::allocate({batch_size, num_tokens_img, num_heads * dim_head}, raw_attn_output.scalar_type(), raw_attn_output.device());
-            checkCUDA(cudaMemcpy2DAsync(
-                raw_attn_output_split.data_ptr(),
-                num_tokens_img * num_heads * dim_head * raw_attn_output_split.scalar_size(),
-                raw_attn_output.data_ptr(),
-                (num_tokens_img_pad + num_tokens_txt_pad) * num_heads * dim_head * raw_attn_output.scalar_size(),
-                num_tokens_img * num_heads * dim_head * raw_attn_output_split.scalar_size(),
-                batch_size,
-                cudaMemcpyDeviceToDevice,
-                stream));
-        }
-
-
+        Tensor raw_attn_output_split = splitAttnOutput(0, num_tokens_img);
         spdlog::debug("raw_attn_output_split={}", raw_attn_output_split.shape.str());
         debug("img.raw_attn_output_split", raw_attn_output_split);
 
-        Tensor attn_output = forward_fc(out_proj, raw_attn_output_split); // std::get<Tensor>(out_proj.forward(raw_attn_output_split));
-        debug("img.attn_output", attn_output);
+        std::vector<std::pair<GEMM_W4A4 *, Tensor>> fcs = {{&out_proj, raw_attn_output_split}};
+        if (!context_pre_only) {
+            Tensor raw_attn_output_split_context = splitAttnOutput(num_tokens_img_pad, num_tokens_txt);
+            spdlog::debug("raw_attn_output_split={}", raw_attn_output_split_context.shape.str());
+            debug("context.raw_attn_output_split", raw_attn_output_split_context);
+            fcs.push_back({&out_proj_context, raw_attn_output_split_context});
+        }
 
-#if 1
-        kernels::mul_add(attn_output, gate_msa, hidden_states);
-        hidden_states = std::move(attn_output);
+        std::vector<Tensor> attn_outputs = forward_fc_grouped(fcs);
+        debug("img.attn_output", attn_outputs[0]);
+        if (!context_pre_only) {
+            debug("context.attn_output", attn_outputs[1]);
+        }
 
         nvtxRangePop();
         nvtxRangePushA("MLP");
 
-        spdlog::debug("attn_output={}", hidden_states.shape.str());
-
-        Tensor norm_hidden_states = norm2.forward(hidden_states);
-        debug("scale_mlp", scale_mlp);
-        debug("shift_mlp", shift_mlp);
-        kernels::mul_add(norm_hidden_states, scale_mlp, shift_mlp);
-
-        spdlog::debug("norm_hidden_states={}", norm_hidden_states.shape.str());
-#else
-        Tensor norm_hidden_states = hidden_states;
-#endif
-
-        // Tensor ff_output = mlp_fc2.forward(GELU::forward(mlp_fc1.forward(norm_hidden_states)));
-        debug("img.ff_input", norm_hidden_states);
-        Tensor ff_output = forward_mlp(mlp_fc1, mlp_fc2, norm_hidden_states);
-        debug("img.ff_output", ff_output);
-
-        debug("gate_mlp", gate_mlp);
-        kernels::mul_add(ff_output, gate_mlp, hidden_states);
-        hidden_states = std::move(ff_output);
-
-        nvtxRangePop();
-
-        spdlog::debug("ff_output={}", hidden_states.shape.str());
-    }
+        Tensor norm_hidden_states, norm_encoder_hidden_states;
+        GEMM_W4A4::Modulation modulation_mlp, modulation_mlp_context;
+        {
+            auto &&[_, gate_msa, shift_mlp, scale_mlp, gate_mlp, modulation_msa] = norm1_output;
 
-    if (context_pre_only) {
-        return { hidden_states, encoder_hidden_states };
-    }
+            mul_add_mod(attn_outputs[0], gate_msa, hidden_states);
+            hidden_states = std::move(attn_outputs[0]);
 
-    {
-        nvtxRangePushA("o_proj_context");
+            spdlog::debug("attn_output={}", hidden_states.shape.str());
 
-        auto &&[_, gate_msa, shift_mlp, scale_mlp, gate_mlp] = norm1_context_output;
+            debug("scale_mlp", scale_mlp);
+            debug("shift_mlp", shift_mlp);
+            if (deferNorm(hidden_states)) {
+                norm_hidden_states = hidden_states;
+                modulation_mlp = {scale_mlp, shift_mlp, norm2.eps};
+            } else {
+                norm_hidden_states = norm2.forward(hidden_states);
+                mul_add_mod(norm_hidden_states, scale_mlp, shift_mlp);
+            }
 
-        Tensor raw_attn_output_split;
-        if (batch_size == 1) {
-            raw_attn_output_split = raw_attn_output.slice(1, num_tokens_img_pad, num_tokens_img_pad + num_tokens_txt).reshape({batch_size, num_tokens_txt, num_heads * dim_head});
-        } else {
-            raw_attn_output_split = Tensor::allocate({batch_size, num_tokens_txt, num_heads * dim_head}, raw_attn_output.scalar_type(), raw_attn_output.device());
-            checkCUDA(cudaMemcpy2DAsync(
-                raw_attn_output_split.data_ptr(),
-                num_tokens_txt * num_heads * dim_head * raw_attn_output_split.scalar_size(),
-                raw_attn_output.data_ptr<char>() + num_tokens_img_pad * num_heads * dim_head * raw_attn_output_split.scalar_size(),
-                (num_tokens_img_pad + num_tokens_txt_pad) * num_heads * dim_head * raw_attn_output.scalar_size(),
-                num_tokens_txt * num_heads * dim_head * raw_attn_output_split.scalar_size(),
-                batch_size,
-                cudaMemcpyDeviceToDevice,
-                stream));
+            spdlog::debug("norm_hidden_states={}", norm_hidden_states.shape.str());
         }
+        if (!context_pre_only) {
+            auto &&[_, gate_msa, shift_mlp, scale_mlp, gate_mlp, modulation_msa] = norm1_context_output;
+
+            mul_add_mod(attn_outputs[1], gate_msa, encoder_hidden_states);
+            encoder_hidden_states = std::move(attn_outputs[1]);
+
+            spdlog::debug("attn_output={}", encoder_hidden_states.shape.str());
+
+            debug("c_scale_mlp", scale_mlp);
+            debug("c_shift_mlp", shift_mlp);
+            if (deferNorm(encoder_hidden_states)) {
+                norm_encoder_hidden_states = encoder_hidden_states;
+                modulation_mlp_context = {scale_mlp, shift_mlp, norm2_context.eps};
+            } else {
+                norm_encoder_hidden_states = norm2_context.forward(encoder_hidden_states);
+                mul_add_mod(norm_encoder_hidden_states, scale_mlp, shift_mlp);
+            }
 
+            spdlog::debug("norm_hidden_states={}", norm_encoder_hidden_states.shape.str());
+        }
 
-        spdlog::debug("raw_attn_output_split={}", raw_attn_output_split.shape.str());
-        debug("context.raw_attn_output_split", raw_attn_output_split);
-
-        Tensor attn_output = forward_fc(out_proj_context, raw_attn_output_split); // std::get<Tensor>(out_proj_context.forward(raw_attn_output_split));
-        debug("context.attn_output", attn_output);
-
-#if 1
-        kernels::mul_add(attn_output, gate_msa, encoder_hidden_states);
-        encoder_hidden_states = std::move(attn_output);
-
-        nvtxRangePop();
-        nvtxRangePushA("MLP");
-
-        spdlog::debug("attn_output={}", encoder_hidden_states.shape.str());
-
-        Tensor norm_hidden_states = norm2_context.forward(encoder_hidden_states);
-        debug("c_scale_mlp", scale_mlp);
-        debug("c_shift_mlp", shift_mlp);
-        kernels::mul_add(norm_hidden_states, scale_mlp, shift_mlp);
-
-        spdlog::debug("norm_hidden_states={}", norm_hidden_states.shape.str());
-#else
-        auto norm_hidden_states = encoder_hidden_states;
-#endif
-
+        // Tensor ff_output = mlp_fc2.forward(GELU::forward(mlp_fc1.forward(norm_hidden_states)));
+        debug("img.ff_input", norm_hidden_states);
+        std::vector<std::tuple<GEMM_W4A4 *, GEMM_W4A4 *, Tensor, GEMM_W4A4::Modulation>> mlps = {{&mlp_fc1, &mlp_fc2, norm_hidden_states, modulation_mlp}};
+        if (!context_pre_only) {
+            debug("context.ff_input", norm_encoder_hidden_states);
+            mlps.push_back({&mlp_context_fc1, &mlp_context_fc2, norm_encoder_hidden_states, modulation_mlp_context});
+        }
+        std::vector<Tensor> ff_outputs = forward_mlp_grouped(mlps);
 
-        // Tensor ff_output = mlp_context_fc2.forward(GELU::forward(mlp_context_fc1.forward(norm_hidden_states)));
-        // Tensor ff_output = mlp_context_fc2.forward_quant(quant_static_fuse_gelu(mlp_context_fc1.forward(norm_hidden_states), 1.0));
-        debug("context.ff_input", norm_hidden_states);
-        Tensor ff_output = forward_mlp(mlp_context_fc1, mlp_context_fc2, norm_hidden_states);
-        debug("context.ff_output", ff_output);
+        debug("img.ff_output", ff_outputs[0]);
+        debug("gate_mlp", norm1_output.gate_mlp);
+        mul_add_mod(ff_outputs[0], norm1_output.gate_mlp, hidden_states);
+        hidden_states = std::move(ff_outputs[0]);
+        spdlog::debug("ff_output={}", hidden_states.shape.str());
 
-        debug("c_gate_mlp", gate_mlp);
-        kernels::mul_add(ff_output, gate_mlp, encoder_hidden_states);
-        encoder_hidden_states = std::move(ff_output);
+        if (!context_pre_only) {
+            debug("context.ff_output", ff_outputs[1]);
+            debug("c_gate_mlp", norm1_context_output.gate_mlp);
+            mul_add_mod(ff_outputs[1], norm1_context_output.gate_mlp, encoder_hidden_states);
+            encoder_hidden_states = std::move(ff_outputs[1]);
+            spdlog::debug("ff_output={}", encoder_hidden_states.shape.str());
+        }
 
         nvtxRangePop();
-
-        spdlog::debug("ff_output={}", encoder_hidden_states.shape.str());
     }
 
     nvtxRangePop();
@@ -731,7 +872,7 @@ std::tuple<Tensor, Tensor> JointTransformerBlock::forward(Tensor hidden_states,
     return { hidden_states, encoder_hidden_states };
 }
 
-FluxModel::FluxModel(bool use_fp4, bool offload, Tensor::ScalarType dtype, Device device) : dtype(dtype), offload(offload) {
+FluxModel::FluxModel(bool use_fp4, bool offload, Tensor::ScalarType dtype, Device device) : dtype(dtype), offloadConfig(LayerOffloadConfig::fromEnv()), offload(offload) {
     for (int i = 0; i < 19; i++) {
         transformer_blocks.push_back(std::make_unique<JointTransformerBlock>(3072, 24, 3072, false, use_fp4, dtype, device));
         registerChildren(*transformer_blocks.back(), format("transformer_blocks.{}", i));
@@ -741,7 +882,7 @@ FluxModel::FluxModel(bool use_fp4, bool offload, Tensor::ScalarType dtype, Devic
         }
     }
     for (int i = 0; i < 38; i++) {
-        single_transformer_blocks.push_back(std::make_unique<FluxSingleTransformerBlock>(3072, 24, 3072, 4, use_fp4, dtype, Device::cuda()));
+        single_transformer_blocks.push_back(std::make_unique<FluxSingleTransformerBlock>(3072, 24, 3072, 4, use_fp4, dtype, device));
         registerChildren(*single_transformer_blocks.back(), format("single_transformer_blocks.{}", i));
         if (offload) {
             single_transformer_blocks.back()->setLazyLoad(true);
@@ -760,6 +901,65 @@ Tensor FluxModel::forward(
         Tensor controlnet_block_samples,
         Tensor controlnet_single_block_samples,
         bool skip_first_layer) {
+    const char *env = getenv("NUNCHAKU_CPU_PLAN");
+    const bool usePlans = env && std::string(env) == "1";
+    if (!usePlans || offload || hidden_states.device().type != Device::CPU || !DebugContext::ctxs.empty()) {
+        return forwardEager(hidden_states, encoder_hidden_states, temb, rotary_emb_img, rotary_emb_context, rotary_emb_single,
+            controlnet_block_samples, controlnet_single_block_samples, skip_first_layer);
+    }
+
+    // the plan of a forward depends on the shapes and dtypes of its inputs and on which of them are given
+    std::vector<Tensor> inputs;
+    std::vector<int> key = {skip_first_layer};
+    for (const Tensor &input : {hidden_states, encoder_hidden_states, temb, rotary_emb_img, rotary_emb_context, rotary_emb_single,
+            controlnet_block_samples, controlnet_single_block_samples}) {
+        if (!input.valid()) {
+            key.push_back(-1);
+            continue;
+        }
+        key.push_back(input.dtype());
+        key.push_back(input.ndims());
+        key.insert(key.end(), input.shape.dataExtent.begin(), input.shape.dataExtent.end());
+        inputs.push_back(input);
+    }
+
+    Tensor result;
+    if (auto it = plans.find(key); it != plans.end()) {
+        result = it->second.replay(inputs).at(0);
+    } else {
+        kernels::CpuPlan plan;
+        {
+            kernels::CpuPlan::Capture capture(plan, inputs);
+            result = forwardEager(hidden_states, encoder_hidden_states, temb, rotary_emb_img, rotary_emb_context, rotary_emb_single,
+                controlnet_block_samples, controlnet_single_block_samples, skip_first_layer);
+            capture.finish({result});
+        }
+        spdlog::debug("Recorded a CPU plan of {} steps, {} MiB of temporaries", plan.numSteps(), plan.arenaBytes() / 1048576);
+        plans.emplace(key, std::move(plan));
+    }
+
+    // the output of a plan is overwritten by its next replay
+    Tensor output = Tensor::empty_like(result);
+    output.copy_(result);
+    return output;
+}
+
+void FluxModel::clearPlans() {
+    plans.clear();
+}
+
+Tensor FluxModel::forwardEager(
+        Tensor hidden_states,
+        Tensor encoder_hidden_states,
+        Tensor temb,
+        Tensor rotary_emb_img,
+        Tensor rotary_emb_context,
+        Tensor rotary_emb_single,
+        Tensor controlnet_block_samples,
+        Tensor controlnet_single_block_samples,
+        bool skip_first_layer) {
+    MemoryScope memoryScope(memoryStats);
+
     const int batch_size = hidden_states.shape[0];
     const Tensor::ScalarType dtype = hidden_states.dtype();
     const Device device = hidden_states.device();
@@ -767,6 +967,12 @@ Tensor FluxModel::forward(
     const int txt_tokens = encoder_hidden_states.shape[1];
     const int img_tokens = hidden_states.shape[1];
 
+    // one timestep embedding for the batch, or one per sample (e.g. requests at different denoising steps)
+    if (temb.ndims() != 2 || (temb.shape[0] != 1 && temb.shape[0] != batch_size) || encoder_hidden_states.shape[0] != batch_size) {
+        throw std::invalid_argument(format("FluxModel: temb {} and encoder_hidden_states {} do not match hidden_states {}",
+            temb.shape.str(), encoder_hidden_states.shape.str(), hidden_states.shape.str()));
+    }
+
     const int numLayers = transformer_blocks.size() + single_transformer_blocks.size();
 
     Tensor concat;
@@ -791,8 +997,8 @@ Tensor FluxModel::forward(
                 // txt first, same as diffusers
                 concat = Tensor::allocate({batch_size, txt_tokens + img_tokens, 3072}, dtype, device);
                 for (int i = 0; i < batch_size; i++) {
-                    concat.slice(0, i, i + 1).slice(1, 0, txt_tokens).copy_(encoder_hidden_states);
-                    concat.slice(0, i, i + 1).slice(1, txt_tokens, txt_tokens + img_tokens).copy_(hidden_states);
+                    concat.slice(0, i, i + 1).slice(1, 0, txt_tokens).copy_(encoder_hidden_states.slice(0, i, i + 1));
+                    concat.slice(0, i, i + 1).slice(1, txt_tokens, txt_tokens + img_tokens).copy_(hidden_states.slice(0, i, i + 1));
                 }
                 hidden_states = concat;
                 encoder_hidden_states = {};
@@ -834,8 +1040,19 @@ Tensor FluxModel::forward(
         }
     };
 
-    LayerOffloadHelper helper(this->offload, numLayers, compute, load, unload);
+    auto layerBytes = [&](int layer) -> size_t {
+        if (size_t(layer) < transformer_blocks.size()) {
+            return transformer_blocks.at(layer)->getLazyParamsBytes();
+        } else {
+            return single_transformer_blocks.at(layer - transformer_blocks.size())->getLazyParamsBytes();
+        }
+    };
+
+    LayerOffloadHelper helper(this->offload, numLayers, compute, load, unload, offloadConfig, &getOffloadStats(false), layerBytes);
     helper.run();
+    if (this->offload) {
+        offloadTimings = std::move(helper.timings);
+    }
 
     return hidden_states;
 }
@@ -886,6 +1103,7 @@ std::tuple<Tensor, Tensor> FluxModel::forward_layer(
 }
 
 void FluxModel::setAttentionImpl(AttentionImpl impl) {
+    clearPlans();
     for (auto &&block : this->transformer_blocks) {
         block->attnImpl = impl;
     }
@@ -893,3 +1111,90 @@ void FluxModel::setAttentionImpl(AttentionImpl impl) {
         block->attnImpl = impl;
     }
 }
+
+ResidentLayerPlan FluxModel::planResidentLayers(size_t budget, double linkBandwidth) {
+    const int numLayers = transformer_blocks.size() + single_transformer_blocks.size();
+
+    std::vector<size_t> bytes;
+    for (auto &&block : transformer_blocks) {
+        bytes.push_back(block->getLazyParamsBytes(true));
+    }
+    for (auto &&block : single_transformer_blocks) {
+        bytes.push_back(block->getLazyParamsBytes(true));
+    }
+
+    // prefer the bandwidth observed in the last run
+    const LayerOffloadStats &offloadStats = getOffloadStats(true);
+    const bool measured = offloadStats.valid() && (int)offloadStats.loadTime.size() == numLayers;
+    if (measured) {
+        double loadedBytes = 0, loadTime = 0;
+        for (int i = 0; i < numLayers; i++) {
+            if (offloadStats.loadTime[i] > 0) {
+                loadedBytes += bytes[i];
+                loadTime += offloadStats.loadTime[i];
+            }
+        }
+        if (loadTime > 0) {
+            linkBandwidth = loadedBytes / loadTime * 1e3;
+        }
+    }
+    if (linkBandwidth <= 0) {
+        throw std::invalid_argument("linkBandwidth must be positive when there are no offload stats");
+    }
+
+    std::vector<float> value(numLayers);
+    for (int i = 0; i < numLayers; i++) {
+        value[i] = bytes[i] / linkBandwidth * 1e3;
+        if (measured) {
+            value[i] += offloadStats.stallTime[i];
+        }
+    }
+
+    std::vector<bool> required(numLayers, false);
+    required[0] = true;    // LayerOffloadHelper never loads the first layer
+
+    size_t totalBytes = 0, maxBytes = 0;
+    for (size_t b : bytes) {
+        totalBytes += b;
+        maxBytes = std::max(maxBytes, b);
+    }
+    if (totalBytes > budget) {
+        // leave room for the layers in flight
+        const size_t reserved = std::max(1, offloadConfig.adaptive ? offloadConfig.maxPrefetchDepth : offloadConfig.prefetchDepth) * maxBytes;
+        budget -= std::min(budget, reserved);
+    }
+
+    ResidentLayerPlan plan = selectResidentLayers(bytes, value, budget, required);
+    spdlog::info("Resident layers: {} of {} ({} MiB), {} MiB transferred per step", 
+        std::count(plan.resident.begin(), plan.resident.end(), true), numLayers, plan.residentBytes / 1048576, plan.transferBytes / 1048576);
+    return plan;
+}
+
+void FluxModel::setResidentLayers(const std::vector<bool> &resident) {
+    const size_t numLayers = transformer_blocks.size() + single_transformer_blocks.size();
+    if (!offload) {
+        throw std::runtime_error("Resident layers can only be changed when offloading is enabled");
+    }
+    if (resident.size() != numLayers || !resident[0]) {
+        throw std::invalid_argument(format("Expected {} resident flags with the first layer resident", numLayers));
+    }
+
+    for (size_t i = 0; i < numLayers; i++) {
+        Module *block = i < transformer_blocks.size() ? (Module *)transformer_blocks[i].get() : (Module *)single_transformer_blocks[i - transformer_blocks.size()].get();
+        if (resident[i]) {
+            block->loadLazyParams();
+            block->setLazyLoad(false);
+        } else {
+            block->setLazyLoad(true);
+            block->releaseLazyParams();
+        }
+    }
+}
+
+const LayerOffloadStats &FluxModel::getOffloadStats(bool wait) {
+    if (offloadTimings.valid() && (wait || offloadTimings.ready())) {
+        offloadStats = offloadTimings.read();
+        offloadTimings = LayerOffloadTimings{};
+    }
+    return offloadStats;
+}
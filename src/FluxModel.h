@@ -5,6 +5,7 @@
 #include "Module.h"
 #include "Linear.h"
 #include "layernorm.h"
+#include "kernels/cpu_plan.h"
 
 enum class AttentionImpl {
     FlashAttention2 = 0,
@@ -16,9 +17,12 @@ public:
     static constexpr bool USE_4BIT = true;
     using GEMM = std::conditional_t<USE_4BIT, GEMV_AWQ, GEMM_W8A8>;
 
+    // on CPU x is the input of the norm and modulation holds scale_msa / shift_msa, the projections that read x
+    // apply LayerNorm(x) * scale_msa + shift_msa while quantizing it (GEMM_W4A4::quantize_norm)
     struct Output {
         Tensor x;
         Tensor gate_msa;
+        GEMM_W4A4::Modulation modulation;
     };
 
 public:
@@ -38,12 +42,14 @@ public:
     static constexpr bool USE_4BIT = true;
     using GEMM = std::conditional_t<USE_4BIT, GEMV_AWQ, GEMM_W8A8>;
 
+    // x and modulation as in AdaLayerNormZeroSingle::Output
     struct Output {
         Tensor x;
         Tensor gate_msa;
         Tensor shift_mlp;
         Tensor scale_mlp;
         Tensor gate_mlp;
+        GEMM_W4A4::Modulation modulation;
     };
 public:
     AdaLayerNormZero(int dim, bool pre_only, Tensor::ScalarType dtype, Device device);
@@ -149,6 +155,11 @@ public:
         Tensor controlnet_block_samples,
         Tensor controlnet_single_block_samples,
         bool skip_first_layer = false);
+    // NUNCHAKU_CPU_PLAN=1: a forward on host tensors is recorded once per shape of the inputs and replayed on the next
+    // steps (see kernels/cpu_plan.h), except when offloading or debugging, which need the host code of every step
+    // plans bind the weights as they are, clearPlans() after anything that changes them other than in place or changes
+    // the kernels a forward calls (LoRA, attention implementation)
+    void clearPlans();
     std::tuple<Tensor, Tensor> forward_layer(
         size_t layer,
         Tensor hidden_states,
@@ -160,12 +171,38 @@ public:
         Tensor controlnet_single_block_samples);
     void setAttentionImpl(AttentionImpl impl);
 
+    // choose the layers to keep on device within `budget` bytes of offloadable weights
+    // layers are valued by the load time they save, measured from the last offloaded forward if available
+    ResidentLayerPlan planResidentLayers(size_t budget, double linkBandwidth);
+    void setResidentLayers(const std::vector<bool> &resident);
+
+    // timings of the last offloaded forward whose events were read, with `wait` those of the last one
+    // without, a forward still running on the device leaves the timings of an earlier one
+    const LayerOffloadStats &getOffloadStats(bool wait);
+
 public:
     const Tensor::ScalarType dtype;
 
     std::vector<std::unique_ptr<JointTransformerBlock>> transformer_blocks;
     std::vector<std::unique_ptr<FluxSingleTransformerBlock>> single_transformer_blocks;
 
+    LayerOffloadConfig offloadConfig;
+
+private:
+    Tensor forwardEager(
+        Tensor hidden_states,
+        Tensor encoder_hidden_states,
+        Tensor temb,
+        Tensor rotary_emb_img,
+        Tensor rotary_emb_context,
+        Tensor rotary_emb_single,
+        Tensor controlnet_block_samples,
+        Tensor controlnet_single_block_samples,
+        bool skip_first_layer);
+
 private:
     bool offload;
+    std::map<std::vector<int>, nunchaku::kernels::CpuPlan> plans;
+    LayerOffloadTimings offloadTimings;     // events of the last offloaded forward, not read yet
+    LayerOffloadStats offloadStats;
 };
\ No newline at end of file
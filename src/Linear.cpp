@@ -3,10 +3,14 @@
 #include "kernels/gemm_f16.h"
 #include "kernels/misc_kernels.h"
 #include "kernels/awq/gemv_awq.h"
+#include "kernels/awq/gemv_awq_cpu.h"
 #include "kernels/dwconv.h"
+#include "WeightQuantizer.h"
 
 #include <nvtx3/nvToolsExt.h>
 
+#include <chrono>
+
 using namespace nunchaku;
 
 GEMM_F16::GEMM_F16(int in_features, int out_features, bool use_bias, Tensor::ScalarType dtype, Device device) :
@@ -66,15 +70,39 @@ void GEMV_AWQ::loadParam(std::string key, Tensor &dst, Tensor src) {
     }
 }
 
+void GEMV_AWQ::bindParam(std::string key, Tensor &dst, Tensor src) {
+    Module::bindParam(key, dst, src);
+    if (key == "lora_down") {
+        this->lora_rank = dst.shape[0];
+    }
+}
+
 Tensor GEMV_AWQ::forward(Tensor x) {
     debug("x", x);
 
     const int M = (int)x.numel() / x.shape[-1];
-    Tensor out = gemv_awq(x, this->qweight, this->wscales, this->wzeros, M, out_features, in_features, group_size);
-    if (bias.valid()) {
-        // TODO: batch
-        assert(out.numel() == bias.numel());
-        out = kernels::add(out, bias.view(out.shape.dataExtent));
+    Tensor out;
+    if (x.device().type == Device::CPU) {
+        // the host kernel adds the bias before rounding, mul_add_batch is CUDA only
+        out = gemv_awq_cpu(x, this->qweight, this->wscales, this->wzeros, M, out_features, in_features, group_size, this->bias);
+    } else if (M <= GEMV_MAX_M) {
+        out = gemv_awq(x, this->qweight, this->wscales, this->wzeros, M, out_features, in_features, group_size);
+    } else {
+        // the CUDA kernel takes at most GEMV_MAX_M rows, e.g. a batch of timestep embeddings runs in chunks
+        auto shape = x.shape.dataExtent;
+        shape.back() = out_features;
+        out = Tensor::allocate(shape, x.scalar_type(), x.device());
+        Tensor x2d = x.view({M, in_features});
+        Tensor out2d = out.view({M, out_features});
+        for (int m = 0; m < M; m += GEMV_MAX_M) {
+            const int rows = std::min(GEMV_MAX_M, M - m);
+            out2d.slice(0, m, m + rows).copy_(
+                gemv_awq(x2d.slice(0, m, m + rows), this->qweight, this->wscales, this->wzeros, rows, out_features, in_features, group_size));
+        }
+    }
+    if (bias.valid() && x.device().type != Device::CPU) {
+        // one row of out per input row
+        kernels::mul_add_batch(out.view({M, out_features}), {}, false, 0, bias, false);
     }
 
     debug("out_before_lora", out);
@@ -140,6 +168,64 @@ GEMM_W4A4::GEMM_W4A4(int in_features, int out_features, bool bias, bool use_fp4,
 #endif
 }
 
+namespace {
+// provider with some tensors replaced
+class TensorsProviderOverlay : public TensorsProvider {
+public:
+    TensorsProviderOverlay(TensorsProvider &base, std::map<std::string, Tensor> overlay) : base(base), overlay(std::move(overlay)) {}
+
+    virtual bool contains(const std::string &key) const override {
+        return overlay.contains(key) || base.contains(key);
+    }
+    virtual Tensor getTensor(const std::string &key) override {
+        if (overlay.contains(key)) {
+            return overlay.at(key);
+        }
+        return base.getTensor(key);
+    }
+
+private:
+    TensorsProvider &base;
+    std::map<std::string, Tensor> overlay;
+};
+};
+
+std::map<std::string, Tensor> GEMM_W4A4::quantizePlainWeight(TensorsProvider &provider) {
+    const std::string prefix = getPrefix();
+    if (provider.contains(prefix + "qweight") || !provider.contains(prefix + "weight")) {
+        return {};
+    }
+
+    Tensor weight = provider.getTensor(prefix + "weight");
+    if (weight.ndims() != 2 || weight.shape[0] != out_features || weight.shape[1] != in_features) {
+        throw std::invalid_argument(spdlog::fmt_lib::format("Weight {} has shape {}, expected [{}, {}]", prefix + "weight", weight.shape.str(), out_features, in_features));
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    W4A4HostQuantized quantized = quantizeW4A4WeightHost(weight, out_features_pad, in_features_pad, use_fp4, dtype);
+    spdlog::debug("Quantized {} to {} on load in {} ms", prefix + "weight", use_fp4 ? "NVFP4" : "INT4",
+        std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count());
+
+    std::map<std::string, Tensor> result = {
+        {prefix + "qweight", quantized.qweight},
+        {prefix + "wscales", quantized.wscales},
+    };
+    if (quantized.wtscale.valid()) {
+        result[prefix + "wtscale"] = quantized.wtscale;
+    }
+    return result;
+}
+
+void GEMM_W4A4::loadParams(TensorsProvider &provider, bool partial) {
+    std::map<std::string, Tensor> overlay = quantizePlainWeight(provider);
+    if (overlay.empty()) {
+        Module::loadParams(provider, partial);
+        return;
+    }
+    TensorsProviderOverlay overlayProvider(provider, std::move(overlay));
+    Module::loadParams(overlayProvider, partial);
+}
+
 void GEMM_W4A4::loadParam(std::string key, Tensor &dst, Tensor src) {
     if (key == "lora_down" || key == "lora_up") {
         assert(src.ndims() == 2);
@@ -172,6 +258,14 @@ void GEMM_W4A4::loadParam(std::string key, Tensor &dst, Tensor src) {
     }
 }
 
+void GEMM_W4A4::bindParam(std::string key, Tensor &dst, Tensor src) {
+    Module::bindParam(key, dst, src);
+    if (key == "lora_down" || key == "lora_up") {
+        this->lora_rank = dst.shape[1];
+        this->lora_scales.resize(ceilDiv(this->lora_rank, 16), 1.0f);
+    }
+}
+
 Tensor GEMM_W4A4::forward(Tensor x) {
     return std::get<Tensor>(this->forward(x, FuseOptions::EMPTY, nullptr));
 }
@@ -185,26 +279,23 @@ std::variant<Tensor, GEMM_W4A4::QuantizedActivation> GEMM_W4A4::forward(Tensor x
 }
 
 void GEMM_W4A4::forward(Tensor x, Tensor out, Tensor pool, Tensor norm_q, Tensor norm_k, Tensor rotary_emb, Tensor out_q, Tensor out_k, Tensor out_v, int numTokens) {
-    QuantizedActivation qact = quantize(x, false);
-
 #if !NO_LORA_FUSION
-
-#if 0
-    Tensor dummy = Tensor::empty_like(qact.lora_act);
-    dummy.zero_();
-
-    gemm_w4a4(qact.act, qweight, out, {}, qact.ascales, wscales, {}, pool, dummy, this->lora_up, {}, {}, norm_q, norm_k, rotary_emb, this->bias, {}, qact.is_unsigned);
-    debug("gemm.nolora.out", out);
-#endif
-
-    kernels::gemm_w4a4(
-        qact.act, qweight, out, {}, qact.ascales, wscales, {}, pool, qact.lora_act, this->lora_up, {}, {}, norm_q, norm_k, rotary_emb, this->bias, {}, {}, {}, qact.is_unsigned, this->lora_scales, false,
-        use_fp4, *this->wtscale.data_ptr<float>(), wcscales.numel() > 0 ? wcscales: Tensor{},
-        out_q, out_k, out_v, numTokens
-    );
-
-    debug("gemm.out", out);
+    GroupedProblem problem;
+    problem.gemm = this;
+    problem.x = x;
+    problem.out = out;
+    problem.pool = pool;
+    problem.norm_q = norm_q;
+    problem.norm_k = norm_k;
+    problem.rotary_emb = rotary_emb;
+    problem.out_q = out_q;
+    problem.out_k = out_k;
+    problem.out_v = out_v;
+    problem.numTokens = numTokens;
+    forward_grouped({problem});
 #else
+    QuantizedActivation qact = quantize(x, false);
+
     const int M = (int)qact.act.numel() / qact.act.shape[-1];
 
     kernels::gemm_w4a4(qact.act, qweight, out, {}, qact.ascales, wscales, {}, pool, {}, {}, {}, {}, norm_q, norm_k, rotary_emb, this->bias, {}, qact.is_unsigned, this->lora_scales);
@@ -233,6 +324,14 @@ void GEMM_W4A4::forward(Tensor x, Tensor out, Tensor pool, Tensor norm_q, Tensor
 }
 
 std::variant<Tensor, GEMM_W4A4::QuantizedActivation> GEMM_W4A4::forward_quant(QuantizedActivation qact, FuseOptions fuse, GEMM_W4A4 *nextGEMM) {
+#if !NO_LORA_FUSION
+    GroupedProblem problem;
+    problem.gemm = this;
+    problem.qact = qact;
+    problem.fuse = fuse;
+    problem.nextGEMM = nextGEMM;
+    return forward_grouped({problem})[0];
+#else
     Tensor out;
     QuantizedActivation qout;
 
@@ -262,39 +361,6 @@ std::variant<Tensor, GEMM_W4A4::QuantizedActivation> GEMM_W4A4::forward_quant(Qu
         next_smooth = nextGEMM->smooth;
     }
 
-#if !NO_LORA_FUSION
-
-#if 0
-    Tensor dummy = Tensor::empty_like(qact.lora_act);
-    dummy.zero_();
-
-    gemm_w4a4(qact.act, qweight, out, qout.act, qact.ascales, wscales, qout.ascales, {}, dummy, this->lora_up, next_lora, qout.lora_act, {}, {}, {}, this->bias, next_smooth, qact.is_unsigned);
-
-    if (fuse == FuseOptions::EMPTY) {
-        debug("gemm.nolora.out", out);
-    } else {
-        debug("gemm.nolora.qout", qout.act);
-        debug("gemm.nolora.oscales", qout.ascales);
-        debug("gemm.nolora.lora_act_out", qout.lora_act);
-    }
-#endif
-
-    kernels::gemm_w4a4(
-        qact.act, qweight, out, qout.act, qact.ascales, wscales, qout.ascales, {}, qact.lora_act, this->lora_up, next_lora, qout.lora_act, {}, {}, {}, this->bias, next_smooth, {}, {}, qact.is_unsigned, this->lora_scales, fuse == FuseOptions::SILU,
-        use_fp4, *this->wtscale.data_ptr<float>(), wcscales.numel() > 0 ? wcscales: Tensor{},
-        {}, {}, {}, 0
-    );
-
-    if (fuse == FuseOptions::EMPTY || fuse == FuseOptions::SILU) {
-        debug("gemm.out", out);
-    } else {
-        debug("gemm.qout", qout.act);
-        debug("gemm.oscales", qout.ascales);
-        debug("gemm.lora_act_out", qout.lora_act);
-    }
-
-    
-#else
     if (!out.valid()) {
         auto shape = TensorShape(qact.act.shape.dataExtent);
         shape[-1] = out_features;
@@ -349,18 +415,124 @@ std::variant<Tensor, GEMM_W4A4::QuantizedActivation> GEMM_W4A4::forward_quant(Qu
         nvtxRangePop();
     }
 
-#endif
     if (out.valid()) {
         return out;
     }
     return qout;
+#endif
 }
 
 Tensor GEMM_W4A4::forward_quant(QuantizedActivation qact) {
     return std::get<Tensor>(this->forward_quant(qact, FuseOptions::EMPTY, nullptr));
 }
 
-GEMM_W4A4::QuantizedActivation GEMM_W4A4::quantize(Tensor x, bool fuse_glu) {
+kernels::GemmW4A4Args GEMM_W4A4::prepareForward(const GroupedProblem &problem, QuantizedActivation qact, std::variant<Tensor, QuantizedActivation> &result) {
+    kernels::GemmW4A4Args args;
+    args.act = qact.act;
+    args.wgt = qweight;
+    args.ascales = qact.ascales;
+    args.wscales = wscales;
+    args.lora_act_in = qact.lora_act;
+    args.lora_up = this->lora_up;
+    args.bias = this->bias;
+    args.act_unsigned = qact.is_unsigned;
+    args.lora_scales = this->lora_scales;
+    args.fp4 = use_fp4;
+    args.alpha = *this->wtscale.data_ptr<float>();
+    args.wcscales = wcscales.numel() > 0 ? wcscales : Tensor{};
+
+    if (problem.out.valid() || problem.out_q.valid()) {
+        args.out = problem.out;
+        args.poolout = problem.pool;
+        args.norm_q = problem.norm_q;
+        args.norm_k = problem.norm_k;
+        args.rotary_emb = problem.rotary_emb;
+        args.out_q = problem.out_q;
+        args.out_k = problem.out_k;
+        args.out_v = problem.out_v;
+        args.attn_tokens = problem.numTokens;
+        result = problem.out;
+    } else if (problem.fuse == FuseOptions::EMPTY || problem.fuse == FuseOptions::SILU) {
+        auto shape = TensorShape(qact.actShape.dataExtent);
+        shape[-1] = out_features;
+        args.out = Tensor::allocate(shape, dtype, device);
+        args.fuse_silu = problem.fuse == FuseOptions::SILU;
+        result = args.out;
+    } else {
+        const int M = (int)qact.act.numel() / qact.act.shape[-1];
+
+        QuantizedActivation qout;
+        qout.act = Tensor::allocate({M, out_features_pad / 2}, Tensor::INT8, device);
+        if (use_fp4) {
+            qout.ascales = Tensor::allocate({out_features_pad / 16, M}, Tensor::FP8_E4M3, device);
+        } else {
+            qout.ascales = Tensor::allocate({out_features_pad / 64, M}, dtype, device);
+        }
+        qout.lora_act = Tensor::allocate({M, lora_rank}, Tensor::FP32, device);
+        qout.is_unsigned = !use_fp4;
+        qout.actShape = qact.actShape;
+
+        args.qout = qout.act;
+        args.oscales = qout.ascales;
+        args.lora_down = problem.nextGEMM->lora_down;
+        args.lora_act_out = qout.lora_act;
+        args.smooth_factor = problem.nextGEMM->smooth;
+        result = qout;
+    }
+    return args;
+}
+
+std::vector<std::variant<Tensor, GEMM_W4A4::QuantizedActivation>> GEMM_W4A4::forward_grouped(std::vector<GroupedProblem> problems) {
+    std::vector<std::variant<Tensor, QuantizedActivation>> results(problems.size());
+
+#if !NO_LORA_FUSION
+    std::vector<kernels::GemmW4A4Args> args;
+    for (size_t i = 0; i < problems.size(); i++) {
+        GroupedProblem &problem = problems[i];
+        QuantizedActivation qact = problem.gemm->quantizeInput(problem);
+        args.push_back(problem.gemm->prepareForward(problem, qact, results[i]));
+    }
+
+    kernels::gemm_w4a4_grouped(args);
+
+    for (size_t i = 0; i < problems.size(); i++) {
+        GEMM_W4A4 *gemm = problems[i].gemm;
+        if (auto *out = std::get_if<Tensor>(&results[i])) {
+            gemm->debug("gemm.out", *out);
+        } else {
+            auto &&qout = std::get<QuantizedActivation>(results[i]);
+            gemm->debug("gemm.qout", qout.act);
+            gemm->debug("gemm.oscales", qout.ascales);
+            gemm->debug("gemm.lora_act_out", qout.lora_act);
+        }
+    }
+#else
+    for (size_t i = 0; i < problems.size(); i++) {
+        GroupedProblem &problem = problems[i];
+        if (problem.out.valid() || problem.out_q.valid()) {
+            problem.gemm->forward(problem.x, problem.out, problem.pool, problem.norm_q, problem.norm_k, problem.rotary_emb, problem.out_q, problem.out_k, problem.out_v, problem.numTokens);
+            results[i] = problem.out;
+        } else {
+            QuantizedActivation qact = problem.gemm->quantizeInput(problem);
+            results[i] = problem.gemm->forward_quant(qact, problem.fuse, problem.nextGEMM);
+        }
+    }
+#endif
+
+    return results;
+}
+
+GEMM_W4A4::QuantizedActivation GEMM_W4A4::quantizeInput(const GroupedProblem &problem) {
+    if (problem.qact.act.valid()) {
+        return problem.qact;
+    }
+    if (problem.modulation.scale.valid()) {
+        return quantize_norm(problem.x, problem.modulation);
+    }
+    return quantize(problem.x, false);
+}
+
+GEMM_W4A4::QuantizedActivation GEMM_W4A4::allocateQuantized(Tensor x) {
     const int actualM = x.numel() / x.shape[-1];
     const int M = ceilDiv(actualM, 256) * 256;
 
@@ -377,6 +549,23 @@ GEMM_W4A4::QuantizedActivation GEMM_W4A4::quantize(Tensor x, bool fuse_glu) {
     qact.lora_act = Tensor::allocate({M, lora_rank}, Tensor::FP32, device);
     qact.is_unsigned = false;
     qact.actShape = x.shape.dataExtent;
+    return qact;
+}
+
+GEMM_W4A4::QuantizedActivation GEMM_W4A4::quantize_norm(Tensor x, const Modulation &mod) {
+    QuantizedActivation qact = allocateQuantized(x);
+
+    debug("quantize_norm.x", x);
+    kernels::quantize_w4a4_act_fuse_norm(x, mod.scale, mod.shift, mod.eps, qact.act, qact.ascales, this->lora_down, qact.lora_act, this->smooth, use_fp4);
+
+    debug("quantize.qact", qact.act);
+    debug("quantize.ascales", qact.ascales);
+    debug("quantize.lora_act", qact.lora_act);
+    return qact;
+}
+
+GEMM_W4A4::QuantizedActivation GEMM_W4A4::quantize(Tensor x, bool fuse_glu) {
+    QuantizedActivation qact = allocateQuantized(x);
 
 #if !NO_LORA_FUSION
     debug("quantize.x", x);
@@ -388,6 +577,7 @@ GEMM_W4A4::QuantizedActivation GEMM_W4A4::quantize(Tensor x, bool fuse_glu) {
     debug("quantize.ascales", qact.ascales);
     debug("quantize.lora_act", qact.lora_act);
 #else 
+    const int M = qact.act.shape[0];
     static const half one = 1.0;
     static const half zero = 0.0;
 
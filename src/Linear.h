@@ -4,6 +4,10 @@
 #include "Tensor.h"
 #include "Module.h"
 
+namespace nunchaku::kernels {
+struct GemmW4A4Args;
+}
+
 class GEMM_F16 : public Module {
 public:
     GEMM_F16(int in_features, int out_features, bool use_bias, Tensor::ScalarType dtype, Device device);
@@ -27,8 +31,12 @@ public:
 
 protected:
     virtual void loadParam(std::string key, Tensor &dst, Tensor src) override;
+    virtual void bindParam(std::string key, Tensor &dst, Tensor src) override;
 
 public:
+    // rows of x one call of the CUDA kernel computes
+    static constexpr int GEMV_MAX_M = 7;
+
     const int in_features;
     const int out_features;
     const int group_size;
@@ -63,6 +71,13 @@ public:
         bool is_unsigned = false;
         TensorShape actShape;
     };
+    // LayerNorm (without affine) of the input followed by the AdaLN modulation x * scale + shift,
+    // applied by quantize_norm in the same pass as the quantization; scale / shift are [dim] or [batch, dim]
+    struct Modulation {
+        Tensor scale;
+        Tensor shift;
+        float eps = 0;
+    };
 
 public:
     GEMM_W4A4(int in_features, int out_features, bool bias, bool use_fp4, Tensor::ScalarType dtype, Device device);
@@ -77,8 +92,35 @@ public:
     std::variant<Tensor, QuantizedActivation> forward_quant(QuantizedActivation qact, FuseOptions fuse, GEMM_W4A4 *nextGEMM = nullptr);
     Tensor forward_quant(QuantizedActivation qact);
 
+    // one problem of forward_grouped: x (or qact when already quantized) through gemm, with the outputs of
+    // forward_quant(qact, fuse, nextGEMM), or with the attention epilogue of forward(x, out, ...) when out or out_q is set
+    // with modulation.scale set, x is the input of the norm and quantize_norm(x, modulation) gives the activation
+    struct GroupedProblem {
+        GEMM_W4A4 *gemm = nullptr;
+        Tensor x;
+        Modulation modulation;
+        QuantizedActivation qact;
+        FuseOptions fuse = FuseOptions::EMPTY;
+        GEMM_W4A4 *nextGEMM = nullptr;
+
+        Tensor out, pool, norm_q, norm_k, rotary_emb;
+        Tensor out_q, out_k, out_v;
+        int numTokens = 0;
+    };
+    // runs the GEMMs of independent problems together (see kernels::gemm_w4a4_grouped), e.g. the image and text
+    // projections of a joint block; returns the output of each problem, out for the attention epilogue
+    static std::vector<std::variant<Tensor, QuantizedActivation>> forward_grouped(std::vector<GroupedProblem> problems);
+
 public:
     QuantizedActivation quantize(Tensor x, bool fuse_glu);
+    // quantize(LayerNorm(x) * mod.scale + mod.shift) without writing the normalized activation, CPU only
+    QuantizedActivation quantize_norm(Tensor x, const Modulation &mod);
+
+    // accepts a plain FP16 / BF16 `weight` in place of qweight / wscales and quantizes it on the host
+    // the weight is the input of quantize_w4a4_wgt, i.e. smoothed with the low-rank branch subtracted
+    virtual void loadParams(TensorsProvider &provider, bool partial = false) override;
+    // the params quantized from the plain `weight` of provider by full name, empty if it holds qweight or no weight
+    std::map<std::string, Tensor> quantizePlainWeight(TensorsProvider &provider);
 
 public:
     const int in_features;
@@ -95,6 +137,14 @@ public:
 
 protected:
     virtual void loadParam(std::string key, Tensor &dst, Tensor src) override;
+    virtual void bindParam(std::string key, Tensor &dst, Tensor src) override;
+
+    QuantizedActivation allocateQuantized(Tensor x);
+    // the quantized input of a problem: qact, or x quantized (through the norm when modulation is set)
+    QuantizedActivation quantizeInput(const GroupedProblem &problem);
+
+    // allocates the outputs of the problem into result and returns the gemm_w4a4 call that writes them
+    nunchaku::kernels::GemmW4A4Args prepareForward(const GroupedProblem &problem, QuantizedActivation qact, std::variant<Tensor, QuantizedActivation> &result);
 
 public:
     Tensor qweight;
@@ -0,0 +1,92 @@
+#include "LoraSlot.h"
+#include "Linear.h"
+#include "layernorm.h"
+
+bool LoraSlot::isSlotParam(Module *module, const std::string &key) {
+    if (key == "lora_down" || key == "lora_up") {
+        return true;
+    }
+    // the vectors a LoRA changes, see fuse_vectors in nunchaku/lora/flux/nunchaku_converter.py
+    if (key == "bias") {
+        return dynamic_cast<GEMM_W4A4 *>(module) || dynamic_cast<GEMV_AWQ *>(module);
+    }
+    return key == "weight" && dynamic_cast<RMSNorm *>(module);
+}
+
+LoraSlot::LoraSlot(Module &root, bool onDevice) : onDevice(onDevice), memoryStats(root.memoryStats) {
+    constexpr size_t alignment = 256;
+
+    std::vector<Tensor> sources;
+    root.traverse([&](Module *m) {
+        if (auto *gemm = dynamic_cast<GEMM_W4A4 *>(m)) {
+            loraScales.emplace_back(gemm, gemm->lora_scales);
+        } else if (auto *gemv = dynamic_cast<GEMV_AWQ *>(m)) {
+            loraScale.emplace_back(gemv, gemv->lora_scale);
+        }
+        for (auto &&[key, param] : m->params) {
+            // the device tensor of an offloaded param may be released, its source holds the value
+            const bool offloaded = m->isOffloaded(param);
+            const Tensor &tensor = offloaded ? param.lazyInfo.src : *param.tensor;
+            const Device paramDevice = offloaded ? param.lazyInfo.device : tensor.device();
+            if (!tensor.valid() || paramDevice.type != Device::CUDA || !isSlotParam(m, key)) {
+                continue;
+            }
+            assert(tensor.is_contiguous());
+            // kept in the type of the param, the source of an offloaded param may be cast on load
+            const Tensor::ScalarType type = offloaded ? param.lazyInfo.type : tensor.scalar_type();
+            entries.push_back(Entry{m, key, TensorShape(tensor.shape.dataExtent), type, totalBytes});
+            sources.push_back(tensor);
+            totalBytes += ceilDiv(tensor.numel() * Tensor::scalarSize.at(type), alignment) * alignment;
+            device = paramDevice;
+        }
+    });
+
+    if (entries.empty()) {
+        return;
+    }
+
+    MemoryScope scope(memoryStats, MemoryKind::Lora);
+    if (onDevice) {
+        storage = Tensor::allocate({(int)totalBytes}, Tensor::INT8, device);
+    } else {
+        storage.buffer = std::make_shared<BufferHost>(totalBytes);
+        storage.buffer->track(memoryStats, MemoryKind::Lora, MemoryTier::PinnedHost);
+        storage.scalarType = Tensor::INT8;
+        storage.shape = TensorShape({(int)totalBytes});
+    }
+
+    for (size_t i = 0; i < entries.size(); i++) {
+        const Entry &entry = entries[i];
+        Tensor view = Tensor::allocate_view(entry.shape, entry.type, storage.buffer, entry.offset);
+        entry.module->loadParam(entry.key, view, sources[i]);
+    }
+
+    spdlog::debug("LoRA slot: {} tensors, {} MiB in {} memory", entries.size(), totalBytes / 1048576, onDevice ? "device" : "pinned host");
+}
+
+void LoraSlot::activate(Tensor &arena) {
+    if (!entries.empty()) {
+        bindEntries(arena);
+    }
+    // after binding, which resizes lora_scales to the rank of the slot
+    for (auto &&[gemm, scales] : loraScales) {
+        gemm->lora_scales = scales;
+    }
+    for (auto &&[gemv, scale] : loraScale) {
+        gemv->lora_scale = scale;
+    }
+}
+
+void LoraSlot::bindEntries(Tensor &arena) {
+    if (!arena.valid() || arena.buffer->getSize() < totalBytes) {
+        // params still bound to the old arena keep it alive until they are rebound below
+        MemoryScope scope(memoryStats, MemoryKind::Lora);
+        arena = Tensor::allocate({(int)totalBytes}, Tensor::INT8, device);
+    }
+
+    Tensor::allocate_view({(int)totalBytes}, Tensor::INT8, arena.buffer).copy_(storage);
+
+    for (auto &&entry : entries) {
+        entry.module->replaceParam(entry.key, Tensor::allocate_view(entry.shape, entry.type, arena.buffer, entry.offset));
+    }
+}
@@ -0,0 +1,49 @@
+#pragma once
+
+#include "common.h"
+#include "Tensor.h"
+#include "Module.h"
+
+class GEMM_W4A4;
+class GEMV_AWQ;
+
+// Snapshot of the params touched by loading a LoRA (lora_down / lora_up, the biases of the linear layers and the
+// weights of the q / k norms) kept in the final packed layout so that switching back to it needs no conversion, and of
+// the LoRA scales set by setLoraScale
+// activation copies the whole snapshot into a reused device arena with one memcpy and binds params to views into it
+class LoraSlot {
+public:
+    // onDevice: keep the snapshot in device memory instead of pinned host memory
+    LoraSlot(Module &root, bool onDevice);
+
+    // arena is grown if needed and reused between activations
+    void activate(Tensor &arena);
+
+    size_t size() const {
+        return totalBytes;
+    }
+
+public:
+    const bool onDevice;
+
+private:
+    static bool isSlotParam(Module *module, const std::string &key);
+    void bindEntries(Tensor &arena);
+
+private:
+    struct Entry {
+        Module *module;
+        std::string key;
+        TensorShape shape;
+        Tensor::ScalarType type;
+        size_t offset;
+    };
+    std::vector<Entry> entries;
+    std::vector<std::pair<GEMM_W4A4 *, std::vector<float>>> loraScales;
+    std::vector<std::pair<GEMV_AWQ *, float>> loraScale;
+    size_t totalBytes = 0;
+    Device device;
+    std::shared_ptr<MemoryStats> memoryStats;
+
+    Tensor storage;
+};
@@ -0,0 +1,113 @@
+#pragma once
+
+#include "common.h"
+
+#include <atomic>
+
+enum class MemoryKind : int {
+    Param = 0,
+    Lora,
+    Activation,
+    COUNT,
+};
+
+enum class MemoryTier : int {
+    Device = 0,
+    PinnedHost,
+    Host,
+    COUNT,
+};
+
+// live and peak bytes of one module, split by kind and tier
+// counters are atomics so that buffers may be freed from any thread
+struct MemoryStats {
+    struct Counter {
+        std::atomic<int64_t> live = 0;
+        std::atomic<int64_t> peak = 0;
+    };
+    Counter counters[(int)MemoryKind::COUNT][(int)MemoryTier::COUNT];
+
+    Counter &at(MemoryKind kind, MemoryTier tier) {
+        return counters[(int)kind][(int)tier];
+    }
+
+    void add(MemoryKind kind, MemoryTier tier, int64_t bytes) {
+        Counter &c = at(kind, tier);
+        const int64_t live = c.live.fetch_add(bytes, std::memory_order_relaxed) + bytes;
+        int64_t peak = c.peak.load(std::memory_order_relaxed);
+        while (live > peak && !c.peak.compare_exchange_weak(peak, live, std::memory_order_relaxed)) {}
+    }
+    void sub(MemoryKind kind, MemoryTier tier, int64_t bytes) {
+        at(kind, tier).live.fetch_sub(bytes, std::memory_order_relaxed);
+    }
+    void resetPeak() {
+        for (auto &&row : counters) {
+            for (auto &&c : row) {
+                c.peak = c.live.load();
+            }
+        }
+    }
+    bool empty() const {
+        for (auto &&row : counters) {
+            for (auto &&c : row) {
+                if (c.peak.load(std::memory_order_relaxed) != 0) {
+                    return false;
+                }
+            }
+        }
+        return true;
+    }
+
+    static const char *name(MemoryKind kind) {
+        static const char *names[] = { "param", "lora", "activation" };
+        return names[(int)kind];
+    }
+    static const char *name(MemoryTier tier) {
+        static const char *names[] = { "device", "pinned", "host" };
+        return names[(int)tier];
+    }
+
+    // allocations made outside of any MemoryScope
+    static std::shared_ptr<MemoryStats> unscoped() {
+        static std::shared_ptr<MemoryStats> inst = std::make_shared<MemoryStats>();
+        return inst;
+    }
+
+    // NUNCHAKU_MEMORY_STATS=0 disables tracking
+    static bool enabled() {
+        static const bool val = []() {
+            const char *env = getenv("NUNCHAKU_MEMORY_STATS");
+            return !(env && std::string(env) == "0");
+        }();
+        return val;
+    }
+};
+
+// tags allocations made by Tensor::allocate on this thread with a module and kind
+class MemoryScope {
+public:
+    MemoryScope(std::shared_ptr<MemoryStats> stats, MemoryKind kind = MemoryKind::Activation) {
+        stack.push_back(Entry{std::move(stats), kind});
+    }
+    MemoryScope(const MemoryScope &) = delete;
+    MemoryScope(MemoryScope &&) = delete;
+
+    ~MemoryScope() {
+        stack.pop_back();
+    }
+
+    static const std::shared_ptr<MemoryStats> &currentStats() {
+        static const std::shared_ptr<MemoryStats> fallback = MemoryStats::unscoped();
+        return stack.empty() ? fallback : stack.back().stats;
+    }
+    static MemoryKind currentKind() {
+        return stack.empty() ? MemoryKind::Activation : stack.back().kind;
+    }
+
+private:
+    struct Entry {
+        std::shared_ptr<MemoryStats> stats;
+        MemoryKind kind;
+    };
+    static inline thread_local std::vector<Entry> stack;
+};
@@ -17,3 +17,60 @@ void Module::copyWithCast(Tensor dst, Tensor src) {
         nunchaku::kernels::cast(tmp, dst);
     }
 }
+
+ResidentLayerPlan selectResidentLayers(const std::vector<size_t> &bytes, const std::vector<float> &value, size_t budget, const std::vector<bool> &required) {
+    assert(bytes.size() == value.size());
+    assert(required.empty() || required.size() == bytes.size());
+
+    const int numLayers = bytes.size();
+
+    ResidentLayerPlan plan;
+    plan.resident.resize(numLayers, false);
+
+    size_t remaining = budget;
+    for (int i = 0; i < numLayers; i++) {
+        if (!required.empty() && required[i]) {
+            plan.resident[i] = true;
+            remaining -= std::min(remaining, bytes[i]);
+        }
+    }
+
+    // round sizes up to units so that the table stays small, the selection never exceeds the budget
+    constexpr size_t maxUnits = 16384;
+    const size_t unit = std::max<size_t>(1 << 20, ceilDiv(remaining, maxUnits));
+    const int capacity = remaining / unit;
+
+    std::vector<float> best(capacity + 1, 0.0f);
+    std::vector<std::vector<bool>> taken(numLayers, std::vector<bool>(capacity + 1, false));
+    for (int i = 0; i < numLayers; i++) {
+        if (plan.resident[i] || value[i] <= 0) {
+            continue;
+        }
+        const size_t w = ceilDiv(bytes[i], unit);
+        if (w > (size_t)capacity) {
+            continue;
+        }
+        for (int c = capacity; c >= (int)w; c--) {
+            if (best[c - w] + value[i] > best[c]) {
+                best[c] = best[c - w] + value[i];
+                taken[i][c] = true;
+            }
+        }
+    }
+    for (int i = numLayers - 1, c = capacity; i >= 0; i--) {
+        if (taken[i][c]) {
+            plan.resident[i] = true;
+            plan.savedTime += value[i];
+            c -= ceilDiv(bytes[i], unit);
+        }
+    }
+
+    for (int i = 0; i < numLayers; i++) {
+        if (plan.resident[i]) {
+            plan.residentBytes += bytes[i];
+        } else {
+            plan.transferBytes += bytes[i];
+        }
+    }
+    return plan;
+}
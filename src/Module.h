@@ -4,7 +4,15 @@
 #include "Tensor.h"
 #include "debug.h"
 
+// content hash of a tensor, covers dtype, shape and data
+uint64_t hashTensor(const Tensor &tensor);
+
 class Module {
+    // stages params into shadow storage and swaps them in, see WeightUpdate.h
+    friend class WeightUpdate;
+    // snapshots the values of params, see LoraSlot.h
+    friend class LoraSlot;
+
 protected:
     enum class ParamFlags : int {
         None = 0,
@@ -23,6 +31,7 @@ protected:
         ParamFlags flags = ParamFlags::None;
 
         TensorLazyLoadInfo lazyInfo;
+        uint64_t srcHash = 0;   // hashTensor of the source loaded last, 0 if unknown
     };
 
     friend inline ParamFlags operator|(ParamFlags lhs, ParamFlags rhs) {
@@ -74,6 +83,13 @@ public:
                 }
                 throw std::runtime_error(spdlog::fmt_lib::format("Tensor {} not found", prefix + key));
             }
+            // compared by WeightUpdate, the loaded param may differ from its source (casts, lora padding)
+            // only full checkpoint loads pay for the hash, params changed by partial loads (LoRA) count as changed
+            param.srcHash = partial ? 0 : hashTensor(src);
+            // keep tracking src of params that were lazy before, they may be offloaded again
+            if (checkFlag(param.flags, ParamFlags::LazyLoad) && param.lazyInfo.src.valid()) {
+                param.lazyInfo.src = src;
+            }
             if (enabledLazyLoad && checkFlag(param.flags, ParamFlags::LazyLoad)) {
                 param.lazyInfo.src = src;
                 if (!param.tensor->valid()) {
@@ -81,6 +97,7 @@ public:
                 }
                 // keep loading params if param is not released
             } 
+            MemoryScope scope(memoryStats, paramMemoryKind(key));
             this->loadParam(key, *param.tensor, src);
             // tensor->copy_(src);
         }
@@ -105,6 +122,7 @@ public:
                 if (dst.valid()) {
                     continue;
                 }
+                MemoryScope scope(m->memoryStats, MemoryKind::Param);
                 dst = Tensor::allocate(lazy.shape, lazy.type, lazy.device);
 
                 if (!src.valid() && !checkFlag(param.flags, ParamFlags::Optional)) {
@@ -126,6 +144,21 @@ public:
             }
         });
     }
+    // bytes moved by loadLazyParams(), includeResident to also count params that could be made lazy
+    size_t getLazyParamsBytes(bool includeResident = false) {
+        size_t bytes = 0;
+        traverse([&bytes, includeResident](Module *m) {
+            if (!m->enabledLazyLoad && !includeResident) {
+                return;
+            }
+            for (auto &&[key, param] : m->params) {
+                if (checkFlag(param.flags, ParamFlags::LazyLoad)) {
+                    bytes += param.lazyInfo.shape.size() * Tensor::scalarSize.at(param.lazyInfo.type);
+                }
+            }
+        });
+        return bytes;
+    }
     void setLazyLoad(bool val) {
         traverse([val](Module *m) {
             m->enabledLazyLoad = val;
@@ -137,6 +170,30 @@ public:
         });
     }
 
+    // offloaded params are released after use and reloaded from lazyInfo.src, which then holds their value
+    bool isOffloaded(const Param &param) const {
+        return enabledLazyLoad && checkFlag(param.flags, ParamFlags::LazyLoad);
+    }
+
+    // make a param refer to an existing tensor (e.g. a view into staged storage) instead of copying into it
+    // an offloaded param takes it as its source instead, a loaded copy is refreshed from it
+    void replaceParam(const std::string &key, Tensor src) {
+        Param &param = params.at(key);
+        param.srcHash = 0;
+        // keep tracking src of params that were lazy before, they may be offloaded again
+        if (checkFlag(param.flags, ParamFlags::LazyLoad) && param.lazyInfo.src.valid()) {
+            param.lazyInfo.src = src;
+        }
+        if (isOffloaded(param)) {
+            param.lazyInfo.src = src;
+            if (param.tensor->valid()) {
+                this->loadParam(key, *param.tensor, src);
+            }
+            return;
+        }
+        this->bindParam(key, *param.tensor, src);
+    }
+
 protected:
     virtual void loadParam(std::string key, Tensor &dst, Tensor src) {
         static const std::set<Tensor::ScalarType> whitelist = {
@@ -150,6 +207,10 @@ protected:
         }
     }
 
+    virtual void bindParam(std::string key, Tensor &dst, Tensor src) {
+        dst = src;
+    }
+
     struct ChildrenRegisterHelper {
         ChildrenRegisterHelper(Module &self) : self(self) {}
         Module &self;
@@ -173,6 +234,9 @@ protected:
     };
     ParamsRegisterHelper registerParams(Tensor &param, std::string name, ParamFlags flags = ParamFlags::None) {
         if (param.valid()) {
+            // params are allocated before the module is known
+            param.buffer->track(memoryStats, paramMemoryKind(name));
+
             params[name].tensor = &param;
             params[name].flags = flags;
 
@@ -186,6 +250,10 @@ protected:
         return ParamsRegisterHelper(*this);
     }
 
+    static MemoryKind paramMemoryKind(const std::string &key) {
+        return key.starts_with("lora_") ? MemoryKind::Lora : MemoryKind::Param;
+    }
+
     void debug(std::string name, Tensor tensor) {
         if (DebugContext::ctxs.empty() || !tensor.valid()) {
             return;
@@ -211,32 +279,205 @@ public:
 
     bool enabledLazyLoad = false;
     bool enabledAutoCastFP16 = true;
+
+    // memory allocated for this module, shared with its buffers which may outlive it
+    std::shared_ptr<MemoryStats> memoryStats = std::make_shared<MemoryStats>();
+};
+
+struct LayerOffloadConfig {
+    int prefetchDepth = 1;      // number of layers loaded ahead of the layer being computed
+    bool adaptive = false;      // size the window from timings of the previous run and the memory budget
+    int maxPrefetchDepth = 2;   // upper bound for adaptive sizing (1 = double buffering, 2 = triple buffering)
+    size_t memoryBudget = 0;    // bytes available to prefetched layers, 0 to use free device memory
+
+    // NUNCHAKU_OFFLOAD_PREFETCH_DEPTH=auto enables adaptive sizing, an integer fixes the depth
+    static LayerOffloadConfig fromEnv() {
+        LayerOffloadConfig config;
+        if (char *env = getenv("NUNCHAKU_OFFLOAD_PREFETCH_DEPTH")) {
+            std::string val(env);
+            if (val == "auto") {
+                config.adaptive = true;
+            } else if (!val.empty()) {
+                config.prefetchDepth = std::max(1, std::stoi(val));
+            }
+        }
+        return config;
+    }
+};
+
+struct LayerOffloadStats {
+    int prefetchDepth = 0;
+    std::vector<float> loadTime;    // ms spent on the load stream for each layer
+    std::vector<float> computeTime; // ms spent on the compute stream for each layer
+    std::vector<float> stallTime;   // ms the compute stream waited for each layer to arrive
+    float totalTime = 0;
+
+    bool valid() const {
+        return !computeTime.empty();
+    }
+    float totalStallTime() const {
+        float sum = 0;
+        for (float t : stallTime) {
+            sum += t;
+        }
+        return sum;
+    }
+};
+
+struct ResidentLayerPlan {
+    std::vector<bool> resident;
+    size_t residentBytes = 0;
+    size_t transferBytes = 0;   // bytes loaded to device per step
+    float savedTime = 0;        // estimated ms of load time removed per step
+};
+
+// 0/1 knapsack over (bytes, value) of each layer, layers marked in `required` are always resident
+ResidentLayerPlan selectResidentLayers(const std::vector<size_t> &bytes, const std::vector<float> &value, size_t budget, const std::vector<bool> &required = {});
+
+// stream / event primitives used by the offload scheduler
+// OffloadSimulator provides a mock implementation to replay the schedule on CPU
+struct CUDAOffloadBackend {
+    using Stream = CUDAStreamWrapper;
+    using Event = CUDAEventWrapper;
+
+    struct StreamContext : public CUDAStreamContext {
+        StreamContext(CUDAOffloadBackend &, Stream &stream) : CUDAStreamContext(stream.stream) {}
+    };
+
+    std::unique_ptr<Stream> createStream() {
+        return std::make_unique<Stream>();
+    }
+    std::unique_ptr<Event> recordEvent() {
+        auto event = std::make_unique<Event>();
+        checkCUDA(cudaEventRecord(event->event, getCurrentCUDAStream()));
+        return event;
+    }
+    void waitEvent(Event *event) {
+        checkCUDA(cudaStreamWaitEvent(getCurrentCUDAStream(), event->event));
+    }
+    void flush() {
+        cudaStreamQuery(getCurrentCUDAStream());
+    }
+    void synchronize(Event *event) {
+        checkCUDA(cudaEventSynchronize(event->event));
+    }
+    bool query(Event *event) {
+        const cudaError_t result = cudaEventQuery(event->event);
+        if (result == cudaErrorNotReady) {
+            return false;
+        }
+        checkCUDA(result);
+        return true;
+    }
+    float elapsedTime(Event *start, Event *end) {
+        float ms;
+        checkCUDA(cudaEventElapsedTime(&ms, start->event, end->event));
+        return ms;
+    }
+    size_t freeMemory() {
+        size_t freeMem, totalMem;
+        checkCUDA(cudaMemGetInfo(&freeMem, &totalMem));
+        return freeMem;
+    }
+};
+
+// the events recorded by an offloaded run, read into LayerOffloadStats later: reading them right after the run
+// would block the host until the device has finished the last layer
+template<typename Backend>
+struct BasicLayerOffloadTimings {
+    using Event = typename Backend::Event;
+
+    Backend backend;
+    int prefetchDepth = 0;
+    std::vector<std::unique_ptr<Event>> eventWaitStart, eventComputeStart, eventComputeDone;
+    std::vector<std::unique_ptr<Event>> eventLoadStart, eventLoadDone;
+
+    bool valid() const {
+        return !eventComputeDone.empty();
+    }
+    // the run has finished on the device, read() would not block
+    bool ready() {
+        return backend.query(eventComputeDone.back().get());
+    }
+
+    LayerOffloadStats read() {
+        backend.synchronize(eventComputeDone.back().get());
+
+        auto elapsed = [this](const std::unique_ptr<Event> &start, const std::unique_ptr<Event> &end) {
+            if (!start || !end) {
+                return 0.0f;
+            }
+            return backend.elapsedTime(start.get(), end.get());
+        };
+
+        const int numLayers = eventComputeDone.size();
+        LayerOffloadStats stats;
+        stats.prefetchDepth = prefetchDepth;
+        stats.loadTime.resize(numLayers);
+        stats.computeTime.resize(numLayers);
+        stats.stallTime.resize(numLayers);
+        for (int i = 0; i < numLayers; i++) {
+            stats.loadTime[i] = elapsed(eventLoadStart[i], eventLoadDone[i]);
+            stats.computeTime[i] = elapsed(eventComputeStart[i], eventComputeDone[i]);
+            stats.stallTime[i] = elapsed(eventWaitStart[i], eventComputeStart[i]);
+        }
+        stats.totalTime = elapsed(eventWaitStart.front(), eventComputeDone.back());
+        return stats;
+    }
 };
 
-struct LayerOffloadHelper {
+template<typename Backend>
+struct BasicLayerOffloadHelper {
     using func_t = std::function<void(int)>;
+    using func_size_t = std::function<size_t(int)>;
+    using Stream = typename Backend::Stream;
+    using Event = typename Backend::Event;
 
     const bool offload;
     const int numLayers;
 
     func_t funcCompute, funcLoad, funcUnload;
 
-    std::unique_ptr<CUDAStreamWrapper> streamCompute;
-    std::unique_ptr<CUDAStreamWrapper> streamLoad;
-    std::unique_ptr<CUDAEventWrapper> eventComputeDone;
-    std::unique_ptr<CUDAEventWrapper> eventLoadDone;
+    LayerOffloadConfig config;
+    func_size_t funcLayerBytes;     // optional, bytes transferred when loading a layer
+    BasicLayerOffloadTimings<Backend> timings;  // filled after run() when offloading
+
+    Backend backend;
+    std::unique_ptr<Stream> streamCompute;
+    std::unique_ptr<Stream> streamLoad;
 
-    LayerOffloadHelper(bool offload, int numLayers, func_t funcCompute, func_t funcLoad, func_t funcUnload) 
-        : offload(offload), numLayers(numLayers), funcCompute(funcCompute), funcLoad(funcLoad), funcUnload(funcUnload) 
+    BasicLayerOffloadHelper(bool offload, int numLayers, func_t funcCompute, func_t funcLoad, func_t funcUnload) 
+        : BasicLayerOffloadHelper(offload, numLayers, funcCompute, funcLoad, funcUnload, LayerOffloadConfig{}) {}
+
+    BasicLayerOffloadHelper(bool offload, int numLayers, func_t funcCompute, func_t funcLoad, func_t funcUnload, 
+                            LayerOffloadConfig config, const LayerOffloadStats *lastStats = nullptr, func_size_t funcLayerBytes = nullptr,
+                            std::optional<bool> workaround = std::nullopt, Backend backend = Backend{}) 
+        : offload(offload), numLayers(numLayers), funcCompute(funcCompute), funcLoad(funcLoad), funcUnload(funcUnload), 
+          config(config), funcLayerBytes(funcLayerBytes), backend(std::move(backend))
     {
         if (offload) {
-            streamCompute = std::make_unique<CUDAStreamWrapper>();
-            streamLoad = std::make_unique<CUDAStreamWrapper>();
+            streamCompute = this->backend.createStream();
+            streamLoad = this->backend.createStream();
 
-            needWorkaround = checkWorkaround();
+            needWorkaround = workaround.has_value() ? *workaround : checkWorkaround();
             if (needWorkaround) {
                 spdlog::debug("Offloading helper: use WDDM workaround");
             }
+
+            if (funcLayerBytes) {
+                for (int i = 0; i < numLayers; i++) {
+                    layerBytes.push_back(funcLayerBytes(i));
+                }
+            }
+
+            prefetchDepth = choosePrefetchDepth(lastStats);
+            spdlog::debug("Offloading helper: prefetch depth {}", prefetchDepth);
+
+            eventWaitStart.resize(numLayers);
+            eventComputeStart.resize(numLayers);
+            eventComputeDone.resize(numLayers);
+            eventLoadStart.resize(numLayers);
+            eventLoadDone.resize(numLayers);
         }
     }
 
@@ -244,55 +485,117 @@ struct LayerOffloadHelper {
         for (int i = 0; i < numLayers; i++) {
             run(i);
         }
-        waitEvent(eventComputeDone.get());
+        if (offload) {
+            waitEvent(eventComputeDone.back().get());
+        }
         funcUnload(numLayers - 1);
+
+        if (offload) {
+            timings.backend = backend;
+            timings.prefetchDepth = prefetchDepth;
+            timings.eventWaitStart = std::move(eventWaitStart);
+            timings.eventComputeStart = std::move(eventComputeStart);
+            timings.eventComputeDone = std::move(eventComputeDone);
+            timings.eventLoadStart = std::move(eventLoadStart);
+            timings.eventLoadDone = std::move(eventLoadDone);
+        }
+    }
+
+    // pick the number of layers to keep in flight
+    // a load of layer L + k is issued when layer L - 1 finishes, so it is hidden if it takes less than ~k layers of compute
+    static int choosePrefetchDepth(const LayerOffloadConfig &config, const LayerOffloadStats *lastStats, int numLayers, size_t maxLayerBytes, size_t budget) {
+        int depth = std::max(1, config.prefetchDepth);
+        if (config.adaptive && lastStats && lastStats->valid()) {
+            float maxLoad = 0, sumCompute = 0;
+            for (float t : lastStats->loadTime) {
+                maxLoad = std::max(maxLoad, t);
+            }
+            for (float t : lastStats->computeTime) {
+                sumCompute += t;
+            }
+            const float avgCompute = sumCompute / lastStats->computeTime.size();
+            depth = avgCompute > 0 ? (int)std::ceil(maxLoad / avgCompute) : config.maxPrefetchDepth;
+            depth = std::clamp(depth, 1, std::max(1, config.maxPrefetchDepth));
+        }
+        if (config.adaptive && maxLayerBytes > 0) {
+            depth = std::min<int>(depth, std::max<size_t>(1, budget / maxLayerBytes));
+        }
+        return std::clamp(depth, 1, std::max(1, numLayers - 1));
     }
 
 private:
+    int choosePrefetchDepth(const LayerOffloadStats *lastStats) {
+        size_t maxLayerBytes = 0;
+        size_t budget = config.memoryBudget;
+        if (config.adaptive && !layerBytes.empty()) {
+            for (size_t bytes : layerBytes) {
+                maxLayerBytes = std::max(maxLayerBytes, bytes);
+            }
+            if (budget == 0) {
+                budget = backend.freeMemory();
+            }
+        }
+        return choosePrefetchDepth(config, lastStats, numLayers, maxLayerBytes, budget);
+    }
+
     void run(int layer) {
         if (!offload) {
             funcCompute(layer);
         } else {
-            std::unique_ptr<CUDAEventWrapper> nextComputeDone, nextLoadDone;
-
             // issue compute kernels first so that we could still overlap compute and memcpy if memory is not pinned
             {
-                CUDAStreamContext ctx(streamCompute->stream);
-                waitEvent(eventLoadDone.get());
+                typename Backend::StreamContext ctx(backend, *streamCompute);
+                eventWaitStart[layer] = backend.recordEvent();
+                waitEvent(eventLoadDone[layer].get());
+                eventComputeStart[layer] = backend.recordEvent();
                 funcCompute(layer);
-                nextComputeDone = std::make_unique<CUDAEventWrapper>();
-                checkCUDA(cudaEventRecord(nextComputeDone->event, getCurrentCUDAStream()));
+                eventComputeDone[layer] = backend.recordEvent();
                 workaroundFlush();
             }
 
             {
-                CUDAStreamContext ctx(streamLoad->stream);
-                waitEvent(eventComputeDone.get());
+                typename Backend::StreamContext ctx(backend, *streamLoad);
+                if (layer > 0) {
+                    waitEvent(eventComputeDone[layer - 1].get());
+                }
                 if (layer - 1 > 0) {
                     funcUnload(layer - 1);
                 }
-                if (layer + 1 < numLayers) {
-                    funcLoad(layer + 1);
+                // layer 0 stays resident, keep the next prefetchDepth offloaded layers in flight
+                // resident layers (0 bytes) load instantly and do not count towards the window
+                int lastLoad = layer;
+                for (int inFlight = 0; lastLoad + 1 < numLayers && inFlight < prefetchDepth; ) {
+                    lastLoad++;
+                    if (layerBytes.empty() || layerBytes[lastLoad] > 0) {
+                        inFlight++;
+                    }
+                }
+                for (; nextLoad <= lastLoad; nextLoad++) {
+                    eventLoadStart[nextLoad] = backend.recordEvent();
+                    funcLoad(nextLoad);
+                    eventLoadDone[nextLoad] = backend.recordEvent();
                 }
-                nextLoadDone = std::make_unique<CUDAEventWrapper>();
-                checkCUDA(cudaEventRecord(nextLoadDone->event, getCurrentCUDAStream()));
                 workaroundFlush();
             }
 
-            eventComputeDone = std::move(nextComputeDone);
-            eventLoadDone = std::move(nextLoadDone);
-
-            workaroundSynchronize();
+            workaroundSynchronize(layer);
         }
     }
 
-    static void waitEvent(CUDAEventWrapper *event) {
+    void waitEvent(Event *event) {
         if (!event) {
             return;
         }
-        checkCUDA(cudaStreamWaitEvent(getCurrentCUDAStream(), event->event));
+        backend.waitEvent(event);
     }
 
+    int prefetchDepth = 1;
+    int nextLoad = 1;
+    std::vector<size_t> layerBytes;
+
+    std::vector<std::unique_ptr<Event>> eventWaitStart, eventComputeStart, eventComputeDone;
+    std::vector<std::unique_ptr<Event>> eventLoadStart, eventLoadDone;
+
     // WDDM prevents multiple streams run concurrently
     // use flush and synchronize to work around
     bool needWorkaround;
@@ -315,12 +618,15 @@ private:
         if (!needWorkaround) {
             return;
         }
-        cudaStreamQuery(getCurrentCUDAStream());
+        backend.flush();
     }
-    void workaroundSynchronize() {
+    void workaroundSynchronize(int layer) {
         if (!needWorkaround) {
             return;
         }
-        checkCUDA(cudaEventSynchronize(eventComputeDone->event));
+        backend.synchronize(eventComputeDone[layer].get());
     }
-};
\ No newline at end of file
+};
+
+using LayerOffloadHelper = BasicLayerOffloadHelper<CUDAOffloadBackend>;
+using LayerOffloadTimings = BasicLayerOffloadTimings<CUDAOffloadBackend>;
@@ -0,0 +1,102 @@
+#include "OffloadSimulator.h"
+
+OffloadSimulator::OffloadSimulator(OffloadSimParams params) : params(std::move(params)), numLayers(this->params.computeTime.size()) {
+    if (this->params.layerBytes.size() != this->params.computeTime.size()) {
+        throw std::invalid_argument(spdlog::fmt_lib::format("Offload simulator: got {} compute times but {} layer sizes", this->params.computeTime.size(), this->params.layerBytes.size()));
+    }
+    if (!this->params.resident.empty() && (int)this->params.resident.size() != numLayers) {
+        throw std::invalid_argument(spdlog::fmt_lib::format("Offload simulator: resident set has {} entries, expected {}", this->params.resident.size(), numLayers));
+    }
+    if (numLayers < 1 || this->params.linkBandwidth <= 0) {
+        throw std::invalid_argument("Offload simulator: need at least one layer and a positive link bandwidth");
+    }
+}
+
+double OffloadSimulator::submit(double duration) {
+    Stream &stream = currentStream();
+    double start = std::max(stream.ready, hostTime);
+    const bool serialized = params.wddm && !params.workaround;
+    if (serialized) {
+        start = std::max(start, deviceReady);
+    }
+    stream.ready = start + duration;
+    deviceReady = std::max(deviceReady, stream.ready);
+    return start;
+}
+
+size_t OffloadSimulator::freeMemory() const {
+    const size_t used = params.baseMemory + residentBytes;
+    return params.deviceMemory > used ? params.deviceMemory - used : 0;
+}
+
+OffloadSimResult OffloadSimulator::run(const LayerOffloadStats *lastStats) {
+    OffloadSimResult result;
+
+    // LayerOffloadHelper never loads the first layer
+    auto isResident = [&](int layer) {
+        return layer == 0 || (!params.resident.empty() && params.resident[layer]);
+    };
+
+    residentBytes = 0;
+    for (int i = 0; i < numLayers; i++) {
+        if (isResident(i)) {
+            residentBytes += params.layerBytes[i];
+        }
+    }
+
+    streams = { &defaultStream };
+
+    auto compute = [&](int layer) {
+        hostTime += params.hostLaunchTime;
+        submit(params.computeTime[layer]);
+    };
+    auto load = [&](int layer) {
+        if (isResident(layer)) {
+            return;
+        }
+        const size_t bytes = params.layerBytes[layer];
+        double duration = bytes / params.linkBandwidth * 1e3;
+        if (params.diskBandwidth > 0) {
+            duration += bytes / params.diskBandwidth * 1e3;
+        }
+        // stream-ordered allocation is taken when the copy starts
+        const double start = submit(duration);
+        memoryEvents.emplace_back(start, (int64_t)bytes);
+        result.transferBytes += bytes;
+    };
+    auto unload = [&](int layer) {
+        if (isResident(layer)) {
+            return;
+        }
+        memoryEvents.emplace_back(currentStream().ready, -(int64_t)params.layerBytes[layer]);
+    };
+    auto layerBytes = [&](int layer) -> size_t {
+        return isResident(layer) ? 0 : params.layerBytes[layer];
+    };
+
+    BasicLayerOffloadHelper<Backend> helper(true, numLayers, compute, load, unload, params.config, lastStats, layerBytes, params.workaround, Backend{this});
+    helper.run();
+
+    // frees before allocations at the same timestamp, the allocator reuses memory released earlier on the stream
+    std::sort(memoryEvents.begin(), memoryEvents.end());
+    int64_t current = 0, peak = 0;
+    for (auto &&[time, delta] : memoryEvents) {
+        current += delta;
+        peak = std::max(peak, current);
+    }
+
+    result.latency = std::max(defaultStream.ready, hostTime);
+    result.peakMemory = params.baseMemory + residentBytes + peak;
+    // read after the latency is taken, like the model the host does not wait for the timings
+    result.stats = helper.timings.read();
+    return result;
+}
+
+OffloadSimResult simulateOffload(const OffloadSimParams &params) {
+    OffloadSimResult result = OffloadSimulator(params).run();
+    if (params.config.adaptive) {
+        // adaptive sizing uses the timings of the previous step
+        result = OffloadSimulator(params).run(&result.stats);
+    }
+    return result;
+}
@@ -0,0 +1,113 @@
+#pragma once
+
+#include "common.h"
+#include "Module.h"
+
+// Discrete-event model of layer offloading
+// replays the LayerOffloadHelper schedule on CPU using recorded per-layer compute times and weight sizes
+struct OffloadSimParams {
+    std::vector<float> computeTime;     // ms per layer, e.g. LayerOffloadStats::computeTime of a real run
+    std::vector<size_t> layerBytes;     // bytes of offloadable weights per layer
+    std::vector<bool> resident;         // layers kept on device, empty to keep only layer 0 as FluxModel does
+
+    double linkBandwidth = 25e9;        // host to device bytes/s
+    double diskBandwidth = 0;           // bytes/s when lazy weights are read from disk on every load, 0 if they stay in host memory
+    float hostLaunchTime = 0.05f;       // ms of host time to submit the kernels of one layer
+
+    bool wddm = false;                  // driver does not run the two streams concurrently
+    bool workaround = false;            // flush and synchronize every layer (NUNCHAKU_OFFLOAD_WDDM_WORKAROUND)
+
+    LayerOffloadConfig config;
+    size_t deviceMemory = 0;            // total device memory, used when config.memoryBudget is 0
+    size_t baseMemory = 0;              // memory used outside offloaded weights, e.g. activations
+};
+
+struct OffloadSimResult {
+    float latency = 0;                  // ms from the first layer to the end of the last one
+    size_t peakMemory = 0;              // bytes
+    size_t transferBytes = 0;           // host to device bytes per step
+    LayerOffloadStats stats;
+};
+
+class OffloadSimulator {
+public:
+    struct Stream {
+        double ready = 0;   // time when all work queued on this stream completes
+    };
+    struct Event {
+        double time = 0;
+    };
+
+    // mock of CUDAOffloadBackend for BasicLayerOffloadHelper
+    struct Backend {
+        using Stream = OffloadSimulator::Stream;
+        using Event = OffloadSimulator::Event;
+
+        struct StreamContext {
+            StreamContext(Backend &backend, Stream &stream) : sim(backend.sim) {
+                sim->streams.push_back(&stream);
+            }
+            StreamContext(const StreamContext &) = delete;
+            StreamContext(StreamContext &&) = delete;
+            ~StreamContext() {
+                sim->streams.pop_back();
+            }
+            OffloadSimulator *sim;
+        };
+
+        std::unique_ptr<Stream> createStream() {
+            return std::make_unique<Stream>();
+        }
+        std::unique_ptr<Event> recordEvent() {
+            auto event = std::make_unique<Event>();
+            event->time = sim->currentStream().ready;
+            return event;
+        }
+        void waitEvent(Event *event) {
+            Stream &stream = sim->currentStream();
+            stream.ready = std::max(stream.ready, event->time);
+        }
+        void flush() {}
+        void synchronize(Event *event) {
+            sim->hostTime = std::max(sim->hostTime, event->time);
+        }
+        bool query(Event *event) {
+            return sim->hostTime >= event->time;
+        }
+        float elapsedTime(Event *start, Event *end) {
+            return float(end->time - start->time);
+        }
+        size_t freeMemory() {
+            return sim->freeMemory();
+        }
+
+        OffloadSimulator *sim = nullptr;
+    };
+
+public:
+    explicit OffloadSimulator(OffloadSimParams params);
+
+    OffloadSimResult run(const LayerOffloadStats *lastStats = nullptr);
+
+private:
+    Stream &currentStream() {
+        return *streams.back();
+    }
+    // queue work of `duration` ms on the current stream
+    double submit(double duration);
+    size_t freeMemory() const;
+
+private:
+    const OffloadSimParams params;
+    const int numLayers;
+
+    double hostTime = 0;
+    double deviceReady = 0;             // serializes all streams in WDDM mode without the workaround
+    Stream defaultStream;
+    std::vector<Stream *> streams;
+
+    size_t residentBytes = 0;
+    std::vector<std::pair<double, int64_t>> memoryEvents;
+};
+
+OffloadSimResult simulateOffload(const OffloadSimParams &params);
@@ -35,7 +35,8 @@ Tensor SanaLinearAttention::forward(Tensor x, Tensor out) {
     assert(x.ndims() == 3);
     const int batch_size = x.shape[0];
     const int num_tokens = x.shape[1];
-    const int num_tokens_pad = ceilDiv(num_tokens, 256) * 256;
+    // the CPU GEMM pads the rows itself and leaves them out of vk, the CUDA epilogue needs whole tiles per batch item
+    const int num_tokens_pad = x.device().type == Device::CPU ? num_tokens : ceilDiv(num_tokens, 256) * 256;
     assert(x.shape[2] == dim);
 
     const int num_heads = dim_pad / HEAD_DIM;
@@ -232,6 +233,7 @@ SanaLinearTransformerBlock::SanaLinearTransformerBlock(int hidden_size, int inte
 Tensor SanaLinearTransformerBlock::forward(Tensor hidden_states, Tensor encoder_hidden_states, Tensor timestep, Tensor cu_seqlens_img, Tensor cu_seqlens_txt, int H, int W, bool pag, bool cfg) {
 
     nvtxRangePushA("SanaLinearTransformerBlock");
+    MemoryScope memoryScope(memoryStats);
 
     nvtxRangePushA("chunk");
 
@@ -329,6 +331,8 @@ SanaModel::SanaModel(SanaConfig config, Tensor::ScalarType dtype, Device device)
 }
 
 Tensor SanaModel::forward(Tensor hidden_states, Tensor encoder_hidden_states, Tensor timestep, Tensor cu_seqlens_img, Tensor cu_seqlens_txt, int H, int W, bool pag, bool cfg, bool skip_first_layer) {
+    MemoryScope memoryScope(memoryStats);
+
     for (int i = (skip_first_layer ? 1 : 0); i < config.num_layers; i++) {
         auto &&block = transformer_blocks[i];
         hidden_states = block->forward(
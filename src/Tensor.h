@@ -1,6 +1,9 @@
 #pragma once
 
 #include "common.h"
+#include "MemoryStats.h"
+
+#include <mutex>
 
 struct Device {
     enum Type {
@@ -22,7 +25,30 @@ struct Device {
 // template<bool readonly>
 class Buffer : public std::enable_shared_from_this<Buffer> {
 public:
-    virtual ~Buffer() {}
+    virtual ~Buffer() {
+        untrack();
+    }
+
+    // account this buffer to a module, replacing any previous owner
+    void track(std::shared_ptr<MemoryStats> stats, MemoryKind kind, MemoryTier tier) {
+        untrack();
+        if (!stats || !MemoryStats::enabled()) {
+            return;
+        }
+        trackedStats = std::move(stats);
+        trackedKind = kind;
+        trackedTier = tier;
+        trackedStats->add(kind, tier, size);
+    }
+    void track(std::shared_ptr<MemoryStats> stats, MemoryKind kind) {
+        track(std::move(stats), kind, trackedStats ? trackedTier : (device.type == Device::CUDA ? MemoryTier::Device : MemoryTier::Host));
+    }
+    void untrack() {
+        if (trackedStats) {
+            trackedStats->sub(trackedKind, trackedTier, size);
+            trackedStats.reset();
+        }
+    }
     
     void *getPtr() { return ptr; }
 
@@ -36,6 +62,36 @@ public:
         return false;
     }
 
+    // counts the writes through Tensor::copy_ / zero_ (and rebinds of the memory), see derived()
+    uint64_t getVersion() const { return version; }
+    void bumpVersion() { version++; }
+
+    // data a host kernel computed from the contents of this buffer (e.g. a packed weight expanded for the CPU GEMM),
+    // built by build() on first use and kept until the buffer is released or written again
+    // `key` names the derivation and the part of the buffer it reads; writes that bypass copy_ are not noticed
+    template<typename T, typename F>
+    std::shared_ptr<const T> derived(const std::string &key, F &&build) {
+        uint64_t seen;
+        {
+            std::lock_guard lock(derivedMutex);
+            if (derivedVersion != version) {
+                derivedData.clear();
+                derivedVersion = version;
+            }
+            if (auto it = derivedData.find(key); it != derivedData.end()) {
+                return std::static_pointer_cast<const T>(it->second);
+            }
+            seen = derivedVersion;
+        }
+        // built without the lock, callers racing on the same key each build their own
+        std::shared_ptr<const T> result = std::make_shared<const T>(build());
+        std::lock_guard lock(derivedMutex);
+        if (derivedVersion == seen && version == seen) {
+            derivedData.emplace(key, result);
+        }
+        return result;
+    }
+
 protected:
     template <typename Derived>
     std::shared_ptr<Derived> shared_from_base() {
@@ -47,6 +103,16 @@ protected:
     void *ptr;
     size_t size;
     Device device;
+
+private:
+    std::shared_ptr<MemoryStats> trackedStats;
+    MemoryKind trackedKind;
+    MemoryTier trackedTier;
+
+    std::atomic<uint64_t> version = 0;
+    std::mutex derivedMutex;
+    uint64_t derivedVersion = 0;
+    std::map<std::string, std::shared_ptr<const void>> derivedData;
 };
 
 // using Buffer = BufferTemplate<false>;
@@ -214,6 +280,20 @@ struct TensorShape {
 };
 
 
+class Tensor;
+
+// set on a thread while it captures a CPU execution plan (see kernels/cpu_plan.h): host tensors allocated meanwhile come
+// from the capture, which follows their lifetime, and copies between host tensors are recorded as steps of the plan
+class CpuCaptureHooks {
+public:
+    virtual std::shared_ptr<Buffer> allocate(size_t size) = 0;
+    virtual void copy(const Tensor &dst, const Tensor &src) = 0;
+
+    static inline thread_local CpuCaptureHooks *current = nullptr;
+
+protected:
+    ~CpuCaptureHooks() = default;
+};
 
 class Tensor {
 public:
@@ -363,6 +443,7 @@ public:
 
     Tensor &zero_() {
         assert(this->is_contiguous());
+        buffer->bumpVersion();
         checkCUDA(cudaMemsetAsync(data_ptr<char>() + shape.offset * scalar_size(), 0, shape.size() * scalar_size(), getCurrentCUDAStream()));
         return *this;
     }
@@ -378,8 +459,12 @@ public:
         if (shape.size() == 0) {
             return *this;
         }
+        buffer->bumpVersion();
 
         if (this->device().type == Device::CPU && other.device().type == Device::CPU) {
+            if (CpuCaptureHooks::current) {
+                CpuCaptureHooks::current->copy(*this, other);
+            }
             memcpy(
                 data_ptr<char>(), 
                 other.data_ptr<char>(), 
@@ -416,11 +501,14 @@ public:
         Tensor result;
         assert(shape.is_contiguous());
         if (device.type == Device::CPU) {
-            result.buffer = std::make_shared<BufferMalloc>(shape.size() * scalarSize.at(scalarType));
+            const size_t size = shape.size() * scalarSize.at(scalarType);
+            result.buffer = CpuCaptureHooks::current ? CpuCaptureHooks::current->allocate(size) : std::make_shared<BufferMalloc>(size);
+            result.buffer->track(MemoryScope::currentStats(), MemoryScope::currentKind(), MemoryTier::Host);
         } else if (device.type == Device::CUDA) {
             // TODO: cross device allocate
             CUDADeviceContext ctx(device.idx);
             result.buffer = std::make_shared<BufferCUDA>(shape.size() * scalarSize.at(scalarType));
+            result.buffer->track(MemoryScope::currentStats(), MemoryScope::currentKind(), MemoryTier::Device);
         } else {
             assert(false);
         }
@@ -515,7 +603,7 @@ private:
     //     return dynamic_cast<BufferCUDA *>(buffer);
     // }
 
-    static inline std::map<cudaStream_t, std::set<std::shared_ptr<Buffer>>> lockedBuffers;
+    static inline thread_local std::map<cudaStream_t, std::set<std::shared_ptr<Buffer>>> lockedBuffers;
     
 public:
     // before launching an async operation, make sure to lock the buffer in case the buffer is freed before GPU completes
@@ -0,0 +1,600 @@
+#include "WeightQuantizer.h"
+#include "kernels/cpu_common.h"
+
+#include <atomic>
+
+namespace {
+
+using namespace nunchaku::kernels;
+
+constexpr int BLOCK_N = 128;    // WARP_N of the W4A4 kernels, one packed block covers 128 rows
+constexpr int CHUNK_K = 64;     // INSN_K, also the INT4 group size
+constexpr int FP4_GROUP = 16;
+
+constexpr float INT4_MAX = 7.0f;
+constexpr float FP4_MAX = 6.0f;
+constexpr float FP8_MAX = 448.0f;
+
+struct Source {
+    const void *data;
+    Tensor::ScalarType type;
+    int N, K;
+};
+
+// e4m3 (satfinite), as quantize_float4_fp8
+uint8_t floatToE4M3(float v) {
+    if (!(v > 0)) {
+        return 0;
+    }
+    if (v >= FP8_MAX) {
+        return 0x7e;
+    }
+    if (v < 0x1p-6f) {
+        return (uint8_t)std::nearbyint(v * 0x1p9f);
+    }
+    int e;
+    const float m = std::frexp(v, &e);
+    int exp = e - 1 + 7;
+    int mant = (int)std::nearbyint((m * 2 - 1) * 8);
+    if (mant == 8) {
+        mant = 0;
+        exp++;
+    }
+    return (uint8_t)std::min((exp << 3) | mant, 0x7e);
+}
+float e4m3ToFloat(uint8_t v) {
+    const int exp = (v >> 3) & 0xf;
+    const int mant = v & 0x7;
+    return exp == 0 ? std::ldexp((float)mant, -9) : std::ldexp((float)(8 + mant), exp - 10);
+}
+
+// e2m1 (satfinite), as quantize_float2_fp4, ties go to the even code
+uint32_t floatToE2M1(float x) {
+    const float a = std::fabs(x);
+    const uint32_t idx = (a > 0.25f) + (a >= 0.75f) + (a > 1.25f) + (a >= 1.75f) + (a > 2.5f) + (a >= 3.5f) + (a > 5.0f);
+    return idx | (std::signbit(x) && idx ? 8 : 0);
+}
+
+float loadElement(const Source &src, size_t idx) {
+    switch (src.type) {
+    case Tensor::BF16:
+    case Tensor::FP16:
+        return halfToFloat(reinterpret_cast<const uint16_t *>(src.data)[idx], src.type);
+    default:
+        return reinterpret_cast<const float *>(src.data)[idx];
+    }
+}
+
+// 64 consecutive values of row n starting at k0, zero outside of the unpadded weight
+void loadChunk(const Source &src, int n, int k0, float *out) {
+    for (int i = 0; i < CHUNK_K; i++) {
+        const int k = k0 + i;
+        out[i] = n < src.N && k < src.K ? loadElement(src, (size_t)n * src.K + k) : 0.0f;
+    }
+}
+
+float absmax(const float *x, int count) {
+    float amax = 0;
+    for (int i = 0; i < count; i++) {
+        amax = std::max(amax, std::fabs(x[i]));
+    }
+    return amax;
+}
+
+// returns the unrounded scale
+float quantizeChunkInt4(const float *x, uint32_t *words) {
+    const float amax = absmax(x, CHUNK_K);
+    const float rscale = amax > 0 ? INT4_MAX / amax : 0.0f;
+    for (int c = 0; c < CHUNK_K / 8; c++) {
+        uint32_t word = 0;
+        for (int i = 0; i < 8; i++) {
+            float y = x[c * 8 + i] * rscale;
+            y = y >= -8.0f ? std::min(y, 7.0f) : -8.0f;
+            word |= ((uint32_t)(int)std::nearbyint(y) & 0xf) << (4 * i);
+        }
+        words[c] = word;
+    }
+    return amax / INT4_MAX;
+}
+
+// rscale of one FP4 group from its absmax, the block scale is stored as e4m3 relative to wtscale
+float fp4GroupScale(float amax, float wtscale, uint8_t &code) {
+    code = floatToE4M3(amax / FP4_MAX / wtscale);
+    const float scale = e4m3ToFloat(code) * wtscale;
+    return scale > 0 ? 1.0f / scale : 0.0f;
+}
+
+void quantizeChunkFp4(const float *x, float wtscale, uint32_t *words, uint8_t *scales) {
+    for (int g = 0; g < CHUNK_K / FP4_GROUP; g++) {
+        const float rscale = fp4GroupScale(absmax(x + g * FP4_GROUP, FP4_GROUP), wtscale, scales[g]);
+        for (int c = 0; c < FP4_GROUP / 8; c++) {
+            uint32_t word = 0;
+            for (int i = 0; i < 8; i++) {
+                word |= floatToE2M1(x[g * FP4_GROUP + c * 8 + i] * rscale) << (4 * i);
+            }
+            words[g * FP4_GROUP / 8 + c] = word;
+        }
+    }
+}
+
+#if HOST_SIMD
+
+TARGET_AVX2
+void loadChunkAVX2(const Source &src, int n, int k0, float *out) {
+    const size_t offset = (size_t)n * src.K + k0;
+    for (int i = 0; i < CHUNK_K; i += 8) {
+        __m256 v;
+        if (src.type == Tensor::BF16) {
+            __m128i h = _mm_loadu_si128(reinterpret_cast<const __m128i *>(reinterpret_cast<const uint16_t *>(src.data) + offset + i));
+            v = _mm256_castsi256_ps(_mm256_slli_epi32(_mm256_cvtepu16_epi32(h), 16));
+        } else if (src.type == Tensor::FP16) {
+            __m128i h = _mm_loadu_si128(reinterpret_cast<const __m128i *>(reinterpret_cast<const uint16_t *>(src.data) + offset + i));
+            v = _mm256_cvtph_ps(h);
+        } else {
+            v = _mm256_loadu_ps(reinterpret_cast<const float *>(src.data) + offset + i);
+        }
+        _mm256_storeu_ps(out + i, v);
+    }
+}
+
+TARGET_AVX2
+float hmax(__m256 v) {
+    __m128 h = _mm_max_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+    h = _mm_max_ps(h, _mm_movehl_ps(h, h));
+    h = _mm_max_ss(h, _mm_shuffle_ps(h, h, 1));
+    return _mm_cvtss_f32(h);
+}
+
+// 8 nibbles (already masked and shifted into place) => one word
+TARGET_AVX2
+uint32_t hor(__m256i v) {
+    __m128i o = _mm_or_si128(_mm256_castsi256_si128(v), _mm256_extracti128_si256(v, 1));
+    o = _mm_or_si128(o, _mm_shuffle_epi32(o, _MM_SHUFFLE(1, 0, 3, 2)));
+    o = _mm_or_si128(o, _mm_shuffle_epi32(o, _MM_SHUFFLE(2, 3, 0, 1)));
+    return (uint32_t)_mm_cvtsi128_si32(o);
+}
+
+TARGET_AVX2
+__m256 absps(__m256 v) {
+    return _mm256_and_ps(v, _mm256_castsi256_ps(_mm256_set1_epi32(0x7fffffff)));
+}
+
+TARGET_AVX2
+float quantizeChunkInt4AVX2(const float *x, uint32_t *words) {
+    __m256 v[CHUNK_K / 8];
+    __m256 vmax = _mm256_setzero_ps();
+    for (int c = 0; c < CHUNK_K / 8; c++) {
+        v[c] = _mm256_loadu_ps(x + c * 8);
+        vmax = _mm256_max_ps(vmax, absps(v[c]));
+    }
+    const float amax = hmax(vmax);
+    const __m256 rscale = _mm256_set1_ps(amax > 0 ? INT4_MAX / amax : 0.0f);
+
+    const __m256i lo = _mm256_set1_epi32(-8);
+    const __m256i hi = _mm256_set1_epi32(7);
+    const __m256i mask = _mm256_set1_epi32(0xf);
+    const __m256i shifts = _mm256_setr_epi32(0, 4, 8, 12, 16, 20, 24, 28);
+    for (int c = 0; c < CHUNK_K / 8; c++) {
+        // cvtps rounds to nearest even like cvt.rni, NaN becomes INT_MIN and is clamped to -8
+        __m256i q = _mm256_cvtps_epi32(_mm256_mul_ps(v[c], rscale));
+        q = _mm256_min_epi32(_mm256_max_epi32(q, lo), hi);
+        words[c] = hor(_mm256_sllv_epi32(_mm256_and_si256(q, mask), shifts));
+    }
+    return amax / INT4_MAX;
+}
+
+TARGET_AVX2
+void quantizeChunkFp4AVX2(const float *x, float wtscale, uint32_t *words, uint8_t *scales) {
+    const __m256i shifts = _mm256_setr_epi32(0, 4, 8, 12, 16, 20, 24, 28);
+    const __m256i zero = _mm256_setzero_si256();
+
+    for (int g = 0; g < CHUNK_K / FP4_GROUP; g++) {
+        __m256 v[FP4_GROUP / 8];
+        __m256 vmax = _mm256_setzero_ps();
+        for (int c = 0; c < FP4_GROUP / 8; c++) {
+            v[c] = _mm256_loadu_ps(x + g * FP4_GROUP + c * 8);
+            vmax = _mm256_max_ps(vmax, absps(v[c]));
+        }
+        const __m256 rscale = _mm256_set1_ps(fp4GroupScale(hmax(vmax), wtscale, scales[g]));
+
+        for (int c = 0; c < FP4_GROUP / 8; c++) {
+            const __m256 y = _mm256_mul_ps(v[c], rscale);
+            const __m256 a = absps(y);
+            // e2m1 code = number of rounding thresholds below |y|, see floatToE2M1
+            __m256i idx = zero;
+            idx = _mm256_sub_epi32(idx, _mm256_castps_si256(_mm256_cmp_ps(a, _mm256_set1_ps(0.25f), _CMP_GT_OQ)));
+            idx = _mm256_sub_epi32(idx, _mm256_castps_si256(_mm256_cmp_ps(a, _mm256_set1_ps(0.75f), _CMP_GE_OQ)));
+            idx = _mm256_sub_epi32(idx, _mm256_castps_si256(_mm256_cmp_ps(a, _mm256_set1_ps(1.25f), _CMP_GT_OQ)));
+            idx = _mm256_sub_epi32(idx, _mm256_castps_si256(_mm256_cmp_ps(a, _mm256_set1_ps(1.75f), _CMP_GE_OQ)));
+            idx = _mm256_sub_epi32(idx, _mm256_castps_si256(_mm256_cmp_ps(a, _mm256_set1_ps(2.5f), _CMP_GT_OQ)));
+            idx = _mm256_sub_epi32(idx, _mm256_castps_si256(_mm256_cmp_ps(a, _mm256_set1_ps(3.5f), _CMP_GE_OQ)));
+            idx = _mm256_sub_epi32(idx, _mm256_castps_si256(_mm256_cmp_ps(a, _mm256_set1_ps(5.0f), _CMP_GT_OQ)));
+            __m256i sign = _mm256_slli_epi32(_mm256_srli_epi32(_mm256_castps_si256(y), 31), 3);
+            sign = _mm256_and_si256(sign, _mm256_cmpgt_epi32(idx, zero));
+            words[g * FP4_GROUP / 8 + c] = hor(_mm256_sllv_epi32(_mm256_or_si256(idx, sign), shifts));
+        }
+    }
+}
+
+#endif
+
+int getNumThreads(int requested) {
+    if (requested > 0) {
+        return requested;
+    }
+    static const int val = []() {
+        if (const char *env = getenv("NUNCHAKU_QUANTIZE_THREADS")) {
+            return std::max(1, atoi(env));
+        }
+        return nunchaku::kernels::cpuNumThreads();
+    }();
+    return val;
+}
+
+};  // namespace
+
+W4A4HostQuantized quantizeW4A4WeightHost(Tensor weight, int N_pad, int K_pad, bool use_fp4, Tensor::ScalarType scaleType, int numThreads) {
+    if (weight.ndims() != 2) {
+        throw std::invalid_argument(spdlog::fmt_lib::format("Weight to quantize must be 2-D, got {} dims", weight.ndims()));
+    }
+    if (weight.dtype() != Tensor::FP16 && weight.dtype() != Tensor::BF16 && weight.dtype() != Tensor::FP32) {
+        throw std::invalid_argument(spdlog::fmt_lib::format("Unsupported weight dtype {} to quantize", (int)weight.dtype()));
+    }
+    if (!use_fp4 && scaleType != Tensor::FP16 && scaleType != Tensor::BF16) {
+        throw std::invalid_argument(spdlog::fmt_lib::format("Unsupported scale dtype {}", (int)scaleType));
+    }
+    if (N_pad % BLOCK_N != 0 || K_pad % 128 != 0 || weight.shape[0] > N_pad || weight.shape[1] > K_pad) {
+        throw std::invalid_argument(spdlog::fmt_lib::format("Invalid padded shape [{}, {}] for weight [{}, {}]", N_pad, K_pad, weight.shape[0], weight.shape[1]));
+    }
+
+    Tensor host = weight;
+    if (weight.device().type != Device::CPU) {
+        host = weight.copy(Device::cpu());
+        checkCUDA(cudaStreamSynchronize(getCurrentCUDAStream()));
+    }
+    if (!host.is_contiguous()) {
+        throw std::invalid_argument("Weight to quantize must be contiguous");
+    }
+
+    const Source src{host.data_ptr(), host.dtype(), (int)host.shape[0], (int)host.shape[1]};
+    const int KB = K_pad / CHUNK_K;
+    const int numBlocks = N_pad / BLOCK_N;
+    numThreads = getNumThreads(numThreads);
+
+#if HOST_SIMD
+    const bool simd = hasAVX2();
+#else
+    const bool simd = false;
+#endif
+    auto load = [&](int n, int k0, float *out) {
+#if HOST_SIMD
+        if (simd && n < src.N && k0 + CHUNK_K <= src.K) {
+            loadChunkAVX2(src, n, k0, out);
+            return;
+        }
+#endif
+        loadChunk(src, n, k0, out);
+    };
+
+    W4A4HostQuantized result;
+    result.qweight = Tensor::allocate({N_pad, K_pad / 2}, Tensor::INT8, Device::cpu());
+    if (use_fp4) {
+        result.wscales = Tensor::allocate({K_pad / FP4_GROUP, N_pad}, Tensor::FP8_E4M3, Device::cpu());
+        result.wtscale = Tensor::allocate({1}, Tensor::FP32, Device::cpu());
+    } else {
+        result.wscales = Tensor::allocate({K_pad / CHUNK_K, N_pad}, scaleType, Device::cpu());
+    }
+
+    // NVFP4 block scales are e4m3 relative to a per-tensor scale that maps the largest block scale to FP8_MAX
+    float wtscale = 1.0f;
+    if (use_fp4) {
+        std::vector<float> partial(numThreads, 0.0f);
+        std::atomic<int> nextSlot = 0;
+        parallelFor(src.N, numThreads, [&](int begin, int end) {
+            alignas(32) float buf[CHUNK_K];
+            float amax = 0;
+            for (int n = begin; n < end; n++) {
+                for (int k0 = 0; k0 < src.K; k0 += CHUNK_K) {
+                    load(n, k0, buf);
+                    amax = std::max(amax, absmax(buf, CHUNK_K));
+                }
+            }
+            partial[nextSlot++] = amax;
+        });
+        const float amax = *std::max_element(partial.begin(), partial.end());
+        if (amax > 0 && std::isfinite(amax)) {
+            wtscale = amax / (FP4_MAX * FP8_MAX);
+        }
+        *result.wtscale.data_ptr<float>() = wtscale;
+    }
+
+    uint32_t *qweight = result.qweight.data_ptr<uint32_t>();
+    uint8_t *fp8scales = use_fp4 ? result.wscales.data_ptr<uint8_t>() : nullptr;
+    uint16_t *f16scales = use_fp4 ? nullptr : result.wscales.data_ptr<uint16_t>();
+    auto roundScale = [scaleType](float f) { return floatToHalf(f, scaleType); };
+
+    parallelFor(numBlocks, numThreads, [&](int begin, int end) {
+        alignas(32) float buf[CHUNK_K];
+        uint32_t words[CHUNK_K / 8];
+
+        for (int bn = begin; bn < end; bn++) {
+            for (int bk = 0; bk < KB; bk++) {
+                for (int m = 0; m < BLOCK_N; m++) {
+                    const int n = bn * BLOCK_N + m;
+                    load(n, bk * CHUNK_K, buf);
+
+                    if (use_fp4) {
+                        // packed_wmscale_t: lane L holds rows {p * 32 + L % 4 * 8 + L / 4}, 4 groups of 16 per row
+                        const int lane = (m % 8) * 4 + (m % 32) / 8;
+                        uint8_t *scales = &fp8scales[(((size_t)(bn * KB + bk) * 32 + lane) * 4 + m / 32) * 4];
+#if HOST_SIMD
+                        if (simd) {
+                            quantizeChunkFp4AVX2(buf, wtscale, words, scales);
+                        } else
+#endif
+                        quantizeChunkFp4(buf, wtscale, words, scales);
+                    } else {
+                        float scale;
+#if HOST_SIMD
+                        if (simd) {
+                            scale = quantizeChunkInt4AVX2(buf, words);
+                        } else
+#endif
+                        scale = quantizeChunkInt4(buf, words);
+                        // packed_wscale_t: see GEMMBase::WSCALES_PACK_SIZE
+                        const int p = ((m / 16) * 4 + (m % 8) / 2) * 4 + ((m % 16) / 8) * 2 + m % 2;
+                        f16scales[(size_t)(bn * KB + bk) * BLOCK_N + p] = roundScale(scale);
+                    }
+
+                    // packed_wgt_t of quantize_w4a4_wgt_kernel: 16x64 tile per lane group, {x, y, z, w} = rows {0-7, 0-7, 8-15, 8-15} x k {0-31, 32-63, 0-31, 32-63}
+                    const int tile = m / 16;
+                    const int row = m % 16;
+                    const size_t base = ((size_t)(bn * KB + bk) * (BLOCK_N / 16) + tile) * 32;
+                    for (int c = 0; c < CHUNK_K / 8; c++) {
+                        const int lane = (row % 8) * 4 + c % 4;
+                        const int reg = (row / 8) * 2 + c / 4;
+                        qweight[(base + lane) * 4 + reg] = words[c];
+                    }
+                }
+            }
+        }
+    });
+
+    return result;
+}
+
+namespace {
+
+constexpr int WARP_SIZE = 32;
+constexpr int INSN_N = 16;
+constexpr int LORA_TILE = 16;   // 16x16 tile of one packed_lora_wgt fragment
+
+// a task costs more than moving a small LoRA weight, give each thread at least 1 MiB
+int packThreads(size_t bytes, int requested) {
+    return (int)std::clamp<size_t>(bytes >> 20, 1, getNumThreads(requested));
+}
+
+void checkHostTensor(const Tensor &t, const char *name) {
+    if (t.device().type != Device::CPU || !t.is_contiguous()) {
+        throw std::invalid_argument(spdlog::fmt_lib::format("{} must be a contiguous tensor in host memory", name));
+    }
+}
+
+void checkShape(const Tensor &t, std::initializer_list<int> shape, const char *name) {
+    bool ok = t.ndims() == shape.size();
+    std::string expected;
+    for (size_t i = 0; i < shape.size(); i++) {
+        ok = ok && t.shape[i] == shape.begin()[i];
+        expected += (i ? ", " : "") + std::to_string(shape.begin()[i]);
+    }
+    if (!ok) {
+        throw std::invalid_argument(spdlog::fmt_lib::format("{} has shape {}, expected [{}]", name, t.shape.str(), expected));
+    }
+}
+
+void check16Bit(const Tensor &t, const char *name) {
+    if (t.dtype() != Tensor::FP16 && t.dtype() != Tensor::BF16) {
+        throw std::invalid_argument(spdlog::fmt_lib::format("{} must be FP16 or BF16, got dtype {}", name, (int)t.dtype()));
+    }
+}
+
+// packed_lora_wgt_t: the 16x16 tile is stored as [num_n_lanes 8, num_k_lanes 4, n_pack 2, k_pack 2, 2 values]
+// tile position p holds row n and column k of the tile
+inline void loraTilePos(int p, int &n, int &k) {
+    const int nl = p >> 5, kl = (p >> 3) & 3, np = (p >> 2) & 1, kp = (p >> 1) & 1;
+    n = np * 8 + nl;
+    k = (kp * 4 + kl) * 2 + (p & 1);
+}
+
+// moves every element between the linear low-rank weight [rows, cols] and its packed form [C_pad / 16, R_pad / 16] tiles
+template<bool Pack>
+void permuteLowRank(const uint16_t *src, uint16_t *dst, int rows, int cols, int CP, int RP, bool down, int numThreads) {
+    constexpr int TILE_SIZE = LORA_TILE * LORA_TILE;
+    int tileN[TILE_SIZE], tileK[TILE_SIZE];
+    size_t offset[TILE_SIZE];
+    for (int p = 0; p < TILE_SIZE; p++) {
+        loraTilePos(p, tileN[p], tileK[p]);
+        offset[p] = (size_t)tileN[p] * cols + tileK[p];
+    }
+    parallelFor(CP, numThreads, [&](int begin, int end) {
+        for (int cp = begin; cp < end; cp++) {
+            for (int rp = 0; rp < RP; rp++) {
+                uint16_t *packed = Pack ? &dst[((size_t)cp * RP + rp) * TILE_SIZE] : nullptr;
+                const uint16_t *unpacked = Pack ? nullptr : &src[((size_t)cp * RP + rp) * TILE_SIZE];
+                // down: n runs over the rank, k over the input channels; up: n over the output channels, k over the rank
+                const int row0 = (down ? rp : cp) * LORA_TILE;
+                const int col0 = (down ? cp : rp) * LORA_TILE;
+                const size_t base = (size_t)row0 * cols + col0;
+
+                if (!Pack) {
+                    for (int p = 0; p < TILE_SIZE; p++) {
+                        dst[base + offset[p]] = unpacked[p];
+                    }
+                } else if (row0 + LORA_TILE <= rows && col0 + LORA_TILE <= cols) {
+                    for (int p = 0; p < TILE_SIZE; p++) {
+                        packed[p] = src[base + offset[p]];
+                    }
+                } else {
+                    // zero padding of the last tiles
+                    for (int p = 0; p < TILE_SIZE; p++) {
+                        const int row = row0 + tileN[p], col = col0 + tileK[p];
+                        packed[p] = row < rows && col < cols ? src[base + offset[p]] : 0;
+                    }
+                }
+            }
+        }
+    });
+}
+
+};  // namespace
+
+void packWeightHost(Tensor weight, Tensor out, int bits, int numThreads) {
+    checkHostTensor(weight, "weight");
+    checkHostTensor(out, "out");
+    if (weight.ndims() != 2 || weight.dtype() != Tensor::INT32) {
+        throw std::invalid_argument("Weight to pack must be a 2-D INT32 tensor");
+    }
+    if (bits != 4 && bits != 8) {
+        throw std::invalid_argument(spdlog::fmt_lib::format("Unsupported weight bits {}", bits));
+    }
+    const int N = weight.shape[0], K = weight.shape[1];
+    const int insnK = 256 / bits;   // 64 for W4A4, 32 for W8A8
+    const int regK = 32 / bits;     // values per 32-bit register
+    // the kernels unroll two INSN_K steps without a boundary check
+    if (N % BLOCK_N != 0 || K % (insnK * 2) != 0) {
+        throw std::invalid_argument(spdlog::fmt_lib::format("Weight shape [{}, {}] must be a multiple of [{}, {}]", N, K, BLOCK_N, insnK * 2));
+    }
+    checkShape(out, {N, K * bits / 8}, "out");
+
+    const int KT = K / insnK;
+    const int32_t *src = weight.data_ptr<int32_t>();
+    uint32_t *dst = out.data_ptr<uint32_t>();
+    const uint32_t mask = (1u << bits) - 1;
+
+    parallelFor(N / BLOCK_N, packThreads(weight.numel() * 4, numThreads), [&](int begin, int end) {
+        for (int bn = begin; bn < end; bn++) {
+            uint32_t *words = dst + (size_t)bn * KT * BLOCK_N * insnK / regK;
+            for (int bk = 0; bk < KT; bk++) {
+                // packed_wgt_t of one warp: [WARP_N / INSN_N, num_n_lanes 8, num_k_lanes 4, n_pack 2, k_pack 2] registers
+                for (int nt = 0; nt < BLOCK_N / INSN_N; nt++) {
+                    for (int lane = 0; lane < WARP_SIZE; lane++) {
+                        for (int reg = 0; reg < 4; reg++) {
+                            const int n = bn * BLOCK_N + nt * INSN_N + reg / 2 * 8 + lane / 4;
+                            const int k = bk * insnK + ((reg % 2) * 4 + lane % 4) * regK;
+                            const int32_t *values = &src[(size_t)n * K + k];
+                            uint32_t word = 0;
+                            for (int i = 0; i < regK; i++) {
+                                word |= ((uint32_t)values[i] & mask) << (i * bits);
+                            }
+                            *words++ = word;
+                        }
+                    }
+                }
+            }
+        }
+    });
+}
+
+void packScaleHost(Tensor scale, Tensor out, int numThreads) {
+    checkHostTensor(scale, "scale");
+    checkHostTensor(out, "out");
+    check16Bit(scale, "scale");
+    if (scale.ndims() < 1 || scale.shape[0] % BLOCK_N != 0) {
+        throw std::invalid_argument(spdlog::fmt_lib::format("Scale shape {} must have a multiple of {} rows", scale.shape.str(), BLOCK_N));
+    }
+    const int N = scale.shape[0];
+    const int G = scale.numel() / N;
+    checkShape(out, {G, N}, "out");
+    if (out.dtype() != scale.dtype()) {
+        throw std::invalid_argument("Packed scales must have the dtype of the scales");
+    }
+
+    const uint16_t *src = scale.data_ptr<uint16_t>();
+    uint16_t *dst = out.data_ptr<uint16_t>();
+
+    parallelFor(N / BLOCK_N, packThreads(scale.numel() * 2, numThreads), [&](int begin, int end) {
+        for (int bn = begin; bn < end; bn++) {
+            for (int g = 0; g < G; g++) {
+                // packed_wscale_t: see GEMMBase::WSCALES_PACK_SIZE
+                uint16_t *packed = &dst[((size_t)bn * G + g) * BLOCK_N];
+                for (int m = 0; m < BLOCK_N; m++) {
+                    const int p = ((m / 16) * 4 + (m % 8) / 2) * 4 + ((m % 16) / 8) * 2 + m % 2;
+                    packed[p] = src[(size_t)(bn * BLOCK_N + m) * G + g];
+                }
+            }
+        }
+    });
+}
+
+void packMicroScaleHost(Tensor scale, Tensor out, int numThreads) {
+    checkHostTensor(scale, "scale");
+    checkHostTensor(out, "out");
+    check16Bit(scale, "scale");
+    if (scale.ndims() != 2 || scale.shape[0] % BLOCK_N != 0 || scale.shape[1] % (CHUNK_K / FP4_GROUP) != 0) {
+        throw std::invalid_argument(spdlog::fmt_lib::format("Micro scale shape {} must be a multiple of [{}, {}]", scale.shape.str(), BLOCK_N, CHUNK_K / FP4_GROUP));
+    }
+    const int N = scale.shape[0];
+    const int G = scale.shape[1];
+    const int KB = G / (CHUNK_K / FP4_GROUP);
+    checkShape(out, {G, N}, "out");
+    if (out.dtype() != Tensor::FP8_E4M3) {
+        throw std::invalid_argument("Packed micro scales must be FP8_E4M3");
+    }
+
+    const uint16_t *src = scale.data_ptr<uint16_t>();
+    uint8_t *dst = out.data_ptr<uint8_t>();
+    auto toFloat = [dtype = scale.dtype()](uint16_t v) { return halfToFloat(v, dtype); };
+
+    std::atomic<bool> outOfRange = false;
+    parallelFor(N / BLOCK_N, packThreads(scale.numel() * 2, numThreads), [&](int begin, int end) {
+        for (int bn = begin; bn < end; bn++) {
+            for (int m = 0; m < BLOCK_N; m++) {
+                // packed_wmscale_t: lane L holds rows {p * 32 + L % 4 * 8 + L / 4}, 4 groups of 16 per row
+                const int lane = (m % 8) * 4 + (m % 32) / 8;
+                const uint16_t *row = &src[(size_t)(bn * BLOCK_N + m) * G];
+                for (int g = 0; g < G; g++) {
+                    const float v = toFloat(row[g]);
+                    if (!(std::fabs(v) <= FP8_MAX)) {
+                        outOfRange = true;
+                    }
+                    const uint8_t code = floatToE4M3(std::fabs(v)) | (std::signbit(v) ? 0x80 : 0);
+                    dst[(((size_t)(bn * KB + g / 4) * WARP_SIZE + lane) * 4 + m / 32) * 4 + g % 4] = code;
+                }
+            }
+        }
+    });
+    if (outOfRange) {
+        throw std::invalid_argument(spdlog::fmt_lib::format("Micro scales must be within +-{}", FP8_MAX));
+    }
+}
+
+void packLowRankWeightHost(Tensor weight, Tensor out, bool down, int numThreads) {
+    checkHostTensor(weight, "weight");
+    checkHostTensor(out, "out");
+    check16Bit(weight, "weight");
+    if (weight.ndims() != 2 || out.dtype() != weight.dtype()) {
+        throw std::invalid_argument("Low-rank weight must be 2-D and packed to its own dtype");
+    }
+    const int rows = weight.shape[0], cols = weight.shape[1];
+    const int C = down ? cols : rows;
+    const int R = down ? rows : cols;
+    const int CP = ceilDiv(C, LORA_TILE), RP = ceilDiv(R, LORA_TILE);
+    checkShape(out, {CP * LORA_TILE, RP * LORA_TILE}, "out");
+
+    permuteLowRank<true>(weight.data_ptr<uint16_t>(), out.data_ptr<uint16_t>(), rows, cols, CP, RP, down, packThreads(out.numel() * 2, numThreads));
+}
+
+void unpackLowRankWeightHost(Tensor weight, Tensor out, bool down, int numThreads) {
+    checkHostTensor(weight, "weight");
+    checkHostTensor(out, "out");
+    check16Bit(weight, "weight");
+    if (weight.ndims() != 2 || out.dtype() != weight.dtype() || weight.shape[0] % LORA_TILE != 0 || weight.shape[1] % LORA_TILE != 0) {
+        throw std::invalid_argument(spdlog::fmt_lib::format("Packed low-rank weight {} must be 2-D with multiples of {}", weight.shape.str(), LORA_TILE));
+    }
+    const int C = weight.shape[0], R = weight.shape[1];
+    const int rows = down ? R : C;
+    const int cols = down ? C : R;
+    checkShape(out, {rows, cols}, "out");
+
+    permuteLowRank<false>(weight.data_ptr<uint16_t>(), out.data_ptr<uint16_t>(), rows, cols, C / LORA_TILE, R / LORA_TILE, down, packThreads(out.numel() * 2, numThreads));
+}
@@ -0,0 +1,32 @@
+#pragma once
+
+#include "common.h"
+#include "Tensor.h"
+
+// Host implementation of quantize_w4a4_wgt plus the weight / scale packing of the offline converter
+// used to quantize plain FP16 / BF16 checkpoints while loading them
+struct W4A4HostQuantized {
+    Tensor qweight;     // [N_pad, K_pad / 2] INT8
+    Tensor wscales;     // [K_pad / 64, N_pad] of scaleType (INT4) or [K_pad / 16, N_pad] FP8_E4M3 (NVFP4)
+    Tensor wtscale;     // [1] FP32 per-tensor scale, NVFP4 only
+};
+
+// weight: [N, K] FP16 / BF16 / FP32 on any device, zero padded to [N_pad, K_pad] (multiples of 128)
+// numThreads <= 0 uses NUNCHAKU_QUANTIZE_THREADS or all hardware threads
+W4A4HostQuantized quantizeW4A4WeightHost(Tensor weight, int N_pad, int K_pad, bool use_fp4, Tensor::ScalarType scaleType, int numThreads = 0);
+
+// Native counterparts of NunchakuWeightPacker in nunchaku/lora/flux/packer.py for tensors in host memory
+// each output element is written once straight from the source, no intermediate permuted copies
+// tile constants follow GEMMBase in gemm_base.cuh: WARP_N = 128, INSN_N = 16, INSN_K = 256 / bits, WARP_SIZE = 32
+// outputs are preallocated, numThreads <= 0 uses NUNCHAKU_QUANTIZE_THREADS or all hardware threads
+
+// weight: [N, K] INT32 holding one 4 / 8 bit value per element => packed_wgt_t out [N, K * bits / 8] INT8
+void packWeightHost(Tensor weight, Tensor out, int bits, int numThreads = 0);
+// scale: [N, G] FP16 / BF16 per-group (or [N] per-channel) scales => packed_wscale_t out [G, N] (stored as [N / 128, G, 128])
+void packScaleHost(Tensor scale, Tensor out, int numThreads = 0);
+// scale: [N, K / 16] FP16 / BF16 within +-448 => packed_wmscale_t out [K / 16, N] FP8_E4M3
+void packMicroScaleHost(Tensor scale, Tensor out, int numThreads = 0);
+// down: [R, C] => out [C_pad, R_pad]; up: [C, R] => out [C_pad, R_pad]; zero padded to multiples of 16
+void packLowRankWeightHost(Tensor weight, Tensor out, bool down, int numThreads = 0);
+// inverse of packLowRankWeightHost, weight: [C, R] => out [R, C] (down) or [C, R] (up)
+void unpackLowRankWeightHost(Tensor weight, Tensor out, bool down, int numThreads = 0);
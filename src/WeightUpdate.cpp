@@ -0,0 +1,155 @@
+#include "WeightUpdate.h"
+#include "Linear.h"
+
+static uint64_t mix(uint64_t h, uint64_t v) {
+    h = (h ^ v) * 0x9E3779B97F4A7C15ull;
+    return h ^ (h >> 29);
+}
+
+uint64_t hashTensor(const Tensor &tensor) {
+    if (!tensor.valid()) {
+        return 0;
+    }
+
+    Tensor host = tensor;
+    if (tensor.device().type != Device::CPU) {
+        host = tensor.copy(Device::cpu());
+        checkCUDA(cudaStreamSynchronize(getCurrentCUDAStream()));
+    }
+    assert(host.is_contiguous());
+
+    const uint8_t *data = host.data_ptr<uint8_t>();
+    const size_t size = host.numel() * host.scalar_size();
+
+    // 4 independent lanes to keep the multiplies pipelined
+    uint64_t h[4] = { 0x243F6A8885A308D3ull, 0x13198A2E03707344ull, 0xA4093822299F31D0ull, 0x082EFA98EC4E6C89ull };
+    size_t i = 0;
+    for (; i + 32 <= size; i += 32) {
+        for (int lane = 0; lane < 4; lane++) {
+            uint64_t v;
+            memcpy(&v, data + i + lane * 8, 8);
+            h[lane] = mix(h[lane], v);
+        }
+    }
+    uint64_t tail = 0;
+    for (; i < size; i++) {
+        tail = (tail << 8) | data[i];
+        if (i % 8 == 7) {
+            h[0] = mix(h[0], tail);
+            tail = 0;
+        }
+    }
+
+    uint64_t result = mix(mix(h[0], h[1]), mix(h[2], h[3]));
+    result = mix(result, tail);
+    result = mix(result, (uint64_t)host.scalar_type());
+    for (int dim : host.shape.dataExtent) {
+        result = mix(result, (uint64_t)dim);
+    }
+    return result;
+}
+
+WeightUpdate::WeightUpdate(Module &root, std::shared_ptr<TensorsProvider> provider, int deviceId)
+    : root(root), provider(std::move(provider)), deviceId(deviceId)
+{
+    thread = std::thread([this]() {
+        try {
+            stage();
+        } catch (...) {
+            error = std::current_exception();
+        }
+        done = true;
+    });
+}
+
+WeightUpdate::~WeightUpdate() {
+    if (thread.joinable()) {
+        thread.join();
+    }
+}
+
+void WeightUpdate::stage() {
+    CUDADeviceContext ctx(deviceId);
+    CUDAStreamWrapper stream;
+    CUDAStreamContext streamCtx(stream.stream);
+
+    spdlog::info("Staging weight update in background");
+
+    root.traverse([&](Module *m) {
+        const std::string prefix = m->getPrefix();
+        // a plain weight of a W4A4 layer is quantized as GEMM_W4A4::loadParams does, then compared as qweight
+        std::map<std::string, Tensor> quantized;
+        if (auto *gemm = dynamic_cast<GEMM_W4A4 *>(m)) {
+            quantized = gemm->quantizePlainWeight(*provider);
+        }
+        for (auto &&[key, param] : m->params) {
+            const std::string name = prefix + key;
+            Tensor src;
+            if (quantized.contains(name)) {
+                src = quantized.at(name);
+            } else if (provider->contains(name)) {
+                src = provider->getTensor(name);
+            } else {
+                continue;
+            }
+
+            // offloaded params are reloaded from their source on every use, only the source needs replacing
+            const bool lazy = m->enabledLazyLoad && Module::checkFlag(param.flags, Module::ParamFlags::LazyLoad);
+
+            const uint64_t hash = hashTensor(src);
+            if (param.srcHash != 0 && hash == param.srcHash) {
+                result.numUnchanged++;
+                continue;
+            }
+            result.numChanged++;
+            result.changedBytes += src.numel() * src.scalar_size();
+
+            if (lazy) {
+                staged.push_back(Staged{m, key, Tensor{}, src, hash, true});
+                continue;
+            }
+
+            // lora params may change rank, take the new shape here so that loadParam does not touch the live module
+            const Tensor &current = *param.tensor;
+            TensorShape shape = current.ndims() == src.ndims() ? src.shape.dataExtent : current.shape.dataExtent;
+            MemoryScope scope(m->memoryStats, Module::paramMemoryKind(key));
+            Tensor shadow = Tensor::allocate(shape, current.scalar_type(), current.device());
+            m->loadParam(key, shadow, src);
+            staged.push_back(Staged{m, key, shadow, src, hash, false});
+        }
+    });
+
+    checkCUDA(cudaStreamSynchronize(stream.stream));
+    Tensor::unlockBuffers(stream.stream);
+
+    spdlog::info("Weight update staged: {} changed ({} MiB), {} unchanged", result.numChanged, result.changedBytes / 1048576, result.numUnchanged);
+}
+
+WeightUpdate::Result WeightUpdate::commit() {
+    if (thread.joinable()) {
+        thread.join();
+    }
+    if (error) {
+        std::rethrow_exception(error);
+    }
+
+    for (auto &&item : staged) {
+        Module::Param &param = item.module->params.at(item.key);
+        if (item.lazy) {
+            param.lazyInfo.src = item.src;
+            if (param.tensor->valid()) {
+                item.module->loadParam(item.key, *param.tensor, item.src);
+            }
+        } else {
+            // a resident param may be offloaded later, it then reloads from the new source
+            if (Module::checkFlag(param.flags, Module::ParamFlags::LazyLoad) && param.lazyInfo.src.valid()) {
+                param.lazyInfo.src = item.src;
+            }
+            item.module->bindParam(item.key, *param.tensor, item.shadow);
+        }
+        param.srcHash = item.hash;
+    }
+    staged.clear();
+
+    return result;
+}
@@ -0,0 +1,58 @@
+#pragma once
+
+#include "common.h"
+#include "Tensor.h"
+#include "Module.h"
+
+#include <thread>
+#include <atomic>
+
+// Double-buffered weight update
+// params whose source hash changed are loaded into shadow storage on a background thread and stream
+// while forwards keep using the current weights, commit() then swaps them in between two forwards
+class WeightUpdate {
+public:
+    struct Result {
+        int numChanged = 0;
+        int numUnchanged = 0;
+        size_t changedBytes = 0;
+    };
+
+    // params are compared by the source hash recorded when they were loaded, params without one count as changed
+    WeightUpdate(Module &root, std::shared_ptr<TensorsProvider> provider, int deviceId);
+    WeightUpdate(const WeightUpdate &) = delete;
+    WeightUpdate(WeightUpdate &&) = delete;
+    ~WeightUpdate();
+
+    bool ready() const {
+        return done.load();
+    }
+
+    // wait for staging to finish and bind the staged params, must not run concurrently with a forward
+    // the replaced storage is released asynchronously on the current stream
+    Result commit();
+
+private:
+    void stage();
+
+private:
+    struct Staged {
+        Module *module;
+        std::string key;
+        Tensor shadow;  // new device storage, invalid for lazy params which only get a new source
+        Tensor src;
+        uint64_t hash;
+        bool lazy;
+    };
+
+    Module &root;
+    std::shared_ptr<TensorsProvider> provider;
+    const int deviceId;
+
+    std::vector<Staged> staged;
+    Result result;
+
+    std::atomic<bool> done = false;
+    std::exception_ptr error;
+    std::thread thread;
+};
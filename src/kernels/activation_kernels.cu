@@ -1,6 +1,7 @@
 #include "activation_kernels_impl.cuh"
 #include "activation_kernels.h"
 #include "dispatch_utils.h"
+#include "misc_kernels_cpu.h"
 
 // Launch element-wise activation kernel.
 #define LAUNCH_ACTIVATION_KERNEL(KERNEL)                                                  \
@@ -74,6 +75,9 @@ void silu(
   Tensor& out,     // [..., d]
   Tensor& input)   // [..., d]
 {
+  if (input.device().type == Device::CPU) {
+    return nunchaku::kernels::silu_cpu(out, input);
+  }
   LAUNCH_ACTIVATION_KERNEL(vllm::silu);
 }
 
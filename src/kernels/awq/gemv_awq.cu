@@ -25,6 +25,7 @@
 */
 
 #include "gemv_awq.h"
+#include "gemv_awq_cpu.h"
 #include "../dispatch_utils.h"
 
 #include "../utils.cuh"
@@ -280,6 +281,9 @@ Tensor gemv_awq(
     int k,
     int group_size)
 {
+    if (_in_feats.device().type == Device::CPU) {
+        return gemv_awq_cpu(_in_feats, _kernel, _scaling_factors, _zeros, m, n, k, group_size);
+    }
     return dispatchFloat16(_scaling_factors.scalar_type(), [&]<typename half_t>() {
         assert(isTypeMatch<half_t>(_in_feats.dtype()));
 
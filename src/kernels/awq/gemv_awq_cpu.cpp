@@ -0,0 +1,237 @@
+#include "gemv_awq_cpu.h"
+#include "kernels/cpu_plan.h"
+#include "kernels/cpu_common.h"
+
+namespace {
+
+using namespace nunchaku::kernels;
+
+constexpr int GROUP_SIZE = 64;
+constexpr int INTERLEAVE = 4;                   // output channels per row of qweight
+constexpr int GROUP_WORDS = GROUP_SIZE / 8;     // packed weights of one channel and group
+constexpr int ROW_GROUP_WORDS = GROUP_WORDS * INTERLEAVE;
+
+// below this many bytes of weights per thread the threads cost more than they save
+constexpr size_t MIN_BYTES_PER_THREAD = 256 << 10;
+
+// k within a group of nibble s of word w (0 .. 7) of a channel
+// a group of a channel is 2 loads of gemv_kernel (k 0 .. 31 and 32 .. 63) of 4 words each, dequantize_s4_to_fp16x2
+// yields nibbles 0, 4, 1, 5, 2, 6, 3, 7 of a word and the shuffle that follows moves element 2 * (j * 4 + i) + t to 2 * (i * 4 + j) + t
+int nibbleK(int w, int s) {
+    const int elem = w % 4 * 8 + (s < 4 ? s * 2 : (s - 4) * 2 + 1);
+    const int i = elem / 2 % 4, j = elem / 8, t = elem % 2;
+    return w / 4 * 32 + (i * 4 + j) * 2 + t;
+}
+
+struct GemvOperands {
+    Tensor::ScalarType dtype;
+    int M, N, K;
+    const uint32_t *wgt;            // qweight, [N / 4, K / 64, 4, 8] words
+    const uint16_t *scales;         // [K / 64, N]
+    const uint16_t *zeros;          // [K / 64, N]
+    std::vector<float> x;           // [M, K / 64, 8, 8], nibble s of word w of a group at s * 8 + w
+    std::vector<float> xsum;        // [M, K / 64], multiplies the zeros
+    const uint16_t *bias;           // [N] or nullptr
+    uint16_t *out;                  // [M, N]
+};
+
+// out[:, 4 * row0 .. 4 * row1) for the rows of qweight [row0, row1)
+using GemvKernel = void (*)(const GemvOperands &op, int row0, int row1);
+
+void gemvScalar(const GemvOperands &op, int row0, int row1) {
+    const int numGroups = op.K / GROUP_SIZE;
+    for (int row = row0; row < row1; row++) {
+        for (int m = 0; m < op.M; m++) {
+            float acc[INTERLEAVE] = {};
+            for (int g = 0; g < numGroups; g++) {
+                const uint32_t *w = op.wgt + ((size_t)row * numGroups + g) * ROW_GROUP_WORDS;
+                const float *x = &op.x[((size_t)m * numGroups + g) * GROUP_SIZE];
+                const float xsum = op.xsum[(size_t)m * numGroups + g];
+                for (int c = 0; c < INTERLEAVE; c++) {
+                    float dot = 0;
+                    for (int s = 0; s < 8; s++) {
+                        for (int i = 0; i < GROUP_WORDS; i++) {
+                            dot += ((w[c * GROUP_WORDS + i] >> (s * 4)) & 0xf) * x[s * 8 + i];
+                        }
+                    }
+                    const int n = row * INTERLEAVE + c;
+                    acc[c] += dot * halfToFloat(op.scales[(size_t)g * op.N + n], op.dtype) + xsum * halfToFloat(op.zeros[(size_t)g * op.N + n], op.dtype);
+                }
+            }
+            for (int c = 0; c < INTERLEAVE; c++) {
+                const int n = row * INTERLEAVE + c;
+                const float bias = op.bias ? halfToFloat(op.bias[n], op.dtype) : 0.0f;
+                op.out[(size_t)m * op.N + n] = floatToHalf(acc[c] + bias, op.dtype);
+            }
+        }
+    }
+}
+
+#if HOST_SIMD
+
+// 4 half precision values to FP32
+TARGET_AVX2
+__m128 loadHalf4(const uint16_t *p, Tensor::ScalarType dtype) {
+    const __m128i h = _mm_loadl_epi64((const __m128i *)p);
+    if (dtype == Tensor::BF16) {
+        return _mm_castsi128_ps(_mm_slli_epi32(_mm_cvtepu16_epi32(h), 16));
+    }
+    return _mm_cvtph_ps(h);
+}
+
+// the 4 channels of a row share the activations of a group, their 128 packed bytes are contiguous
+// the nibbles are taken in place from the 8 words of a channel (shift and mask per 32-bit lane, no shuffles),
+// the scale multiplies the per-group dot products as vectors, a single horizontal sum per channel at the end
+TARGET_AVX2
+void gemvAVX2(const GemvOperands &op, int row0, int row1) {
+    const int numGroups = op.K / GROUP_SIZE;
+    const __m256i mask = _mm256_set1_epi32(0xf);
+    for (int row = row0; row < row1; row++) {
+        for (int m = 0; m < op.M; m++) {
+            __m256 acc0 = _mm256_setzero_ps(), acc1 = _mm256_setzero_ps(), acc2 = _mm256_setzero_ps(), acc3 = _mm256_setzero_ps();
+            // the bias joins the zero point terms
+            __m128 zacc = op.bias ? loadHalf4(op.bias + row * INTERLEAVE, op.dtype) : _mm_setzero_ps();
+            for (int g = 0; g < numGroups; g++) {
+                const uint32_t *w = op.wgt + ((size_t)row * numGroups + g) * ROW_GROUP_WORDS;
+                const float *x = &op.x[((size_t)m * numGroups + g) * GROUP_SIZE];
+                const __m128 scales = loadHalf4(op.scales + (size_t)g * op.N + row * INTERLEAVE, op.dtype);
+                const __m128 zeros = loadHalf4(op.zeros + (size_t)g * op.N + row * INTERLEAVE, op.dtype);
+                zacc = _mm_fmadd_ps(zeros, _mm_set1_ps(op.xsum[(size_t)m * numGroups + g]), zacc);
+
+                const __m256i v0 = _mm256_loadu_si256((const __m256i *)(w + 0 * GROUP_WORDS));
+                const __m256i v1 = _mm256_loadu_si256((const __m256i *)(w + 1 * GROUP_WORDS));
+                const __m256i v2 = _mm256_loadu_si256((const __m256i *)(w + 2 * GROUP_WORDS));
+                const __m256i v3 = _mm256_loadu_si256((const __m256i *)(w + 3 * GROUP_WORDS));
+                __m256 dot0 = _mm256_setzero_ps(), dot1 = _mm256_setzero_ps(), dot2 = _mm256_setzero_ps(), dot3 = _mm256_setzero_ps();
+                for (int s = 0; s < 8; s++) {
+                    const __m256 xv = _mm256_loadu_ps(x + s * 8);
+                    const __m128i shift = _mm_cvtsi32_si128(s * 4);
+                    dot0 = _mm256_fmadd_ps(_mm256_cvtepi32_ps(_mm256_and_si256(_mm256_srl_epi32(v0, shift), mask)), xv, dot0);
+                    dot1 = _mm256_fmadd_ps(_mm256_cvtepi32_ps(_mm256_and_si256(_mm256_srl_epi32(v1, shift), mask)), xv, dot1);
+                    dot2 = _mm256_fmadd_ps(_mm256_cvtepi32_ps(_mm256_and_si256(_mm256_srl_epi32(v2, shift), mask)), xv, dot2);
+                    dot3 = _mm256_fmadd_ps(_mm256_cvtepi32_ps(_mm256_and_si256(_mm256_srl_epi32(v3, shift), mask)), xv, dot3);
+                }
+                acc0 = _mm256_fmadd_ps(dot0, _mm256_set1_ps(_mm_cvtss_f32(scales)), acc0);
+                acc1 = _mm256_fmadd_ps(dot1, _mm256_set1_ps(_mm_cvtss_f32(_mm_shuffle_ps(scales, scales, 1))), acc1);
+                acc2 = _mm256_fmadd_ps(dot2, _mm256_set1_ps(_mm_cvtss_f32(_mm_shuffle_ps(scales, scales, 2))), acc2);
+                acc3 = _mm256_fmadd_ps(dot3, _mm256_set1_ps(_mm_cvtss_f32(_mm_shuffle_ps(scales, scales, 3))), acc3);
+            }
+            alignas(16) float zsum[INTERLEAVE];
+            _mm_store_ps(zsum, zacc);
+            uint16_t *out = op.out + (size_t)m * op.N + row * INTERLEAVE;
+            out[0] = floatToHalf(hsumAVX2(acc0) + zsum[0], op.dtype);
+            out[1] = floatToHalf(hsumAVX2(acc1) + zsum[1], op.dtype);
+            out[2] = floatToHalf(hsumAVX2(acc2) + zsum[2], op.dtype);
+            out[3] = floatToHalf(hsumAVX2(acc3) + zsum[3], op.dtype);
+        }
+    }
+}
+
+#endif
+
+std::pair<const char *, GemvKernel> selectGemvKernel() {
+    const std::string forced = forcedISA();
+#if HOST_SIMD
+    // memory bound, AVX-512 hosts take the AVX2 path
+    if (forced != "scalar" && hasAVX2()) {
+        return {"avx2", gemvAVX2};
+    }
+#endif
+    return {"scalar", gemvScalar};
+}
+
+};  // namespace
+
+Tensor gemv_awq_cpu(
+    Tensor _in_feats,
+    Tensor _kernel,
+    Tensor _scaling_factors,
+    Tensor _zeros,
+    int m,
+    int n,
+    int k,
+    int group_size,
+    Tensor _bias,
+    Tensor _out_feats)
+{
+    nunchaku::kernels::CpuPlanStep step;
+    for (auto tensor : {_in_feats, _kernel, _scaling_factors, _zeros}) {
+        if (tensor.device().type != Device::CPU || !tensor.is_contiguous()) {
+            throw std::invalid_argument("All operands of gemv_awq_cpu must be contiguous CPU tensors");
+        }
+    }
+    if (group_size != GROUP_SIZE || k % GROUP_SIZE != 0 || n % INTERLEAVE != 0) {
+        throw std::invalid_argument(spdlog::fmt_lib::format("Invalid gemv_awq shape n={} k={} group_size={}", n, k, group_size));
+    }
+    const Tensor::ScalarType dtype = _scaling_factors.scalar_type();
+    if ((dtype != Tensor::FP16 && dtype != Tensor::BF16) || _in_feats.scalar_type() != dtype || _zeros.scalar_type() != dtype) {
+        throw std::invalid_argument("gemv_awq_cpu needs FP16 or BF16 inputs, scales and zeros of the same type");
+    }
+    assert(_in_feats.numel() == (size_t)m * k);
+    assert(_kernel.numel() == (size_t)n * k / 8);
+    assert(_scaling_factors.numel() == (size_t)n * (k / GROUP_SIZE));
+    assert(_zeros.numel() == _scaling_factors.numel());
+    if (_bias.valid() && (_bias.device().type != Device::CPU || !_bias.is_contiguous() || _bias.numel() != (size_t)n || _bias.scalar_type() != dtype)) {
+        throw std::invalid_argument(spdlog::fmt_lib::format("gemv_awq_cpu: invalid bias={} for n={}", _bias.shape.str(), n));
+    }
+
+    auto output_shape = _in_feats.shape.dataExtent;
+    output_shape.back() = n;
+    if (!_out_feats.valid()) {
+        _out_feats = Tensor::allocate(output_shape, dtype, Device::cpu());
+    }
+    if (_out_feats.device().type != Device::CPU || !_out_feats.is_contiguous() || _out_feats.sizes() != output_shape || _out_feats.scalar_type() != dtype) {
+        throw std::invalid_argument("gemv_awq_cpu: out_feats must be a contiguous CPU tensor of the shape and dtype of the output");
+    }
+
+    GemvOperands op;
+    op.dtype = dtype;
+    op.M = m;
+    op.N = n;
+    op.K = k;
+
+    auto [name, kernel] = selectGemvKernel();
+    const int rows = n / INTERLEAVE;
+    const size_t bytes = (size_t)n * k / 2;
+    const int numThreads = std::max<int>(1, std::min<size_t>(nunchaku::kernels::cpuNumThreads(), bytes / MIN_BYTES_PER_THREAD));
+    spdlog::trace("gemv_awq_cpu: m={} n={} k={} kernel={} threads={}", m, n, k, name, numThreads);
+
+    auto run = [op, kernel = kernel, rows, numThreads](Tensor in_feats, Tensor qweight, Tensor scales, Tensor zeros, Tensor bias, Tensor out_feats) mutable {
+        const int m = op.M, k = op.K;
+        op.wgt = reinterpret_cast<const uint32_t *>(qweight.data_ptr());
+        op.scales = scales.data_ptr<uint16_t>();
+        op.zeros = zeros.data_ptr<uint16_t>();
+        op.bias = bias.valid() ? bias.data_ptr<uint16_t>() : nullptr;
+        op.out = out_feats.data_ptr<uint16_t>();
+
+        // reorder the activations once into the order of the nibbles, the inner loops then read both contiguously
+        const int numGroups = k / GROUP_SIZE;
+        int order[GROUP_SIZE];
+        for (int w = 0; w < GROUP_WORDS; w++) {
+            for (int s = 0; s < 8; s++) {
+                order[s * 8 + w] = nibbleK(w, s);
+            }
+        }
+        const uint16_t *in = in_feats.data_ptr<uint16_t>();
+        op.x.resize((size_t)m * k);
+        op.xsum.resize((size_t)m * numGroups);
+        for (int i = 0; i < m; i++) {
+            for (int g = 0; g < numGroups; g++) {
+                float sum = 0;
+                for (int t = 0; t < GROUP_SIZE; t++) {
+                    const float v = halfToFloat(in[(size_t)i * k + g * GROUP_SIZE + order[t]], op.dtype);
+                    op.x[((size_t)i * numGroups + g) * GROUP_SIZE + t] = v;
+                    sum += v;
+                }
+                op.xsum[(size_t)i * numGroups + g] = sum;
+            }
+        }
+
+        parallelFor(rows, numThreads, [&](int begin, int end) {
+            kernel(op, begin, end);
+        });
+    };
+    run(_in_feats, _kernel, _scaling_factors, _zeros, _bias, _out_feats);
+    step.record(run, _in_feats, _kernel, _scaling_factors, _zeros, _bias, _out_feats);
+    return _out_feats;
+}
@@ -0,0 +1,22 @@
+#pragma once
+
+#include "common.h"
+#include "Tensor.h"
+
+// host implementation of gemv_awq for operands in CPU memory, same packed layout as gemv_kernel:
+// qweight [N / 4, K / 8 * 4] interleaves 4 output channels per row, scales / zeros [K / 64, N], w = q * scale + zero
+// accumulates in FP32 without the half roundings of the dequantized weights and products of the CUDA kernel,
+// the bias (if given) is added before the single rounding to the output type
+// NUNCHAKU_CPU_THREADS sets the number of threads (default: all cores)
+// NUNCHAKU_CPU_GEMM_ISA=scalar forces the portable code path
+Tensor gemv_awq_cpu(
+    Tensor _in_feats,
+    Tensor _kernel,
+    Tensor _scaling_factors,
+    Tensor _zeros,
+    int m,
+    int n,
+    int k,
+    int group_size,
+    Tensor _bias = {},          // [n]
+    Tensor _out_feats = {});    // contiguous [..., n], allocated if not given
@@ -0,0 +1,194 @@
+#pragma once
+
+#include "common.h"
+#include "Tensor.h"
+#include "kernels/cpu_runtime.h"
+
+#if defined(__linux__)
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+// helpers shared by the host kernels (*_cpu.cpp), which setup.py builds with -O3
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#include <immintrin.h>
+#define HOST_SIMD 1
+#define TARGET_AVX2 __attribute__((target("avx2,fma,f16c")))
+#define TARGET_AVX512 __attribute__((target("avx2,fma,f16c,avx512f")))
+#define TARGET_AVX512_VNNI __attribute__((target("avx2,fma,f16c,avx512f,avx512bw,avx512vnni")))
+#define TARGET_AVX512_BF16 __attribute__((target("avx2,fma,f16c,avx512f,avx512bw,avx512bf16")))
+#define TARGET_AMX_BF16 __attribute__((target("avx2,fma,f16c,avx512f,avx512bw,avx512bf16,amx-tile,amx-bf16")))
+#define TARGET_AMX_INT8 __attribute__((target("avx2,fma,f16c,avx512f,avx512bw,avx512vnni,amx-tile,amx-int8")))
+#else
+#define HOST_SIMD 0
+#endif
+
+namespace nunchaku::kernels {
+
+inline float bitsToFloat(uint32_t bits) {
+    float f;
+    memcpy(&f, &bits, sizeof(f));
+    return f;
+}
+inline uint32_t floatToBits(float f) {
+    uint32_t bits;
+    memcpy(&bits, &f, sizeof(bits));
+    return bits;
+}
+
+// dtype is FP16 or BF16
+inline float halfToFloat(uint16_t h, Tensor::ScalarType dtype) {
+    if (dtype == Tensor::BF16) {
+        return bitsToFloat(uint32_t(h) << 16);
+    }
+    const uint32_t sign = uint32_t(h & 0x8000) << 16;
+    const uint32_t exp = (h >> 10) & 0x1f;
+    const uint32_t mant = h & 0x3ff;
+    if (exp == 0x1f) {
+        return bitsToFloat(sign | 0x7f800000 | (mant << 13));
+    }
+    if (exp == 0) {
+        return bitsToFloat(sign | floatToBits(std::ldexp((float)mant, -24)));
+    }
+    return bitsToFloat(sign | ((exp + 112) << 23) | (mant << 13));
+}
+
+// round to nearest even
+inline uint16_t floatToHalf(float f, Tensor::ScalarType dtype) {
+    uint32_t bits = floatToBits(f);
+    if (dtype == Tensor::BF16) {
+        if ((bits & 0x7fffffff) > 0x7f800000) {
+            return uint16_t((bits >> 16) | 0x40);
+        }
+        return uint16_t((bits + 0x7fff + ((bits >> 16) & 1)) >> 16);
+    }
+    const uint32_t sign = (bits >> 16) & 0x8000;
+    bits &= 0x7fffffff;
+    if (bits >= 0x47800000) {
+        return uint16_t(sign | (bits > 0x7f800000 ? 0x7e00 : 0x7c00));
+    }
+    if (bits < 0x38800000) {
+        // subnormal, let the FPU round at 2^-24 by adding 0.5
+        return uint16_t(sign | (floatToBits(bitsToFloat(bits) + 0.5f) - 0x3f000000));
+    }
+    bits += 0xc8000fff + ((bits >> 13) & 1);
+    return uint16_t(sign | (bits >> 13));
+}
+
+inline float roundToHalf(float f, Tensor::ScalarType dtype) {
+    return halfToFloat(floatToHalf(f, dtype), dtype);
+}
+
+#if HOST_SIMD
+
+inline bool hasAVX2() {
+    static const bool val = __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma") && __builtin_cpu_supports("f16c");
+    return val;
+}
+inline bool hasAVX512() {
+    static const bool val = hasAVX2() && __builtin_cpu_supports("avx512f");
+    return val;
+}
+inline bool hasAVX512VNNI() {
+    static const bool val = hasAVX512() && __builtin_cpu_supports("avx512bw") && __builtin_cpu_supports("avx512vnni");
+    return val;
+}
+inline bool hasAVX512BF16() {
+    static const bool val = hasAVX512() && __builtin_cpu_supports("avx512bw") && __builtin_cpu_supports("avx512bf16");
+    return val;
+}
+
+// the AMX tile data is off until the process asks the kernel for it
+inline bool requestAMXTileData() {
+    static const bool val = []() {
+#if defined(__linux__)
+        constexpr int ARCH_REQ_XCOMP_PERM = 0x1023;
+        constexpr int XFEATURE_XTILEDATA = 18;
+        if (syscall(SYS_arch_prctl, ARCH_REQ_XCOMP_PERM, XFEATURE_XTILEDATA) != 0) {
+            spdlog::debug("AMX is not permitted by the kernel");
+            return false;
+        }
+        return true;
+#else
+        return false;
+#endif
+    }();
+    return val;
+}
+inline bool hasAMXBF16() {
+    static const bool val = hasAVX512BF16() && __builtin_cpu_supports("amx-tile") && __builtin_cpu_supports("amx-bf16") && requestAMXTileData();
+    return val;
+}
+inline bool hasAMXInt8() {
+    static const bool val = hasAVX512VNNI() && __builtin_cpu_supports("amx-tile") && __builtin_cpu_supports("amx-int8") && requestAMXTileData();
+    return val;
+}
+
+// 8 FP16 / BF16 values to FP32
+TARGET_AVX2 inline __attribute__((always_inline))
+__m256 loadHalf8(const uint16_t *p, bool bf16) {
+    const __m128i h = _mm_loadu_si128((const __m128i *)p);
+    return bf16 ? _mm256_castsi256_ps(_mm256_slli_epi32(_mm256_cvtepu16_epi32(h), 16)) : _mm256_cvtph_ps(h);
+}
+
+// BF16 rounds to nearest even on the bits, NaNs keep their top mantissa bits
+TARGET_AVX2 inline __attribute__((always_inline))
+void storeHalf8(uint16_t *p, __m256 v, bool bf16) {
+    if (!bf16) {
+        _mm_storeu_si128((__m128i *)p, _mm256_cvtps_ph(v, _MM_FROUND_TO_NEAREST_INT));
+        return;
+    }
+    const __m256i bits = _mm256_castps_si256(v);
+    const __m256i lsb = _mm256_and_si256(_mm256_srli_epi32(bits, 16), _mm256_set1_epi32(1));
+    const __m256i r = _mm256_srli_epi32(_mm256_add_epi32(bits, _mm256_add_epi32(lsb, _mm256_set1_epi32(0x7fff))), 16);
+    _mm_storeu_si128((__m128i *)p, _mm_packus_epi32(_mm256_castsi256_si128(r), _mm256_extracti128_si256(r, 1)));
+}
+
+// roundToHalf of 8 values
+TARGET_AVX2 inline __attribute__((always_inline))
+__m256 roundToHalfAVX2(__m256 v, bool bf16) {
+    if (!bf16) {
+        return _mm256_cvtph_ps(_mm256_cvtps_ph(v, _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC));
+    }
+    __m256i bits = _mm256_castps_si256(v);
+    bits = _mm256_add_epi32(bits, _mm256_add_epi32(_mm256_set1_epi32(0x7fff), _mm256_and_si256(_mm256_srli_epi32(bits, 16), _mm256_set1_epi32(1))));
+    return _mm256_castsi256_ps(_mm256_and_si256(bits, _mm256_set1_epi32(0xffff0000)));
+}
+
+TARGET_AVX2 inline __attribute__((always_inline))
+float hsumAVX2(__m256 v) {
+    __m128 s = _mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+    s = _mm_add_ps(s, _mm_movehl_ps(s, s));
+    s = _mm_add_ss(s, _mm_movehdup_ps(s));
+    return _mm_cvtss_f32(s);
+}
+
+TARGET_AVX2 inline __attribute__((always_inline))
+float hmaxAVX2(__m256 v) {
+    __m128 m = _mm_max_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+    m = _mm_max_ps(m, _mm_movehl_ps(m, m));
+    m = _mm_max_ss(m, _mm_movehdup_ps(m));
+    return _mm_cvtss_f32(m);
+}
+
+#endif
+
+// NUNCHAKU_CPU_GEMM_ISA: the kernel a host op selects at most ("scalar", "avx2", ...), empty for the best one available
+inline std::string forcedISA() {
+    const char *env = getenv("NUNCHAKU_CPU_GEMM_ISA");
+    return env ? env : "";
+}
+
+// func(begin, end) on contiguous ranges of [0, count), one per thread of the CPU runtime
+template<typename F>
+void parallelFor(int count, F &&func) {
+    cpuParallelFor(count, ceilDiv(count, cpuNumThreads()), func);
+}
+// at most numThreads of the ranges run at once
+template<typename F>
+void parallelFor(int count, int numThreads, F &&func) {
+    cpuParallelFor(count, ceilDiv(count, std::max(numThreads, 1)), func);
+}
+
+};  // namespace nunchaku::kernels
@@ -0,0 +1,334 @@
+#include "cpu_plan.h"
+#include "kernels/zgemm/zgemm.h"
+
+#include <algorithm>
+#include <mutex>
+
+using spdlog::fmt_lib::format;
+
+namespace nunchaku::kernels {
+
+// temporaries that may share memory start at multiples of this
+static constexpr size_t ARENA_ALIGNMENT = 64;
+
+struct CpuPlan::State {
+    // memory bound when the plan is finished (temporaries) or at each replay (inputs), shared by all steps that use it
+    class BufferPlanned : public Buffer {
+    public:
+        explicit BufferPlanned(size_t size) {
+            this->ptr = nullptr;
+            this->size = size;
+            this->device.type = Device::CPU;
+        }
+        void rebind(void *ptr) {
+            this->ptr = ptr;
+            bumpVersion();
+        }
+    };
+
+    struct Input {
+        std::vector<int> extent;
+        Tensor::ScalarType dtype;
+        std::shared_ptr<BufferPlanned> buffer;
+    };
+
+    std::vector<Input> inputs;
+    std::vector<std::function<void()>> steps;
+    std::vector<Tensor> outputs;
+
+    std::shared_ptr<Buffer> arena;
+    std::vector<std::shared_ptr<Buffer>> kept;
+    size_t keptBytes = 0;
+
+    std::mutex mutex;   // replays of one plan run one after another
+};
+
+// host buffers allocated during a capture, from their allocation to their release
+// buffers may be released on any thread (e.g. by a worker dropping the last tensor), so it is locked
+struct CpuPlan::Capture::Registry {
+    class BufferCaptured : public BufferMalloc {
+    public:
+        BufferCaptured(size_t size, std::weak_ptr<Registry> registry) : BufferMalloc(size), registry(std::move(registry)) {}
+        virtual ~BufferCaptured() {
+            if (auto locked = registry.lock()) {
+                locked->release(this->ptr);
+            }
+        }
+
+    private:
+        std::weak_ptr<Registry> registry;
+    };
+
+    struct Temporary {
+        size_t size;
+        size_t birth;               // number of steps recorded when it was allocated
+        size_t death = SIZE_MAX;    // ... and released
+        Buffer *buffer;             // while alive
+        std::shared_ptr<State::BufferPlanned> planned;      // once a step uses it
+    };
+
+    void release(void *ptr) {
+        std::lock_guard lock(mutex);
+        auto it = live.find(reinterpret_cast<uintptr_t>(ptr));
+        if (it == live.end()) {
+            return;
+        }
+        temporaries.at(it->second).death = numSteps;
+        temporaries.at(it->second).buffer = nullptr;
+        live.erase(it);
+    }
+
+    std::mutex mutex;
+    std::vector<Temporary> temporaries;
+    std::map<uintptr_t, size_t> live;   // start address => index in temporaries
+    size_t numSteps = 0;
+};
+
+static thread_local CpuPlan::Capture *currentCapture = nullptr;
+
+std::vector<Tensor> CpuPlan::replay(const std::vector<Tensor> &inputs) {
+    if (!state) {
+        throw std::runtime_error("CpuPlan: replay of a plan that was never captured");
+    }
+    std::lock_guard lock(state->mutex);
+
+    if (inputs.size() != state->inputs.size()) {
+        throw std::invalid_argument(format("CpuPlan: captured with {} inputs, replayed with {}", state->inputs.size(), inputs.size()));
+    }
+    for (size_t i = 0; i < inputs.size(); i++) {
+        const Tensor &input = inputs[i];
+        const State::Input &slot = state->inputs[i];
+        if (input.device().type != Device::CPU || !input.is_contiguous() || input.sizes() != slot.extent || input.dtype() != slot.dtype) {
+            throw std::invalid_argument(format("CpuPlan: input {} does not match the capture (contiguous host tensor of the same shape and dtype)", i));
+        }
+        slot.buffer->rebind(const_cast<void *>(input.data_ptr()));
+    }
+    for (auto &step : state->steps) {
+        step();
+    }
+    return state->outputs;
+}
+
+size_t CpuPlan::numSteps() const {
+    return state ? state->steps.size() : 0;
+}
+
+size_t CpuPlan::arenaBytes() const {
+    return state && state->arena ? state->arena->getSize() : 0;
+}
+
+size_t CpuPlan::keptBytes() const {
+    return state ? state->keptBytes : 0;
+}
+
+CpuPlan::Capture::Capture(CpuPlan &plan, std::vector<Tensor> inputs) : plan(plan) {
+    if (CpuCaptureHooks::current) {
+        throw std::runtime_error("CpuPlan: a plan is already being captured on this thread");
+    }
+    state = std::make_shared<State>();
+    registry = std::make_shared<Registry>();
+    for (size_t i = 0; i < inputs.size(); i++) {
+        const Tensor &input = inputs[i];
+        if (input.device().type != Device::CPU || !input.is_contiguous()) {
+            throw std::invalid_argument(format("CpuPlan: input {} is not a contiguous host tensor", i));
+        }
+        state->inputs.push_back(State::Input{
+            input.sizes(), input.dtype(), std::make_shared<State::BufferPlanned>(input.numel() * input.scalar_size())
+        });
+        state->inputs.back().buffer->rebind(const_cast<void *>(input.data_ptr()));
+    }
+    plan.state.reset();
+
+    CpuCaptureHooks::current = this;
+    currentCapture = this;
+}
+
+CpuPlan::Capture::~Capture() {
+    CpuCaptureHooks::current = nullptr;
+    currentCapture = nullptr;
+}
+
+void CpuPlan::Capture::finish(std::vector<Tensor> outputs) {
+    if (finished) {
+        throw std::runtime_error("CpuPlan: capture finished twice");
+    }
+    for (auto &output : outputs) {
+        state->outputs.push_back(bind(output));
+    }
+
+    CpuCaptureHooks::current = nullptr;
+    currentCapture = nullptr;
+    finished = true;
+
+    // references taken below are dropped after the lock, a last one runs the release of the buffer
+    std::vector<std::shared_ptr<Buffer>> alive;
+    std::lock_guard lock(registry->mutex);
+
+    // alive buffers keep their memory and contents, which the steps may read on replay (e.g. caches of the modules)
+    for (auto it = registry->live.begin(); it != registry->live.end();) {
+        Registry::Temporary &tmp = registry->temporaries.at(it->second);
+        std::shared_ptr<Buffer> buffer = tmp.buffer->weak_from_this().lock();
+        if (!buffer) {
+            // released on another thread right now, its destructor waits for the lock
+            tmp.death = registry->numSteps;
+            tmp.buffer = nullptr;
+            it = registry->live.erase(it);
+            continue;
+        }
+        if (tmp.planned) {
+            tmp.planned->rebind(buffer->getPtr());
+            state->kept.push_back(buffer);
+            state->keptBytes += tmp.size;
+        }
+        alive.push_back(std::move(buffer));
+        ++it;
+    }
+
+    // the others share one block: first fit by decreasing size against the temporaries placed so far that live at the
+    // same time as it
+    std::vector<Registry::Temporary *> order;
+    for (auto &tmp : registry->temporaries) {
+        if (tmp.planned && tmp.death != SIZE_MAX) {
+            order.push_back(&tmp);
+        }
+    }
+    std::stable_sort(order.begin(), order.end(), [](auto *a, auto *b) { return a->size > b->size; });
+
+    struct Placement {
+        size_t begin, end;
+        const Registry::Temporary *tmp;
+    };
+    std::vector<Placement> placed;
+    std::vector<size_t> offsets;
+    size_t arenaSize = 0;
+    for (auto *tmp : order) {
+        std::vector<Placement> overlapping;
+        for (auto &p : placed) {
+            if (p.tmp->birth < tmp->death && tmp->birth < p.tmp->death) {
+                overlapping.push_back(p);
+            }
+        }
+        std::sort(overlapping.begin(), overlapping.end(), [](auto &a, auto &b) { return a.begin < b.begin; });
+        size_t offset = 0;
+        for (auto &p : overlapping) {
+            if (offset + tmp->size <= p.begin) {
+                break;
+            }
+            offset = std::max(offset, ceilDiv(p.end, ARENA_ALIGNMENT) * ARENA_ALIGNMENT);
+        }
+        placed.push_back(Placement{offset, offset + tmp->size, tmp});
+        offsets.push_back(offset);
+        arenaSize = std::max(arenaSize, offset + tmp->size);
+    }
+    if (arenaSize > 0) {
+        state->arena = std::make_shared<BufferMalloc>(arenaSize);
+        for (size_t i = 0; i < order.size(); i++) {
+            order[i]->planned->rebind(state->arena->getPtr<char>() + offsets[i]);
+        }
+    }
+
+    plan.state = state;
+}
+
+Tensor CpuPlan::Capture::bind(const Tensor &tensor) {
+    Capture *capture = currentCapture;
+    if (!capture || !tensor.valid() || tensor.device().type != Device::CPU) {
+        return tensor;
+    }
+
+    auto rebase = [&](std::shared_ptr<Buffer> buffer, size_t bytes) {
+        if (bytes % tensor.scalar_size() != 0) {
+            throw std::runtime_error(format("CpuPlan: tensor at byte {} of a buffer of the plan is not aligned to its dtype", bytes));
+        }
+        Tensor result = tensor;
+        result.buffer = std::move(buffer);
+        result.shape.offset = bytes / tensor.scalar_size();
+        return result;
+    };
+
+    const char *data = tensor.data_ptr<char>();
+    for (auto &input : capture->state->inputs) {
+        const char *base = input.buffer->getPtr<char>();
+        if (data >= base && data < base + input.buffer->getSize()) {
+            return rebase(input.buffer, data - base);
+        }
+    }
+
+    Registry &registry = *capture->registry;
+    std::lock_guard lock(registry.mutex);
+    const uintptr_t address = reinterpret_cast<uintptr_t>(data);
+    auto it = registry.live.upper_bound(address);
+    if (it != registry.live.begin()) {
+        --it;
+        Registry::Temporary &tmp = registry.temporaries.at(it->second);
+        if (address < it->first + tmp.size) {
+            if (!tmp.planned) {
+                tmp.planned = std::make_shared<State::BufferPlanned>(tmp.size);
+            }
+            return rebase(tmp.planned, address - it->first);
+        }
+    }
+    // allocated before the capture, the step keeps it alive
+    return tensor;
+}
+
+GemmW4A4Args CpuPlan::Capture::bind(const GemmW4A4Args &args) {
+    GemmW4A4Args result = args;
+    for (Tensor GemmW4A4Args::*member : {
+            &GemmW4A4Args::act, &GemmW4A4Args::wgt, &GemmW4A4Args::out, &GemmW4A4Args::qout,
+            &GemmW4A4Args::ascales, &GemmW4A4Args::wscales, &GemmW4A4Args::oscales, &GemmW4A4Args::poolout,
+            &GemmW4A4Args::lora_act_in, &GemmW4A4Args::lora_up, &GemmW4A4Args::lora_down, &GemmW4A4Args::lora_act_out,
+            &GemmW4A4Args::norm_q, &GemmW4A4Args::norm_k, &GemmW4A4Args::rotary_emb, &GemmW4A4Args::bias,
+            &GemmW4A4Args::smooth_factor, &GemmW4A4Args::out_vk, &GemmW4A4Args::out_linearattn,
+            &GemmW4A4Args::wcscales, &GemmW4A4Args::out_q, &GemmW4A4Args::out_k, &GemmW4A4Args::out_v}) {
+        result.*member = bind(args.*member);
+    }
+    return result;
+}
+
+std::vector<GemmW4A4Args> CpuPlan::Capture::bind(const std::vector<GemmW4A4Args> &problems) {
+    std::vector<GemmW4A4Args> result;
+    for (auto &args : problems) {
+        result.push_back(bind(args));
+    }
+    return result;
+}
+
+std::vector<Tensor> CpuPlan::Capture::bind(const std::vector<Tensor> &tensors) {
+    std::vector<Tensor> result;
+    for (auto &tensor : tensors) {
+        result.push_back(bind(tensor));
+    }
+    return result;
+}
+
+void CpuPlan::Capture::addStep(std::function<void()> step) {
+    Capture *capture = currentCapture;
+    assert(capture);
+    std::lock_guard lock(capture->registry->mutex);
+    capture->state->steps.push_back(std::move(step));
+    capture->registry->numSteps = capture->state->steps.size();
+}
+
+std::shared_ptr<Buffer> CpuPlan::Capture::allocate(size_t size) {
+    auto buffer = std::make_shared<Registry::BufferCaptured>(size, registry);
+    if (!buffer->getPtr()) {
+        return buffer;
+    }
+    std::lock_guard lock(registry->mutex);
+    registry->live[reinterpret_cast<uintptr_t>(buffer->getPtr())] = registry->temporaries.size();
+    registry->temporaries.push_back(Registry::Temporary{size, registry->numSteps, SIZE_MAX, buffer.get(), nullptr});
+    return buffer;
+}
+
+void CpuPlan::Capture::copy(const Tensor &dst, const Tensor &src) {
+    if (CpuPlanStep::inside()) {
+        return;
+    }
+    addStep([dst = bind(dst), src = bind(src)]() mutable {
+        dst.buffer->bumpVersion();
+        memcpy(dst.data_ptr<char>(), src.data_ptr<char>(), dst.numel() * dst.scalar_size());
+    });
+}
+
+};  // namespace nunchaku::kernels
@@ -0,0 +1,100 @@
+#pragma once
+
+#include "common.h"
+#include "Tensor.h"
+
+namespace nunchaku::kernels {
+
+struct GemmW4A4Args;
+
+// the calls of the CPU kernels made by one run of host code (e.g. a forward of the model), recorded by CpuPlan::Capture
+// and replayed for inputs of the same shapes without running the host code again: every step holds a kernel call as
+// prepared by its entry point (checked, kernels and blockings chosen) and the tensors of the call, which are rebound to
+//   - the inputs given at replay, for tensors in the memory of an input of the capture
+//   - one block shared by all temporaries allocated and released during the capture, each at an offset chosen so that
+//     temporaries live at the same time never overlap (so the plan needs no more memory than the eager run)
+//   - the tensors themselves otherwise (weights, buffers still alive at the end of the capture), which the plan keeps
+// copies between host tensors are recorded as well; anything else the host code computes on host memory is not, so
+// it must not write temporaries that the kernels read (scalars and shapes are fine, they are part of each step)
+class CpuPlan {
+public:
+    class Capture;
+
+    // the outputs given to Capture::finish, computed from `inputs` of the same shapes and dtypes as at capture
+    // the outputs are owned by the plan (or alias an input) and are overwritten by the next replay
+    std::vector<Tensor> replay(const std::vector<Tensor> &inputs);
+
+    bool valid() const { return state != nullptr; }
+    size_t numSteps() const;
+    size_t arenaBytes() const;      // the block of the temporaries
+    size_t keptBytes() const;       // buffers allocated during the capture and still alive at its end
+
+private:
+    struct State;
+    std::shared_ptr<State> state;
+};
+
+// records the kernels called on this thread between construction and finish() into `plan`
+// a capture left without finish() (e.g. by an exception) leaves the plan invalid; captures do not nest
+class CpuPlan::Capture : private CpuCaptureHooks {
+public:
+    Capture(CpuPlan &plan, std::vector<Tensor> inputs);
+    Capture(const Capture &) = delete;
+    Capture &operator=(const Capture &) = delete;
+    ~Capture();
+
+    void finish(std::vector<Tensor> outputs);
+
+    // the argument of a step as it is stored in the plan of the capture running on this thread
+    static Tensor bind(const Tensor &tensor);
+    static GemmW4A4Args bind(const GemmW4A4Args &args);
+    static std::vector<GemmW4A4Args> bind(const std::vector<GemmW4A4Args> &problems);
+    static std::vector<Tensor> bind(const std::vector<Tensor> &tensors);
+    template<typename T>
+    static const T &bind(const T &value) { return value; }
+
+    static void addStep(std::function<void()> step);
+
+private:
+    std::shared_ptr<Buffer> allocate(size_t size) override;
+    void copy(const Tensor &dst, const Tensor &src) override;
+
+private:
+    struct Registry;
+
+    CpuPlan &plan;
+    std::shared_ptr<State> state;
+    std::shared_ptr<Registry> registry;
+    bool finished = false;
+};
+
+// guards an entry point of the CPU kernels: while a plan is captured on this thread, record() adds a step to it, unless
+// the entry point was called from within another one (whose step covers it)
+// a step is the part of the entry point that runs once its checks have passed and its kernels (and blockings) are
+// chosen: `run` closes over that prepared state and takes the tensors of the call, which the plan rebinds on replay
+// entry points record after running it, so a call that throws adds no step and their outputs are already allocated
+class CpuPlanStep {
+public:
+    CpuPlanStep() { depth++; }
+    CpuPlanStep(const CpuPlanStep &) = delete;
+    CpuPlanStep &operator=(const CpuPlanStep &) = delete;
+    ~CpuPlanStep() { depth--; }
+
+    template<typename F, typename... Values>
+    void record(F run, const Values &...values) {
+        if (depth != 1 || !CpuCaptureHooks::current) {
+            return;
+        }
+        auto args = std::make_tuple(CpuPlan::Capture::bind(values)...);
+        CpuPlan::Capture::addStep([run = std::move(run), args = std::move(args)]() mutable {
+            std::apply(run, args);
+        });
+    }
+
+    static bool inside() { return depth > 0; }
+
+private:
+    static inline thread_local int depth = 0;
+};
+
+};  // namespace nunchaku::kernels
@@ -0,0 +1,429 @@
+#include "cpu_runtime.h"
+
+#include <condition_variable>
+#include <deque>
+#include <filesystem>
+#include <thread>
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+namespace nunchaku::kernels {
+
+namespace {
+
+constexpr int SPIN_ROUNDS = 64;     // yields before a thread without work goes to sleep
+
+// "0-3,8-11" -> {0, 1, 2, 3, 8, 9, 10, 11}
+std::vector<int> parseCpuList(const std::string &list) {
+    std::vector<int> cpus;
+    std::stringstream ss(list);
+    std::string range;
+    while (std::getline(ss, range, ',')) {
+        if (range.empty() || range == "\n") {
+            continue;
+        }
+        const size_t dash = range.find('-');
+        const int first = std::stoi(range.substr(0, dash));
+        const int last = dash == std::string::npos ? first : std::stoi(range.substr(dash + 1));
+        for (int cpu = first; cpu <= last; cpu++) {
+            cpus.push_back(cpu);
+        }
+    }
+    return cpus;
+}
+
+// cores allowed by the affinity mask grouped by NUMA node, nodes without allowed cores are dropped
+std::vector<std::vector<int>> readTopology() {
+    std::vector<int> allowed;
+#ifdef __linux__
+    cpu_set_t mask;
+    if (sched_getaffinity(0, sizeof(mask), &mask) == 0) {
+        for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+            if (CPU_ISSET(cpu, &mask)) {
+                allowed.push_back(cpu);
+            }
+        }
+    }
+#endif
+    if (allowed.empty()) {
+        return {{}};
+    }
+
+    std::map<int, std::vector<int>> nodes;
+    std::error_code ec;
+    for (auto &&entry : std::filesystem::directory_iterator("/sys/devices/system/node", ec)) {
+        const std::string name = entry.path().filename().string();
+        if (name.rfind("node", 0) != 0 || name.size() == 4 || name.find_first_not_of("0123456789", 4) != std::string::npos) {
+            continue;
+        }
+        std::ifstream fin(entry.path() / "cpulist");
+        std::string list;
+        if (!std::getline(fin, list)) {
+            continue;
+        }
+        for (int cpu : parseCpuList(list)) {
+            if (std::binary_search(allowed.begin(), allowed.end(), cpu)) {
+                nodes[std::stoi(name.substr(4))].push_back(cpu);
+            }
+        }
+    }
+
+    std::vector<std::vector<int>> result;
+    for (auto &&[node, cpus] : nodes) {
+        result.push_back(std::move(cpus));
+    }
+    if (result.empty()) {
+        result.push_back(allowed);
+    }
+    return result;
+}
+
+int numAllowedCpus() {
+    int count = 0;
+    for (auto &&cpus : readTopology()) {
+        count += cpus.size();
+    }
+    return count;
+}
+
+// index of the worker the current thread is, -1 outside the pool
+thread_local int currentWorker = -1;
+// node the tasks of a thread outside the pool go to, looked up on first use
+thread_local int currentNode = -1;
+thread_local uint32_t stealSeed = 0;
+
+};  // namespace
+
+class CpuThreadPool {
+    struct Task;
+
+public:
+    // never destroyed, the workers sleep until the process exits
+    static CpuThreadPool &instance() {
+        static CpuThreadPool *pool = new CpuThreadPool();
+        return *pool;
+    }
+
+    CpuRuntimeInfo info() const {
+        CpuRuntimeInfo info;
+        info.numThreads = workers.size() + 1;
+        info.numNodes = injected.size();
+        info.pinned = pinned;
+        for (auto &&worker : workers) {
+            info.cpus.push_back(pinned ? worker->cpu : -1);
+            info.nodes.push_back(worker->node);
+        }
+        return info;
+    }
+
+    void submit(CpuTaskGroup &group, std::function<void()> func) {
+        group.pending.fetch_add(1);
+        push(Task{std::move(func), &group});
+    }
+
+    void push(Task &&task) {
+        if (currentWorker >= 0) {
+            workers[currentWorker]->queue.push(std::move(task));
+        } else {
+            injected[callerNode()]->push(std::move(task));
+        }
+        queued.fetch_add(1);
+        if (sleepers.load() > 0) {
+            std::lock_guard lock(sleepMutex);
+            wake.notify_one();
+        }
+    }
+
+    // own newest task, then the injected queue and the oldest task of each worker of the own node, then of the other nodes
+    bool pop(Task &task) {
+        if (queued.load() <= 0) {
+            return false;
+        }
+        const int self = currentWorker;
+        if (self >= 0 && workers[self]->queue.pop(task, true)) {
+            queued.fetch_sub(1);
+            return true;
+        }
+        const int home = self >= 0 ? workers[self]->node : callerNode();
+        const int numNodes = injected.size();
+        stealSeed = stealSeed * 1664525u + 1013904223u;
+        for (int i = 0; i < numNodes; i++) {
+            const int node = (home + i) % numNodes;
+            if (injected[node]->pop(task, false)) {
+                queued.fetch_sub(1);
+                return true;
+            }
+            const auto &victims = nodeWorkers[node];
+            const int start = victims.empty() ? 0 : (stealSeed >> 8) % victims.size();
+            for (size_t j = 0; j < victims.size(); j++) {
+                const int victim = victims[(start + j) % victims.size()];
+                if (victim != self && workers[victim]->queue.pop(task, false)) {
+                    queued.fetch_sub(1);
+                    return true;
+                }
+            }
+        }
+        return false;
+    }
+
+    void execute(Task &task) {
+        CpuTaskGroup *group = task.group;
+        try {
+            task.func();
+        } catch (...) {
+            std::lock_guard lock(group->mutex);
+            if (!group->error) {
+                group->error = std::current_exception();
+            }
+        }
+        // the captures may refer to the stack of the waiting thread, release them before it may return
+        task = Task{};
+        if (group->pending.fetch_sub(1) == 1 && waiters.load() > 0) {
+            std::lock_guard lock(sleepMutex);
+            wake.notify_all();
+        }
+    }
+
+    void waitFor(CpuTaskGroup &group) {
+        Task task;
+        while (group.pending.load() > 0) {
+            if (pop(task)) {
+                execute(task);
+                continue;
+            }
+            if (spin([&]() { return group.pending.load() == 0 || queued.load() > 0; })) {
+                continue;
+            }
+            std::unique_lock lock(sleepMutex);
+            sleepers++;
+            waiters++;
+            wake.wait(lock, [&]() { return group.pending.load() == 0 || queued.load() > 0; });
+            waiters--;
+            sleepers--;
+        }
+    }
+
+private:
+    struct Task {
+        std::function<void()> func;
+        CpuTaskGroup *group = nullptr;
+    };
+
+    struct alignas(64) TaskQueue {
+        std::mutex mutex;
+        std::deque<Task> tasks;
+        std::atomic<int> size = 0;      // read without the lock to skip empty queues
+
+        void push(Task &&task) {
+            std::lock_guard lock(mutex);
+            tasks.push_back(std::move(task));
+            size.fetch_add(1, std::memory_order_relaxed);
+        }
+        bool pop(Task &task, bool newest) {
+            if (size.load(std::memory_order_relaxed) == 0) {
+                return false;
+            }
+            std::lock_guard lock(mutex);
+            if (tasks.empty()) {
+                return false;
+            }
+            if (newest) {
+                task = std::move(tasks.back());
+                tasks.pop_back();
+            } else {
+                task = std::move(tasks.front());
+                tasks.pop_front();
+            }
+            size.fetch_sub(1, std::memory_order_relaxed);
+            return true;
+        }
+    };
+
+    struct Worker {
+        TaskQueue queue;
+        int node;
+        int cpu;
+    };
+
+    CpuThreadPool() {
+        const auto topology = readTopology();
+        std::vector<std::pair<int, int>> slots;     // (cpu, node), filling node by node
+        for (size_t node = 0; node < topology.size(); node++) {
+            injected.push_back(std::make_unique<TaskQueue>());
+            nodeWorkers.emplace_back();
+            for (int cpu : topology[node]) {
+                slots.emplace_back(cpu, node);
+                if (cpu >= (int)cpuNode.size()) {
+                    cpuNode.resize(cpu + 1, 0);
+                }
+                cpuNode[cpu] = node;
+            }
+        }
+        if (slots.empty()) {
+            slots.emplace_back(-1, 0);
+        }
+
+        // the first core is left to the thread that waits for the work
+        const int numWorkers = cpuNumThreads() - 1;
+
+        // with more threads than cores (NUNCHAKU_CPU_THREADS) some workers would share a core while others are free
+        const char *env = getenv("NUNCHAKU_CPU_PIN");
+        pinned = !(env && std::string(env) == "0") && slots[0].first >= 0 && numWorkers < (int)slots.size();
+        for (int i = 0; i < numWorkers; i++) {
+            auto [cpu, node] = slots[(i + 1) % slots.size()];     // wraps only when not pinned
+            auto worker = std::make_unique<Worker>();
+            worker->node = node;
+            worker->cpu = cpu;
+            nodeWorkers[node].push_back(i);
+            workers.push_back(std::move(worker));
+        }
+        for (int i = 0; i < numWorkers; i++) {
+            std::thread(&CpuThreadPool::workerMain, this, i).detach();
+        }
+        spdlog::debug("CPU runtime: {} workers on {} NUMA nodes, pinned={}", numWorkers, topology.size(), pinned);
+    }
+
+    int callerNode() {
+        if (currentNode < 0) {
+            currentNode = 0;
+#ifdef __linux__
+            const int cpu = sched_getcpu();
+            if (cpu >= 0 && cpu < (int)cpuNode.size()) {
+                currentNode = cpuNode[cpu];
+            }
+#endif
+        }
+        return currentNode;
+    }
+
+    template<typename F>
+    bool spin(F &&ready) {
+        for (int i = 0; i < SPIN_ROUNDS; i++) {
+            if (ready()) {
+                return true;
+            }
+            std::this_thread::yield();
+        }
+        return false;
+    }
+
+    void workerMain(int index) {
+        currentWorker = index;
+        stealSeed = index * 2654435761u;
+#ifdef __linux__
+        if (pinned) {
+            cpu_set_t mask;
+            CPU_ZERO(&mask);
+            CPU_SET(workers[index]->cpu, &mask);
+            if (int err = pthread_setaffinity_np(pthread_self(), sizeof(mask), &mask)) {
+                spdlog::warn("Failed to pin CPU worker {} to core {}: {}", index, workers[index]->cpu, strerror(err));
+            }
+        }
+#endif
+        Task task;
+        while (true) {
+            if (pop(task)) {
+                execute(task);
+                continue;
+            }
+            if (spin([&]() { return queued.load() > 0; })) {
+                continue;
+            }
+            std::unique_lock lock(sleepMutex);
+            sleepers++;
+            wake.wait(lock, [&]() { return queued.load() > 0; });
+            sleepers--;
+        }
+    }
+
+private:
+    std::vector<std::unique_ptr<Worker>> workers;
+    std::vector<std::unique_ptr<TaskQueue>> injected;   // tasks of threads outside the pool, per node
+    std::vector<std::vector<int>> nodeWorkers;
+    std::vector<int> cpuNode;
+    bool pinned;
+
+    std::atomic<int64_t> queued = 0;
+    // a sleeper registers before it checks its condition and a producer reads the count after it publishes, so either
+    // the sleeper sees the work or the producer sees the sleeper
+    std::atomic<int> sleepers = 0;
+    std::atomic<int> waiters = 0;
+    std::mutex sleepMutex;
+    std::condition_variable wake;
+};
+
+CpuRuntimeInfo cpuRuntimeInfo() {
+    return CpuThreadPool::instance().info();
+}
+
+int cpuNumThreads() {
+    static const int val = []() {
+        if (const char *env = getenv("NUNCHAKU_CPU_THREADS")) {
+            return std::max(1, atoi(env));
+        }
+        return std::max(1, numAllowedCpus());
+    }();
+    return val;
+}
+
+CpuTaskGroup::~CpuTaskGroup() {
+    if (pending.load() > 0) {
+        CpuThreadPool::instance().waitFor(*this);
+    }
+}
+
+void CpuTaskGroup::run(std::function<void()> func) {
+    CpuThreadPool::instance().submit(*this, std::move(func));
+}
+
+void CpuTaskGroup::wait() {
+    if (pending.load() > 0) {
+        CpuThreadPool::instance().waitFor(*this);
+    }
+    std::exception_ptr e;
+    {
+        std::lock_guard lock(mutex);
+        std::swap(e, error);
+    }
+    if (e) {
+        std::rethrow_exception(e);
+    }
+}
+
+namespace {
+
+void splitRange(CpuTaskGroup &group, int begin, int end, int grain, const std::function<void(int, int)> &func) {
+    while (end - begin > grain) {
+        const int mid = begin + (end - begin) / 2;
+        group.run([&group, mid, end, grain, &func]() {
+            splitRange(group, mid, end, grain, func);
+        });
+        end = mid;
+    }
+    func(begin, end);
+}
+
+};  // namespace
+
+void cpuParallelFor(int count, int grain, const std::function<void(int, int)> &func) {
+    if (count <= 0) {
+        return;
+    }
+    const int numThreads = cpuNumThreads();
+    if (grain <= 0) {
+        grain = ceilDiv(count, numThreads * 4);
+    }
+    if (numThreads <= 1 || count <= grain) {
+        func(0, count);
+        return;
+    }
+    // if func throws on this thread, the destructor of the group waits for the queued ranges before it propagates
+    CpuTaskGroup group;
+    splitRange(group, 0, count, grain, func);
+    group.wait();
+}
+
+};  // namespace nunchaku::kernels
@@ -0,0 +1,55 @@
+#pragma once
+
+#include "common.h"
+
+#include <atomic>
+#include <mutex>
+
+namespace nunchaku::kernels {
+
+// the worker pool shared by the CPU kernels, created on first use: NUNCHAKU_CPU_THREADS - 1 workers (default: one per
+// core allowed by the affinity mask) plus the thread that waits for the work, so ops never spawn threads themselves
+// every worker has its own deque and belongs to the NUMA node of its core (from /sys/devices/system/node); it runs its
+// newest task first and, when empty, steals the oldest task of a worker of its node before those of the other nodes
+// threads outside the pool queue their tasks on the node they run on and help with queued tasks while they wait, so
+// ops issued from several threads at once share the cores instead of oversubscribing them
+// NUNCHAKU_CPU_PIN=0 leaves the workers unpinned (default: each worker is pinned to one core, filling node by node,
+// unless there are more threads than cores)
+struct CpuRuntimeInfo {
+    int numThreads;             // workers + the waiting thread
+    int numNodes;
+    bool pinned;
+    std::vector<int> cpus;      // core of each worker, -1 if unpinned
+    std::vector<int> nodes;     // NUMA node of each worker
+};
+CpuRuntimeInfo cpuRuntimeInfo();
+
+// number of threads the CPU kernels split their work for, NUNCHAKU_CPU_THREADS (default: all cores)
+int cpuNumThreads();
+
+// tasks run on the pool; wait() runs queued tasks on the waiting thread until all tasks of the group are done, so a task
+// may open a group of its own and wait for it without holding up a worker
+// wait() rethrows the first exception of a task, the destructor waits as well but drops it
+class CpuTaskGroup {
+public:
+    CpuTaskGroup() = default;
+    CpuTaskGroup(const CpuTaskGroup &) = delete;
+    CpuTaskGroup &operator=(const CpuTaskGroup &) = delete;
+    ~CpuTaskGroup();
+
+    void run(std::function<void()> func);
+    void wait();
+
+private:
+    friend class CpuThreadPool;
+
+    std::atomic<int> pending = 0;
+    std::mutex mutex;
+    std::exception_ptr error;
+};
+
+// func(begin, end) on contiguous ranges of [0, count) of at most grain items (grain <= 0: about 4 per thread)
+// the range is halved recursively, idle workers steal the larger halves first
+void cpuParallelFor(int count, int grain, const std::function<void(int, int)> &func);
+
+};  // namespace nunchaku::kernels
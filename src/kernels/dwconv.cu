@@ -2,6 +2,7 @@
 #include "Tensor.h"
 
 #include "dispatch_cutlass.h"
+#include "dwconv_cpu.h"
 
 #include <cuda_runtime.h>
 #include "cutlass/cutlass.h"
@@ -201,6 +202,10 @@ Tensor depthwise_conv2d_kernel(Tensor A, Tensor B) {
 #endif
 
 Tensor dwconv_f16(Tensor input, Tensor weight, Tensor out, Tensor bias) {
+    if (input.device().type == Device::CPU) {
+        return dwconv_f16_cpu(input, weight, out, bias);
+    }
+
 
     assert(input.ndims() == 4);
 
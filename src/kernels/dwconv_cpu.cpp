@@ -0,0 +1,286 @@
+#include "dwconv_cpu.h"
+#include "kernels/cpu_plan.h"
+#include "kernels/cpu_common.h"
+
+namespace {
+
+using namespace nunchaku::kernels;
+
+constexpr int MAX_TILE_H = 16;                  // output rows of a task, each channel block reads 2 more input rows
+constexpr int WINDOW_BYTES = 256 << 10;         // 3 input rows of a channel block, fits L2
+constexpr int CHANNEL_ALIGN = 16;               // channel blocks are whole AVX-512 vectors of FP32
+
+struct ConvProblem {
+    Tensor::ScalarType dtype;
+    int W, C;
+    size_t inPixel, outPixel;       // elements between pixels of a row of input / out
+    std::vector<float> weight;      // [3, 3, C]
+    std::vector<float> bias;        // [C], zeros without bias
+};
+
+// out[x, c0 .. c1) of one output row for all x, rows[dy] is input row y + dy - 1, only rows [dy0, dy1) are inside the image
+using RowKernel = void (*)(const ConvProblem &p, const uint16_t *const *rows, int dy0, int dy1, uint16_t *out, int c0, int c1);
+
+struct KernelInfo {
+    const char *name;
+    RowKernel kernel;
+};
+
+void rowKernelScalar(const ConvProblem &p, const uint16_t *const *rows, int dy0, int dy1, uint16_t *out, int c0, int c1) {
+    for (int x = 0; x < p.W; x++) {
+        const int dx0 = x == 0 ? 1 : 0;
+        const int dx1 = x == p.W - 1 ? 2 : 3;
+        for (int c = c0; c < c1; c++) {
+            float acc = p.bias[c];
+            for (int dy = dy0; dy < dy1; dy++) {
+                for (int dx = dx0; dx < dx1; dx++) {
+                    acc += p.weight[(dy * 3 + dx) * p.C + c] * halfToFloat(rows[dy][(x + dx - 1) * p.inPixel + c], p.dtype);
+                }
+            }
+            out[x * p.outPixel + c] = floatToHalf(acc, p.dtype);
+        }
+    }
+}
+
+#if HOST_SIMD
+
+// 8 channels per register; the pixels of a row are swept in blocks of XB with independent accumulators, all channels
+// of a block before the next one, so that the loads walk along the contiguous channels of a few pixels
+TARGET_AVX2
+void rowKernelAVX2(const ConvProblem &p, const uint16_t *const *rows, int dy0, int dy1, uint16_t *out, int c0, int c1) {
+    constexpr int V = 8;
+    constexpr int XB = 4;
+    const bool bf16 = p.dtype == Tensor::BF16;
+    const int W = p.W;
+    const size_t ps = p.inPixel;
+    const int cv = c0 + (c1 - c0) / V * V;
+    int x = 0;
+    while (x < W) {
+        if (x > 0 && x + XB < W) {
+            for (int c = c0; c < cv; c += V) {
+                __m256 acc[XB];
+                for (int i = 0; i < XB; i++) {
+                    acc[i] = _mm256_loadu_ps(&p.bias[c]);
+                }
+                for (int dy = dy0; dy < dy1; dy++) {
+                    const __m256 w0 = _mm256_loadu_ps(&p.weight[(dy * 3) * p.C + c]);
+                    const __m256 w1 = _mm256_loadu_ps(&p.weight[(dy * 3 + 1) * p.C + c]);
+                    const __m256 w2 = _mm256_loadu_ps(&p.weight[(dy * 3 + 2) * p.C + c]);
+                    const uint16_t *in = rows[dy] + (x - 1) * ps + c;
+                    // the pixels are a row of channels apart, too far for the hardware prefetcher
+                    for (int i = XB + 2; i < 2 * XB + 2; i++) {
+                        _mm_prefetch((const char *)(in + i * ps), _MM_HINT_T0);
+                    }
+                    __m256 v[XB + 2];
+                    for (int i = 0; i < XB + 2; i++) {
+                        v[i] = loadHalf8(in + i * ps, bf16);
+                    }
+                    for (int i = 0; i < XB; i++) {
+                        acc[i] = _mm256_fmadd_ps(w0, v[i], acc[i]);
+                        acc[i] = _mm256_fmadd_ps(w1, v[i + 1], acc[i]);
+                        acc[i] = _mm256_fmadd_ps(w2, v[i + 2], acc[i]);
+                    }
+                }
+                for (int i = 0; i < XB; i++) {
+                    storeHalf8(out + (x + i) * p.outPixel + c, acc[i], bf16);
+                }
+            }
+            x += XB;
+            continue;
+        }
+        // borders and the pixels left over by the blocks
+        for (int c = c0; c < cv; c += V) {
+            __m256 acc = _mm256_loadu_ps(&p.bias[c]);
+            for (int dy = dy0; dy < dy1; dy++) {
+                for (int dx = x == 0 ? 1 : 0; dx < (x == W - 1 ? 2 : 3); dx++) {
+                    acc = _mm256_fmadd_ps(_mm256_loadu_ps(&p.weight[(dy * 3 + dx) * p.C + c]), loadHalf8(rows[dy] + (x + dx - 1) * ps + c, bf16), acc);
+                }
+            }
+            storeHalf8(out + x * p.outPixel + c, acc, bf16);
+        }
+        x++;
+    }
+    if (cv < c1) {
+        rowKernelScalar(p, rows, dy0, dy1, out, cv, c1);
+    }
+}
+
+TARGET_AVX512 inline __attribute__((always_inline))
+__m512 load16(const uint16_t *p, bool bf16) {
+    const __m256i h = _mm256_loadu_si256((const __m256i *)p);
+    return bf16 ? _mm512_castsi512_ps(_mm512_slli_epi32(_mm512_cvtepu16_epi32(h), 16)) : _mm512_cvtph_ps(h);
+}
+
+TARGET_AVX512 inline __attribute__((always_inline))
+void store16(uint16_t *p, __m512 v, bool bf16) {
+    if (!bf16) {
+        _mm256_storeu_si256((__m256i *)p, _mm512_cvtps_ph(v, _MM_FROUND_TO_NEAREST_INT));
+        return;
+    }
+    const __m512i bits = _mm512_castps_si512(v);
+    const __m512i lsb = _mm512_and_si512(_mm512_srli_epi32(bits, 16), _mm512_set1_epi32(1));
+    const __m512i r = _mm512_srli_epi32(_mm512_add_epi32(bits, _mm512_add_epi32(lsb, _mm512_set1_epi32(0x7fff))), 16);
+    _mm256_storeu_si256((__m256i *)p, _mm512_cvtepi32_epi16(r));
+}
+
+// 16 channels per register
+TARGET_AVX512
+void rowKernelAVX512(const ConvProblem &p, const uint16_t *const *rows, int dy0, int dy1, uint16_t *out, int c0, int c1) {
+    constexpr int V = 16;
+    constexpr int XB = 8;
+    const bool bf16 = p.dtype == Tensor::BF16;
+    const int W = p.W;
+    const size_t ps = p.inPixel;
+    const int cv = c0 + (c1 - c0) / V * V;
+    int x = 0;
+    while (x < W) {
+        if (x > 0 && x + XB < W) {
+            for (int c = c0; c < cv; c += V) {
+                __m512 acc[XB];
+                for (int i = 0; i < XB; i++) {
+                    acc[i] = _mm512_loadu_ps(&p.bias[c]);
+                }
+                for (int dy = dy0; dy < dy1; dy++) {
+                    const __m512 w0 = _mm512_loadu_ps(&p.weight[(dy * 3) * p.C + c]);
+                    const __m512 w1 = _mm512_loadu_ps(&p.weight[(dy * 3 + 1) * p.C + c]);
+                    const __m512 w2 = _mm512_loadu_ps(&p.weight[(dy * 3 + 2) * p.C + c]);
+                    const uint16_t *in = rows[dy] + (x - 1) * ps + c;
+                    // the pixels are a row of channels apart, too far for the hardware prefetcher
+                    for (int i = XB + 2; i < 2 * XB + 2; i++) {
+                        _mm_prefetch((const char *)(in + i * ps), _MM_HINT_T0);
+                    }
+                    __m512 v[XB + 2];
+                    for (int i = 0; i < XB + 2; i++) {
+                        v[i] = load16(in + i * ps, bf16);
+                    }
+                    for (int i = 0; i < XB; i++) {
+                        acc[i] = _mm512_fmadd_ps(w0, v[i], acc[i]);
+                        acc[i] = _mm512_fmadd_ps(w1, v[i + 1], acc[i]);
+                        acc[i] = _mm512_fmadd_ps(w2, v[i + 2], acc[i]);
+                    }
+                }
+                for (int i = 0; i < XB; i++) {
+                    store16(out + (x + i) * p.outPixel + c, acc[i], bf16);
+                }
+            }
+            x += XB;
+            continue;
+        }
+        // borders and the pixels left over by the blocks
+        for (int c = c0; c < cv; c += V) {
+            __m512 acc = _mm512_loadu_ps(&p.bias[c]);
+            for (int dy = dy0; dy < dy1; dy++) {
+                for (int dx = x == 0 ? 1 : 0; dx < (x == W - 1 ? 2 : 3); dx++) {
+                    acc = _mm512_fmadd_ps(_mm512_loadu_ps(&p.weight[(dy * 3 + dx) * p.C + c]), load16(rows[dy] + (x + dx - 1) * ps + c, bf16), acc);
+                }
+            }
+            store16(out + x * p.outPixel + c, acc, bf16);
+        }
+        x++;
+    }
+    if (cv < c1) {
+        rowKernelAVX2(p, rows, dy0, dy1, out, cv, c1);
+    }
+}
+
+#endif
+
+KernelInfo selectKernel() {
+    const std::string forced = forcedISA();
+#if HOST_SIMD
+    if ((forced.empty() || forced == "avx512") && hasAVX512()) {
+        return KernelInfo{"avx512", rowKernelAVX512};
+    }
+    if ((forced.empty() || forced == "avx512" || forced == "avx2") && hasAVX2()) {
+        return KernelInfo{"avx2", rowKernelAVX2};
+    }
+#endif
+    return KernelInfo{"scalar", rowKernelScalar};
+}
+
+};  // namespace
+
+Tensor dwconv_f16_cpu(Tensor input, Tensor weight, Tensor out, Tensor bias) {
+    nunchaku::kernels::CpuPlanStep step;
+    assert(input.ndims() == 4);
+    const int N = input.size(0);
+    const int H = input.size(1);
+    const int W = input.size(2);
+    const int C = input.size(3);
+    const Tensor::ScalarType dtype = input.dtype();
+
+    if (weight.ndims() != 4 || weight.size(0) != C || weight.size(1) != 3 || weight.size(2) != 3 || weight.size(3) != 1) {
+        throw std::invalid_argument(spdlog::fmt_lib::format("dwconv_f16_cpu needs a [{}, 3, 3, 1] weight, got {}", C, weight.shape.str()));
+    }
+    if (!out.valid()) {
+        out = Tensor::allocate({N, H, W, C}, dtype, input.device());
+    }
+    assert(out.ndims() == 4);
+    assert(out.size(0) == N && out.size(1) == H && out.size(2) == W && out.size(3) == C);
+    for (auto tensor : {input, weight, out, bias}) {
+        if (tensor.valid() && tensor.device().type != Device::CPU) {
+            throw std::invalid_argument("All operands of dwconv_f16_cpu must be CPU tensors");
+        }
+    }
+    if (input.stride(3) != 1 || out.stride(3) != 1 || !weight.is_contiguous() || (bias.valid() && !bias.is_contiguous())) {
+        throw std::invalid_argument("dwconv_f16_cpu needs contiguous channels and a contiguous weight / bias");
+    }
+    assert(weight.dtype() == dtype && out.dtype() == dtype);
+    assert(!bias.valid() || (bias.dtype() == dtype && bias.numel() == (size_t)C));
+
+    ConvProblem p;
+    p.dtype = dtype;
+    p.W = W;
+    p.C = C;
+    p.inPixel = input.stride(2);
+    p.outPixel = out.stride(2);
+
+    // enough row tiles for all threads, taller tiles read fewer rows twice
+    const int tileH = std::clamp(ceilDiv(N * H, nunchaku::kernels::cpuNumThreads()), 1, MAX_TILE_H);
+    const int tilesH = ceilDiv(H, tileH);
+    const int channelBlock = std::min(C, std::max(CHANNEL_ALIGN, WINDOW_BYTES / (3 * W * 2) / CHANNEL_ALIGN * CHANNEL_ALIGN));
+
+    const KernelInfo kernel = selectKernel();
+    spdlog::trace("dwconv_f16_cpu: N={} H={} W={} C={} tileH={} channelBlock={} kernel={}", N, H, W, C, tileH, channelBlock, kernel.name);
+
+    auto run = [p, N, H, tileH, tilesH, channelBlock, kernel](Tensor input, Tensor weight, Tensor out, Tensor bias) mutable {
+        const int C = p.C;
+        p.weight.resize((size_t)9 * C);
+        p.bias.assign(C, 0.0f);
+        const uint16_t *w = weight.data_ptr<uint16_t>();
+        for (int c = 0; c < C; c++) {
+            for (int t = 0; t < 9; t++) {
+                p.weight[(size_t)t * C + c] = halfToFloat(w[c * 9 + t], p.dtype);
+            }
+            if (bias.valid()) {
+                p.bias[c] = halfToFloat(bias.data_ptr<uint16_t>()[c], p.dtype);
+            }
+        }
+
+        const uint16_t *in = input.data_ptr<uint16_t>();
+        uint16_t *output = out.data_ptr<uint16_t>();
+        const size_t inImage = input.stride(0), inRow = input.stride(1);
+        const size_t outImage = out.stride(0), outRow = out.stride(1);
+
+        parallelFor(N * tilesH, [&](int begin, int end) {
+            for (int task = begin; task < end; task++) {
+                const int n = task / tilesH;
+                const int y0 = task % tilesH * tileH;
+                const int y1 = std::min(H, y0 + tileH);
+                for (int c0 = 0; c0 < C; c0 += channelBlock) {
+                    const int c1 = std::min(C, c0 + channelBlock);
+                    for (int y = y0; y < y1; y++) {
+                        const uint16_t *rows[3];
+                        for (int dy = 0; dy < 3; dy++) {
+                            rows[dy] = in + n * inImage + std::clamp(y + dy - 1, 0, H - 1) * inRow;
+                        }
+                        kernel.kernel(p, rows, y == 0 ? 1 : 0, y == H - 1 ? 2 : 3, output + n * outImage + y * outRow, c0, c1);
+                    }
+                }
+            }
+        });
+    };
+    run(input, weight, out, bias);
+    step.record(run, input, weight, out, bias);
+    return out;
+}
@@ -0,0 +1,13 @@
+#pragma once
+
+#include "common.h"
+#include "Tensor.h"
+
+// host implementation of dwconv_f16 for operands in CPU memory: depthwise 3x3 convolution, stride 1, zero padding 1
+// input / out are NHWC with contiguous channels (pixels and rows may be strided), weight is [C, 3, 3, 1]
+// accumulates in FP32 starting from the bias and rounds once, where the CUDA kernel accumulates in half
+// each task convolves a tile of rows of one image, one block of channels at a time so that the 3 input rows read
+// for an output row stay in L2 and the next row reuses 2 of them
+// NUNCHAKU_CPU_THREADS sets the number of threads (default: all cores)
+// NUNCHAKU_CPU_GEMM_ISA=scalar|avx2|avx512 forces a code path (default: best supported)
+Tensor dwconv_f16_cpu(Tensor input, Tensor weight, Tensor out, Tensor bias);
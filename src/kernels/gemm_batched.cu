@@ -1,4 +1,5 @@
 #include "gemm_batched.h"
+#include "gemm_f16_cpu.h"
 
 #include <cutlass/core_io.h>
 #include <cutlass/cutlass.h>
@@ -15,6 +16,10 @@ Tensor gemm_batched_fp16(
     Tensor out  // FP32 row-major [(... batch ...), M, N]
 )
 {
+    if (a.device().type == Device::CPU) {
+        return gemm_batched_fp16_cpu(a, b, out);
+    }
+
     const int M = a.shape[-2];
     const int K = a.shape[-1];
     const int N = a.shape[-2];
@@ -1,4 +1,5 @@
 #include "gemm_f16.h"
+#include "gemm_f16_cpu.h"
 
 #include "dispatch_cutlass.h"
 
@@ -18,6 +19,10 @@ Tensor gemm_f16(Tensor input,  // FP16
                 Tensor bias,
                 float alpha
 ) {
+    if (input.device().type == Device::CPU) {
+        return gemm_f16_cpu(input, weight, out, bias, alpha);
+    }
+
     auto N = weight.size(0);
     auto K = input.size(-1);
     auto M = input.numel() / K;
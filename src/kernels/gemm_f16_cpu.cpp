@@ -0,0 +1,489 @@
+#include "gemm_f16_cpu.h"
+#include "kernels/cpu_plan.h"
+#include "kernels/cpu_common.h"
+
+using spdlog::fmt_lib::format;
+
+namespace {
+
+using namespace nunchaku::kernels;
+
+constexpr int NR = 16;          // columns of a packed panel of B, one AVX-512 register / AMX tile row of FP32
+constexpr int ROW_ALIGN = 16;   // rows of the packed A are padded to the rows of an AMX tile
+constexpr int MB = 64;          // rows of A per task
+constexpr int KC = 256;         // depth of a pass, the panel slice of B stays in L1
+constexpr int AMX_K = 32;       // BF16 depth of an AMX tile, the packed BF16 depth is padded to it
+constexpr int PACK_K = 32;      // depth of a slice of B transposed at once while packing
+
+// below this many FLOPs per thread the threads cost more than they save
+constexpr size_t MIN_FLOPS_PER_THREAD = 4 << 20;
+
+int ceilDiv(int a, int b) {
+    return (a + b - 1) / b;
+}
+
+// out = alpha * a @ b^T + bias for each matrix of a batch, the rows of every operand are ld elements apart
+// a GEMM as checked by its entry point, the operands are passed to runGemm
+struct GemmProblem {
+    Tensor::ScalarType dtype;       // of a, b and bias
+    Tensor::ScalarType outType;     // dtype or FP32
+    int M, N, K;
+    float alpha;
+    std::vector<size_t> a;          // element offsets of the matrices of the batch
+    std::vector<size_t> b;
+    std::vector<size_t> out;
+    size_t lda, ldb, ldo;
+};
+
+// c[MR, NR] += a[MR, kc] @ panel[kc, NR], a is the packed A (lda elements per row), b the packed panel at depth k0
+// FP32 kernels take FP32 operands with the panel as [kc, NR], BF16 kernels take BF16 pairs with the panel as [kc / 2, NR, 2]
+using MicroKernel = void (*)(const void *a, size_t lda, const void *b, int kc, float *c);
+
+struct KernelInfo {
+    const char *name;
+    MicroKernel kernel;
+    int MR;
+    bool bf16;      // operands stay BF16, otherwise they are converted to FP32
+    bool amx;       // threads configure the tiles before running the kernel
+};
+
+void convertRowScalar(const uint16_t *src, float *dst, int n, Tensor::ScalarType dtype) {
+    for (int i = 0; i < n; i++) {
+        dst[i] = halfToFloat(src[i], dtype);
+    }
+}
+
+template<int MR>
+void microKernelScalar(const void *a, size_t lda, const void *b, int kc, float *c) {
+    const float *pa = static_cast<const float *>(a);
+    const float *pb = static_cast<const float *>(b);
+    for (int k = 0; k < kc; k++) {
+        for (int i = 0; i < MR; i++) {
+            const float v = pa[i * lda + k];
+            for (int j = 0; j < NR; j++) {
+                c[i * NR + j] += v * pb[k * NR + j];
+            }
+        }
+    }
+}
+
+#if HOST_SIMD
+
+TARGET_AVX2
+void convertRowAVX2(const uint16_t *src, float *dst, int n, Tensor::ScalarType dtype) {
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        _mm256_storeu_ps(dst + i, loadHalf8(src + i, dtype == Tensor::BF16));
+    }
+    convertRowScalar(src + i, dst + i, n - i, dtype);
+}
+
+// 4 rows of 2 x 8 columns
+TARGET_AVX2
+void microKernelAVX2(const void *a, size_t lda, const void *b, int kc, float *c) {
+    constexpr int MR = 4;
+    const float *pa = static_cast<const float *>(a);
+    const float *pb = static_cast<const float *>(b);
+    __m256 acc[MR][2];
+    for (int i = 0; i < MR; i++) {
+        acc[i][0] = _mm256_loadu_ps(c + i * NR);
+        acc[i][1] = _mm256_loadu_ps(c + i * NR + 8);
+    }
+    for (int k = 0; k < kc; k++) {
+        const __m256 b0 = _mm256_loadu_ps(pb + k * NR);
+        const __m256 b1 = _mm256_loadu_ps(pb + k * NR + 8);
+        for (int i = 0; i < MR; i++) {
+            const __m256 v = _mm256_broadcast_ss(pa + i * lda + k);
+            acc[i][0] = _mm256_fmadd_ps(v, b0, acc[i][0]);
+            acc[i][1] = _mm256_fmadd_ps(v, b1, acc[i][1]);
+        }
+    }
+    for (int i = 0; i < MR; i++) {
+        _mm256_storeu_ps(c + i * NR, acc[i][0]);
+        _mm256_storeu_ps(c + i * NR + 8, acc[i][1]);
+    }
+}
+
+// 8 rows of 16 columns
+TARGET_AVX512
+void microKernelAVX512(const void *a, size_t lda, const void *b, int kc, float *c) {
+    constexpr int MR = 8;
+    const float *pa = static_cast<const float *>(a);
+    const float *pb = static_cast<const float *>(b);
+    __m512 acc[MR];
+    for (int i = 0; i < MR; i++) {
+        acc[i] = _mm512_loadu_ps(c + i * NR);
+    }
+    for (int k = 0; k < kc; k++) {
+        const __m512 vb = _mm512_loadu_ps(pb + k * NR);
+        for (int i = 0; i < MR; i++) {
+            acc[i] = _mm512_fmadd_ps(_mm512_set1_ps(pa[i * lda + k]), vb, acc[i]);
+        }
+    }
+    for (int i = 0; i < MR; i++) {
+        _mm512_storeu_ps(c + i * NR, acc[i]);
+    }
+}
+
+// 8 rows of 16 columns, each vdpbf16ps adds the products of 2 consecutive k in FP32
+TARGET_AVX512_BF16
+void microKernelAVX512BF16(const void *a, size_t lda, const void *b, int kc, float *c) {
+    constexpr int MR = 8;
+    const uint16_t *pa = static_cast<const uint16_t *>(a);
+    const uint16_t *pb = static_cast<const uint16_t *>(b);
+    __m512 acc[MR];
+    for (int i = 0; i < MR; i++) {
+        acc[i] = _mm512_loadu_ps(c + i * NR);
+    }
+    for (int k = 0; k < kc; k += 2) {
+        const __m512bh vb = (__m512bh)_mm512_loadu_si512(pb + k * NR);
+        for (int i = 0; i < MR; i++) {
+            int32_t pair;
+            memcpy(&pair, pa + i * lda + k, sizeof(pair));
+            acc[i] = _mm512_dpbf16_ps(acc[i], (__m512bh)_mm512_set1_epi32(pair), vb);
+        }
+    }
+    for (int i = 0; i < MR; i++) {
+        _mm512_storeu_ps(c + i * NR, acc[i]);
+    }
+}
+
+// tile 0: c [16, 16] FP32, tile 1: a [16, 32] BF16, tile 2: b [16, 16 x 2] BF16 pairs
+struct alignas(64) TileConfig {
+    uint8_t palette;
+    uint8_t startRow;
+    uint8_t reserved[14];
+    uint16_t colsb[16];
+    uint8_t rows[16];
+};
+
+// a static object: some compilers declare only its first bytes as read by ldtilecfg and drop stores to the rest
+constexpr TileConfig makeTileConfig() {
+    TileConfig cfg = {};
+    cfg.palette = 1;
+    for (int t = 0; t < 3; t++) {
+        cfg.rows[t] = ROW_ALIGN;
+        cfg.colsb[t] = 64;
+    }
+    return cfg;
+}
+constexpr TileConfig TILE_CONFIG = makeTileConfig();
+
+TARGET_AMX_BF16
+void amxBegin() {
+    _tile_loadconfig(&TILE_CONFIG);
+}
+
+TARGET_AMX_BF16
+void amxEnd() {
+    _tile_release();
+}
+
+// 16 rows of 16 columns
+TARGET_AMX_BF16
+void microKernelAMX(const void *a, size_t lda, const void *b, int kc, float *c) {
+    const uint16_t *pa = static_cast<const uint16_t *>(a);
+    const uint16_t *pb = static_cast<const uint16_t *>(b);
+    _tile_loadd(0, c, NR * sizeof(float));
+    for (int k = 0; k < kc; k += AMX_K) {
+        _tile_loadd(1, pa + k, lda * sizeof(uint16_t));
+        _tile_loadd(2, pb + k * NR, NR * 2 * sizeof(uint16_t));
+        _tile_dpbf16ps(0, 1, 2);
+    }
+    _tile_stored(0, c, NR * sizeof(float));
+}
+
+#endif
+
+// FP16 never takes the BF16 kernels, converting it to BF16 would round its mantissa
+KernelInfo selectKernel(Tensor::ScalarType dtype) {
+    const std::string forced = forcedISA();
+    const bool bf16 = dtype == Tensor::BF16;
+#if HOST_SIMD
+    if (bf16 && (forced.empty() || forced == "amx") && hasAMXBF16()) {
+        return KernelInfo{"amx", microKernelAMX, 16, true, true};
+    }
+    if (bf16 && (forced.empty() || forced == "amx" || forced == "avx512bf16") && hasAVX512BF16()) {
+        return KernelInfo{"avx512bf16", microKernelAVX512BF16, 8, true, false};
+    }
+    if ((forced.empty() || forced == "amx" || forced == "avx512bf16" || forced == "avx512") && hasAVX512()) {
+        return KernelInfo{"avx512", microKernelAVX512, 8, false, false};
+    }
+    if (forced != "scalar" && hasAVX2()) {
+        return KernelInfo{"avx2", microKernelAVX2, 4, false, false};
+    }
+#endif
+    return KernelInfo{"scalar", microKernelScalar<4>, 4, false, false};
+}
+
+void convertRow(const uint16_t *src, float *dst, int n, Tensor::ScalarType dtype) {
+#if HOST_SIMD
+    if (hasAVX2()) {
+        return convertRowAVX2(src, dst, n, dtype);
+    }
+#endif
+    convertRowScalar(src, dst, n, dtype);
+}
+
+// element offsets of the matrices [rows, cols] of a tensor [(... batch ...), rows, cols], in the order of the flattened batch
+std::vector<size_t> batchOffsets(const Tensor &t, int batch) {
+    std::vector<size_t> result;
+    const int numLead = std::max<int>(0, (int)t.ndims() - 2);
+    std::vector<int> idx(numLead, 0);
+    for (int i = 0; i < batch; i++) {
+        size_t offset = 0;
+        for (int d = 0; d < numLead; d++) {
+            offset += idx[d] * t.stride(d);
+        }
+        result.push_back(offset);
+        for (int d = numLead - 1; d >= 0 && ++idx[d] == t.shape[d]; d--) {
+            idx[d] = 0;
+        }
+    }
+    return result;
+}
+
+// bias is [N] or nullptr
+void runGemm(const GemmProblem &p, const KernelInfo &kernel, const uint16_t *aBase, const uint16_t *bBase, char *outBase, const uint16_t *bias) {
+    const int batch = p.a.size();
+    const int M = p.M, N = p.N, K = p.K;
+    const int Mpad = ceilDiv(M, ROW_ALIGN) * ROW_ALIGN;
+    const int Kpad = kernel.bf16 ? ceilDiv(K, AMX_K) * AMX_K : K;
+    const int panels = ceilDiv(N, NR);
+    const int mBlocks = ceilDiv(Mpad, MB);
+    const size_t elemSize = kernel.bf16 ? sizeof(uint16_t) : sizeof(float);
+    const size_t sizeA = (size_t)Mpad * Kpad;
+    const size_t sizePanel = (size_t)Kpad * NR;
+
+    const size_t flops = 2 * (size_t)batch * M * N * K;
+    const int numThreads = std::max<int>(1, std::min<size_t>(nunchaku::kernels::cpuNumThreads(), flops / MIN_FLOPS_PER_THREAD));
+    spdlog::trace("gemm_f16_cpu: batch={} M={} N={} K={} kernel={} threads={}", batch, M, N, K, kernel.name, numThreads);
+
+    // pack A into rows of Kpad and B into panels of NR columns, converted to FP32 unless the kernel takes BF16
+    // zeros pad the rows of A to Mpad, the depth to Kpad and the last panel to NR columns
+    // the buffers are kept across calls, first touching fresh pages costs as much as the packing itself
+    static thread_local std::vector<char> scratchA, scratchB;
+    scratchA.resize(std::max(scratchA.size(), batch * sizeA * elemSize));
+    scratchB.resize(std::max(scratchB.size(), batch * panels * sizePanel * elemSize));
+    char *const packedA = scratchA.data();
+    char *const packedB = scratchB.data();
+    parallelFor(batch * (mBlocks + panels), numThreads, [&](int begin, int end) {
+        for (int job = begin; job < end; job++) {
+            const int bi = job / (mBlocks + panels);
+            const int idx = job % (mBlocks + panels);
+            if (idx < mBlocks) {
+                for (int i = idx * MB; i < std::min(Mpad, (idx + 1) * MB); i++) {
+                    const uint16_t *src = aBase + p.a[bi] + i * p.lda;
+                    char *dst = packedA + (bi * sizeA + (size_t)i * Kpad) * elemSize;
+                    const int valid = i < M ? K : 0;
+                    if (kernel.bf16) {
+                        memcpy(dst, src, valid * sizeof(uint16_t));
+                    } else {
+                        convertRow(src, reinterpret_cast<float *>(dst), valid, p.dtype);
+                    }
+                    memset(dst + valid * elemSize, 0, (Kpad - valid) * elemSize);
+                }
+            } else {
+                // PACK_K deep slices of the NR rows of B are transposed through a tile, the panel is written in whole cache lines
+                const int panel = idx - mBlocks;
+                const int cols = std::min(NR, N - panel * NR);
+                char *dst = packedB + ((size_t)bi * panels + panel) * sizePanel * elemSize;
+                for (int k0 = 0; k0 < Kpad; k0 += PACK_K) {
+                    const int depth = std::min(PACK_K, Kpad - k0);
+                    const int valid = std::min(depth, K - k0);
+                    if (kernel.bf16) {
+                        // pairs of consecutive k stay together
+                        uint32_t tile[NR][PACK_K / 2] = {};
+                        for (int j = 0; j < cols; j++) {
+                            memcpy(tile[j], bBase + p.b[bi] + (panel * NR + j) * p.ldb + k0, valid * sizeof(uint16_t));
+                        }
+                        uint32_t *pairs = reinterpret_cast<uint32_t *>(dst) + k0 / 2 * NR;
+                        for (int kk = 0; kk < depth / 2; kk++) {
+                            for (int j = 0; j < NR; j++) {
+                                pairs[kk * NR + j] = tile[j][kk];
+                            }
+                        }
+                    } else {
+                        float tile[NR][PACK_K] = {};
+                        for (int j = 0; j < cols; j++) {
+                            convertRow(bBase + p.b[bi] + (panel * NR + j) * p.ldb + k0, tile[j], valid, p.dtype);
+                        }
+                        float *values = reinterpret_cast<float *>(dst) + k0 * NR;
+                        for (int kk = 0; kk < depth; kk++) {
+                            for (int j = 0; j < NR; j++) {
+                                values[kk * NR + j] = tile[j][kk];
+                            }
+                        }
+                    }
+                }
+            }
+        }
+    });
+
+    // tasks of MB rows x NR columns, the panels of a row block are adjacent so a thread reuses its rows of A from L2
+    parallelFor(batch * mBlocks * panels, numThreads, [&](int begin, int end) {
+#if HOST_SIMD
+        if (kernel.amx) {
+            amxBegin();
+        }
+#endif
+        float acc[MB * NR];
+        for (int task = begin; task < end; task++) {
+            const int bi = task / (mBlocks * panels);
+            const int mb = task / panels % mBlocks;
+            const int panel = task % panels;
+            const int row0 = mb * MB;
+            const int rows = std::min(MB, Mpad - row0);
+            const char *a = packedA + (bi * sizeA + (size_t)row0 * Kpad) * elemSize;
+            const char *b = packedB + ((size_t)bi * panels + panel) * sizePanel * elemSize;
+
+            std::fill_n(acc, rows * NR, 0.0f);
+            for (int k0 = 0; k0 < Kpad; k0 += KC) {
+                const int kc = std::min(KC, Kpad - k0);
+                for (int r = 0; r < rows; r += kernel.MR) {
+                    kernel.kernel(a + ((size_t)r * Kpad + k0) * elemSize, Kpad, b + (size_t)k0 * NR * elemSize, kc, acc + r * NR);
+                }
+            }
+
+            for (int i = 0; i < std::min(rows, M - row0); i++) {
+                char *out = outBase + (p.out[bi] + (row0 + i) * p.ldo) * (p.outType == Tensor::FP32 ? sizeof(float) : sizeof(uint16_t));
+                for (int j = 0; j < std::min(NR, N - panel * NR); j++) {
+                    const int n = panel * NR + j;
+                    float v = p.alpha * acc[i * NR + j];
+                    if (bias) {
+                        v += halfToFloat(bias[n], p.dtype);
+                    }
+                    if (p.outType == Tensor::FP32) {
+                        reinterpret_cast<float *>(out)[n] = v;
+                    } else {
+                        reinterpret_cast<uint16_t *>(out)[n] = floatToHalf(v, p.outType);
+                    }
+                }
+            }
+        }
+#if HOST_SIMD
+        if (kernel.amx) {
+            amxEnd();
+        }
+#endif
+    });
+}
+
+void checkOperand(const Tensor &t, const char *name) {
+    if (t.device().type != Device::CPU) {
+        throw std::invalid_argument(format("{} of the CPU GEMM must be in CPU memory", name));
+    }
+    if (t.ndims() >= 2 && t.stride(-1) != 1) {
+        throw std::invalid_argument(format("{} of the CPU GEMM must have contiguous rows", name));
+    }
+}
+
+}; // namespace
+
+Tensor gemm_f16_cpu(Tensor input, Tensor weight, Tensor out, Tensor bias, float alpha) {
+    nunchaku::kernels::CpuPlanStep step;
+    checkOperand(input, "input");
+    checkOperand(weight, "weight");
+    const int N = weight.size(0);
+    const int K = input.size(-1);
+    if (weight.ndims() != 2 || weight.size(1) != K) {
+        throw std::invalid_argument(format("gemm_f16_cpu: weight must be [N, {}]", K));
+    }
+    const Tensor::ScalarType dtype = weight.scalar_type();
+    if ((dtype != Tensor::FP16 && dtype != Tensor::BF16) || input.scalar_type() != dtype || (bias.valid() && bias.scalar_type() != dtype)) {
+        throw std::invalid_argument("gemm_f16_cpu needs FP16 or BF16 operands of the same type");
+    }
+    assert(!bias.valid() || (bias.ndims() == 1 && bias.shape[0] == N && bias.is_contiguous()));
+
+    if (!out.valid()) {
+        auto out_shape = TensorShape(input.shape.dataExtent);
+        out_shape[-1] = N;
+        out = Tensor::empty(out_shape, dtype, Device::cpu());
+    }
+    checkOperand(out, "out");
+    assert(out.scalar_type() == dtype);
+    assert(out.shape[-1] == N);
+
+    GemmProblem p;
+    p.dtype = dtype;
+    p.outType = dtype;
+    p.N = N;
+    p.K = K;
+    p.alpha = alpha;
+    p.b = {0};
+    p.ldb = weight.stride(0);
+
+    // the tokens of contiguous operands are a single matrix, otherwise each matrix of the leading dims is one
+    if (input.ndims() <= 2 || (input.is_contiguous() && out.is_contiguous())) {
+        p.M = input.numel() / K;
+        p.lda = input.ndims() == 2 ? input.stride(0) : K;
+        p.ldo = out.ndims() == 2 ? out.stride(0) : N;
+        p.a = {0};
+        p.out = {0};
+    } else {
+        const int batch = input.numel() / ((size_t)input.size(-2) * K);
+        p.M = input.size(-2);
+        p.lda = input.stride(-2);
+        p.ldo = out.stride(-2);
+        p.a = batchOffsets(input, batch);
+        p.out = batchOffsets(out, batch);
+        p.b.assign(batch, 0);
+    }
+
+    auto run = [p, kernel = selectKernel(dtype)](Tensor input, Tensor weight, Tensor out, Tensor bias) {
+        runGemm(p, kernel, input.data_ptr<uint16_t>(), weight.data_ptr<uint16_t>(), out.data_ptr<char>(),
+            bias.valid() ? bias.data_ptr<uint16_t>() : nullptr);
+    };
+    run(input, weight, out, bias);
+    step.record(run, input, weight, out, bias);
+    return out;
+}
+
+Tensor gemm_batched_fp16_cpu(Tensor a, Tensor b, Tensor out) {
+    nunchaku::kernels::CpuPlanStep step;
+    checkOperand(a, "a");
+    checkOperand(b, "b");
+    const int M = a.shape[-2];
+    const int K = a.shape[-1];
+    const int N = b.shape[-2];
+    const int batch = a.numel() / ((size_t)M * K);
+    if (b.shape[-1] != K || b.numel() / ((size_t)N * K) != (size_t)batch) {
+        throw std::invalid_argument(format("gemm_batched_fp16_cpu: b must be [{}, N, {}]", batch, K));
+    }
+    const Tensor::ScalarType dtype = a.scalar_type();
+    if ((dtype != Tensor::FP16 && dtype != Tensor::BF16) || b.scalar_type() != dtype) {
+        throw std::invalid_argument("gemm_batched_fp16_cpu needs FP16 or BF16 operands of the same type");
+    }
+
+    if (!out.valid()) {
+        auto outShape = TensorShape(a.shape.dataExtent);
+        outShape[-1] = N;
+        out = Tensor::empty(outShape, Tensor::FP32, Device::cpu());
+    }
+    checkOperand(out, "out");
+    assert(out.dtype() == Tensor::FP32);
+    assert(M == out.shape[-2]);
+    assert(N == out.shape[-1]);
+    assert(out.numel() / ((size_t)M * N) == (size_t)batch);
+
+    GemmProblem p;
+    p.dtype = dtype;
+    p.outType = Tensor::FP32;
+    p.M = M;
+    p.N = N;
+    p.K = K;
+    p.alpha = 1.0f;
+    p.lda = a.stride(-2);
+    p.ldb = b.stride(-2);
+    p.ldo = out.stride(-2);
+    p.a = batchOffsets(a, batch);
+    p.b = batchOffsets(b, batch);
+    p.out = batchOffsets(out, batch);
+
+    auto run = [p, kernel = selectKernel(dtype)](Tensor a, Tensor b, Tensor out) {
+        runGemm(p, kernel, a.data_ptr<uint16_t>(), b.data_ptr<uint16_t>(), out.data_ptr<char>(), nullptr);
+    };
+    run(a, b, out);
+    step.record(run, a, b, out);
+    return out;
+}
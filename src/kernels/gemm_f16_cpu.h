@@ -0,0 +1,24 @@
+#pragma once
+
+#include "common.h"
+#include "Tensor.h"
+
+// host implementations of gemm_f16 and gemm_batched_fp16 for operands in CPU memory
+// FP16 / BF16 inputs are accumulated in FP32, the rows of the operands may be strided as the CUDA versions allow
+// BF16 runs on AMX tiles or AVX-512 BF16 dot products where present; FP16 and older CPUs convert to FP32 (AVX-512 or F16C + FMA)
+// NUNCHAKU_CPU_THREADS sets the number of threads (default: all cores)
+// NUNCHAKU_CPU_GEMM_ISA=scalar|avx2|avx512|avx512bf16|amx forces a code path (default: best supported for the dtype)
+
+Tensor gemm_f16_cpu(
+    Tensor input,  // FP16 / BF16 [..., K]
+    Tensor weight, // FP16 / BF16 [N, K]
+    Tensor out,    // FP16 / BF16 [..., N]
+    Tensor bias,   // [N]
+    float alpha
+);
+
+Tensor gemm_batched_fp16_cpu(
+    Tensor a,   // FP16 / BF16 row-major [(... batch ...), M, K]
+    Tensor b,   // FP16 / BF16 col-major [(... batch ...), N, K]
+    Tensor out  // FP32 row-major [(... batch ...), M, N]
+);
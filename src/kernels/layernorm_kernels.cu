@@ -1,5 +1,6 @@
 #include "layernorm_kernels_impl.cuh"
 #include "dispatch_utils.h"
+#include "misc_kernels_cpu.h"
 
 void rms_norm(Tensor &out,    // [..., hidden_size]
               Tensor &input,  // [..., hidden_size]
@@ -25,6 +26,9 @@ void rms_norm(Tensor &out,    // [..., hidden_size]
 }
 
 void layernorm_general(Tensor out, Tensor input, Tensor weight, Tensor bias, float epsilon) {
+  if (input.device().type == Device::CPU) {
+    return nunchaku::kernels::layernorm_cpu(out, input, weight, bias, epsilon);
+  }
   int hidden_size = input.size(-1);
   int num_tokens = input.numel() / hidden_size;
   dim3 grid(num_tokens);
@@ -1,10 +1,15 @@
 #include "misc_kernels_impl.cuh"
 #include "misc_kernels.h"
+#include "misc_kernels_cpu.h"
 #include "dispatch_utils.h"
 
 namespace nunchaku::kernels {
 
 Tensor add(Tensor a, Tensor b) {
+    if (a.device().type == Device::CPU) {
+        return add_cpu(a, b);
+    }
+
     assert(a.shape.dataExtent == b.shape.dataExtent);
     assert(a.dtype() == b.dtype());
     assert(a.is_contiguous());
@@ -60,6 +65,9 @@ void mul_add(Tensor x, Tensor scale, Tensor bias) {
 }
 
 void mul_add_batch(Tensor x, Tensor scale, bool batch_scale, double scale_shift, Tensor bias, bool batch_bias) {
+    if (x.device().type == Device::CPU) {
+        return mul_add_batch_cpu(x, scale, batch_scale, scale_shift, bias, batch_bias);
+    }
 
     const int batch_size = x.shape[0];
     assert(!batch_scale || scale.shape[0] == batch_size);
@@ -175,11 +183,6 @@ template<size_t N>
 std::array<Tensor, N> split_mod(Tensor input) {
     assert(input.shape[-1] % N == 0);
 
-    int threadsPerBlock = 1024;
-    int blocksPerGrid = (input.numel() + threadsPerBlock - 1) / threadsPerBlock;
-
-    auto stream = getCurrentCUDAStream();
-
     auto shapeOut = input.shape;
     shapeOut[-1] /= N;
 
@@ -187,6 +190,15 @@ std::array<Tensor, N> split_mod(Tensor input) {
     for (int k = 0; k < N; k++) {
         out[k] = Tensor::empty(shapeOut, input.scalar_type(), input.device());
     }
+    if (input.device().type == Device::CPU) {
+        split_mod_cpu(input, std::vector<Tensor>(out.begin(), out.end()));
+        return out;
+    }
+
+    int threadsPerBlock = 1024;
+    int blocksPerGrid = (input.numel() + threadsPerBlock - 1) / threadsPerBlock;
+
+    auto stream = getCurrentCUDAStream();
 
     dispatch(input.scalar_type(), [&]<typename scalar_t>() {
         std::array<scalar_t *, N> outPtr;
@@ -269,6 +281,10 @@ void cast(Tensor input, Tensor output) {
 }
 
 Tensor topk(Tensor x, int k) {
+    if (x.device().type == Device::CPU) {
+        return topk_cpu(x, k);
+    }
+
     constexpr int MAXK = 64 + 4;
 
     const int N = x.shape[-1];
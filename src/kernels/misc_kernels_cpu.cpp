@@ -0,0 +1,259 @@
+#include "misc_kernels_cpu.h"
+#include "kernels/cpu_plan.h"
+#include "kernels/cpu_common.h"
+
+#include <numeric>
+
+namespace nunchaku::kernels {
+
+Tensor topk_cpu(Tensor x, int k, Tensor out) {
+    CpuPlanStep step;
+    const int N = x.shape[-1];
+    if (k < 1 || k > N) {
+        throw std::invalid_argument(spdlog::fmt_lib::format("topk_cpu: k={} out of range for rows of {}", k, N));
+    }
+    if (x.device().type != Device::CPU || x.dtype() != Tensor::FP32 || x.stride(-1) != 1) {
+        throw std::invalid_argument("topk_cpu needs an FP32 CPU tensor with contiguous rows");
+    }
+    const size_t rows = x.numel() / N;
+    const size_t rowStride = x.ndims() >= 2 ? x.stride(-2) : N;   // as the CUDA kernel, rows are evenly strided
+    auto outShape = TensorShape(x.shape.dataExtent);
+    outShape[-1] = k;
+    outShape.dataStride.clear();
+    if (!out.valid()) {
+        out = Tensor::empty(outShape, Tensor::INT32, Device::cpu());
+    }
+    if (out.device().type != Device::CPU || out.dtype() != Tensor::INT32 || !out.is_contiguous() || out.sizes() != outShape.dataExtent) {
+        throw std::invalid_argument(spdlog::fmt_lib::format("topk_cpu: out must be a contiguous INT32 CPU tensor {}", outShape.str()));
+    }
+
+    // the rows are a few dozen pooled blocks, a partial sort per row is cheaper than waking threads
+    auto run = [N, k, rows, rowStride](Tensor x, Tensor out) {
+        std::vector<int32_t> idx(N);
+        for (size_t row = 0; row < rows; row++) {
+            const float *in = x.data_ptr<float>() + row * rowStride;
+            // NaN ranks below everything so that the order stays strict
+            auto key = [in](int32_t i) { return std::isnan(in[i]) ? -INFINITY : in[i]; };
+            std::iota(idx.begin(), idx.end(), 0);
+            std::partial_sort(idx.begin(), idx.begin() + k, idx.end(), [&key](int32_t a, int32_t b) {
+                return key(a) > key(b) || (key(a) == key(b) && a > b);
+            });
+            std::copy(idx.begin(), idx.begin() + k, out.data_ptr<int32_t>() + row * k);
+        }
+    };
+    run(x, out);
+    step.record(run, x, out);
+    return out;
+}
+
+namespace {
+
+void checkHalf(const char *op, const Tensor &t, Tensor::ScalarType dtype) {
+    if (t.device().type != Device::CPU || t.scalar_type() != dtype || (dtype != Tensor::FP16 && dtype != Tensor::BF16)) {
+        throw std::invalid_argument(spdlog::fmt_lib::format("{} needs FP16 or BF16 CPU tensors of one type", op));
+    }
+}
+
+void checkContiguous(const char *op, const Tensor &t) {
+    if (!t.is_contiguous()) {
+        throw std::invalid_argument(spdlog::fmt_lib::format("{} needs contiguous tensors", op));
+    }
+}
+
+};  // namespace
+
+Tensor add_cpu(Tensor a, Tensor b) {
+    CpuPlanStep step;
+    const auto dtype = a.scalar_type();
+    checkHalf("add_cpu", a, dtype);
+    checkHalf("add_cpu", b, dtype);
+    checkContiguous("add_cpu", a);
+    checkContiguous("add_cpu", b);
+    if (a.sizes() != b.sizes()) {
+        throw std::invalid_argument("add_cpu needs tensors of one shape");
+    }
+    Tensor out = Tensor::empty_like(a);
+
+    const int numel = a.numel();
+    auto run = [dtype, numel](Tensor a, Tensor b, Tensor out) {
+        const uint16_t *pa = a.data_ptr<uint16_t>();
+        const uint16_t *pb = b.data_ptr<uint16_t>();
+        uint16_t *pout = out.data_ptr<uint16_t>();
+        parallelFor(numel, [&](int begin, int end) {
+            for (int i = begin; i < end; i++) {
+                pout[i] = floatToHalf(halfToFloat(pa[i], dtype) + halfToFloat(pb[i], dtype), dtype);
+            }
+        });
+    };
+    run(a, b, out);
+    step.record(run, a, b, out);
+    return out;
+}
+
+void mul_add_batch_cpu(Tensor x, Tensor scale, bool batch_scale, double scale_shift, Tensor bias, bool batch_bias) {
+    CpuPlanStep step;
+    const auto dtype = x.scalar_type();
+    checkHalf("mul_add_batch_cpu", x, dtype);
+    checkHalf("mul_add_batch_cpu", bias, dtype);
+    if (scale.valid()) {
+        checkHalf("mul_add_batch_cpu", scale, dtype);
+    }
+    const int batch = x.shape[0];
+    const int numel = x.numel() / batch;
+    const int numelScale = scale.valid() ? scale.numel() / (batch_scale ? batch : 1) : 1;
+    const int numelBias = bias.numel() / (batch_bias ? batch : 1);
+    if ((batch_scale && scale.shape[0] != batch) || (batch_bias && bias.shape[0] != batch) || numel % numelScale != 0 ||
+        numel % numelBias != 0) {
+        throw std::invalid_argument(spdlog::fmt_lib::format(
+            "mul_add_batch_cpu: scale={} / bias={} do not tile x={}", scale.shape.str(), bias.shape.str(), x.shape.str()));
+    }
+    // as the CUDA kernel, every batch of x, scale and bias is contiguous from its batch stride on
+    const int64_t strideX = x.stride(0);
+    const int64_t strideScale = batch_scale ? scale.stride(0) : 0;
+    const int64_t strideBias = batch_bias ? bias.stride(0) : 0;
+    // the shift is added in the half type
+    const float shift = roundToHalf((float)scale_shift, dtype);
+
+    auto run = [=](Tensor x, Tensor scale, Tensor bias) {
+        uint16_t *px = x.data_ptr<uint16_t>();
+        const uint16_t *pscale = scale.valid() ? scale.data_ptr<uint16_t>() : nullptr;
+        const uint16_t *pbias = bias.data_ptr<uint16_t>();
+        const bool fp16 = dtype == Tensor::FP16;
+        parallelFor(batch * (numel / numelBias), [&](int begin, int end) {
+            for (int chunk = begin; chunk < end; chunk++) {
+                const int b = chunk / (numel / numelBias);
+                const int base = chunk % (numel / numelBias) * numelBias;
+                uint16_t *rx = px + strideX * b + base;
+                const uint16_t *rbias = pbias + strideBias * b;
+                for (int i = 0; i < numelBias; i++) {
+                    float tmp = halfToFloat(rx[i], dtype);
+                    if (pscale) {
+                        const float s = halfToFloat(pscale[strideScale * b + (base + i) % numelScale], dtype);
+                        tmp = roundToHalf(tmp * roundToHalf(s + shift, dtype), dtype);
+                    }
+                    tmp = roundToHalf(tmp + halfToFloat(rbias[i], dtype), dtype);
+                    if (fp16) {
+                        tmp = std::clamp(tmp, -65504.0f, 65504.0f);
+                    }
+                    rx[i] = floatToHalf(tmp, dtype);
+                }
+            }
+        });
+    };
+    run(x, scale, bias);
+    step.record(run, x, scale, bias);
+}
+
+void split_mod_cpu(Tensor input, std::vector<Tensor> out) {
+    CpuPlanStep step;
+    const auto dtype = input.scalar_type();
+    const int N = out.size();
+    checkHalf("split_mod_cpu", input, dtype);
+    checkContiguous("split_mod_cpu", input);
+    for (auto &t : out) {
+        checkHalf("split_mod_cpu", t, dtype);
+        checkContiguous("split_mod_cpu", t);
+        if (t.numel() * N != input.numel()) {
+            throw std::invalid_argument(spdlog::fmt_lib::format(
+                "split_mod_cpu: out={} is not a 1/{} of input={}", t.shape.str(), N, input.shape.str()));
+        }
+    }
+
+    const int rows = input.numel() / N;
+    auto run = [dtype, N, rows](Tensor input, std::vector<Tensor> out) {
+        const uint16_t *in = input.data_ptr<uint16_t>();
+        parallelFor(rows, [&](int begin, int end) {
+            for (int k = 0; k < N; k++) {
+                uint16_t *dst = out[k].data_ptr<uint16_t>();
+                for (int i = begin; i < end; i++) {
+                    dst[i] = in[(size_t)i * N + k];
+                }
+            }
+        });
+    };
+    run(input, out);
+    step.record(run, input, out);
+}
+
+void silu_cpu(Tensor out, Tensor input) {
+    CpuPlanStep step;
+    const auto dtype = input.scalar_type();
+    checkHalf("silu_cpu", input, dtype);
+    checkHalf("silu_cpu", out, dtype);
+    checkContiguous("silu_cpu", input);
+    checkContiguous("silu_cpu", out);
+    if (out.numel() != input.numel()) {
+        throw std::invalid_argument(spdlog::fmt_lib::format("silu_cpu: out={} for input={}", out.shape.str(), input.shape.str()));
+    }
+
+    const int numel = input.numel();
+    auto run = [dtype, numel](Tensor out, Tensor input) {
+        const uint16_t *in = input.data_ptr<uint16_t>();
+        uint16_t *pout = out.data_ptr<uint16_t>();
+        parallelFor(numel, [&](int begin, int end) {
+            for (int i = begin; i < end; i++) {
+                const float x = halfToFloat(in[i], dtype);
+                pout[i] = floatToHalf(x / (1.0f + expf(-x)), dtype);
+            }
+        });
+    };
+    run(out, input);
+    step.record(run, out, input);
+}
+
+void layernorm_cpu(Tensor out, Tensor input, Tensor weight, Tensor bias, float eps) {
+    CpuPlanStep step;
+    const auto dtype = input.scalar_type();
+    const int hidden = input.shape[-1];
+    checkHalf("layernorm_cpu", input, dtype);
+    checkHalf("layernorm_cpu", out, dtype);
+    checkContiguous("layernorm_cpu", input);
+    checkContiguous("layernorm_cpu", out);
+    for (auto *t : {&weight, &bias}) {
+        if (t->valid()) {
+            checkHalf("layernorm_cpu", *t, dtype);
+            if (t->numel() != (size_t)hidden) {
+                throw std::invalid_argument(
+                    spdlog::fmt_lib::format("layernorm_cpu: invalid weight / bias {} for hidden={}", t->shape.str(), hidden));
+            }
+        }
+    }
+    if (out.numel() != input.numel()) {
+        throw std::invalid_argument(spdlog::fmt_lib::format("layernorm_cpu: out={} for input={}", out.shape.str(), input.shape.str()));
+    }
+
+    const int rows = input.numel() / hidden;
+    auto run = [dtype, hidden, rows, eps](Tensor out, Tensor input, Tensor weight, Tensor bias) {
+        const uint16_t *pw = weight.valid() ? weight.data_ptr<uint16_t>() : nullptr;
+        const uint16_t *pb = bias.valid() ? bias.data_ptr<uint16_t>() : nullptr;
+        parallelFor(rows, [&](int begin, int end) {
+            std::vector<float> val(hidden);
+            for (int row = begin; row < end; row++) {
+                const uint16_t *in = input.data_ptr<uint16_t>() + (size_t)row * hidden;
+                uint16_t *dst = out.data_ptr<uint16_t>() + (size_t)row * hidden;
+                float sum = 0, sumsq = 0;
+                for (int i = 0; i < hidden; i++) {
+                    val[i] = halfToFloat(in[i], dtype);
+                    sum += val[i];
+                    sumsq += val[i] * val[i];
+                }
+                const float mean = sum / hidden;
+                const float rstd = 1.0f / std::sqrt(std::max(sumsq / hidden - mean * mean, 0.0f) + eps);
+                for (int i = 0; i < hidden; i++) {
+                    float y = (val[i] - mean) * rstd;
+                    if (pw) {
+                        y *= halfToFloat(pw[i], dtype);
+                    }
+                    if (pb) {
+                        y += halfToFloat(pb[i], dtype);
+                    }
+                    dst[i] = floatToHalf(y, dtype);
+                }
+            }
+        });
+    };
+    run(out, input, weight, bias);
+    step.record(run, out, input, weight, bias);
+}
+
+};  // namespace nunchaku::kernels
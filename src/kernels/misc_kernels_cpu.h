@@ -0,0 +1,24 @@
+#pragma once
+
+#include "common.h"
+#include "Tensor.h"
+
+namespace nunchaku::kernels {
+
+// host topk for the FP32 pooled attention scores in CPU memory: x [..., N] -> INT32 [..., k] indices of the k largest
+// values of each row, largest first and the later index first on ties (the CUDA kernel keeps the later one as well)
+// written to out if given (contiguous INT32 [..., k])
+Tensor topk_cpu(Tensor x, int k, Tensor out = {});
+
+// host versions of the elementwise ops of the Flux blocks for FP16 / BF16 tensors in CPU memory, computed in FP32 and
+// rounded to the half type after each operation the CUDA kernel does in half precision (fp16 results of mul_add are
+// clamped to its range as there)
+Tensor add_cpu(Tensor a, Tensor b);
+void mul_add_batch_cpu(Tensor x, Tensor scale, bool batch_scale, double scale_shift, Tensor bias, bool batch_bias);
+// out[k] = input[..., k::N] for the N contiguous outputs
+void split_mod_cpu(Tensor input, std::vector<Tensor> out);
+void silu_cpu(Tensor out, Tensor input);
+// LayerNorm over the last dim with optional affine weight / bias, the statistics as generalLayerNorm (E[x²] - E[x]²)
+void layernorm_cpu(Tensor out, Tensor input, Tensor weight, Tensor bias, float eps);
+
+};  // namespace nunchaku::kernels
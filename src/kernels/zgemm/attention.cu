@@ -1,5 +1,6 @@
 #include "zgemm.h"
 #include "attention.cuh"
+#include "attention_cpu.h"
 
 #ifndef M_LOG2E
 #define M_LOG2E 1.4426950408889634074
@@ -14,6 +15,10 @@ void attention_fp16(
     Tensor o,   // linear [Batch, TokensQ, Head * HEAD_DIM]
     float scale
 ) {
+    if (q.device().type == Device::CPU) {
+        return attention_fp16_cpu(q, k, v, o, scale);
+    }
+
     int sizeBatch = q.shape[0];
     int numHeads = q.shape[1];
     int numTokensQ = q.shape[2];
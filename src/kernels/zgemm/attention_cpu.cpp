@@ -0,0 +1,532 @@
+#include "attention_cpu.h"
+#include "kernels/cpu_plan.h"
+#include "kernels/cpu_common.h"
+
+#ifndef M_LOG2E
+#define M_LOG2E 1.4426950408889634074
+#endif
+
+namespace nunchaku::kernels {
+
+namespace {
+
+constexpr int BLOCK_Q = 64;         // queries of a task
+constexpr int BLOCK_KV = 64;        // keys per step of the online softmax
+constexpr int SIMD_HEAD_DIM = 128;  // head dim of the SIMD step kernels
+
+// checked by makeProblem, the pointers are set by runProblem from the tensors of each run
+struct AttnProblem {
+    Tensor::ScalarType dtype, outDtype;
+    int B, H, TQ, TK, D;
+    const uint16_t *q, *k, *v;
+    uint16_t *o;
+    // elements between batches, tokens and heads
+    size_t qStride[3], kStride[3], vStride[3], oStride[3];
+    float scale;    // times log2(e), the softmax runs on exp2
+
+    // block-sparse attention: the query tiles of row block i only see the key blocks blockmask[b, h, i, :]
+    // of blockSize tokens, a negative index ends the list; all keys without a mask
+    const int32_t *blockmask = nullptr;
+    int blockSize = 0, maskBlocks = 0;
+    size_t maskStride[3];   // elements between batches, heads and row blocks
+};
+
+// the keys and values of one head in FP32, converted once by each thread for all of its query tiles of that head
+struct HeadCache {
+    int batch = -1, head = -1;
+    std::vector<float> kt;  // [TK / BLOCK_KV][D][BLOCK_KV], keys transposed per step, zero padded
+    std::vector<float> v;   // [TK / BLOCK_KV * BLOCK_KV][D], zero padded
+};
+
+struct TaskScratch {
+    std::vector<float> q;       // [BLOCK_Q, D], scaled
+    std::vector<float> s;       // [BLOCK_Q, BLOCK_KV], scores then probabilities
+    std::vector<float> o;       // [BLOCK_Q, D]
+    std::vector<float> m, l;    // [BLOCK_Q] running max and sum of each row
+};
+
+// one step of the online softmax over keys [k0, k0 + cols) of a query tile:
+// S = Q Kt, m / l / S updated to the new row maxima, O = O * exp2(m_old - m_new) + S V
+// kt / v point at the step's slices of HeadCache, rows of S past cols count as masked
+using StepKernel = void (*)(const float *q, const float *kt, const float *v, int cols, int D, TaskScratch &s);
+
+struct KernelInfo {
+    const char *name;
+    StepKernel step;
+};
+
+// NaN scores (masked keys) are skipped by the max and give a probability of 0, a row without any key yet keeps m = -inf
+void stepScalar(const float *q, const float *kt, const float *v, int cols, int D, TaskScratch &s) {
+    for (int i = 0; i < BLOCK_Q; i++) {
+        float *srow = &s.s[i * BLOCK_KV];
+        for (int j = 0; j < BLOCK_KV; j++) {
+            srow[j] = 0;
+        }
+        for (int d = 0; d < D; d++) {
+            const float qv = q[i * D + d];
+            const float *krow = kt + d * BLOCK_KV;
+            for (int j = 0; j < BLOCK_KV; j++) {
+                srow[j] += qv * krow[j];
+            }
+        }
+
+        float rowMax = -INFINITY;
+        for (int j = 0; j < cols; j++) {
+            rowMax = std::max(rowMax, srow[j]);
+        }
+        const float newMax = std::max(s.m[i], rowMax);
+        if (newMax == -INFINITY) {
+            continue;
+        }
+        const float alpha = std::exp2(s.m[i] - newMax);
+        float sum = 0;
+        for (int j = 0; j < BLOCK_KV; j++) {
+            const float p = j < cols && srow[j] > -INFINITY ? std::exp2(srow[j] - newMax) : 0.0f;
+            srow[j] = p;
+            sum += p;
+        }
+        s.m[i] = newMax;
+        s.l[i] = s.l[i] * alpha + sum;
+
+        float *orow = &s.o[i * D];
+        for (int d = 0; d < D; d++) {
+            orow[d] *= alpha;
+        }
+        for (int j = 0; j < cols; j++) {
+            const float p = srow[j];
+            const float *vrow = v + j * D;
+            for (int d = 0; d < D; d++) {
+                orow[d] += p * vrow[d];
+            }
+        }
+    }
+}
+
+#if HOST_SIMD
+
+// 2^x for x <= 0: degree 6 polynomial of the fraction, relative error below 2e-7
+// NaN and -inf (masked scores) give 0, everything below 2^-127 flushes to 0
+TARGET_AVX2 inline __attribute__((always_inline))
+__m256 exp2AVX2(__m256 x) {
+    x = _mm256_max_ps(x, _mm256_set1_ps(-127.0f));
+    const __m256 n = _mm256_round_ps(x, _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+    const __m256 f = _mm256_sub_ps(x, n);
+    __m256 p = _mm256_set1_ps(1.5403530e-4f);
+    p = _mm256_fmadd_ps(p, f, _mm256_set1_ps(1.3333558e-3f));
+    p = _mm256_fmadd_ps(p, f, _mm256_set1_ps(9.6181291e-3f));
+    p = _mm256_fmadd_ps(p, f, _mm256_set1_ps(5.5504109e-2f));
+    p = _mm256_fmadd_ps(p, f, _mm256_set1_ps(2.4022651e-1f));
+    p = _mm256_fmadd_ps(p, f, _mm256_set1_ps(6.9314718e-1f));
+    p = _mm256_fmadd_ps(p, f, _mm256_set1_ps(1.0f));
+    const __m256i e = _mm256_slli_epi32(_mm256_add_epi32(_mm256_cvtps_epi32(n), _mm256_set1_epi32(127)), 23);
+    return _mm256_mul_ps(p, _mm256_castsi256_ps(e));
+}
+
+// C[4, NV * 8] = (accumulate ? C : 0) + A[4, K] . B[K, NV * 8], all row-major FP32
+template<int NV>
+TARGET_AVX2 inline __attribute__((always_inline))
+void blockAVX2(const float *A, int lda, const float *B, int ldb, float *C, int ldc, int K, bool accumulate) {
+    constexpr int MR = 4;
+    __m256 c[MR][NV];
+    for (int r = 0; r < MR; r++) {
+        for (int v = 0; v < NV; v++) {
+            c[r][v] = accumulate ? _mm256_loadu_ps(C + r * ldc + v * 8) : _mm256_setzero_ps();
+        }
+    }
+    for (int k = 0; k < K; k++) {
+        __m256 b[NV];
+        for (int v = 0; v < NV; v++) {
+            b[v] = _mm256_loadu_ps(B + k * ldb + v * 8);
+        }
+        for (int r = 0; r < MR; r++) {
+            const __m256 a = _mm256_broadcast_ss(A + r * lda + k);
+            for (int v = 0; v < NV; v++) {
+                c[r][v] = _mm256_fmadd_ps(a, b[v], c[r][v]);
+            }
+        }
+    }
+    for (int r = 0; r < MR; r++) {
+        for (int v = 0; v < NV; v++) {
+            _mm256_storeu_ps(C + r * ldc + v * 8, c[r][v]);
+        }
+    }
+}
+
+template<int D>
+TARGET_AVX2
+void stepAVX2(const float *q, const float *kt, const float *v, int cols, int, TaskScratch &s) {
+    constexpr int NV = 2;
+    for (int i0 = 0; i0 < BLOCK_Q; i0 += 4) {
+        for (int j0 = 0; j0 < BLOCK_KV; j0 += NV * 8) {
+            blockAVX2<NV>(q + i0 * D, D, kt + j0, BLOCK_KV, &s.s[i0 * BLOCK_KV + j0], BLOCK_KV, D, false);
+        }
+    }
+
+    const __m256 iota = _mm256_setr_ps(0, 1, 2, 3, 4, 5, 6, 7);
+    const __m256 negInf = _mm256_set1_ps(-INFINITY);
+    for (int i = 0; i < BLOCK_Q; i++) {
+        float *srow = &s.s[i * BLOCK_KV];
+        __m256 sv[BLOCK_KV / 8];
+        __m256 vmax = negInf;
+        for (int c = 0; c < BLOCK_KV / 8; c++) {
+            const __m256 valid = _mm256_cmp_ps(_mm256_add_ps(iota, _mm256_set1_ps((float)(c * 8))), _mm256_set1_ps((float)cols), _CMP_LT_OQ);
+            sv[c] = _mm256_blendv_ps(negInf, _mm256_loadu_ps(srow + c * 8), valid);
+            // max_ps returns the second operand when either is NaN
+            vmax = _mm256_max_ps(sv[c], vmax);
+        }
+        const float newMax = std::max(s.m[i], hmaxAVX2(vmax));
+        if (newMax == -INFINITY) {
+            for (int c = 0; c < BLOCK_KV / 8; c++) {
+                _mm256_storeu_ps(srow + c * 8, _mm256_setzero_ps());
+            }
+            continue;
+        }
+        const __m256 vnewMax = _mm256_set1_ps(newMax);
+        __m256 vsum = _mm256_setzero_ps();
+        for (int c = 0; c < BLOCK_KV / 8; c++) {
+            const __m256 p = exp2AVX2(_mm256_sub_ps(sv[c], vnewMax));
+            _mm256_storeu_ps(srow + c * 8, p);
+            vsum = _mm256_add_ps(vsum, p);
+        }
+        const float alpha = _mm256_cvtss_f32(exp2AVX2(_mm256_set1_ps(s.m[i] - newMax)));
+        s.m[i] = newMax;
+        s.l[i] = s.l[i] * alpha + hsumAVX2(vsum);
+
+        const __m256 valpha = _mm256_set1_ps(alpha);
+        float *orow = &s.o[i * D];
+        for (int d = 0; d < D; d += 8) {
+            _mm256_storeu_ps(orow + d, _mm256_mul_ps(_mm256_loadu_ps(orow + d), valpha));
+        }
+    }
+
+    for (int i0 = 0; i0 < BLOCK_Q; i0 += 4) {
+        for (int d0 = 0; d0 < D; d0 += NV * 8) {
+            blockAVX2<NV>(&s.s[i0 * BLOCK_KV], BLOCK_KV, v + d0, D, &s.o[i0 * D + d0], D, cols, true);
+        }
+    }
+}
+
+// 2^x for x <= 0 as exp2AVX2, scalef flushes the masked scores (clamped to -200) to 0
+TARGET_AVX512 inline __attribute__((always_inline))
+__m512 exp2AVX512(__m512 x) {
+    x = _mm512_max_ps(x, _mm512_set1_ps(-200.0f));
+    const __m512 n = _mm512_roundscale_ps(x, _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+    const __m512 f = _mm512_sub_ps(x, n);
+    __m512 p = _mm512_set1_ps(1.5403530e-4f);
+    p = _mm512_fmadd_ps(p, f, _mm512_set1_ps(1.3333558e-3f));
+    p = _mm512_fmadd_ps(p, f, _mm512_set1_ps(9.6181291e-3f));
+    p = _mm512_fmadd_ps(p, f, _mm512_set1_ps(5.5504109e-2f));
+    p = _mm512_fmadd_ps(p, f, _mm512_set1_ps(2.4022651e-1f));
+    p = _mm512_fmadd_ps(p, f, _mm512_set1_ps(6.9314718e-1f));
+    p = _mm512_fmadd_ps(p, f, _mm512_set1_ps(1.0f));
+    return _mm512_scalef_ps(p, n);
+}
+
+// C[4, NV * 16] = (accumulate ? C : 0) + A[4, K] . B[K, NV * 16], all row-major FP32
+template<int NV>
+TARGET_AVX512 inline __attribute__((always_inline))
+void blockAVX512(const float *A, int lda, const float *B, int ldb, float *C, int ldc, int K, bool accumulate) {
+    constexpr int MR = 4;
+    __m512 c[MR][NV];
+    for (int r = 0; r < MR; r++) {
+        for (int v = 0; v < NV; v++) {
+            c[r][v] = accumulate ? _mm512_loadu_ps(C + r * ldc + v * 16) : _mm512_setzero_ps();
+        }
+    }
+    for (int k = 0; k < K; k++) {
+        __m512 b[NV];
+        for (int v = 0; v < NV; v++) {
+            b[v] = _mm512_loadu_ps(B + k * ldb + v * 16);
+        }
+        for (int r = 0; r < MR; r++) {
+            const __m512 a = _mm512_set1_ps(A[r * lda + k]);
+            for (int v = 0; v < NV; v++) {
+                c[r][v] = _mm512_fmadd_ps(a, b[v], c[r][v]);
+            }
+        }
+    }
+    for (int r = 0; r < MR; r++) {
+        for (int v = 0; v < NV; v++) {
+            _mm512_storeu_ps(C + r * ldc + v * 16, c[r][v]);
+        }
+    }
+}
+
+// 4 rows x 64 columns per block: the 16 accumulators and 4 vectors of B leave room for the broadcasts
+template<int D>
+TARGET_AVX512
+void stepAVX512(const float *q, const float *kt, const float *v, int cols, int, TaskScratch &s) {
+    constexpr int NV = 4;
+    static_assert(BLOCK_KV == NV * 16);
+    for (int i0 = 0; i0 < BLOCK_Q; i0 += 4) {
+        blockAVX512<NV>(q + i0 * D, D, kt, BLOCK_KV, &s.s[i0 * BLOCK_KV], BLOCK_KV, D, false);
+    }
+
+    const __m512 negInf = _mm512_set1_ps(-INFINITY);
+    for (int i = 0; i < BLOCK_Q; i++) {
+        float *srow = &s.s[i * BLOCK_KV];
+        __m512 sv[NV];
+        __m512 vmax = negInf;
+        for (int c = 0; c < NV; c++) {
+            const int valid = std::clamp(cols - c * 16, 0, 16);
+            sv[c] = _mm512_mask_loadu_ps(negInf, (__mmask16)((1u << valid) - 1), srow + c * 16);
+            // max_ps returns the second operand when either is NaN
+            vmax = _mm512_max_ps(sv[c], vmax);
+        }
+        const float newMax = std::max(s.m[i], _mm512_reduce_max_ps(vmax));
+        if (newMax == -INFINITY) {
+            for (int c = 0; c < NV; c++) {
+                _mm512_storeu_ps(srow + c * 16, _mm512_setzero_ps());
+            }
+            continue;
+        }
+        const __m512 vnewMax = _mm512_set1_ps(newMax);
+        __m512 vsum = _mm512_setzero_ps();
+        for (int c = 0; c < NV; c++) {
+            const __m512 p = exp2AVX512(_mm512_sub_ps(sv[c], vnewMax));
+            _mm512_storeu_ps(srow + c * 16, p);
+            vsum = _mm512_add_ps(vsum, p);
+        }
+        const float alpha = _mm512_cvtss_f32(exp2AVX512(_mm512_set1_ps(s.m[i] - newMax)));
+        s.m[i] = newMax;
+        s.l[i] = s.l[i] * alpha + _mm512_reduce_add_ps(vsum);
+
+        const __m512 valpha = _mm512_set1_ps(alpha);
+        float *orow = &s.o[i * D];
+        for (int d = 0; d < D; d += 16) {
+            _mm512_storeu_ps(orow + d, _mm512_mul_ps(_mm512_loadu_ps(orow + d), valpha));
+        }
+    }
+
+    for (int i0 = 0; i0 < BLOCK_Q; i0 += 4) {
+        for (int d0 = 0; d0 < D; d0 += NV * 16) {
+            blockAVX512<NV>(&s.s[i0 * BLOCK_KV], BLOCK_KV, v + d0, D, &s.o[i0 * D + d0], D, cols, true);
+        }
+    }
+}
+
+#endif
+
+// the SIMD steps are compiled for SIMD_HEAD_DIM only
+KernelInfo selectKernel(int D) {
+    const std::string forced = forcedISA();
+#if HOST_SIMD
+    if (D == SIMD_HEAD_DIM) {
+        if ((forced.empty() || forced == "avx512") && hasAVX512()) {
+            return KernelInfo{"avx512", stepAVX512<SIMD_HEAD_DIM>};
+        }
+        if ((forced.empty() || forced == "avx512" || forced == "avx2") && hasAVX2()) {
+            return KernelInfo{"avx2", stepAVX2<SIMD_HEAD_DIM>};
+        }
+    }
+#endif
+    return KernelInfo{"scalar", stepScalar};
+}
+
+void loadHead(const AttnProblem &p, int b, int h, HeadCache &cache) {
+    if (cache.batch == b && cache.head == h) {
+        return;
+    }
+    cache.batch = b;
+    cache.head = h;
+
+    const int D = p.D;
+    const int steps = ceilDiv(p.TK, BLOCK_KV);
+    cache.kt.assign((size_t)steps * D * BLOCK_KV, 0.0f);
+    cache.v.assign((size_t)steps * BLOCK_KV * D, 0.0f);
+    for (int t = 0; t < p.TK; t++) {
+        const uint16_t *krow = p.k + b * p.kStride[0] + t * p.kStride[1] + h * p.kStride[2];
+        const uint16_t *vrow = p.v + b * p.vStride[0] + t * p.vStride[1] + h * p.vStride[2];
+        float *kt = &cache.kt[(size_t)t / BLOCK_KV * D * BLOCK_KV + t % BLOCK_KV];
+        float *v = &cache.v[(size_t)t * D];
+        for (int d = 0; d < D; d++) {
+            kt[d * BLOCK_KV] = halfToFloat(krow[d], p.dtype);
+            v[d] = halfToFloat(vrow[d], p.dtype);
+        }
+    }
+}
+
+void runTask(const AttnProblem &p, const KernelInfo &kernel, int b, int h, int q0, HeadCache &cache, TaskScratch &s) {
+    const int D = p.D;
+    const int rows = std::min(BLOCK_Q, p.TQ - q0);
+    loadHead(p, b, h, cache);
+
+    // the rows past the end of q stay zero, their outputs are dropped
+    std::fill(s.q.begin(), s.q.end(), 0.0f);
+    for (int i = 0; i < rows; i++) {
+        const uint16_t *qrow = p.q + b * p.qStride[0] + (q0 + i) * p.qStride[1] + h * p.qStride[2];
+        for (int d = 0; d < D; d++) {
+            s.q[i * D + d] = halfToFloat(qrow[d], p.dtype) * p.scale;
+        }
+    }
+    std::fill(s.o.begin(), s.o.end(), 0.0f);
+    std::fill(s.m.begin(), s.m.end(), -INFINITY);
+    std::fill(s.l.begin(), s.l.end(), 0.0f);
+
+    auto runSteps = [&](int begin, int end) {
+        for (int k0 = begin; k0 < end; k0 += BLOCK_KV) {
+            const int cols = std::min(BLOCK_KV, end - k0);
+            kernel.step(s.q.data(), &cache.kt[(size_t)k0 * D], &cache.v[(size_t)k0 * D], cols, D, s);
+        }
+    };
+    if (!p.blockmask) {
+        runSteps(0, p.TK);
+    } else {
+        const int32_t *blocks = p.blockmask + b * p.maskStride[0] + h * p.maskStride[1] + q0 / p.blockSize * p.maskStride[2];
+        for (int i = 0; i < p.maskBlocks && blocks[i] >= 0; i++) {
+            runSteps(blocks[i] * p.blockSize, std::min((blocks[i] + 1) * p.blockSize, p.TK));
+        }
+    }
+
+    // queries that saw no unmasked key get 0
+    for (int i = 0; i < rows; i++) {
+        const float rl = s.l[i] > 0 ? 1.0f / s.l[i] : 0.0f;
+        uint16_t *orow = p.o + b * p.oStride[0] + (q0 + i) * p.oStride[1] + h * p.oStride[2];
+        for (int d = 0; d < D; d++) {
+            orow[d] = floatToHalf(s.o[i * D + d] * rl, p.outDtype);
+        }
+    }
+}
+
+AttnProblem makeProblem(Tensor q, Tensor k, Tensor v, Tensor o, float scale) {
+    if (q.ndims() != 4 || k.ndims() != 4 || v.ndims() != 4) {
+        throw std::invalid_argument(spdlog::fmt_lib::format(
+            "attention_cpu needs [B, T, H, D] operands, got q={} k={} v={}", q.shape.str(), k.shape.str(), v.shape.str()));
+    }
+    if (o.ndims() == 3) {
+        o = o.view({o.shape[0], o.shape[1], q.shape[2], q.shape[3]});
+    }
+
+    AttnProblem p;
+    p.dtype = q.dtype();
+    p.outDtype = o.dtype();
+    p.B = q.shape[0];
+    p.TQ = q.shape[1];
+    p.H = q.shape[2];
+    p.D = q.shape[3];
+    p.TK = k.shape[1];
+
+    for (auto tensor : {k, v}) {
+        if (tensor.shape[0] != p.B || tensor.shape[1] != p.TK || tensor.shape[2] != p.H || tensor.shape[3] != p.D) {
+            throw std::invalid_argument(spdlog::fmt_lib::format(
+                "attention_cpu: shapes of q={} k={} v={} do not match", q.shape.str(), k.shape.str(), v.shape.str()));
+        }
+    }
+    if (o.ndims() != 4 || o.shape[0] != p.B || o.shape[1] != p.TQ || o.shape[2] != p.H || o.shape[3] != p.D) {
+        throw std::invalid_argument(spdlog::fmt_lib::format("attention_cpu: o={} does not match q={}", o.shape.str(), q.shape.str()));
+    }
+    for (auto tensor : {q, k, v, o}) {
+        if (tensor.device().type != Device::CPU || tensor.stride(3) != 1) {
+            throw std::invalid_argument("All operands of attention_cpu must be CPU tensors with contiguous head dims");
+        }
+        if (tensor.dtype() != Tensor::FP16 && tensor.dtype() != Tensor::BF16) {
+            throw std::invalid_argument("attention_cpu supports FP16 and BF16 operands only");
+        }
+    }
+    if (k.dtype() != p.dtype || v.dtype() != p.dtype) {
+        throw std::invalid_argument("attention_cpu: q, k and v must have the same dtype");
+    }
+
+    for (int i = 0; i < 3; i++) {
+        p.qStride[i] = q.stride(i);
+        p.kStride[i] = k.stride(i);
+        p.vStride[i] = v.stride(i);
+        p.oStride[i] = o.stride(i);
+    }
+    p.scale = scale * (float)M_LOG2E;
+
+    return p;
+}
+
+// the key blocks listed by blockmask are read by the tasks, it is checked by every run as it is usually computed
+void checkBlockmask(const AttnProblem &p) {
+    const int rowBlocks = ceilDiv(p.TQ, p.blockSize);
+    const int colBlocks = ceilDiv(p.TK, p.blockSize);
+    for (int b = 0; b < p.B; b++) {
+        for (int h = 0; h < p.H; h++) {
+            for (int r = 0; r < rowBlocks; r++) {
+                const int32_t *blocks = p.blockmask + b * p.maskStride[0] + h * p.maskStride[1] + r * p.maskStride[2];
+                for (int i = 0; i < p.maskBlocks && blocks[i] >= 0; i++) {
+                    if (blocks[i] >= colBlocks) {
+                        throw std::invalid_argument(spdlog::fmt_lib::format(
+                            "attention_blocksparse_cpu: key block {} out of range, there are {}", blocks[i], colBlocks));
+                    }
+                }
+            }
+        }
+    }
+}
+
+void runProblem(AttnProblem p, const KernelInfo &kernel, Tensor q, Tensor k, Tensor v, Tensor o, Tensor blockmask) {
+    p.q = q.data_ptr<uint16_t>();
+    p.k = k.data_ptr<uint16_t>();
+    p.v = v.data_ptr<uint16_t>();
+    p.o = o.data_ptr<uint16_t>();
+    if (blockmask.valid()) {
+        p.blockmask = blockmask.data_ptr<int32_t>();
+        checkBlockmask(p);
+    }
+    const int tilesQ = ceilDiv(p.TQ, BLOCK_Q);
+    spdlog::trace("attention_cpu: B={} H={} TQ={} TK={} D={} sparse={} kernel={}", p.B, p.H, p.TQ, p.TK, p.D, p.blockmask != nullptr, kernel.name);
+
+    // tasks run head by head, the query tiles of a thread mostly share one head and reuse its converted keys / values
+    parallelFor(p.B * p.H * tilesQ, [&](int begin, int end) {
+        HeadCache cache;
+        TaskScratch s;
+        s.q.resize(BLOCK_Q * p.D);
+        s.s.resize(BLOCK_Q * BLOCK_KV);
+        s.o.resize(BLOCK_Q * p.D);
+        s.m.resize(BLOCK_Q);
+        s.l.resize(BLOCK_Q);
+        for (int task = begin; task < end; task++) {
+            const int bh = task / tilesQ;
+            runTask(p, kernel, bh / p.H, bh % p.H, task % tilesQ * BLOCK_Q, cache, s);
+        }
+    });
+}
+
+};  // namespace
+
+void attention_cpu(Tensor q, Tensor k, Tensor v, Tensor o, float scale) {
+    CpuPlanStep step;
+    const AttnProblem p = makeProblem(q, k, v, o, scale);
+    auto run = [p, kernel = selectKernel(p.D)](Tensor q, Tensor k, Tensor v, Tensor o) {
+        runProblem(p, kernel, q, k, v, o, Tensor{});
+    };
+    run(q, k, v, o);
+    step.record(run, q, k, v, o);
+}
+
+void attention_blocksparse_cpu(Tensor q, Tensor k, Tensor v, Tensor o, float scale, Tensor blockmask, int blockSize) {
+    CpuPlanStep step;
+    AttnProblem p = makeProblem(q, k, v, o, scale);
+    if (blockSize <= 0 || blockSize % BLOCK_Q != 0 || blockSize % BLOCK_KV != 0) {
+        throw std::invalid_argument(spdlog::fmt_lib::format(
+            "attention_blocksparse_cpu: block size {} must be a multiple of {}", blockSize, std::max(BLOCK_Q, BLOCK_KV)));
+    }
+    const int rowBlocks = ceilDiv(p.TQ, blockSize);
+    if (blockmask.ndims() != 4 || blockmask.shape[0] != p.B || blockmask.shape[1] != p.H || blockmask.shape[2] != rowBlocks) {
+        throw std::invalid_argument(spdlog::fmt_lib::format(
+            "attention_blocksparse_cpu: blockmask must be [{}, {}, {}, K], got {}", p.B, p.H, rowBlocks, blockmask.shape.str()));
+    }
+    if (blockmask.device().type != Device::CPU || blockmask.dtype() != Tensor::INT32 || blockmask.stride(3) != 1) {
+        throw std::invalid_argument("attention_blocksparse_cpu: blockmask must be an INT32 CPU tensor with contiguous rows");
+    }
+
+    p.blockSize = blockSize;
+    p.maskBlocks = blockmask.shape[3];
+    for (int i = 0; i < 3; i++) {
+        p.maskStride[i] = blockmask.stride(i);
+    }
+    auto run = [p, kernel = selectKernel(p.D)](Tensor q, Tensor k, Tensor v, Tensor o, Tensor blockmask) {
+        runProblem(p, kernel, q, k, v, o, blockmask);
+    };
+    run(q, k, v, o, blockmask);
+    step.record(run, q, k, v, o, blockmask);
+}
+
+void attention_fp16_cpu(Tensor q, Tensor k, Tensor v, Tensor o, float scale) {
+    attention_cpu(q.transpose(1, 2), k.transpose(1, 2), v.transpose(1, 2), o, scale);
+}
+
+};  // namespace nunchaku::kernels
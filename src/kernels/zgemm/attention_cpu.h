@@ -0,0 +1,27 @@
+#pragma once
+
+#include "common.h"
+#include "Tensor.h"
+
+namespace nunchaku::kernels {
+
+// host attention for operands in CPU memory: o = softmax(q k^T * scale) v per batch and head, flash style
+// each task takes a tile of 64 queries of one head through the keys in tiles of 64 with an online softmax,
+// scores, probabilities and the output accumulate in FP32 and o is rounded once
+// q / k / v are [B, T, H, D] with contiguous D and any other strides, i.e. slices of the linear qkv [B, T, 3 * H * D]
+// or transposes of the [B, H, T, D] layout of attention_fp16; o is [B, TQ, H, D] (or [B, TQ, H * D]) in FP16 / BF16
+// scores that are NaN count as -inf, so keys set to NaN (the padding of the packed k) are masked
+// D = 128 has SIMD kernels, other head dims run the scalar path
+// NUNCHAKU_CPU_THREADS sets the number of threads (default: all cores)
+// NUNCHAKU_CPU_GEMM_ISA=scalar|avx2|avx512 forces a code path (default: best supported)
+void attention_cpu(Tensor q, Tensor k, Tensor v, Tensor o, float scale);
+
+// attention_cpu restricted to the blocks of blockmask [B, H, ceil(TQ / blockSize), K] (INT32), the output of topk
+// over pooled scores as consumed by mha_fwd_block: queries of row block i only attend to the key blocks listed for it,
+// a negative index ends a list; blockSize must be a multiple of 64, skipped blocks cost nothing
+void attention_blocksparse_cpu(Tensor q, Tensor k, Tensor v, Tensor o, float scale, Tensor blockmask, int blockSize);
+
+// attention_fp16 on CPU: q / k / v are [B, H, T, D] with each head row-major, o is [B, TQ, H * D]
+void attention_fp16_cpu(Tensor q, Tensor k, Tensor v, Tensor o, float scale);
+
+};  // namespace nunchaku::kernels
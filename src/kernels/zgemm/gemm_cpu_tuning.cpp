@@ -0,0 +1,142 @@
+#include "gemm_cpu_tuning.h"
+
+#include <filesystem>
+
+namespace nunchaku::kernels {
+
+namespace {
+
+constexpr const char *HEADER = "nunchaku-cpu-gemm-tuning";
+
+std::string defaultPath() {
+    if (const char *env = getenv("NUNCHAKU_CPU_GEMM_TUNE_DB")) {
+        return env;
+    }
+    std::filesystem::path dir;
+    if (const char *cache = getenv("XDG_CACHE_HOME"); cache && *cache) {
+        dir = cache;
+    } else if (const char *home = getenv("HOME"); home && *home) {
+        dir = std::filesystem::path(home) / ".cache";
+    } else {
+        return "";
+    }
+    return (dir / "nunchaku" / "cpu_gemm_tuning.txt").string();
+}
+
+const char *dtypeName(Tensor::ScalarType dtype) {
+    return dtype == Tensor::BF16 ? "bf16" : "fp16";
+}
+
+};  // namespace
+
+CpuGemmTuningDB &CpuGemmTuningDB::instance() {
+    static CpuGemmTuningDB *db = []() {
+        auto *db = new CpuGemmTuningDB();
+        db->load(defaultPath());
+        return db;
+    }();
+    return *db;
+}
+
+int CpuGemmTuningDB::bucketM(int M) {
+    int tiles = ceilDiv(M, 256);
+    int bucket = 1;
+    while (bucket < tiles) {
+        bucket *= 2;
+    }
+    return bucket;
+}
+
+std::optional<CpuGemmBlocking> CpuGemmTuningDB::find(const CpuGemmShape &shape) {
+    std::lock_guard lock(mutex);
+    auto it = entries.find(shape);
+    if (it == entries.end()) {
+        return std::nullopt;
+    }
+    return it->second.blocking;
+}
+
+void CpuGemmTuningDB::insert(const CpuGemmShape &shape, CpuGemmBlocking blocking, double gflops) {
+    {
+        std::lock_guard lock(mutex);
+        entries[shape] = Entry{blocking, gflops};
+    }
+    save();
+}
+
+// one line per shape: isa format dtype threads m_bucket N K mc kc nc swap gflops
+void CpuGemmTuningDB::load(const std::string &path) {
+    std::lock_guard lock(mutex);
+    this->path = path;
+    entries.clear();
+    if (path.empty()) {
+        return;
+    }
+    std::ifstream fin(path);
+    if (!fin) {
+        return;
+    }
+
+    std::string header;
+    int version = 0;
+    if (!(fin >> header >> version) || header != HEADER || version != VERSION) {
+        spdlog::warn("Ignoring CPU GEMM tuning database {} of another version", path);
+        return;
+    }
+    std::string line;
+    while (std::getline(fin, line)) {
+        if (line.empty() || line[0] == '#') {
+            continue;
+        }
+        std::istringstream ss(line);
+        CpuGemmShape shape;
+        CpuGemmBlocking blocking;
+        std::string format, dtype;
+        int swap;
+        double gflops;
+        if (!(ss >> shape.isa >> format >> dtype >> shape.threads >> shape.mBucket >> shape.N >> shape.K >> blocking.mc >> blocking.kc >> blocking.nc >> swap >> gflops)) {
+            spdlog::warn("Skipping malformed line in CPU GEMM tuning database {}: {}", path, line);
+            continue;
+        }
+        shape.fp4 = format == "fp4";
+        shape.dtype = dtype == "bf16" ? Tensor::BF16 : Tensor::FP16;
+        blocking.swapBlockMN = swap != 0;
+        entries[shape] = Entry{blocking, gflops};
+    }
+    spdlog::debug("Loaded {} CPU GEMM blockings from {}", entries.size(), path);
+}
+
+void CpuGemmTuningDB::save() {
+    std::lock_guard lock(mutex);
+    if (path.empty()) {
+        return;
+    }
+    // write a temporary file and rename it, concurrent processes never see a partial database
+    const std::filesystem::path target(path);
+    const std::filesystem::path tmp = target.string() + spdlog::fmt_lib::format(".{}.tmp", std::chrono::steady_clock::now().time_since_epoch().count());
+    std::error_code ec;
+    if (target.has_parent_path()) {
+        std::filesystem::create_directories(target.parent_path(), ec);
+    }
+    {
+        std::ofstream fout(tmp);
+        if (!fout) {
+            spdlog::warn("Cannot write CPU GEMM tuning database {}", path);
+            return;
+        }
+        fout << HEADER << " " << VERSION << "\n";
+        fout << "# isa format dtype threads m_bucket N K mc kc nc swap gflops\n";
+        for (auto &&[shape, entry] : entries) {
+            fout << spdlog::fmt_lib::format("{} {} {} {} {} {} {} {} {} {} {} {:.1f}\n",
+                shape.isa, shape.fp4 ? "fp4" : "int4", dtypeName(shape.dtype), shape.threads, shape.mBucket, shape.N, shape.K,
+                entry.blocking.mc, entry.blocking.kc, entry.blocking.nc, entry.blocking.swapBlockMN ? 1 : 0, entry.gflops);
+        }
+    }
+    std::filesystem::rename(tmp, target, ec);
+    if (ec) {
+        spdlog::warn("Cannot replace CPU GEMM tuning database {}: {}", path, ec.message());
+        std::filesystem::remove(tmp, ec);
+    }
+}
+
+};  // namespace nunchaku::kernels
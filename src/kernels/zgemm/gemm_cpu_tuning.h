@@ -0,0 +1,62 @@
+#pragma once
+
+#include "common.h"
+#include "Tensor.h"
+
+#include <mutex>
+#include <tuple>
+
+namespace nunchaku::kernels {
+
+// blocking of the main loop of gemm_w4a4_cpu over the 256 x 128 output tiles
+struct CpuGemmBlocking {
+    int mc;             // rows of a tile swept by the micro kernel before moving to the next 16 channels, multiple of MR
+    int kc;             // groups of 64 along K accumulated per pass over a tile
+    int nc;             // columns of a tile per sweep over its mc rows, multiple of NR
+    bool swapBlockMN;   // consecutive tiles of a thread walk along N (sharing activations) instead of along M (sharing weights)
+};
+
+struct CpuGemmShape {
+    std::string isa;    // micro kernel, see NUNCHAKU_CPU_GEMM_ISA
+    bool fp4;
+    Tensor::ScalarType dtype;
+    int threads;
+    int mBucket;        // number of 256-row tiles rounded up to a power of 2
+    int N, K;
+
+    bool operator<(const CpuGemmShape &other) const {
+        return std::tie(isa, fp4, dtype, threads, mBucket, N, K) < std::tie(other.isa, other.fp4, other.dtype, other.threads, other.mBucket, other.N, other.K);
+    }
+};
+
+// versioned on-disk database of tuned blockings per shape
+// NUNCHAKU_CPU_GEMM_TUNE_DB sets the file (default: $XDG_CACHE_HOME or ~/.cache / nunchaku/cpu_gemm_tuning.txt)
+// files of another version are ignored and replaced on the next save
+class CpuGemmTuningDB {
+public:
+    static constexpr int VERSION = 2;
+
+    // loaded from disk on first use
+    static CpuGemmTuningDB &instance();
+
+    static int bucketM(int M);
+
+    std::optional<CpuGemmBlocking> find(const CpuGemmShape &shape);
+    // records the winner of a tuning run and rewrites the database file
+    void insert(const CpuGemmShape &shape, CpuGemmBlocking blocking, double gflops);
+
+    void load(const std::string &path);
+    void save();
+
+private:
+    struct Entry {
+        CpuGemmBlocking blocking;
+        double gflops;
+    };
+
+    std::mutex mutex;
+    std::string path;
+    std::map<CpuGemmShape, Entry> entries;
+};
+
+};  // namespace nunchaku::kernels
@@ -1,5 +1,6 @@
 #include "zgemm.h"
 #include "gemm_w4a4_launch.cuh"
+#include "gemm_w4a4_cpu.h"
 
 namespace nunchaku::kernels {
 
@@ -63,6 +64,14 @@ void gemm_w4a4(
     Tensor out_v,           // packed attention [B, H, M, D]
     int attn_tokens
 ) {
+    if (act.device().type == Device::CPU) {
+        return gemm_w4a4_cpu(
+            act, wgt, out, qout, ascales, wscales, oscales, poolout, lora_act_in, lora_up, lora_down, lora_act_out,
+            norm_q, norm_k, rotary_emb, bias, smooth_factor, out_vk, out_linearattn, act_unsigned, lora_scales,
+            fuse_silu, fp4, alpha, wcscales, out_q, out_k, out_v, attn_tokens
+        );
+    }
+
     Tensor::ScalarType dtype = Tensor::INVALID_SCALAR_TYPE;
     if (!fp4) {
         dtype = ascales.dtype();
@@ -109,13 +118,81 @@ void gemm_w4a4(
     });
 }
 
+void gemm_w4a4(const GemmW4A4Args &args) {
+    gemm_w4a4(
+        args.act, args.wgt, args.out, args.qout, args.ascales, args.wscales, args.oscales, args.poolout,
+        args.lora_act_in, args.lora_up, args.lora_down, args.lora_act_out, args.norm_q, args.norm_k, args.rotary_emb,
+        args.bias, args.smooth_factor, args.out_vk, args.out_linearattn, args.act_unsigned, args.lora_scales,
+        args.fuse_silu, args.fp4, args.alpha, args.wcscales, args.out_q, args.out_k, args.out_v, args.attn_tokens
+    );
+}
+
+// side streams of gemm_w4a4_grouped, created on first use per device
+static CUDAStreamWrapper &getGroupedStream(int idx) {
+    static thread_local std::map<int, std::vector<std::unique_ptr<CUDAStreamWrapper>>> streams;
+    auto &&list = streams[CUDADeviceContext::getDevice()];
+    while ((int)list.size() <= idx) {
+        list.push_back(std::make_unique<CUDAStreamWrapper>());
+    }
+    return *list[idx];
+}
+
+void gemm_w4a4_grouped(const std::vector<GemmW4A4Args> &problems) {
+    bool onCPU = true;
+    for (auto &&args : problems) {
+        onCPU &= args.act.device().type == Device::CPU;
+    }
+
+    // the side streams have no latency numbers yet, so on GPU they wait for NUNCHAKU_GROUPED_GEMM=1
+    const char *env = getenv("NUNCHAKU_GROUPED_GEMM");
+    const bool grouped = env ? std::string(env) != "0" : onCPU;
+    if (problems.size() <= 1 || !grouped) {
+        for (auto &&args : problems) {
+            gemm_w4a4(args);
+        }
+        return;
+    }
+
+    if (onCPU) {
+        return gemm_w4a4_cpu_grouped(problems);
+    }
+
+    // the first problem stays on the current stream, the others fork from it and are joined back
+    // so that the small text-side GEMMs fill the SMs left idle by the tail of the image-side ones
+    cudaStream_t mainStream = getCurrentCUDAStream();
+    CUDAEventWrapper forkEvent(cudaEventDisableTiming);
+    checkCUDA(cudaEventRecord(forkEvent.event, mainStream));
+
+    std::vector<std::unique_ptr<CUDAEventWrapper>> joinEvents;
+    for (size_t i = 1; i < problems.size(); i++) {
+        CUDAStreamWrapper &stream = getGroupedStream(i - 1);
+        checkCUDA(cudaStreamWaitEvent(stream.stream, forkEvent.event));
+        {
+            CUDAStreamContext ctx(stream.stream);
+            gemm_w4a4(problems[i]);
+        }
+        joinEvents.push_back(std::make_unique<CUDAEventWrapper>(cudaEventDisableTiming));
+        checkCUDA(cudaEventRecord(joinEvents.back()->event, stream.stream));
+    }
+    gemm_w4a4(problems[0]);
+    for (auto &&event : joinEvents) {
+        checkCUDA(cudaStreamWaitEvent(mainStream, event->event));
+    }
+}
+
 void linearattn_vk_mul_q(Tensor q, Tensor vk) {
+    if (q.device().type == Device::CPU) {
+        return linearattn_vk_mul_q_cpu(q, vk);
+    }
     invoke_launch(q.dtype(), false, false, [&]<typename Config, bool USE_FP4>() {
         GEMM_W4A4_Launch<Config, false>::linearattn_vk_mul_q(q, vk);
     });
 }
 
 void quantize_w4a4_act_fuse_lora(Tensor input, Tensor output, Tensor oscales, Tensor lora_down, Tensor lora_act_out, Tensor smooth, bool fuse_glu, bool fp4) {
+    if (input.device().type == Device::CPU) {
+        return quantize_w4a4_act_fuse_lora_cpu(input, output, oscales, lora_down, lora_act_out, smooth, fuse_glu, fp4);
+    }
     invoke_launch(input.dtype(), fp4, false, [&]<typename Config, bool USE_FP4>() {
         GEMM_W4A4_Launch<Config, USE_FP4>::quantize_w4a4_act_fuse_lora(
             input, output, oscales, lora_down, lora_act_out, smooth, fuse_glu, fp4
@@ -123,6 +200,14 @@ void quantize_w4a4_act_fuse_lora(Tensor input, Tensor output, Tensor oscales, Te
     });
 }
 
+void quantize_w4a4_act_fuse_norm(Tensor input, Tensor scale, Tensor shift, float eps, Tensor output, Tensor oscales, Tensor lora_down, Tensor lora_act_out, Tensor smooth, bool fp4) {
+    if (input.device().type != Device::CPU) {
+        // on the GPU LayerNorm and mul_add are cheap next to the GEMM, the blocks only defer the norm on CPU
+        throw std::invalid_argument("quantize_w4a4_act_fuse_norm is only implemented for CPU tensors");
+    }
+    return quantize_w4a4_act_fuse_norm_cpu(input, scale, shift, eps, output, oscales, lora_down, lora_act_out, smooth, fp4);
+}
+
 void quantize_w4a4_act(Tensor input, Tensor output, Tensor oscales) {
     invoke_launch(input.dtype(), false, false, [&]<typename Config, bool USE_FP4>() {
         GEMM_W4A4_Launch<Config, false>::quantize_w4a4_act(
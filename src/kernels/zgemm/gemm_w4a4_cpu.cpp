@@ -0,0 +1,2037 @@
+#include "gemm_w4a4_cpu.h"
+#include "gemm_cpu_tuning.h"
+#include "kernels/cpu_plan.h"
+#include "kernels/cpu_common.h"
+
+#include <mutex>
+
+namespace nunchaku::kernels {
+
+namespace {
+
+// tile sizes of GEMMConfig_W4A4, they define the packed layouts
+constexpr int BLOCK_M = 256;
+constexpr int BLOCK_N = 128;
+constexpr int WARP_M = 32;
+constexpr int GROUP_K = 64;     // WARP_K, also the INT4 group size
+constexpr int FP4_GROUP = 16;   // NVFP4 micro-scale block
+
+constexpr float FP8_MAX = 448.0f;
+
+constexpr int CHUNK_GROUPS = 16;    // default INT4 groups of K swept per pass over a tile, keeps A and B chunks in L2
+
+constexpr float SHIFT_GELU = 0.171875f;
+
+constexpr int LITELA_HEAD_DIM = 32;
+constexpr float LITELA_EPS = 1e-6f;
+
+// EpilogueRMSNormRope / EpiloguePackQKV of the Flux qkv projection: every tile of BLOCK_N columns is one head
+constexpr int ATTN_HEAD_DIM = 128;
+constexpr float RMSNORM_EPS = 1e-6f;
+constexpr int POOL_SIZE = 128;      // rows averaged into one row of poolout
+static_assert(ATTN_HEAD_DIM == BLOCK_N);
+
+// e4m3 (satfinite), as quantize_float4_fp8
+uint8_t floatToE4M3(float v) {
+    if (!(v > 0)) {
+        return 0;
+    }
+    if (v >= FP8_MAX) {
+        return 0x7e;
+    }
+    if (v < 0x1p-6f) {
+        return (uint8_t)std::nearbyint(v * 0x1p9f);
+    }
+    int e;
+    const float m = std::frexp(v, &e);
+    int exp = e - 1 + 7;
+    int mant = (int)std::nearbyint((m * 2 - 1) * 8);
+    if (mant == 8) {
+        mant = 0;
+        exp++;
+    }
+    return (uint8_t)std::min((exp << 3) | mant, 0x7e);
+}
+float e4m3ToFloat(uint8_t v) {
+    const int exp = (v >> 3) & 0xf;
+    const int mant = v & 0x7;
+    return exp == 0 ? std::ldexp((float)mant, -9) : std::ldexp((float)(8 + mant), exp - 10);
+}
+
+// e2m1 (satfinite), as quantize_float2_fp4, ties go to the even code
+uint32_t floatToE2M1(float x) {
+    const float a = std::fabs(x);
+    const uint32_t idx = (a > 0.25f) + (a >= 0.75f) + (a > 1.25f) + (a >= 1.75f) + (a > 2.5f) + (a >= 3.5f) + (a > 5.0f);
+    return idx | (std::signbit(x) && idx ? 8 : 0);
+}
+
+// nibble -> int8 tables for the operands of the int8 dot products
+// activations are made unsigned with an offset that is subtracted again through wcorr, FP4 values are doubled to be integers
+constexpr int8_t NIBBLE_UNSIGNED[16]   = {0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15};
+constexpr int8_t NIBBLE_INT4_ACT[16]   = {8, 9, 10, 11, 12, 13, 14, 15, 0, 1, 2, 3, 4, 5, 6, 7};
+constexpr int8_t NIBBLE_INT4_WGT[16]   = {0, 1, 2, 3, 4, 5, 6, 7, -8, -7, -6, -5, -4, -3, -2, -1};
+constexpr int8_t NIBBLE_E2M1_ACT[16]   = {12, 13, 14, 15, 16, 18, 20, 24, 12, 11, 10, 9, 8, 6, 4, 0};
+constexpr int8_t NIBBLE_E2M1_WGT[16]   = {0, 1, 2, 3, 4, 6, 8, 12, 0, -1, -2, -3, -4, -6, -8, -12};
+constexpr int INT4_ACT_OFFSET = 8;
+constexpr int E2M1_ACT_OFFSET = 12;
+
+// uint32 word of a packed act [M, K / 2] holding elements k .. k + 7 (k % 8 == 0) of row m
+// the same layout is used for packed weights with rows and the two register halves swapped
+size_t packedActWord(int m, int k, int K) {
+    const int mm = m % BLOCK_M;
+    const int r = mm % 16;
+    const int c = k % GROUP_K / 8;
+    const int lane = r % 8 * 4 + c % 4;
+    const int reg = c / 4 * 2 + r / 8;
+    return (((((size_t)(m / BLOCK_M) * (K / GROUP_K) + k / GROUP_K) * 8 + mm / WARP_M) * 2 + mm % WARP_M / 16) * 32 + lane) * 4 + reg;
+}
+
+size_t packedWgtWord(int n, int k, int K) {
+    const int nn = n % BLOCK_N;
+    const int r = nn % 16;
+    const int c = k % GROUP_K / 8;
+    const int lane = r % 8 * 4 + c % 4;
+    const int reg = r / 8 * 2 + c / 4;
+    return ((((size_t)(n / BLOCK_N) * (K / GROUP_K) + k / GROUP_K) * 8 + nn / 16) * 32 + lane) * 4 + reg;
+}
+
+// packed as [K / 64, M]
+size_t packedAscaleIndex(int m, int group, int numGroups) {
+    const int mm = m % BLOCK_M;
+    const int lane = mm % WARP_M / 16 * 8 + mm % 8;
+    const int elem = mm % 16 / 8;
+    return (((size_t)(m / BLOCK_M) * numGroups + group) * 8 + mm / WARP_M) * 32 + lane * 2 + elem;
+}
+
+// byte of the e4m3 micro-scale of row m for elements block * 16 .. block * 16 + 15
+// packed as [M / 256, K / 64, 8 warps, 32 lanes, 4 blocks], lane l holds row l / 4 + l % 2 * 8 of m tile l % 4 / 2
+size_t packedAmscaleByte(int m, int block, int K) {
+    const int mm = m % BLOCK_M;
+    const int r = mm % 16;
+    const int lane = r % 8 * 4 + mm % WARP_M / 16 * 2 + r / 8;
+    return ((((size_t)(m / BLOCK_M) * (K / GROUP_K) + block / 4) * 8 + mm / WARP_M) * 32 + lane) * 4 + block % 4;
+}
+
+// packed as [N / 128, K / 64, 32 lanes, 4 packs of 32 channels, 4 blocks], lane l holds channel l / 4 + l % 4 * 8 of a pack
+size_t packedWmscaleByte(int n, int block, int K) {
+    const int nn = n % BLOCK_N;
+    const int lane = nn % 8 * 4 + nn % 32 / 8;
+    return ((((size_t)(n / BLOCK_N) * (K / GROUP_K) + block / 4) * 32 + lane) * 4 + nn / 32) * 4 + block % 4;
+}
+
+// position of channel n within its block of 128 in packed ws (wscales of one group, bias, wcscales, smooth_factor)
+int packedWscaleIndex(int n) {
+    const int nn = n % BLOCK_N;
+    return (nn / 16 * 4 + nn % 8 / 2) * 4 + nn % 16 / 8 * 2 + nn % 2;
+}
+
+// packed lora_act [M / 256, R / 16, 8 warps, 2 m tiles, 8, 32 lanes] of float
+size_t loraActIndex(int m, int r, int rank) {
+    const int mm = m % BLOCK_M;
+    const int row = mm % 16;
+    const int col = r % 16;
+    const int lane = row % 8 * 4 + col % 8 / 2;
+    const int elem = col % 2 + row / 8 * 2 + col / 8 * 4;
+    return (((((size_t)(m / BLOCK_M) * (rank / 16) + r / 16) * 8 + mm / WARP_M) * 2 + mm % WARP_M / 16) * 8 + elem) * 32 + lane;
+}
+
+// rotary_emb as packed by pack_rotemb of transformer_flux.py, [M / 16, D / 8, 8 rows, 4 pairs, 2 row halves, {sin, cos}]
+// of float: the index of the sin of pair `pair` (columns 2 * pair and 2 * pair + 1) in row m, the cos follows it
+size_t rotaryIndex(int m, int pair) {
+    const int row = m % 16;
+    return ((((size_t)(m / 16) * (ATTN_HEAD_DIM / 8) + pair / 4) * 8 + row % 8) * 4 + pair % 4) * 4 + row / 8 * 2;
+}
+
+// the packed weight unpacked for the micro kernels, built once per weight buffer (see Buffer::derived)
+struct UnpackedWeight {
+    std::vector<int8_t> wgt;        // [N / 16, K / 4, 16, 4], 4 consecutive k of 16 channels per 64 bytes
+    std::vector<int32_t> wcorr;     // [K / group, N], offset * sum of the weights of a group, 0 for unsigned activations
+};
+
+// operands unpacked from nibbles into the layout of the int8 dot products
+// a group shares one scale per row: 64 elements for INT4, 16 for NVFP4 (doubled e2m1 values, the 1 / 4 goes into wscales)
+// the activations are unpacked by every call, the weight side is cached on the buffers of the packed tensors
+struct Operands {
+    int M, N, K;
+    int groupSize;
+    std::vector<uint8_t> act;       // [M, K], signed activations are stored + offset so that all values are >= 0
+    std::vector<float> ascales;     // [K / group, M]
+    std::shared_ptr<const UnpackedWeight> weight;
+    std::shared_ptr<const std::vector<float>> wscales;  // [K / group, N]
+};
+
+// C[MR, NR] += sum of ascale * wscale * (act . wgt) over groups [g0, g1)
+using MicroKernel = void (*)(const Operands &op, int m0, int n0, int g0, int g1, float *C, int ldc);
+
+// out[0 .. 7] = table[nibble i of word]
+using NibbleDecoder = void (*)(uint32_t word, const int8_t *table, int8_t *out);
+
+struct KernelInfo {
+    const char *name;
+    MicroKernel func;
+    int MR, NR;
+    NibbleDecoder decode;
+};
+
+void decodeNibblesScalar(uint32_t word, const int8_t *table, int8_t *out) {
+    for (int i = 0; i < 8; i++) {
+        out[i] = table[(word >> (i * 4)) & 0xf];
+    }
+}
+
+template<int GROUP>
+void microKernelScalar(const Operands &op, int m0, int n0, int g0, int g1, float *C, int ldc) {
+    constexpr int MR = 4;
+    constexpr int NR = 16;
+    const uint8_t *A = op.act.data() + (size_t)m0 * op.K;
+    const int8_t *B = op.weight->wgt.data() + (size_t)(n0 / 16) * op.K * 16;
+    const float *ascales = op.ascales.data();
+    const float *wscales = op.wscales->data();
+    const int32_t *wcorr = op.weight->wcorr.data();
+
+    for (int g = g0; g < g1; g++) {
+        int32_t acc[MR][NR] = {};
+        for (int kk = g * GROUP / 4; kk < (g + 1) * GROUP / 4; kk++) {
+            const int8_t *b = B + kk * 64;
+            for (int i = 0; i < MR; i++) {
+                const uint8_t *a = A + (size_t)i * op.K + kk * 4;
+                for (int j = 0; j < NR; j++) {
+                    acc[i][j] += a[0] * b[j * 4] + a[1] * b[j * 4 + 1] + a[2] * b[j * 4 + 2] + a[3] * b[j * 4 + 3];
+                }
+            }
+        }
+        const float *ws = wscales + (size_t)g * op.N + n0;
+        const int32_t *corr = wcorr + (size_t)g * op.N + n0;
+        for (int i = 0; i < MR; i++) {
+            const float as = ascales[(size_t)g * op.M + m0 + i];
+            for (int j = 0; j < NR; j++) {
+                C[i * ldc + j] += float(acc[i][j] - corr[j]) * (ws[j] * as);
+            }
+        }
+    }
+}
+
+#if HOST_SIMD
+
+// the table lookup as a byte shuffle
+TARGET_AVX2
+void decodeNibblesShuffle(uint32_t word, const int8_t *table, int8_t *out) {
+    const __m128i w = _mm_cvtsi32_si128((int)word);
+    const __m128i mask = _mm_set1_epi8(0xf);
+    const __m128i idx = _mm_unpacklo_epi8(_mm_and_si128(w, mask), _mm_and_si128(_mm_srli_epi16(w, 4), mask));
+    _mm_storel_epi64((__m128i *)out, _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)table), idx));
+}
+
+// maddubs + madd: u8 x s8 products summed over 4 bytes into int32, no saturation for 4-bit operands (at most 2 * 24 * 12)
+template<int GROUP>
+TARGET_AVX2
+void microKernelAVX2(const Operands &op, int m0, int n0, int g0, int g1, float *C, int ldc) {
+    constexpr int MR = 4;
+    const uint8_t *A = op.act.data() + (size_t)m0 * op.K;
+    const int8_t *B = op.weight->wgt.data() + (size_t)(n0 / 16) * op.K * 16;
+    const float *ascales = op.ascales.data();
+    const float *wscales = op.wscales->data();
+    const int32_t *wcorr = op.weight->wcorr.data();
+    const __m256i ones = _mm256_set1_epi16(1);
+
+    for (int g = g0; g < g1; g++) {
+        __m256i acc[MR][2];
+        for (int i = 0; i < MR; i++) {
+            acc[i][0] = _mm256_setzero_si256();
+            acc[i][1] = _mm256_setzero_si256();
+        }
+        for (int kk = g * GROUP / 4; kk < (g + 1) * GROUP / 4; kk++) {
+            const __m256i b0 = _mm256_loadu_si256((const __m256i *)(B + kk * 64));
+            const __m256i b1 = _mm256_loadu_si256((const __m256i *)(B + kk * 64 + 32));
+            for (int i = 0; i < MR; i++) {
+                int32_t a4;
+                memcpy(&a4, A + (size_t)i * op.K + kk * 4, sizeof(a4));
+                const __m256i a = _mm256_set1_epi32(a4);
+                acc[i][0] = _mm256_add_epi32(acc[i][0], _mm256_madd_epi16(_mm256_maddubs_epi16(a, b0), ones));
+                acc[i][1] = _mm256_add_epi32(acc[i][1], _mm256_madd_epi16(_mm256_maddubs_epi16(a, b1), ones));
+            }
+        }
+        const float *ws = wscales + (size_t)g * op.N + n0;
+        const int32_t *corr = wcorr + (size_t)g * op.N + n0;
+        const __m256 ws0 = _mm256_loadu_ps(ws);
+        const __m256 ws1 = _mm256_loadu_ps(ws + 8);
+        const __m256i corr0 = _mm256_loadu_si256((const __m256i *)corr);
+        const __m256i corr1 = _mm256_loadu_si256((const __m256i *)(corr + 8));
+        for (int i = 0; i < MR; i++) {
+            const __m256 as = _mm256_set1_ps(ascales[(size_t)g * op.M + m0 + i]);
+            float *c = C + i * ldc;
+            _mm256_storeu_ps(c,     _mm256_fmadd_ps(_mm256_cvtepi32_ps(_mm256_sub_epi32(acc[i][0], corr0)), _mm256_mul_ps(ws0, as), _mm256_loadu_ps(c)));
+            _mm256_storeu_ps(c + 8, _mm256_fmadd_ps(_mm256_cvtepi32_ps(_mm256_sub_epi32(acc[i][1], corr1)), _mm256_mul_ps(ws1, as), _mm256_loadu_ps(c + 8)));
+        }
+    }
+}
+
+template<int GROUP>
+TARGET_AVX512_VNNI
+void microKernelAVX512VNNI(const Operands &op, int m0, int n0, int g0, int g1, float *C, int ldc) {
+    constexpr int MR = 8;
+    const uint8_t *A = op.act.data() + (size_t)m0 * op.K;
+    const int8_t *B0 = op.weight->wgt.data() + (size_t)(n0 / 16) * op.K * 16;
+    const int8_t *B1 = B0 + (size_t)op.K * 16;
+    const float *ascales = op.ascales.data();
+    const float *wscales = op.wscales->data();
+    const int32_t *wcorr = op.weight->wcorr.data();
+
+    for (int g = g0; g < g1; g++) {
+        __m512i acc[MR][2];
+        for (int i = 0; i < MR; i++) {
+            acc[i][0] = _mm512_setzero_si512();
+            acc[i][1] = _mm512_setzero_si512();
+        }
+        for (int kk = g * GROUP / 4; kk < (g + 1) * GROUP / 4; kk++) {
+            const __m512i b0 = _mm512_loadu_si512(B0 + kk * 64);
+            const __m512i b1 = _mm512_loadu_si512(B1 + kk * 64);
+            for (int i = 0; i < MR; i++) {
+                int32_t a4;
+                memcpy(&a4, A + (size_t)i * op.K + kk * 4, sizeof(a4));
+                const __m512i a = _mm512_set1_epi32(a4);
+                acc[i][0] = _mm512_dpbusd_epi32(acc[i][0], a, b0);
+                acc[i][1] = _mm512_dpbusd_epi32(acc[i][1], a, b1);
+            }
+        }
+        const float *ws = wscales + (size_t)g * op.N + n0;
+        const int32_t *corr = wcorr + (size_t)g * op.N + n0;
+        const __m512 ws0 = _mm512_loadu_ps(ws);
+        const __m512 ws1 = _mm512_loadu_ps(ws + 16);
+        const __m512i corr0 = _mm512_loadu_si512(corr);
+        const __m512i corr1 = _mm512_loadu_si512(corr + 16);
+        for (int i = 0; i < MR; i++) {
+            const __m512 as = _mm512_set1_ps(ascales[(size_t)g * op.M + m0 + i]);
+            float *c = C + i * ldc;
+            _mm512_storeu_ps(c,      _mm512_fmadd_ps(_mm512_cvtepi32_ps(_mm512_sub_epi32(acc[i][0], corr0)), _mm512_mul_ps(ws0, as), _mm512_loadu_ps(c)));
+            _mm512_storeu_ps(c + 16, _mm512_fmadd_ps(_mm512_cvtepi32_ps(_mm512_sub_epi32(acc[i][1], corr1)), _mm512_mul_ps(ws1, as), _mm512_loadu_ps(c + 16)));
+        }
+    }
+}
+
+#endif
+
+KernelInfo selectKernel(bool fp4) {
+    const std::string forced = forcedISA();
+#if HOST_SIMD
+    if ((forced.empty() || forced == "avx512vnni") && hasAVX512VNNI()) {
+        return KernelInfo{"avx512vnni", fp4 ? microKernelAVX512VNNI<FP4_GROUP> : microKernelAVX512VNNI<GROUP_K>, 8, 32, decodeNibblesShuffle};
+    }
+    if ((forced.empty() || forced == "avx512vnni" || forced == "avx2") && hasAVX2()) {
+        return KernelInfo{"avx2", fp4 ? microKernelAVX2<FP4_GROUP> : microKernelAVX2<GROUP_K>, 4, 16, decodeNibblesShuffle};
+    }
+#endif
+    return KernelInfo{"scalar", fp4 ? microKernelScalar<FP4_GROUP> : microKernelScalar<GROUP_K>, 4, 16, decodeNibblesScalar};
+}
+
+// fp4: e2m1 nibbles with e4m3 micro-scales per 16 elements
+void unpackActivations(Operands &op, Tensor act, Tensor ascales, bool act_unsigned, bool fp4, NibbleDecoder decode) {
+    const int M = op.M, K = op.K;
+    const int numGroups = K / op.groupSize;
+    const Tensor::ScalarType dtype = ascales.dtype();
+    const int8_t *actTable = fp4 ? NIBBLE_E2M1_ACT : act_unsigned ? NIBBLE_UNSIGNED : NIBBLE_INT4_ACT;
+
+    op.act.resize((size_t)M * K);
+    op.ascales.resize((size_t)numGroups * M);
+
+    const uint32_t *actWords = act.data_ptr<uint32_t>();
+    const uint16_t *as = ascales.data_ptr<uint16_t>();
+    const uint8_t *ams = ascales.data_ptr<uint8_t>();
+
+    parallelFor(M / BLOCK_M, [&](int begin, int end) {
+        for (int m = begin * BLOCK_M; m < end * BLOCK_M; m++) {
+            int8_t *dst = reinterpret_cast<int8_t *>(&op.act[(size_t)m * K]);
+            for (int k = 0; k < K; k += 8) {
+                decode(actWords[packedActWord(m, k, K)], actTable, dst + k);
+            }
+            for (int g = 0; g < numGroups; g++) {
+                op.ascales[(size_t)g * M + m] = fp4
+                    ? e4m3ToFloat(ams[packedAmscaleByte(m, g, K)])
+                    : halfToFloat(as[packedAscaleIndex(m, g, numGroups)], dtype);
+            }
+        }
+    });
+}
+
+// actOffset is the offset of the activations the weight is multiplied with, which wcorr subtracts again
+UnpackedWeight unpackWeight(Tensor wgt, int N, int K, int groupSize, bool fp4, int actOffset, NibbleDecoder decode) {
+    const int8_t *wgtTable = fp4 ? NIBBLE_E2M1_WGT : NIBBLE_INT4_WGT;
+    const uint32_t *wgtWords = wgt.data_ptr<uint32_t>();
+
+    UnpackedWeight result;
+    result.wgt.resize((size_t)N * K);
+    result.wcorr.assign((size_t)(K / groupSize) * N, 0);
+
+    parallelFor(N / BLOCK_N, [&](int begin, int end) {
+        for (int n = begin * BLOCK_N; n < end * BLOCK_N; n++) {
+            int8_t *dst = &result.wgt[(size_t)(n / 16) * K * 16 + n % 16 * 4];
+            for (int k = 0; k < K; k += 8) {
+                int8_t v[8];
+                decode(wgtWords[packedWgtWord(n, k, K)], wgtTable, v);
+                memcpy(dst + k / 4 * 64, v, 4);
+                memcpy(dst + k / 4 * 64 + 64, v + 4, 4);
+                if (actOffset != 0) {
+                    int32_t sum = 0;
+                    for (int i = 0; i < 8; i++) {
+                        sum += v[i];
+                    }
+                    result.wcorr[(size_t)(k / groupSize) * N + n] += actOffset * sum;
+                }
+            }
+        }
+    });
+    return result;
+}
+
+// alpha (the per-tensor weight scale of NVFP4) is folded into the scales
+std::vector<float> unpackWeightScales(Tensor wscales, int N, int K, int groupSize, bool fp4, float alpha) {
+    const int numGroups = K / groupSize;
+    const uint16_t *ws = wscales.data_ptr<uint16_t>();
+    const uint8_t *wms = wscales.data_ptr<uint8_t>();
+
+    std::vector<float> result((size_t)numGroups * N);
+    parallelFor(N / BLOCK_N, [&](int begin, int end) {
+        for (int n = begin * BLOCK_N; n < end * BLOCK_N; n++) {
+            const int bn = n / BLOCK_N;
+            for (int g = 0; g < numGroups; g++) {
+                result[(size_t)g * N + n] = fp4
+                    ? e4m3ToFloat(wms[packedWmscaleByte(n, g, K)]) * (alpha * 0.25f)
+                    : halfToFloat(ws[((size_t)bn * numGroups + g) * BLOCK_N + packedWscaleIndex(n)], wscales.dtype());
+            }
+        }
+    });
+    return result;
+}
+
+void unpackOperands(Operands &op, Tensor act, Tensor wgt, Tensor ascales, Tensor wscales, bool act_unsigned, bool fp4, float alpha, NibbleDecoder decode) {
+    const int N = op.N, K = op.K;
+    const int groupSize = op.groupSize = fp4 ? FP4_GROUP : GROUP_K;
+    const int actOffset = fp4 ? E2M1_ACT_OFFSET : act_unsigned ? 0 : INT4_ACT_OFFSET;
+
+    unpackActivations(op, act, ascales, act_unsigned, fp4, decode);
+    op.weight = wgt.buffer->derived<UnpackedWeight>(
+        spdlog::fmt_lib::format("gemm_w4a4_cpu.wgt {} {} {} {} {}", wgt.shape.offset, N, K, fp4, actOffset),
+        [&]() { return unpackWeight(wgt, N, K, groupSize, fp4, actOffset, decode); });
+    op.wscales = wscales.buffer->derived<std::vector<float>>(
+        spdlog::fmt_lib::format("gemm_w4a4_cpu.wscales {} {} {} {} {} {}", wscales.shape.offset, (int)wscales.dtype(), N, K, fp4, alpha),
+        [&]() { return unpackWeightScales(wscales, N, K, groupSize, fp4, alpha); });
+}
+
+// packed ws [N] to float in channel order, empty if the tensor is not given
+std::vector<float> unpackVector(Tensor packed, int N) {
+    std::vector<float> result;
+    if (!packed.valid()) {
+        return result;
+    }
+    const uint16_t *data = packed.data_ptr<uint16_t>();
+    result.resize(N);
+    for (int n = 0; n < N; n++) {
+        result[n] = halfToFloat(data[n / BLOCK_N * BLOCK_N + packedWscaleIndex(n)], packed.dtype());
+    }
+    return result;
+}
+
+// packed lora_wgt [N / 16, R / 16, 32 lanes, 8] to float [R, N] (transposed) for lora_up and [N, R] for lora_down
+std::vector<float> unpackLoraWeight(Tensor packed, int N, int rank, bool down) {
+    const uint16_t *data = packed.data_ptr<uint16_t>();
+    std::vector<float> result((size_t)N * rank);
+    for (int ct = 0; ct < N / 16; ct++) {
+        for (int rt = 0; rt < rank / 16; rt++) {
+            for (int lane = 0; lane < 32; lane++) {
+                for (int elem = 0; elem < 8; elem++) {
+                    const int a = elem / 4 * 8 + lane / 4;
+                    const int b = elem / 2 % 2 * 8 + lane % 4 * 2 + elem % 2;
+                    const int n = ct * 16 + (down ? b : a);
+                    const int r = rt * 16 + (down ? a : b);
+                    const float v = halfToFloat(data[(((size_t)ct * (rank / 16) + rt) * 32 + lane) * 8 + elem], packed.dtype());
+                    if (down) {
+                        result[(size_t)n * rank + r] = v;
+                    } else {
+                        result[(size_t)r * N + n] = v;
+                    }
+                }
+            }
+        }
+    }
+    return result;
+}
+
+// unpackLoraWeight cached on the buffer of the packed weight
+std::shared_ptr<const std::vector<float>> loraWeight(Tensor packed, int N, int rank, bool down) {
+    return packed.buffer->derived<std::vector<float>>(
+        spdlog::fmt_lib::format("gemm_w4a4_cpu.lora {} {} {} {} {}", packed.shape.offset, (int)packed.dtype(), N, rank, down),
+        [&]() { return unpackLoraWeight(packed, N, rank, down); });
+}
+
+float gelu(float x) {
+    return x * (0.5f + 0.5f * std::tanh(0.79788456f * (x + 0.044715f * x * x * x)));
+}
+
+float silu(float x) {
+    return x / (1.0f + std::exp(-x));
+}
+
+// NVFP4 of 16 smoothed values as quantize_w4a4_fp4_from_fpsum_warp: the e2m1 codes use the unrounded scale
+// returns the e4m3 micro-scale
+uint8_t quantizeBlockFp4(const float *v, uint32_t *words) {
+    float amax = 0;
+    for (int t = 0; t < FP4_GROUP; t++) {
+        amax = std::max(amax, std::abs(v[t]));
+    }
+    const float scale = std::min(amax * (1.0f / 6.0f), FP8_MAX);
+    const float rscale = scale > 0 ? 1.0f / scale : 0.0f;
+    for (int c = 0; c < FP4_GROUP / 8; c++) {
+        uint32_t word = 0;
+        for (int t = 0; t < 8; t++) {
+            word |= floatToE2M1(v[c * 8 + t] * rscale) << (t * 4);
+        }
+        words[c] = word;
+    }
+    return floatToE4M3(scale);
+}
+
+// vk[0 .. 32) += vt kr over the rows of one head, vk[32] += the column sums of kr; kr is [rows, 32], vt [32, rows]
+using VkAccumulate = void (*)(const float *kr, const float *vt, int rows, float *vk);
+
+void vkAccumulateScalar(const float *kr, const float *vt, int rows, float *vk) {
+    constexpr int D = LITELA_HEAD_DIM;
+    for (int r = 0; r < D; r++) {
+        float *dst = vk + r * D;
+        for (int i = 0; i < rows; i++) {
+            const float v = vt[r * rows + i];
+            for (int j = 0; j < D; j++) {
+                dst[j] += v * kr[i * D + j];
+            }
+        }
+    }
+    for (int i = 0; i < rows; i++) {
+        for (int j = 0; j < D; j++) {
+            vk[D * D + j] += kr[i * D + j];
+        }
+    }
+}
+
+#if HOST_SIMD
+
+// two rows of vk per sweep over the tokens: 8 accumulators, 4 vectors of kr and 2 broadcasts
+TARGET_AVX2
+void vkAccumulateAVX2(const float *kr, const float *vt, int rows, float *vk) {
+    constexpr int D = LITELA_HEAD_DIM;
+    constexpr int NV = D / 8;
+    for (int r = 0; r < D; r += 2) {
+        __m256 acc0[NV], acc1[NV];
+        for (int c = 0; c < NV; c++) {
+            acc0[c] = _mm256_loadu_ps(vk + r * D + c * 8);
+            acc1[c] = _mm256_loadu_ps(vk + (r + 1) * D + c * 8);
+        }
+        for (int i = 0; i < rows; i++) {
+            const __m256 v0 = _mm256_broadcast_ss(vt + r * rows + i);
+            const __m256 v1 = _mm256_broadcast_ss(vt + (r + 1) * rows + i);
+            for (int c = 0; c < NV; c++) {
+                const __m256 k = _mm256_loadu_ps(kr + i * D + c * 8);
+                acc0[c] = _mm256_fmadd_ps(v0, k, acc0[c]);
+                acc1[c] = _mm256_fmadd_ps(v1, k, acc1[c]);
+            }
+        }
+        for (int c = 0; c < NV; c++) {
+            _mm256_storeu_ps(vk + r * D + c * 8, acc0[c]);
+            _mm256_storeu_ps(vk + (r + 1) * D + c * 8, acc1[c]);
+        }
+    }
+    __m256 sum[NV];
+    for (int c = 0; c < NV; c++) {
+        sum[c] = _mm256_loadu_ps(vk + D * D + c * 8);
+    }
+    for (int i = 0; i < rows; i++) {
+        for (int c = 0; c < NV; c++) {
+            sum[c] = _mm256_add_ps(sum[c], _mm256_loadu_ps(kr + i * D + c * 8));
+        }
+    }
+    for (int c = 0; c < NV; c++) {
+        _mm256_storeu_ps(vk + D * D + c * 8, sum[c]);
+    }
+}
+
+#endif
+
+// a tile of the q or k third, one head: the row x = half(C) becomes x * (rsqrt(mean(x^2) + eps) * weight) with the pairs
+// of columns rotated by the sin / cos of the row, rounded to half once, as EpilogueRMSNormRope
+using NormRope = void (*)(float *C, const float *rotary, int m0, const float *weight, Tensor::ScalarType dtype);
+
+void normRopeScalar(float *C, const float *rotary, int m0, const float *weight, Tensor::ScalarType dtype) {
+    for (int i = 0; i < BLOCK_M; i++) {
+        float *row = C + i * BLOCK_N;
+        float sqrsum = 0;
+        for (int j = 0; j < ATTN_HEAD_DIM; j++) {
+            row[j] = roundToHalf(row[j], dtype);
+            sqrsum += row[j] * row[j];
+        }
+        const float coef = 1.0f / std::sqrt(sqrsum / ATTN_HEAD_DIM + RMSNORM_EPS);
+        for (int pair = 0; pair < ATTN_HEAD_DIM / 2; pair++) {
+            const float *sincos = rotary + rotaryIndex(m0 + i, pair);
+            const float x = row[pair * 2] * (coef * weight[pair * 2]);
+            const float y = row[pair * 2 + 1] * (coef * weight[pair * 2 + 1]);
+            row[pair * 2] = roundToHalf(x * sincos[1] - y * sincos[0], dtype);
+            row[pair * 2 + 1] = roundToHalf(x * sincos[0] + y * sincos[1], dtype);
+        }
+    }
+}
+
+struct Epilogue {
+    Tensor::ScalarType dtype;
+    int M, N;
+
+    std::vector<float> bias, wcscales;
+
+    int rankUp = 0;
+    const float *loraActIn = nullptr;
+    std::shared_ptr<const std::vector<float>> loraUp;       // [R, N]
+    std::vector<float> loraScales;  // [R / 16]
+
+    enum { MidNone, MidGelu, MidSilu } mid = MidNone;
+
+    int rankDown = 0;
+    float *loraActOut = nullptr;
+    std::shared_ptr<const std::vector<float>> loraDown;     // [N, R]
+    std::shared_ptr<std::mutex[]> loraActOutLocks; // one per block of rows
+
+    uint16_t *out = nullptr;
+    int actualM = 0, actualN = 0;
+
+    uint32_t *qout = nullptr;
+    uint16_t *oscales = nullptr;
+    uint8_t *omscales = nullptr;    // NVFP4 micro-scales of qout, used instead of oscales
+    std::vector<float> smooth;
+
+    // EpilogueLiteLA: relu(q) goes to linearattnQ, k and v only feed the vk statistics of their head
+    uint16_t *linearattnQ = nullptr;    // [actualM, N / 3]
+    float *outVk = nullptr;             // [B, N / 96, 33, 32]
+    int tokensPerBatch = 0;
+    std::shared_ptr<std::mutex[]> vkLocks; // one per batch item and head
+    VkAccumulate vkAccumulate = vkAccumulateScalar;
+
+    // EpilogueRMSNormRope: the heads of the q / k thirds are normalized and rotated before any output is written
+    const float *rotary = nullptr;      // [M, 128] packed by pack_rotemb
+    std::vector<float> normQ, normK;    // [128]
+    NormRope normRope = normRopeScalar;
+    // EpilogueQKVProj: mean of every POOL_SIZE rows of the q / k thirds of out
+    uint16_t *poolout = nullptr;        // [poolRows, N]
+    int poolRows = 0;
+    // EpiloguePackQKV: q / k / v as [B, H, T, 128] heads, the rows of each batch item from attnTokens on are masked
+    uint16_t *packed[3] = {};
+    Tensor::ScalarType packedDtype;
+    size_t packedStrideBatch[3] = {}, packedStrideHead[3] = {};
+    int packedTokens = 0;
+    int attnTokens = 0;
+};
+
+// the k / v thirds of a LiteLA tile: every 64 columns are the k and v of one head, whose
+// vk = [v, 1]^T relu(k) accumulates over the rows of each batch item, in half precision inputs as the mma of the kernel
+void accumulateLiteLA(Epilogue &ep, int bm, int bn, const float *C, std::vector<float> &scratch) {
+    constexpr int D = LITELA_HEAD_DIM;
+    const int m0 = bm * BLOCK_M;
+    const int numHeads = ep.N / 3 / D;
+    const int rows = std::min(BLOCK_M, ep.actualM - m0);
+    scratch.resize((D + 1) * D + BLOCK_M * D * 2);
+    float *vk = scratch.data();
+    float *kr = vk + (D + 1) * D;   // [rows, D]
+    float *vt = kr + BLOCK_M * D;   // [D, rows]
+    for (int head = 0; head < BLOCK_N / (D * 2); head++) {
+        const int h = (bn * BLOCK_N - ep.N / 3) / (D * 2) + head;
+        for (int i0 = 0; i0 < rows;) {
+            // a tile may span the end of a batch item
+            const int b = (m0 + i0) / ep.tokensPerBatch;
+            const int segment = std::min(rows, (b + 1) * ep.tokensPerBatch - m0) - i0;
+            for (int i = 0; i < segment; i++) {
+                const float *k = C + (i0 + i) * BLOCK_N + head * D * 2;
+                const float *v = k + D;
+                for (int j = 0; j < D; j++) {
+                    kr[i * D + j] = std::max(roundToHalf(k[j], ep.dtype), 0.0f);
+                    vt[j * segment + i] = roundToHalf(v[j], ep.dtype);
+                }
+            }
+            std::fill(vk, vk + (D + 1) * D, 0.0f);
+            ep.vkAccumulate(kr, vt, segment, vk);
+            i0 += segment;
+
+            std::lock_guard<std::mutex> lock(ep.vkLocks[b * numHeads + h]);
+            float *dst = ep.outVk + ((size_t)b * numHeads + h) * (D + 1) * D;
+            for (int t = 0; t < (D + 1) * D; t++) {
+                dst[t] += vk[t];
+            }
+        }
+    }
+}
+
+// the pools of POOL_SIZE rows in a tile of the q or k third, a pool cut short by the end of out averages its valid rows
+void writePool(const Epilogue &ep, int bm, int bn, const float *C) {
+    for (int p = 0; p < BLOCK_M / POOL_SIZE; p++) {
+        const int pool = bm * (BLOCK_M / POOL_SIZE) + p;
+        const int rows = std::min(POOL_SIZE, ep.actualM - pool * POOL_SIZE);
+        if (pool >= ep.poolRows || rows <= 0) {
+            break;
+        }
+        float sum[BLOCK_N] = {};
+        for (int i = 0; i < rows; i++) {
+            const float *row = C + (p * POOL_SIZE + i) * BLOCK_N;
+            for (int j = 0; j < BLOCK_N; j++) {
+                sum[j] += row[j];
+            }
+        }
+        uint16_t *dst = ep.poolout + (size_t)pool * ep.N + bn * BLOCK_N;
+        for (int j = 0; j < BLOCK_N; j++) {
+            dst[j] = floatToHalf(sum[j] / rows, ep.dtype);
+        }
+    }
+}
+
+// EpiloguePackQKV: the tile is head bn of q, k or v and its rows are tokens of the packed [B, H, T, 128] outputs,
+// rows past attnTokens get 0 in q / v and NaN in k so that the attention masks them
+void writePacked(const Epilogue &ep, int bm, int bn, const float *C) {
+    const int headsPerThird = ep.N / 3 / BLOCK_N;
+    const int which = bn / headsPerThird;
+    const int head = bn % headsPerThird;
+    const uint16_t mask = floatToHalf(which == 1 ? NAN : 0.0f, ep.packedDtype);
+    for (int i = 0; i < BLOCK_M; i++) {
+        const int m = bm * BLOCK_M + i;
+        const int b = m / ep.packedTokens, t = m % ep.packedTokens;
+        uint16_t *dst = ep.packed[which] + b * ep.packedStrideBatch[which] + head * ep.packedStrideHead[which] + (size_t)t * ATTN_HEAD_DIM;
+        if (t >= ep.attnTokens) {
+            std::fill(dst, dst + ATTN_HEAD_DIM, mask);
+            continue;
+        }
+        const float *row = C + i * BLOCK_N;
+        for (int j = 0; j < ATTN_HEAD_DIM; j++) {
+            dst[j] = floatToHalf(roundToHalf(row[j], ep.dtype), ep.packedDtype);
+        }
+    }
+}
+
+// runs the epilogues in the order of the CUDA kernel on one BLOCK_M x BLOCK_N tile of fp32 sums
+void applyEpilogue(Epilogue &ep, int bm, int bn, float *C, std::vector<float> &scratch) {
+    const int m0 = bm * BLOCK_M;
+    const int n0 = bn * BLOCK_N;
+
+    if (!ep.bias.empty() || !ep.wcscales.empty()) {
+        for (int i = 0; i < BLOCK_M; i++) {
+            float *row = C + i * BLOCK_N;
+            if (!ep.wcscales.empty()) {
+                for (int j = 0; j < BLOCK_N; j++) {
+                    row[j] *= ep.wcscales[n0 + j];
+                }
+            }
+            if (!ep.bias.empty()) {
+                for (int j = 0; j < BLOCK_N; j++) {
+                    row[j] += ep.bias[n0 + j];
+                }
+            }
+        }
+    }
+
+    if (ep.rankUp > 0) {
+        // the kernel feeds the scaled lora_act to the tensor cores in half precision
+        const int R = ep.rankUp;
+        scratch.resize((size_t)BLOCK_M * R);
+        for (int i = 0; i < BLOCK_M; i++) {
+            for (int r = 0; r < R; r++) {
+                scratch[i * R + r] = roundToHalf(ep.loraActIn[loraActIndex(m0 + i, r, R)] * ep.loraScales[r / 16], ep.dtype);
+            }
+        }
+        for (int i = 0; i < BLOCK_M; i++) {
+            float *row = C + i * BLOCK_N;
+            for (int r = 0; r < R; r++) {
+                const float a = scratch[i * R + r];
+                const float *up = ep.loraUp->data() + (size_t)r * ep.N + n0;
+                for (int j = 0; j < BLOCK_N; j++) {
+                    row[j] += a * up[j];
+                }
+            }
+        }
+    }
+
+    if (ep.mid == Epilogue::MidGelu) {
+        for (int i = 0; i < BLOCK_M * BLOCK_N; i++) {
+            C[i] = gelu(C[i]);
+        }
+    } else if (ep.mid == Epilogue::MidSilu) {
+        for (int i = 0; i < BLOCK_M * BLOCK_N; i++) {
+            C[i] = silu(C[i]);
+        }
+    }
+
+    if (ep.rankDown > 0) {
+        const int R = ep.rankDown;
+        scratch.assign((size_t)BLOCK_M * R, 0.0f);
+        for (int i = 0; i < BLOCK_M; i++) {
+            float *partial = &scratch[i * R];
+            for (int j = 0; j < BLOCK_N; j++) {
+                const float h = roundToHalf(C[i * BLOCK_N + j], ep.dtype);
+                const float *down = ep.loraDown->data() + (size_t)(n0 + j) * R;
+                for (int r = 0; r < R; r++) {
+                    partial[r] += h * down[r];
+                }
+            }
+        }
+        std::lock_guard<std::mutex> lock(ep.loraActOutLocks[bm]);
+        for (int i = 0; i < BLOCK_M; i++) {
+            for (int r = 0; r < R; r++) {
+                ep.loraActOut[loraActIndex(m0 + i, r, R)] += scratch[i * R + r];
+            }
+        }
+    }
+
+    if (ep.rotary && bn * BLOCK_N < ep.N / 3 * 2) {
+        ep.normRope(C, ep.rotary, m0, (bn * BLOCK_N < ep.N / 3 ? ep.normQ : ep.normK).data(), ep.dtype);
+        if (ep.poolout) {
+            writePool(ep, bm, bn, C);
+        }
+    }
+
+    if (ep.packed[0]) {
+        writePacked(ep, bm, bn, C);
+        return;
+    }
+
+    if (ep.outVk) {
+        const int qN = ep.N / 3;
+        if (bn * BLOCK_N >= qN) {
+            accumulateLiteLA(ep, bm, bn, C, scratch);
+            return;
+        }
+        const bool clamp = ep.dtype == Tensor::FP16;
+        for (int i = 0; i < BLOCK_M && m0 + i < ep.actualM; i++) {
+            uint16_t *dst = ep.linearattnQ + (size_t)(m0 + i) * qN + n0;
+            for (int j = 0; j < BLOCK_N; j++) {
+                float v = std::max(C[i * BLOCK_N + j], 0.0f);
+                if (clamp) {
+                    v = std::min(v, 65504.0f);
+                }
+                dst[j] = floatToHalf(v, ep.dtype);
+            }
+        }
+        return;
+    }
+
+    if (ep.out) {
+        const bool clamp = ep.dtype == Tensor::FP16;
+        for (int i = 0; i < BLOCK_M && m0 + i < ep.actualM; i++) {
+            uint16_t *dst = ep.out + (size_t)(m0 + i) * ep.actualN;
+            for (int j = 0; j < BLOCK_N && n0 + j < ep.actualN; j++) {
+                float v = C[i * BLOCK_N + j];
+                if (clamp) {
+                    v = std::clamp(v, -65504.0f, 65504.0f);
+                }
+                dst[n0 + j] = floatToHalf(v, ep.dtype);
+            }
+        }
+    }
+
+    if (ep.qout && ep.omscales) {
+        // NVFP4 is signed, the GELU output is quantized without shift
+        for (int i = 0; i < BLOCK_M; i++) {
+            const int m = m0 + i;
+            for (int q = 0; q < BLOCK_N / FP4_GROUP; q++) {
+                const int block = bn * (BLOCK_N / FP4_GROUP) + q;
+                float v[FP4_GROUP];
+                for (int t = 0; t < FP4_GROUP; t++) {
+                    const int n = block * FP4_GROUP + t;
+                    v[t] = roundToHalf(roundToHalf(C[i * BLOCK_N + q * FP4_GROUP + t], ep.dtype) / ep.smooth[n], ep.dtype);
+                }
+                uint32_t words[FP4_GROUP / 8];
+                ep.omscales[packedAmscaleByte(m, block, ep.N)] = quantizeBlockFp4(v, words);
+                for (int c = 0; c < FP4_GROUP / 8; c++) {
+                    ep.qout[packedActWord(m, block * FP4_GROUP + c * 8, ep.N)] = words[c];
+                }
+            }
+        }
+    } else if (ep.qout) {
+        // unsigned INT4 for the GELU output of the next layer, same roundings as EpilogueQuantize
+        const int numGroups = ep.N / GROUP_K;
+        for (int i = 0; i < BLOCK_M; i++) {
+            const int m = m0 + i;
+            for (int q = 0; q < BLOCK_N / GROUP_K; q++) {
+                const int g = bn * (BLOCK_N / GROUP_K) + q;
+                float v[GROUP_K];
+                float amax = 0;
+                for (int t = 0; t < GROUP_K; t++) {
+                    const int n = g * GROUP_K + t;
+                    const float shifted = roundToHalf(roundToHalf(C[i * BLOCK_N + q * GROUP_K + t], ep.dtype) + SHIFT_GELU, ep.dtype);
+                    v[t] = roundToHalf(shifted / ep.smooth[n], ep.dtype);
+                    amax = std::max(amax, std::abs(v[t]));
+                }
+                const float scale = amax * (1.0f / 15.0f);
+                const float rscale = 1.0f / scale;
+                for (int c = 0; c < GROUP_K / 8; c++) {
+                    uint32_t word = 0;
+                    for (int t = 0; t < 8; t++) {
+                        const float x = v[c * 8 + t] * rscale;
+                        const uint32_t qv = x > 0 ? (uint32_t)std::min(std::nearbyint(x), 15.0f) : 0;
+                        word |= qv << (t * 4);
+                    }
+                    ep.qout[packedActWord(m, g * GROUP_K + c * 8, ep.N)] = word;
+                }
+                ep.oscales[packedAscaleIndex(m, g, numGroups)] = floatToHalf(scale, ep.dtype);
+            }
+        }
+    }
+}
+
+// tile order of a thread, as swapBlockMN of the CUDA launch: consecutive tiles walk along M unless swapped
+void tileCoords(int tile, int tilesM, int tilesN, bool swapBlockMN, int &bm, int &bn) {
+    if (swapBlockMN) {
+        bm = tile / tilesN;
+        bn = tile % tilesN;
+    } else {
+        bm = tile % tilesM;
+        bn = tile / tilesM;
+    }
+}
+
+// C[BLOCK_M, BLOCK_N] = act[bm] * wgt[bn], K in passes of kc groups, each pass sweeps mc rows per NR channels of nc columns
+void computeTile(const Operands &op, const KernelInfo &kernel, const CpuGemmBlocking &blocking, int bm, int bn, float *C) {
+    const int numGroups = op.K / op.groupSize;
+    const int chunkGroups = blocking.kc * GROUP_K / op.groupSize;
+    std::fill(C, C + BLOCK_M * BLOCK_N, 0.0f);
+    for (int g0 = 0; g0 < numGroups; g0 += chunkGroups) {
+        const int g1 = std::min(g0 + chunkGroups, numGroups);
+        for (int n0 = 0; n0 < BLOCK_N; n0 += blocking.nc) {
+            for (int m0 = 0; m0 < BLOCK_M; m0 += blocking.mc) {
+                for (int n = n0; n < n0 + blocking.nc; n += kernel.NR) {
+                    for (int m = m0; m < m0 + blocking.mc; m += kernel.MR) {
+                        kernel.func(op, bm * BLOCK_M + m, bn * BLOCK_N + n, g0, g1, &C[m * BLOCK_N + n], BLOCK_N);
+                    }
+                }
+            }
+        }
+    }
+}
+
+// without an entry in the database: full tiles, CHUNK_GROUPS per pass and the swapBlockMN rule of the CUDA launch
+CpuGemmBlocking defaultBlocking(int M, int N) {
+    return CpuGemmBlocking{BLOCK_M, CHUNK_GROUPS, BLOCK_N, M > N * 2};
+}
+
+// tiles per thread timed for each candidate, enough to see the reuse between consecutive tiles
+constexpr int TUNE_TILES_PER_THREAD = 4;
+
+// times the main loop (without epilogue) of every candidate blocking on a sample of the tiles of this GEMM
+// the sample is a fixed corner of the tile grid, swapBlockMN only changes the order in which it is walked
+CpuGemmBlocking tuneBlocking(const Operands &op, const KernelInfo &kernel, double &bestGflops) {
+    const int tilesM = op.M / BLOCK_M, tilesN = op.N / BLOCK_N;
+    const int target = cpuNumThreads() * TUNE_TILES_PER_THREAD;
+    // close to square so that both orders reuse operands between consecutive tiles
+    int sampleM = std::min(tilesM, std::max(1, (int)std::sqrt((double)target)));
+    const int sampleN = std::min(tilesN, ceilDiv(target, sampleM));
+    sampleM = std::min(tilesM, ceilDiv(target, sampleN));
+    const int sample = sampleM * sampleN;
+
+    auto run = [&](const CpuGemmBlocking &blocking) {
+        const auto start = std::chrono::steady_clock::now();
+        parallelFor(sample, [&](int begin, int end) {
+            std::vector<float> C((size_t)BLOCK_M * BLOCK_N);
+            for (int tile = begin; tile < end; tile++) {
+                int bm, bn;
+                tileCoords(tile, sampleM, sampleN, blocking.swapBlockMN, bm, bn);
+                computeTile(op, kernel, blocking, bm, bn, C.data());
+            }
+        });
+        return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    };
+
+    CpuGemmBlocking best = defaultBlocking(op.M, op.N);
+    run(best);  // warm up caches and page in the operands
+    double bestTime = run(best);
+    for (bool swap : {false, true}) {
+        for (int mc : {64, 128, BLOCK_M}) {
+            for (int kc : {4, 8, 16, 32}) {
+                for (int nc : {32, 64, BLOCK_N}) {
+                    if (nc % kernel.NR != 0) {
+                        continue;
+                    }
+                    const CpuGemmBlocking candidate{mc, kc, nc, swap};
+                    // best of two, a single run is noisy on a busy host
+                    const double time = std::min(run(candidate), run(candidate));
+                    if (time < bestTime) {
+                        best = candidate;
+                        bestTime = time;
+                    }
+                }
+            }
+        }
+    }
+    bestGflops = 2.0 * sample * BLOCK_M * BLOCK_N * op.K / bestTime / 1e9;
+    return best;
+}
+
+// NUNCHAKU_CPU_GEMM_TUNE=1 tunes shapes missing from the database at first use, =force retunes them all
+std::string tuneMode() {
+    const char *env = getenv("NUNCHAKU_CPU_GEMM_TUNE");
+    return env ? env : "";
+}
+
+// the blocking of the database or the default one, false if the shape is to be tuned on its operands (see tuneMode)
+bool findBlocking(int M, int N, int K, const KernelInfo &kernel, bool fp4, Tensor::ScalarType dtype, CpuGemmBlocking &blocking) {
+    const CpuGemmShape shape{kernel.name, fp4, dtype, cpuNumThreads(), CpuGemmTuningDB::bucketM(M), N, K};
+
+    const std::string tune = tuneMode();
+    const bool force = tune == "force";
+    if (!force) {
+        auto found = CpuGemmTuningDB::instance().find(shape);
+        if (found && found->mc > 0 && BLOCK_M % found->mc == 0 && found->mc % kernel.MR == 0 && found->kc > 0 &&
+            found->nc > 0 && BLOCK_N % found->nc == 0 && found->nc % kernel.NR == 0) {
+            blocking = *found;
+            return true;
+        }
+    }
+    blocking = defaultBlocking(M, N);
+    return !force && tune != "1";
+}
+
+CpuGemmBlocking tuneAndSaveBlocking(const Operands &op, const KernelInfo &kernel, bool fp4, Tensor::ScalarType dtype) {
+    const CpuGemmShape shape{kernel.name, fp4, dtype, cpuNumThreads(), CpuGemmTuningDB::bucketM(op.M), op.N, op.K};
+    double gflops;
+    const CpuGemmBlocking blocking = tuneBlocking(op, kernel, gflops);
+    spdlog::info("gemm_w4a4_cpu: tuned M={} N={} K={} {} {} on {} threads: mc={} kc={} nc={} swapBlockMN={} ({:.1f} GFLOP/s in the main loop)",
+        op.M, op.N, op.K, fp4 ? "fp4" : "int4", kernel.name, shape.threads, blocking.mc, blocking.kc, blocking.nc, blocking.swapBlockMN, gflops);
+    CpuGemmTuningDB::instance().insert(shape, blocking, gflops);
+    return blocking;
+}
+
+// rows handled by one pass of quantize_w4a4_act_fuse_lora_cpu, an m tile of the packed layouts
+constexpr int QUANT_ROWS = 16;
+
+struct ActQuantizer {
+    Tensor::ScalarType dtype;
+    const uint16_t *input = nullptr;
+    int actualM, actualN;           // shape of the input, actualN counts both halves of the GLU
+    int M, N;
+    bool fuseGlu;
+
+    std::vector<float> smooth;      // [N]
+
+    // quantize_w4a4_act_fuse_norm_cpu: LayerNorm (without affine) and AdaLN modulation of the input rows
+    bool normalize = false;
+    float eps = 0;
+    int tokensPerBatch = 0;
+    std::vector<float> modScale;    // [batch, N], zero padded
+    std::vector<float> modShift;    // [batch, N]
+
+    int rank = 0;
+    std::shared_ptr<const std::vector<float>> loraDown;     // [N, R]
+
+    uint32_t *output = nullptr;
+    uint16_t *oscales = nullptr;
+    uint8_t *omscales = nullptr;    // NVFP4 micro-scales, used instead of oscales
+};
+
+// x[QUANT_ROWS, 64] = group g of rows m0 .. m0 + 15 as the kernel sees them (half precision, GLU applied, zero padded)
+void loadGroupScalar(const ActQuantizer &q, int m0, int g, float *x) {
+    for (int i = 0; i < QUANT_ROWS; i++) {
+        const int m = m0 + i;
+        for (int t = 0; t < GROUP_K; t++) {
+            const int n = g * GROUP_K + t;
+            float v = 0;
+            if (q.fuseGlu) {
+                if (m < q.actualM && n * 2 < q.actualN) {
+                    const uint16_t *src = q.input + (size_t)m * q.actualN + n * 2;
+                    const float gate = roundToHalf(silu(halfToFloat(src[1], q.dtype)), q.dtype);
+                    v = roundToHalf(halfToFloat(src[0], q.dtype) * gate, q.dtype);
+                }
+            } else if (m < q.actualM && n < q.actualN) {
+                v = halfToFloat(q.input[(size_t)m * q.actualN + n], q.dtype);
+            }
+            x[i * GROUP_K + t] = v;
+        }
+    }
+}
+
+// mean and 1 / std of a row from its sum and sum of squares, like generalLayerNorm with USE_DIFF_OF_SQUARES
+void finishRowStats(float sum, float sumsq, int n, float eps, float *stats) {
+    const float mean = sum / n;
+    const float variance = std::max(sumsq / n - mean * mean, 0.0f);
+    stats[0] = mean;
+    stats[1] = 1.0f / std::sqrt(variance + eps);
+}
+
+// stats[QUANT_ROWS, 2] = mean and 1 / std of rows m0 .. m0 + 15, padding rows get 0
+void rowStatsScalar(const ActQuantizer &q, int m0, float *stats) {
+    for (int i = 0; i < QUANT_ROWS; i++) {
+        const int m = m0 + i;
+        float sum = 0, sumsq = 0;
+        if (m < q.actualM) {
+            const uint16_t *src = q.input + (size_t)m * q.actualN;
+            for (int n = 0; n < q.actualN; n++) {
+                const float v = halfToFloat(src[n], q.dtype);
+                sum += v;
+                sumsq += v * v;
+            }
+        }
+        finishRowStats(sum, sumsq, q.actualN, q.eps, stats + i * 2);
+    }
+}
+
+// like loadGroupScalar, with the rows normalized and modulated: LayerNorm::forward followed by kernels::mul_add,
+// rounding to half after the norm, the product and the sum (and clamping fp16 to its range) as the two kernels do
+void loadGroupNormScalar(const ActQuantizer &q, int m0, int g, const float *stats, float *x) {
+    for (int i = 0; i < QUANT_ROWS; i++) {
+        const int m = m0 + i;
+        const float *scale = m < q.actualM ? q.modScale.data() + (size_t)(m / q.tokensPerBatch) * q.N : nullptr;
+        const float *shift = m < q.actualM ? q.modShift.data() + (size_t)(m / q.tokensPerBatch) * q.N : nullptr;
+        for (int t = 0; t < GROUP_K; t++) {
+            const int n = g * GROUP_K + t;
+            float v = 0;
+            if (m < q.actualM && n < q.actualN) {
+                const float norm = roundToHalf((halfToFloat(q.input[(size_t)m * q.actualN + n], q.dtype) - stats[i * 2]) * stats[i * 2 + 1], q.dtype);
+                v = roundToHalf(roundToHalf(norm * scale[n], q.dtype) + shift[n], q.dtype);
+                if (q.dtype == Tensor::FP16) {
+                    v = std::clamp(v, -65504.0f, 65504.0f);
+                }
+            }
+            x[i * GROUP_K + t] = v;
+        }
+    }
+}
+
+// signed INT4 of x / smooth with one scale per row and group, same roundings as EpilogueQuantize
+void quantizeGroupScalar(const ActQuantizer &q, int m0, int g, const float *x) {
+    const int numGroups = q.N / GROUP_K;
+    const float *smooth = q.smooth.data() + g * GROUP_K;
+    for (int i = 0; i < QUANT_ROWS; i++) {
+        const int m = m0 + i;
+        float v[GROUP_K];
+        float amax = 0;
+        for (int t = 0; t < GROUP_K; t++) {
+            v[t] = roundToHalf(x[i * GROUP_K + t] / smooth[t], q.dtype);
+            amax = std::max(amax, std::abs(v[t]));
+        }
+        const float scale = amax * (1.0f / 7.0f);
+        // an all-zero group gives 0 * inf on the GPU, which cvt.rni turns into 0
+        const float rscale = amax > 0 ? 1.0f / scale : 0.0f;
+        for (int c = 0; c < GROUP_K / 8; c++) {
+            uint32_t word = 0;
+            for (int t = 0; t < 8; t++) {
+                const int qv = std::clamp((int)std::nearbyint(v[c * 8 + t] * rscale), -8, 7);
+                word |= uint32_t(qv & 0xf) << (t * 4);
+            }
+            q.output[packedActWord(m, g * GROUP_K + c * 8, q.N)] = word;
+        }
+        q.oscales[packedAscaleIndex(m, g, numGroups)] = floatToHalf(scale, q.dtype);
+    }
+}
+
+// NVFP4 of x / smooth, 4 blocks of 16 with e4m3 micro-scales per group
+void quantizeGroupFp4(const ActQuantizer &q, int m0, int g, const float *x) {
+    const float *smooth = q.smooth.data() + g * GROUP_K;
+    for (int i = 0; i < QUANT_ROWS; i++) {
+        const int m = m0 + i;
+        float v[GROUP_K];
+        for (int t = 0; t < GROUP_K; t++) {
+            v[t] = roundToHalf(x[i * GROUP_K + t] / smooth[t], q.dtype);
+        }
+        for (int b = 0; b < GROUP_K / FP4_GROUP; b++) {
+            const int block = g * (GROUP_K / FP4_GROUP) + b;
+            uint32_t words[FP4_GROUP / 8];
+            q.omscales[packedAmscaleByte(m, block, q.N)] = quantizeBlockFp4(v + b * FP4_GROUP, words);
+            for (int c = 0; c < FP4_GROUP / 8; c++) {
+                q.output[packedActWord(m, block * FP4_GROUP + c * 8, q.N)] = words[c];
+            }
+        }
+    }
+}
+
+// acc[QUANT_ROWS, R] += x[QUANT_ROWS, 64] . down[64, R]
+void loraDownScalar(const float *x, const float *down, int rank, float *acc) {
+    for (int i = 0; i < QUANT_ROWS; i++) {
+        float *a = acc + i * rank;
+        for (int t = 0; t < GROUP_K; t++) {
+            const float xv = x[i * GROUP_K + t];
+            const float *d = down + t * rank;
+            for (int r = 0; r < rank; r++) {
+                a[r] += xv * d[r];
+            }
+        }
+    }
+}
+
+#if HOST_SIMD
+
+TARGET_AVX2
+void loadGroupAVX2(const ActQuantizer &q, int m0, int g, float *x) {
+    if (q.fuseGlu || (g + 1) * GROUP_K > q.actualN) {
+        // the GLU calls expf from libm, which is SSE code and stalls on dirty upper halves of the ymm registers
+        _mm256_zeroupper();
+        loadGroupScalar(q, m0, g, x);
+        return;
+    }
+    const bool bf16 = q.dtype == Tensor::BF16;
+    for (int i = 0; i < QUANT_ROWS; i++) {
+        const int m = m0 + i;
+        float *dst = x + i * GROUP_K;
+        if (m >= q.actualM) {
+            for (int c = 0; c < GROUP_K / 8; c++) {
+                _mm256_storeu_ps(dst + c * 8, _mm256_setzero_ps());
+            }
+            continue;
+        }
+        const uint16_t *src = q.input + (size_t)m * q.actualN + g * GROUP_K;
+        for (int c = 0; c < GROUP_K / 8; c++) {
+            const __m256 f = loadHalf8(src + c * 8, bf16);
+            _mm256_storeu_ps(dst + c * 8, f);
+        }
+    }
+}
+
+TARGET_AVX2
+void rowStatsAVX2(const ActQuantizer &q, int m0, float *stats) {
+    const bool bf16 = q.dtype == Tensor::BF16;
+    for (int i = 0; i < QUANT_ROWS; i++) {
+        const int m = m0 + i;
+        if (m >= q.actualM) {
+            finishRowStats(0, 0, q.actualN, q.eps, stats + i * 2);
+            continue;
+        }
+        const uint16_t *src = q.input + (size_t)m * q.actualN;
+        // two chains each, the adds are latency bound otherwise
+        __m256 sum[2] = {_mm256_setzero_ps(), _mm256_setzero_ps()};
+        __m256 sumsq[2] = {_mm256_setzero_ps(), _mm256_setzero_ps()};
+        int n = 0;
+        for (; n + 16 <= q.actualN; n += 16) {
+            for (int c = 0; c < 2; c++) {
+                const __m256 f = loadHalf8(src + n + c * 8, bf16);
+                sum[c] = _mm256_add_ps(sum[c], f);
+                sumsq[c] = _mm256_fmadd_ps(f, f, sumsq[c]);
+            }
+        }
+        alignas(32) float lanes[2][8];
+        _mm256_store_ps(lanes[0], _mm256_add_ps(sum[0], sum[1]));
+        _mm256_store_ps(lanes[1], _mm256_add_ps(sumsq[0], sumsq[1]));
+        float s = 0, s2 = 0;
+        for (int l = 0; l < 8; l++) {
+            s += lanes[0][l];
+            s2 += lanes[1][l];
+        }
+        for (; n < q.actualN; n++) {
+            const float v = halfToFloat(src[n], q.dtype);
+            s += v;
+            s2 += v * v;
+        }
+        finishRowStats(s, s2, q.actualN, q.eps, stats + i * 2);
+    }
+}
+
+TARGET_AVX2
+void loadGroupNormAVX2(const ActQuantizer &q, int m0, int g, const float *stats, float *x) {
+    if ((g + 1) * GROUP_K > q.actualN) {
+        _mm256_zeroupper();
+        loadGroupNormScalar(q, m0, g, stats, x);
+        return;
+    }
+    const bool bf16 = q.dtype == Tensor::BF16;
+    const __m256 hmax = _mm256_set1_ps(bf16 ? INFINITY : 65504.0f);
+    const __m256 hmin = _mm256_set1_ps(bf16 ? -INFINITY : -65504.0f);
+    for (int i = 0; i < QUANT_ROWS; i++) {
+        const int m = m0 + i;
+        float *dst = x + i * GROUP_K;
+        if (m >= q.actualM) {
+            for (int c = 0; c < GROUP_K / 8; c++) {
+                _mm256_storeu_ps(dst + c * 8, _mm256_setzero_ps());
+            }
+            continue;
+        }
+        const uint16_t *src = q.input + (size_t)m * q.actualN + g * GROUP_K;
+        const float *scale = q.modScale.data() + (size_t)(m / q.tokensPerBatch) * q.N + g * GROUP_K;
+        const float *shift = q.modShift.data() + (size_t)(m / q.tokensPerBatch) * q.N + g * GROUP_K;
+        const __m256 mean = _mm256_set1_ps(stats[i * 2]);
+        const __m256 rstd = _mm256_set1_ps(stats[i * 2 + 1]);
+        for (int c = 0; c < GROUP_K / 8; c++) {
+            __m256 f = loadHalf8(src + c * 8, bf16);
+            f = roundToHalfAVX2(_mm256_mul_ps(_mm256_sub_ps(f, mean), rstd), bf16);
+            f = roundToHalfAVX2(_mm256_mul_ps(f, _mm256_loadu_ps(scale + c * 8)), bf16);
+            f = roundToHalfAVX2(_mm256_add_ps(f, _mm256_loadu_ps(shift + c * 8)), bf16);
+            _mm256_storeu_ps(dst + c * 8, _mm256_min_ps(_mm256_max_ps(f, hmin), hmax));
+        }
+    }
+}
+
+TARGET_AVX2
+void quantizeGroupAVX2(const ActQuantizer &q, int m0, int g, const float *x) {
+    const int numGroups = q.N / GROUP_K;
+    const float *smooth = q.smooth.data() + g * GROUP_K;
+    const bool bf16 = q.dtype == Tensor::BF16;
+    const __m256 absMask = _mm256_castsi256_ps(_mm256_set1_epi32(0x7fffffff));
+    const __m256i qmin = _mm256_set1_epi32(-8);
+    const __m256i qmax = _mm256_set1_epi32(7);
+    const __m256i nibble = _mm256_set1_epi32(0xf);
+    const __m256i shifts = _mm256_setr_epi32(0, 4, 8, 12, 16, 20, 24, 28);
+
+    for (int i = 0; i < QUANT_ROWS; i++) {
+        const int m = m0 + i;
+        __m256 v[GROUP_K / 8];
+        __m256 vmax = _mm256_setzero_ps();
+        for (int c = 0; c < GROUP_K / 8; c++) {
+            v[c] = roundToHalfAVX2(_mm256_div_ps(_mm256_loadu_ps(x + i * GROUP_K + c * 8), _mm256_loadu_ps(smooth + c * 8)), bf16);
+            vmax = _mm256_max_ps(vmax, _mm256_and_ps(v[c], absMask));
+        }
+        const float amax = hmaxAVX2(vmax);
+
+        const float scale = amax * (1.0f / 7.0f);
+        const __m256 rscale = _mm256_set1_ps(amax > 0 ? 1.0f / scale : 0.0f);
+        for (int c = 0; c < GROUP_K / 8; c++) {
+            __m256i qv = _mm256_cvtps_epi32(_mm256_mul_ps(v[c], rscale));
+            qv = _mm256_min_epi32(_mm256_max_epi32(qv, qmin), qmax);
+            qv = _mm256_sllv_epi32(_mm256_and_si256(qv, nibble), shifts);
+            __m128i w = _mm_or_si128(_mm256_castsi256_si128(qv), _mm256_extracti128_si256(qv, 1));
+            w = _mm_or_si128(w, _mm_shuffle_epi32(w, _MM_SHUFFLE(1, 0, 3, 2)));
+            w = _mm_or_si128(w, _mm_shuffle_epi32(w, _MM_SHUFFLE(2, 3, 0, 1)));
+            q.output[packedActWord(m, g * GROUP_K + c * 8, q.N)] = _mm_cvtsi128_si32(w);
+        }
+        q.oscales[packedAscaleIndex(m, g, numGroups)] = floatToHalf(scale, q.dtype);
+    }
+}
+
+TARGET_AVX2
+void loraDownAVX2(const float *x, const float *down, int rank, float *acc) {
+    constexpr int MR = 4;
+    for (int i0 = 0; i0 < QUANT_ROWS; i0 += MR) {
+        for (int r0 = 0; r0 < rank; r0 += 16) {
+            __m256 c[MR][2];
+            for (int i = 0; i < MR; i++) {
+                c[i][0] = _mm256_loadu_ps(acc + (i0 + i) * rank + r0);
+                c[i][1] = _mm256_loadu_ps(acc + (i0 + i) * rank + r0 + 8);
+            }
+            for (int t = 0; t < GROUP_K; t++) {
+                const __m256 d0 = _mm256_loadu_ps(down + t * rank + r0);
+                const __m256 d1 = _mm256_loadu_ps(down + t * rank + r0 + 8);
+                for (int i = 0; i < MR; i++) {
+                    const __m256 xv = _mm256_broadcast_ss(x + (i0 + i) * GROUP_K + t);
+                    c[i][0] = _mm256_fmadd_ps(xv, d0, c[i][0]);
+                    c[i][1] = _mm256_fmadd_ps(xv, d1, c[i][1]);
+                }
+            }
+            for (int i = 0; i < MR; i++) {
+                _mm256_storeu_ps(acc + (i0 + i) * rank + r0, c[i][0]);
+                _mm256_storeu_ps(acc + (i0 + i) * rank + r0 + 8, c[i][1]);
+            }
+        }
+    }
+}
+
+// NV vectors of 16 ranks per pass, 4 rows x 4 vectors fill half of the zmm registers with accumulators
+template<int NV>
+TARGET_AVX512_VNNI inline __attribute__((always_inline))
+void loraDownAVX512Pass(const float *x, const float *down, int rank, float *acc, int i0, int r0) {
+    constexpr int MR = 4;
+    __m512 c[MR][NV];
+    for (int i = 0; i < MR; i++) {
+        for (int v = 0; v < NV; v++) {
+            c[i][v] = _mm512_loadu_ps(acc + (i0 + i) * rank + r0 + v * 16);
+        }
+    }
+    for (int t = 0; t < GROUP_K; t++) {
+        __m512 d[NV];
+        for (int v = 0; v < NV; v++) {
+            d[v] = _mm512_loadu_ps(down + t * rank + r0 + v * 16);
+        }
+        for (int i = 0; i < MR; i++) {
+            const __m512 xv = _mm512_set1_ps(x[(i0 + i) * GROUP_K + t]);
+            for (int v = 0; v < NV; v++) {
+                c[i][v] = _mm512_fmadd_ps(xv, d[v], c[i][v]);
+            }
+        }
+    }
+    for (int i = 0; i < MR; i++) {
+        for (int v = 0; v < NV; v++) {
+            _mm512_storeu_ps(acc + (i0 + i) * rank + r0 + v * 16, c[i][v]);
+        }
+    }
+}
+
+TARGET_AVX512_VNNI
+void loraDownAVX512(const float *x, const float *down, int rank, float *acc) {
+    for (int i0 = 0; i0 < QUANT_ROWS; i0 += 4) {
+        int r0 = 0;
+        for (; r0 + 64 <= rank; r0 += 64) {
+            loraDownAVX512Pass<4>(x, down, rank, acc, i0, r0);
+        }
+        for (; r0 < rank; r0 += 16) {
+            loraDownAVX512Pass<1>(x, down, rank, acc, i0, r0);
+        }
+    }
+}
+
+#endif
+
+struct QuantKernels {
+    const char *name;
+    void (*load)(const ActQuantizer &q, int m0, int g, float *x);
+    void (*quantize)(const ActQuantizer &q, int m0, int g, const float *x);
+    void (*loraDown)(const float *x, const float *down, int rank, float *acc);
+    void (*rowStats)(const ActQuantizer &q, int m0, float *stats);
+    void (*loadNorm)(const ActQuantizer &q, int m0, int g, const float *stats, float *x);
+};
+
+// follows NUNCHAKU_CPU_GEMM_ISA like the GEMM, the quantization itself needs no more than AVX2
+QuantKernels selectQuantKernels(bool fp4) {
+    const std::string forced = forcedISA();
+    QuantKernels kernels{"scalar", loadGroupScalar, quantizeGroupScalar, loraDownScalar, rowStatsScalar, loadGroupNormScalar};
+#if HOST_SIMD
+    if ((forced.empty() || forced == "avx512vnni") && hasAVX512VNNI()) {
+        kernels = QuantKernels{"avx512vnni", loadGroupAVX2, quantizeGroupAVX2, loraDownAVX512, rowStatsAVX2, loadGroupNormAVX2};
+    } else if ((forced.empty() || forced == "avx512vnni" || forced == "avx2") && hasAVX2()) {
+        kernels = QuantKernels{"avx2", loadGroupAVX2, quantizeGroupAVX2, loraDownAVX2, rowStatsAVX2, loadGroupNormAVX2};
+    }
+#endif
+    if (fp4) {
+        kernels.quantize = quantizeGroupFp4;
+    }
+    return kernels;
+}
+
+// checks the outputs of quantize_w4a4_act_fuse_lora_cpu / _fuse_norm_cpu, sets the rank of the LoRA down projection
+void checkQuantizerOutputs(ActQuantizer &q, Tensor output, Tensor oscales, Tensor lora_down, Tensor lora_act_out, bool fp4) {
+    assert(output.dtype() == Tensor::INT8);
+    assert(output.numel() / output.shape[-1] == (size_t)q.M);
+    assert(output.shape[-1] == q.N / 2);
+    if (fp4) {
+        assert(oscales.dtype() == Tensor::FP8_E4M3);
+        assert(oscales.numel() == (size_t)q.M * q.N / FP4_GROUP);
+    } else {
+        assert(oscales.dtype() == q.dtype);
+        assert(oscales.numel() == (size_t)q.M * q.N / GROUP_K);
+    }
+
+    if (!lora_down.valid()) {
+        return;
+    }
+    q.rank = lora_down.shape[1];
+    assert(q.rank % 16 == 0);
+    assert(lora_down.shape[0] == q.N);
+    assert(lora_act_out.shape[0] == q.M);
+    assert(lora_act_out.shape[1] == q.rank);
+}
+
+// points a checked quantizer at the input and outputs of a run, returns lora_act_out (or null)
+float *bindQuantizer(ActQuantizer &q, Tensor input, Tensor output, Tensor oscales, Tensor lora_down, Tensor lora_act_out, Tensor smooth, bool fp4) {
+    q.input = input.data_ptr<uint16_t>();
+    q.output = output.data_ptr<uint32_t>();
+    if (fp4) {
+        q.omscales = oscales.data_ptr<uint8_t>();
+    } else {
+        q.oscales = oscales.data_ptr<uint16_t>();
+    }
+
+    q.smooth = smooth.valid() ? unpackVector(smooth, q.N) : std::vector<float>(q.N, 1.0f);
+
+    if (q.rank == 0) {
+        return nullptr;
+    }
+    q.loraDown = loraWeight(lora_down, q.N, q.rank, true);
+    return lora_act_out.data_ptr<float>();
+}
+
+void runQuantizer(const ActQuantizer &q, const QuantKernels &kernels, float *loraAct, bool fp4, const char *name) {
+    spdlog::trace("{}: M={} N={} rank={} fp4={} kernel={}", name, q.M, q.N, q.rank, fp4, kernels.name);
+
+    // each pass converts one group of 16 rows, feeds it to the LoRA down projection and quantizes it while it is in L1
+    // with the norm fused, the statistics of the 16 rows are taken first, the rows then stay in L2 for the groups
+    const int numGroups = q.N / GROUP_K;
+    parallelFor(q.M / QUANT_ROWS, [&](int begin, int end) {
+        std::vector<float> x(QUANT_ROWS * GROUP_K);
+        std::vector<float> acc((size_t)QUANT_ROWS * q.rank);
+        float stats[QUANT_ROWS * 2];
+        for (int tile = begin; tile < end; tile++) {
+            const int m0 = tile * QUANT_ROWS;
+            std::fill(acc.begin(), acc.end(), 0.0f);
+            if (q.normalize) {
+                kernels.rowStats(q, m0, stats);
+            }
+            for (int g = 0; g < numGroups; g++) {
+                if (q.normalize) {
+                    kernels.loadNorm(q, m0, g, stats, x.data());
+                } else {
+                    kernels.load(q, m0, g, x.data());
+                }
+                if (q.rank > 0) {
+                    kernels.loraDown(x.data(), q.loraDown->data() + (size_t)g * GROUP_K * q.rank, q.rank, acc.data());
+                }
+                kernels.quantize(q, m0, g, x.data());
+            }
+            for (int i = 0; i < QUANT_ROWS; i++) {
+                for (int r = 0; r < q.rank; r++) {
+                    loraAct[loraActIndex(m0 + i, r, q.rank)] = acc[i * q.rank + r];
+                }
+            }
+        }
+    });
+}
+
+// q[t, 0 .. 32) = (relu(q) vk^T)[0 .. 32) / ((relu(q) vk^T)[32] + eps) for the tokens of one head,
+// vkT is vk[0 .. 32) transposed to [32 (q), 32 (out)] and den the row vk[32]
+using VkMulQKernel = void (*)(uint16_t *q, size_t ldq, int tokens, const float *vkT, const float *den, Tensor::ScalarType dtype);
+
+void vkMulQScalar(uint16_t *q, size_t ldq, int tokens, const float *vkT, const float *den, Tensor::ScalarType dtype) {
+    constexpr int D = LITELA_HEAD_DIM;
+    for (int t = 0; t < tokens; t++) {
+        uint16_t *row = q + t * ldq;
+        float acc[D] = {};
+        float sum = 0;
+        for (int i = 0; i < D; i++) {
+            const float qi = halfToFloat(row[i], dtype);
+            for (int j = 0; j < D; j++) {
+                acc[j] += qi * vkT[i * D + j];
+            }
+            sum += qi * den[i];
+        }
+        const float rsum = 1.0f / (sum + LITELA_EPS);
+        for (int j = 0; j < D; j++) {
+            row[j] = floatToHalf(acc[j] * rsum, dtype);
+        }
+    }
+}
+
+#if HOST_SIMD
+
+// TN tokens at a time, so that each row of vkT loaded feeds TN * 4 accumulators (3 * 4 + 4 + 1 of the 16 ymm)
+template<int TN>
+TARGET_AVX2 inline __attribute__((always_inline))
+void vkMulQTokensAVX2(uint16_t *q, size_t ldq, const float *vkT, const float *den, bool bf16) {
+    constexpr int D = LITELA_HEAD_DIM;
+    constexpr int NV = D / 8;
+    alignas(32) float qf[TN][D];
+    float rsum[TN];
+    for (int t = 0; t < TN; t++) {
+        __m256 sum = _mm256_setzero_ps();
+        for (int c = 0; c < NV; c++) {
+            const __m256 f = loadHalf8(q + t * ldq + c * 8, bf16);
+            _mm256_store_ps(qf[t] + c * 8, f);
+            sum = _mm256_fmadd_ps(f, _mm256_loadu_ps(den + c * 8), sum);
+        }
+        rsum[t] = 1.0f / (hsumAVX2(sum) + LITELA_EPS);
+    }
+
+    __m256 acc[TN][NV];
+    for (int t = 0; t < TN; t++) {
+        for (int c = 0; c < NV; c++) {
+            acc[t][c] = _mm256_setzero_ps();
+        }
+    }
+    for (int i = 0; i < D; i++) {
+        __m256 w[NV];
+        for (int c = 0; c < NV; c++) {
+            w[c] = _mm256_loadu_ps(vkT + i * D + c * 8);
+        }
+        for (int t = 0; t < TN; t++) {
+            const __m256 qi = _mm256_broadcast_ss(qf[t] + i);
+            for (int c = 0; c < NV; c++) {
+                acc[t][c] = _mm256_fmadd_ps(qi, w[c], acc[t][c]);
+            }
+        }
+    }
+
+    for (int t = 0; t < TN; t++) {
+        const __m256 r = _mm256_set1_ps(rsum[t]);
+        for (int c = 0; c < NV; c++) {
+            storeHalf8(q + t * ldq + c * 8, _mm256_mul_ps(acc[t][c], r), bf16);
+        }
+    }
+}
+
+TARGET_AVX2
+void vkMulQAVX2(uint16_t *q, size_t ldq, int tokens, const float *vkT, const float *den, Tensor::ScalarType dtype) {
+    const bool bf16 = dtype == Tensor::BF16;
+    int t = 0;
+    for (; t + 3 <= tokens; t += 3) {
+        vkMulQTokensAVX2<3>(q + t * ldq, ldq, vkT, den, bf16);
+    }
+    for (; t < tokens; t++) {
+        vkMulQTokensAVX2<1>(q + t * ldq, ldq, vkT, den, bf16);
+    }
+}
+
+
+TARGET_AVX2
+void normRopeAVX2(float *C, const float *rotary, int m0, const float *weight, Tensor::ScalarType dtype) {
+    constexpr int NC = ATTN_HEAD_DIM / 8;
+    const bool bf16 = dtype == Tensor::BF16;
+    // the sin of the first column of a pair is negated, x * cos + swap(x) * sin then gives both outputs of the rotation
+    const __m256 negEven = _mm256_castsi256_ps(_mm256_setr_epi32(INT32_MIN, 0, INT32_MIN, 0, INT32_MIN, 0, INT32_MIN, 0));
+    for (int i = 0; i < BLOCK_M; i++) {
+        float *row = C + i * BLOCK_N;
+        __m256 x[NC];
+        __m256 sqrsum[2] = {_mm256_setzero_ps(), _mm256_setzero_ps()};
+        for (int c = 0; c < NC; c++) {
+            x[c] = roundToHalfAVX2(_mm256_loadu_ps(row + c * 8), bf16);
+            sqrsum[c % 2] = _mm256_fmadd_ps(x[c], x[c], sqrsum[c % 2]);
+        }
+        alignas(32) float lanes[8];
+        _mm256_store_ps(lanes, _mm256_add_ps(sqrsum[0], sqrsum[1]));
+        float sum = 0;
+        for (int l = 0; l < 8; l++) {
+            sum += lanes[l];
+        }
+        const __m256 coef = _mm256_set1_ps(1.0f / std::sqrt(sum / ATTN_HEAD_DIM + RMSNORM_EPS));
+        // the 8 columns of c are pairs 4c .. 4c + 3, whose sin / cos are at 0, 4, 8, 12 (+ 2 for the rows 8 .. 15 of 16)
+        const float *rope = rotary + rotaryIndex(m0 + i, 0);
+        for (int c = 0; c < NC; c++) {
+            const __m256 lo = _mm256_loadu_ps(rope + c * 128), hi = _mm256_loadu_ps(rope + c * 128 + 8);
+            const __m256 pairs02 = _mm256_permute2f128_ps(lo, hi, 0x20), pairs13 = _mm256_permute2f128_ps(lo, hi, 0x31);
+            const __m256 sin = _mm256_xor_ps(_mm256_shuffle_ps(pairs02, pairs13, _MM_SHUFFLE(0, 0, 0, 0)), negEven);
+            const __m256 cos = _mm256_shuffle_ps(pairs02, pairs13, _MM_SHUFFLE(1, 1, 1, 1));
+            const __m256 v = _mm256_mul_ps(x[c], _mm256_mul_ps(coef, _mm256_loadu_ps(weight + c * 8)));
+            const __m256 swapped = _mm256_permute_ps(v, _MM_SHUFFLE(2, 3, 0, 1));
+            _mm256_storeu_ps(row + c * 8, roundToHalfAVX2(_mm256_fmadd_ps(v, cos, _mm256_mul_ps(swapped, sin)), bf16));
+        }
+    }
+}
+#endif
+
+// one GEMM of gemm_w4a4_cpu_grouped: prepareProblem checks the arguments and chooses the kernel and blocking,
+// bindProblem points a copy at the tensors of a run and unpacks its operands
+struct GemmProblem {
+    Epilogue ep;
+    Operands op;
+    KernelInfo kernel;
+    CpuGemmBlocking blocking;
+    bool fp4;
+    bool tune = false;  // the blocking is tuned on the operands of the next run
+    int tilesM, tilesN;
+};
+
+void prepareProblem(GemmProblem &p, const GemmW4A4Args &args) {
+    // out_q / out_k / out_v are checked below, they are usually slices of the tokens of a longer sequence
+    for (auto tensor : {args.act, args.wgt, args.out, args.qout, args.ascales, args.wscales, args.oscales, args.poolout, args.lora_act_in, args.lora_up, args.lora_down, args.lora_act_out, args.norm_q, args.norm_k, args.rotary_emb, args.bias, args.smooth_factor, args.wcscales, args.out_vk, args.out_linearattn}) {
+        if (tensor.valid() && (tensor.device().type != Device::CPU || !tensor.is_contiguous())) {
+            throw std::invalid_argument("All operands of gemm_w4a4_cpu must be contiguous CPU tensors");
+        }
+    }
+
+    const int M = args.act.numel() / args.act.shape[-1];
+    const int N = args.wgt.shape[0];
+    const int K = args.act.shape[-1] * 2;
+    if (K != args.wgt.shape[1] * 2 || M % BLOCK_M != 0 || N % BLOCK_N != 0 || K % GROUP_K != 0) {
+        throw std::invalid_argument(spdlog::fmt_lib::format("Invalid gemm_w4a4 shape M={} N={} K={}", M, N, K));
+    }
+    if (!args.fp4) {
+        assert(args.alpha == 1.0f);
+    }
+
+    // the FP4 scales are FP8, take the half type from the other operands as gemm_w4a4 does
+    Tensor::ScalarType dtype = args.fp4 ? Tensor::INVALID_SCALAR_TYPE : args.ascales.dtype();
+    if (args.fp4) {
+        for (auto tensor : {args.out, args.bias, args.lora_up, args.lora_down, args.wcscales}) {
+            if (tensor.valid()) {
+                assert(dtype == Tensor::INVALID_SCALAR_TYPE || dtype == tensor.dtype());
+                dtype = tensor.dtype();
+            }
+        }
+        if (dtype == Tensor::INVALID_SCALAR_TYPE) {
+            throw std::invalid_argument("NVFP4 gemm_w4a4_cpu needs a half precision operand to infer the output type");
+        }
+    }
+
+    Epilogue &ep = p.ep;
+    ep.dtype = dtype;
+    ep.M = M;
+    ep.N = N;
+
+    assert(args.lora_up.valid() == args.lora_act_in.valid());
+    assert(args.lora_down.valid() == args.lora_act_out.valid());
+    ep.rankUp = args.lora_up.valid() ? args.lora_up.shape[1] : 0;
+    ep.rankDown = args.lora_down.valid() ? args.lora_down.shape[1] : 0;
+    if (ep.rankUp > 0) {
+        assert(ep.rankUp % 16 == 0);
+        assert(args.lora_up.shape[0] == N);
+        assert(args.lora_act_in.shape[0] == M);
+        assert(args.lora_act_in.shape[1] == ep.rankUp);
+    }
+    if (ep.rankUp > 0 && ep.rankDown > 0) {
+        assert(ep.rankDown % 16 == 0);
+        assert(args.lora_down.shape[0] == N);
+        assert(args.lora_act_out.shape[0] == M);
+        assert(args.lora_act_out.shape[1] == ep.rankDown);
+    } else {
+        ep.rankDown = 0;
+    }
+
+    if (args.out_linearattn.valid()) {
+        // unlike the CUDA kernel, the rows of out_linearattn need not be padded to whole tiles
+        const int batch = args.out_vk.valid() ? args.out_vk.shape[0] : 0;
+        if (args.out.valid() || args.qout.valid() || batch == 0 || args.out_vk.dtype() != Tensor::FP32 ||
+            args.out_vk.numel() != (size_t)batch * (N / 3 / LITELA_HEAD_DIM) * (LITELA_HEAD_DIM + 1) * LITELA_HEAD_DIM ||
+            args.out_linearattn.ndims() != 3 || args.out_linearattn.shape[0] != batch || args.out_linearattn.shape[2] * 3 != N ||
+            (N / 3) % BLOCK_N != 0) {
+            throw std::invalid_argument(spdlog::fmt_lib::format(
+                "gemm_w4a4_cpu: invalid linear attention outputs out_vk={} out_linearattn={} for N={}",
+                args.out_vk.shape.str(), args.out_linearattn.shape.str(), N));
+        }
+        ep.tokensPerBatch = args.out_linearattn.shape[1];
+        ep.actualM = batch * ep.tokensPerBatch;
+        assert(ep.actualM <= M && M - ep.actualM < BLOCK_M);
+    } else if (args.out.valid()) {
+        ep.actualM = args.out.numel() / args.out.shape[-1];
+        ep.actualN = args.out.shape[-1];
+        assert(ep.actualM <= M && M - ep.actualM < BLOCK_M);
+        assert(ep.actualN <= N && N - ep.actualN < BLOCK_N);
+    }
+
+    if (args.rotary_emb.valid()) {
+        const Tensor &rot = args.rotary_emb;
+        if (!args.norm_q.valid() || !args.norm_k.valid() || args.norm_q.numel() != ATTN_HEAD_DIM || args.norm_k.numel() != ATTN_HEAD_DIM ||
+            args.norm_q.dtype() != dtype || args.norm_k.dtype() != dtype ||
+            rot.dtype() != Tensor::FP32 || rot.ndims() != 3 || rot.shape[0] * rot.shape[1] != M || rot.shape[2] != ATTN_HEAD_DIM ||
+            N % (ATTN_HEAD_DIM * 3) != 0 || args.out_linearattn.valid() || args.qout.valid()) {
+            throw std::invalid_argument(spdlog::fmt_lib::format(
+                "gemm_w4a4_cpu: invalid rotary_emb={} norm_q={} norm_k={} for M={} N={}",
+                rot.shape.str(), args.norm_q.shape.str(), args.norm_k.shape.str(), M, N));
+        }
+    } else if (args.out_q.valid() || args.poolout.valid()) {
+        throw std::invalid_argument("gemm_w4a4_cpu: out_q / out_k / out_v and poolout need rotary_emb, norm_q and norm_k");
+    }
+
+    if (args.poolout.valid()) {
+        if (!args.out.valid() || args.poolout.shape[-1] != N || args.poolout.dtype() != dtype) {
+            throw std::invalid_argument(spdlog::fmt_lib::format("gemm_w4a4_cpu: invalid poolout={} for out={}", args.poolout.shape.str(), args.out.shape.str()));
+        }
+        ep.poolRows = args.poolout.numel() / N;
+    }
+
+    if (args.out_q.valid()) {
+        // unlike the CUDA kernel, which writes the fragments of its attention kernel, each head is a row-major [T, 128] as
+        // attention_fp16_cpu reads it; the rows of act are the tokens of all batch items of the outputs
+        Tensor packed[3] = {args.out_q, args.out_k, args.out_v};
+        for (auto &&x : packed) {
+            if (args.out.valid() || !x.valid() || x.device().type != Device::CPU || x.ndims() != 4 || x.shape.dataExtent != args.out_q.shape.dataExtent ||
+                x.dtype() != args.out_q.dtype() || (x.dtype() != Tensor::FP16 && x.dtype() != Tensor::BF16) ||
+                x.shape[1] * ATTN_HEAD_DIM * 3 != N || x.shape[3] != ATTN_HEAD_DIM || x.shape[0] * x.shape[2] != M ||
+                x.stride(3) != 1 || x.stride(2) != (size_t)ATTN_HEAD_DIM || args.attn_tokens <= 0 || args.attn_tokens > x.shape[2]) {
+                throw std::invalid_argument(spdlog::fmt_lib::format(
+                    "gemm_w4a4_cpu: invalid packed attention outputs out_q={} out_k={} out_v={} for M={} N={} attn_tokens={}",
+                    args.out_q.shape.str(), args.out_k.shape.str(), args.out_v.shape.str(), M, N, args.attn_tokens));
+            }
+        }
+        for (int i = 0; i < 3; i++) {
+            ep.packedStrideBatch[i] = packed[i].stride(0);
+            ep.packedStrideHead[i] = packed[i].stride(1);
+        }
+        ep.packedDtype = args.out_q.dtype();
+        ep.packedTokens = args.out_q.shape[2];
+        ep.attnTokens = args.attn_tokens;
+    }
+    if (args.qout.valid() && args.oscales.valid()) {
+        ep.mid = Epilogue::MidGelu;
+    } else if (args.out.valid()) {
+        ep.mid = args.fuse_silu ? Epilogue::MidSilu : Epilogue::MidNone;
+    } else if (!args.out_linearattn.valid() && !args.out_q.valid()) {
+        throw std::invalid_argument("gemm_w4a4_cpu needs out, qout / oscales, out_vk / out_linearattn or out_q / out_k / out_v");
+    }
+
+    Operands &op = p.op;
+    op.M = M;
+    op.N = N;
+    op.K = K;
+    op.groupSize = args.fp4 ? FP4_GROUP : GROUP_K;
+    p.fp4 = args.fp4;
+    p.kernel = selectKernel(args.fp4);
+    const KernelInfo &kernel = p.kernel;
+#if HOST_SIMD
+    if (std::string(kernel.name) != "scalar") {
+        ep.vkAccumulate = vkAccumulateAVX2;
+        ep.normRope = normRopeAVX2;
+    }
+#endif
+    spdlog::trace("gemm_w4a4_cpu: M={} N={} K={} fp4={} kernel={}", M, N, K, args.fp4, kernel.name);
+
+    p.tune = !findBlocking(M, N, K, kernel, args.fp4, dtype, p.blocking);
+    spdlog::trace("gemm_w4a4_cpu: mc={} kc={} nc={} swapBlockMN={} tune={}", p.blocking.mc, p.blocking.kc, p.blocking.nc, p.blocking.swapBlockMN, p.tune);
+
+    p.tilesM = M / BLOCK_M;
+    p.tilesN = N / BLOCK_N;
+}
+
+// the outputs of a prepared problem, the vectors of its epilogue and its operands, from the tensors of args
+// the weights are looked up in the caches of their buffers on every run, an update of the weight bumps the version of its buffer
+void bindProblem(GemmProblem &p, GemmW4A4Args args) {
+    Epilogue &ep = p.ep;
+    const int M = ep.M, N = ep.N;
+    ep.bias = unpackVector(args.bias, N);
+    ep.wcscales = unpackVector(args.wcscales, N);
+
+    if (ep.rankUp > 0) {
+        ep.loraActIn = args.lora_act_in.data_ptr<float>();
+        ep.loraUp = loraWeight(args.lora_up, N, ep.rankUp, false);
+        for (int i = 0; i < ep.rankUp / 16; i++) {
+            ep.loraScales.push_back(i < (int)args.lora_scales.size() ? args.lora_scales[i] : 0.0f);
+        }
+    }
+    if (ep.rankDown > 0) {
+        ep.loraActOut = args.lora_act_out.data_ptr<float>();
+        ep.loraDown = loraWeight(args.lora_down, N, ep.rankDown, true);
+        ep.loraActOutLocks = std::shared_ptr<std::mutex[]>(new std::mutex[M / BLOCK_M]);
+        memset(ep.loraActOut, 0, args.lora_act_out.numel() * sizeof(float));
+    }
+
+    if (args.out_linearattn.valid()) {
+        ep.linearattnQ = args.out_linearattn.data_ptr<uint16_t>();
+        ep.outVk = args.out_vk.data_ptr<float>();
+        ep.vkLocks = std::shared_ptr<std::mutex[]>(new std::mutex[args.out_vk.numel() / ((LITELA_HEAD_DIM + 1) * LITELA_HEAD_DIM)]);
+        memset(ep.outVk, 0, args.out_vk.numel() * sizeof(float));
+    } else if (args.out.valid()) {
+        ep.out = args.out.data_ptr<uint16_t>();
+    }
+    if (args.rotary_emb.valid()) {
+        ep.rotary = args.rotary_emb.data_ptr<float>();
+        for (auto [norm, weight] : {std::pair{args.norm_q, &ep.normQ}, std::pair{args.norm_k, &ep.normK}}) {
+            for (int i = 0; i < ATTN_HEAD_DIM; i++) {
+                weight->push_back(halfToFloat(norm.data_ptr<uint16_t>()[i], norm.dtype()));
+            }
+        }
+    }
+    if (args.poolout.valid()) {
+        ep.poolout = args.poolout.data_ptr<uint16_t>();
+    }
+    if (args.out_q.valid()) {
+        Tensor packed[3] = {args.out_q, args.out_k, args.out_v};
+        for (int i = 0; i < 3; i++) {
+            ep.packed[i] = packed[i].data_ptr<uint16_t>();
+        }
+    }
+    if (ep.mid == Epilogue::MidGelu) {
+        ep.qout = args.qout.data_ptr<uint32_t>();
+        if (p.fp4) {
+            ep.omscales = args.oscales.data_ptr<uint8_t>();
+        } else {
+            ep.oscales = args.oscales.data_ptr<uint16_t>();
+        }
+        ep.smooth = unpackVector(args.smooth_factor, N);
+    }
+
+    unpackOperands(p.op, args.act, args.wgt, args.ascales, args.wscales, args.act_unsigned && !p.fp4, p.fp4, args.alpha, p.kernel.decode);
+}
+
+void runTiles(GemmProblem &p, int begin, int end, float *C, std::vector<float> &scratch) {
+    for (int tile = begin; tile < end; tile++) {
+        int bm, bn;
+        tileCoords(tile, p.tilesM, p.tilesN, p.blocking.swapBlockMN, bm, bn);
+        computeTile(p.op, p.kernel, p.blocking, bm, bn, C);
+        applyEpilogue(p.ep, bm, bn, C, scratch);
+    }
+}
+
+// runs the prepared problems on the tensors of args, a tuned blocking is kept in prepared for the next runs
+void runProblems(std::vector<GemmProblem> &prepared, const std::vector<GemmW4A4Args> &args) {
+    // every problem is a task that unpacks its operands and splits its own tiles, so that the unpacking of one overlaps
+    // the tiles of the others and the threads that run out of tiles of a large problem steal those of a small one
+    // (the text side of a joint block) instead of waiting for it
+    // tuning times candidate blockings on all threads, so with it on every problem is bound before any tile runs:
+    // the timings saved to the database must not include the contention with the tiles of the other problems
+    std::vector<GemmProblem> bound(prepared);
+    const bool tuning = std::any_of(prepared.begin(), prepared.end(), [](const GemmProblem &p) { return p.tune; });
+    if (tuning) {
+        for (size_t i = 0; i < bound.size(); i++) {
+            GemmProblem &p = bound[i];
+            bindProblem(p, args[i]);
+            if (p.tune) {
+                p.blocking = prepared[i].blocking = tuneAndSaveBlocking(p.op, p.kernel, p.fp4, p.ep.dtype);
+                p.tune = prepared[i].tune = false;
+            }
+        }
+    }
+    CpuTaskGroup group;
+    for (size_t i = 0; i < bound.size(); i++) {
+        group.run([&, i]() {
+            GemmProblem &p = bound[i];
+            if (!tuning) {
+                bindProblem(p, args[i]);
+            }
+            cpuParallelFor(p.tilesM * p.tilesN, 0, [&](int begin, int end) {
+                std::vector<float> C((size_t)BLOCK_M * BLOCK_N);
+                std::vector<float> scratch;
+                runTiles(p, begin, end, C.data(), scratch);
+            });
+        });
+    }
+    group.wait();
+}
+
+};  // namespace
+
+void gemm_w4a4_cpu(
+    Tensor act,           // packed act [M, K / 2]
+    Tensor wgt,           // packed act [N, K / 2]
+    Tensor out,           // linear     [M, N]
+    Tensor qout,          // packed act [M, N / 2]
+    Tensor ascales,       // packed as  [K / 64, M]
+    Tensor wscales,       // packed ws  [K / 64, N]
+    Tensor oscales,       // packed as  [N / 64, M]
+    Tensor poolout,       // linear     [M / PoolSize, N]
+    Tensor lora_act_in,   // packed lora_act [M, R]
+    Tensor lora_up,       // packed lora_wgt [N, R]
+    Tensor lora_down,     // packed lora_wgt [N, R]
+    Tensor lora_act_out,  // packed lora_act [M, R]
+    Tensor norm_q,        // linear     [HEAD_DIM]
+    Tensor norm_k,        // linear     [HEAD_DIM]
+    Tensor rotary_emb,    // linear     [M, HEAD_DIM / 2, 2, 2]
+    Tensor bias,          // packed ws  [N]
+    Tensor smooth_factor, // packed ws  [N], for quantization of the next layer
+    Tensor out_vk,        // linear     [B, num_heads, head_dim + 1, head_dim]
+    Tensor out_linearattn,// linear     [B, (M), N / 3]
+    bool act_unsigned,
+    std::vector<float> lora_scales,  // [R / 16]
+    bool fuse_silu,
+    bool fp4,
+    float alpha,
+    Tensor wcscales,
+    Tensor out_q,          // packed attention [B, H, M, D]
+    Tensor out_k,          // packed attention [B, H, M, D]
+    Tensor out_v,          // packed attention [B, H, M, D]
+    int attn_tokens
+) {
+    gemm_w4a4_cpu_grouped({GemmW4A4Args{
+        act, wgt, out, qout, ascales, wscales, oscales, poolout, lora_act_in, lora_up, lora_down, lora_act_out,
+        norm_q, norm_k, rotary_emb, bias, smooth_factor, out_vk, out_linearattn, act_unsigned, lora_scales,
+        fuse_silu, fp4, alpha, wcscales, out_q, out_k, out_v, attn_tokens
+    }});
+}
+
+void gemm_w4a4_cpu_grouped(const std::vector<GemmW4A4Args> &problems) {
+    CpuPlanStep step;
+    std::vector<GemmProblem> prepared(problems.size());
+    for (size_t i = 0; i < problems.size(); i++) {
+        prepareProblem(prepared[i], problems[i]);
+    }
+    runProblems(prepared, problems);
+    step.record([prepared](const std::vector<GemmW4A4Args> &args) mutable { runProblems(prepared, args); }, problems);
+}
+
+void quantize_w4a4_act_fuse_lora_cpu(Tensor input, Tensor output, Tensor oscales, Tensor lora_down, Tensor lora_act_out, Tensor smooth, bool fuse_glu, bool fp4) {
+    CpuPlanStep step;
+
+    for (auto tensor : {input, output, oscales, lora_down, lora_act_out, smooth}) {
+        if (tensor.valid() && (tensor.device().type != Device::CPU || !tensor.is_contiguous())) {
+            throw std::invalid_argument("All operands of quantize_w4a4_act_fuse_lora_cpu must be contiguous CPU tensors");
+        }
+    }
+
+    ActQuantizer q;
+    q.dtype = input.dtype();
+    q.actualM = input.numel() / input.shape[-1];
+    q.actualN = input.shape[-1];
+    q.M = ceilDiv(q.actualM, BLOCK_M) * BLOCK_M;
+    q.N = ceilDiv(q.actualN / (fuse_glu ? 2 : 1), BLOCK_N) * BLOCK_N;
+    q.fuseGlu = fuse_glu;
+    checkQuantizerOutputs(q, output, oscales, lora_down, lora_act_out, fp4);
+
+    auto run = [q, kernels = selectQuantKernels(fp4), fp4](Tensor input, Tensor output, Tensor oscales, Tensor lora_down, Tensor lora_act_out, Tensor smooth) {
+        ActQuantizer bound = q;
+        float *loraAct = bindQuantizer(bound, input, output, oscales, lora_down, lora_act_out, smooth, fp4);
+        runQuantizer(bound, kernels, loraAct, fp4, "quantize_w4a4_act_fuse_lora_cpu");
+    };
+    run(input, output, oscales, lora_down, lora_act_out, smooth);
+    step.record(run, input, output, oscales, lora_down, lora_act_out, smooth);
+}
+
+void quantize_w4a4_act_fuse_norm_cpu(Tensor input, Tensor scale, Tensor shift, float eps, Tensor output, Tensor oscales, Tensor lora_down, Tensor lora_act_out, Tensor smooth, bool fp4) {
+    CpuPlanStep step;
+
+    for (auto tensor : {input, scale, shift, output, oscales, lora_down, lora_act_out, smooth}) {
+        if (tensor.valid() && (tensor.device().type != Device::CPU || !tensor.is_contiguous())) {
+            throw std::invalid_argument("All operands of quantize_w4a4_act_fuse_norm_cpu must be contiguous CPU tensors");
+        }
+    }
+
+    ActQuantizer q;
+    q.dtype = input.dtype();
+    q.actualM = input.numel() / input.shape[-1];
+    q.actualN = input.shape[-1];
+    q.M = ceilDiv(q.actualM, BLOCK_M) * BLOCK_M;
+    q.N = ceilDiv(q.actualN, BLOCK_N) * BLOCK_N;
+    q.fuseGlu = false;
+
+    // one row of scale / shift per batch item, the rows of the input are split evenly between them
+    const int batch = scale.numel() / q.actualN;
+    if (batch == 0 || scale.numel() != (size_t)batch * q.actualN || shift.numel() != scale.numel() || q.actualM % batch != 0) {
+        throw std::invalid_argument(spdlog::fmt_lib::format(
+            "quantize_w4a4_act_fuse_norm_cpu: scale {} and shift {} do not match input {}", scale.shape.str(), shift.shape.str(), input.shape.str()));
+    }
+    if (scale.dtype() != q.dtype || shift.dtype() != q.dtype) {
+        throw std::invalid_argument("quantize_w4a4_act_fuse_norm_cpu: scale and shift must have the dtype of the input");
+    }
+    q.normalize = true;
+    q.eps = eps;
+    q.tokensPerBatch = q.actualM / batch;
+    checkQuantizerOutputs(q, output, oscales, lora_down, lora_act_out, fp4);
+
+    auto run = [q, kernels = selectQuantKernels(fp4), batch, fp4](
+                   Tensor input, Tensor scale, Tensor shift, Tensor output, Tensor oscales, Tensor lora_down, Tensor lora_act_out, Tensor smooth) {
+        ActQuantizer bound = q;
+        bound.modScale.assign((size_t)batch * q.N, 0.0f);
+        bound.modShift.assign((size_t)batch * q.N, 0.0f);
+        const uint16_t *scalePtr = scale.data_ptr<uint16_t>();
+        const uint16_t *shiftPtr = shift.data_ptr<uint16_t>();
+        for (int b = 0; b < batch; b++) {
+            for (int n = 0; n < q.actualN; n++) {
+                bound.modScale[(size_t)b * q.N + n] = halfToFloat(scalePtr[(size_t)b * q.actualN + n], q.dtype);
+                bound.modShift[(size_t)b * q.N + n] = halfToFloat(shiftPtr[(size_t)b * q.actualN + n], q.dtype);
+            }
+        }
+        float *loraAct = bindQuantizer(bound, input, output, oscales, lora_down, lora_act_out, smooth, fp4);
+        runQuantizer(bound, kernels, loraAct, fp4, "quantize_w4a4_act_fuse_norm_cpu");
+    };
+    run(input, scale, shift, output, oscales, lora_down, lora_act_out, smooth);
+    step.record(run, input, scale, shift, output, oscales, lora_down, lora_act_out, smooth);
+}
+
+void linearattn_vk_mul_q_cpu(Tensor q, Tensor vk) {
+    CpuPlanStep step;
+
+    constexpr int D = LITELA_HEAD_DIM;
+    if (q.device().type != Device::CPU || vk.device().type != Device::CPU || !q.is_contiguous() || !vk.is_contiguous()) {
+        throw std::invalid_argument("All operands of linearattn_vk_mul_q_cpu must be contiguous CPU tensors");
+    }
+    // the ranks first, the shapes are only read once they are known to have enough dims
+    if (vk.ndims() != 4 || q.ndims() != 3 || vk.dtype() != Tensor::FP32 || vk.shape[2] != D + 1 || vk.shape[3] != D ||
+        q.shape[0] != vk.shape[0] || q.shape[2] != vk.shape[1] * D || (q.dtype() != Tensor::FP16 && q.dtype() != Tensor::BF16)) {
+        throw std::invalid_argument(spdlog::fmt_lib::format("linearattn_vk_mul_q_cpu: invalid q={} vk={}", q.shape.str(), vk.shape.str()));
+    }
+    const int batch = vk.shape[0];
+    const int numHeads = vk.shape[1];
+    const int numTokens = q.shape[1];
+    const Tensor::ScalarType dtype = q.dtype();
+
+    VkMulQKernel kernel = vkMulQScalar;
+    const char *name = "scalar";
+#if HOST_SIMD
+    if (forcedISA() != "scalar" && hasAVX2()) {
+        kernel = vkMulQAVX2;
+        name = "avx2";
+    }
+#endif
+    spdlog::trace("linearattn_vk_mul_q_cpu: B={} H={} tokens={} kernel={}", batch, numHeads, numTokens, name);
+
+    // tasks are blocks of tokens of one batch item, each sweeps all heads so that its rows of q are read once
+    constexpr int TOKEN_BLOCK = 64;
+    const int blocks = ceilDiv(numTokens, TOKEN_BLOCK);
+    auto run = [batch, numHeads, numTokens, dtype, kernel, blocks, TOKEN_BLOCK](Tensor q, Tensor vk) {
+        parallelFor(batch * blocks, [&](int begin, int end) {
+            std::vector<float> vkT(D * D);
+            for (int task = begin; task < end; task++) {
+                const int b = task / blocks;
+                const int t0 = task % blocks * TOKEN_BLOCK;
+                for (int h = 0; h < numHeads; h++) {
+                    const float *src = vk.data_ptr<float>() + ((size_t)b * numHeads + h) * (D + 1) * D;
+                    for (int i = 0; i < D; i++) {
+                        for (int j = 0; j < D; j++) {
+                            vkT[i * D + j] = src[j * D + i];
+                        }
+                    }
+                    uint16_t *rows = q.data_ptr<uint16_t>() + ((size_t)b * numTokens + t0) * numHeads * D + h * D;
+                    kernel(rows, (size_t)numHeads * D, std::min(TOKEN_BLOCK, numTokens - t0), vkT.data(), src + D * D, dtype);
+                }
+            }
+        });
+    };
+    run(q, vk);
+    step.record(run, q, vk);
+}
+
+};  // namespace nunchaku::kernels
@@ -0,0 +1,74 @@
+#pragma once
+
+#include "common.h"
+#include "Tensor.h"
+#include "zgemm.h"
+
+namespace nunchaku::kernels {
+
+// host implementation of gemm_w4a4 for operands in CPU memory, same packed layouts as the CUDA kernels
+// supports bias / wcscales, LoRA up, SILU, GELU + quantization for the next layer and LoRA down, and the linear attention
+// epilogue of Sana (out_vk / out_linearattn), which accumulates vk straight from the tiles so that k and v are never stored
+// and takes out_linearattn [B, tokens, N / 3] without padding tokens to whole tiles
+// with rotary_emb (packed by pack_rotemb) the heads of 128 in the q / k thirds get the RMSNorm of norm_q / norm_k and the
+// rotary embedding on each tile before it is written, to out (mean pooled over 128 rows into poolout) or to out_q / out_k /
+// out_v [B, H, T, 128], which take each head row-major as attention_fp16_cpu reads it and may be slices along T;
+// tokens from attn_tokens on are masked with 0 in q / v and NaN in k
+// NVFP4 (fp4) decodes e2m1 to int8, takes exact int dot products per block of 16 and applies the e4m3 micro-scales and alpha in FP32
+// the weight, its scales and the LoRA weights are unpacked once per buffer and kept with it until it is written again
+// (see Buffer::derived); tensors passed from Python are wrapped anew by each call, so those are unpacked every time
+// NUNCHAKU_CPU_THREADS sets the number of threads (default: all cores)
+// NUNCHAKU_CPU_GEMM_ISA=scalar|avx2|avx512vnni forces a code path (default: best supported)
+// the blocking of each shape comes from the tuning database (see gemm_cpu_tuning.h), NUNCHAKU_CPU_GEMM_TUNE=1 tunes
+// shapes without an entry at first use and =force retunes all of them, otherwise the swapBlockMN rule of the CUDA launch applies
+void gemm_w4a4_cpu(
+        Tensor act,           // packed act [M, K / 2]
+        Tensor wgt,           // packed act [N, K / 2]
+        Tensor out,           // linear     [M, N]
+        Tensor qout,          // packed act [M, N / 2]
+        Tensor ascales,       // packed as  [K / 64, M]
+        Tensor wscales,       // packed ws  [K / 64, N]
+        Tensor oscales,       // packed as  [N / 64, M]
+        Tensor poolout,       // linear     [M / PoolSize, N]
+        Tensor lora_act_in,   // packed lora_act [M, R]
+        Tensor lora_up,       // packed lora_wgt [N, R]
+        Tensor lora_down,     // packed lora_wgt [N, R]
+        Tensor lora_act_out,  // packed lora_act [M, R]
+        Tensor norm_q,        // linear     [HEAD_DIM]
+        Tensor norm_k,        // linear     [HEAD_DIM]
+        Tensor rotary_emb,    // linear     [M, HEAD_DIM / 2, 2, 2]
+        Tensor bias,          // packed ws  [N]
+        Tensor smooth_factor, // packed ws  [N], for quantization of the next layer
+        Tensor out_vk,        // linear     [B, num_heads, head_dim + 1, head_dim]
+        Tensor out_linearattn,// linear     [B, (M), N / 3]
+        bool act_unsigned,
+        std::vector<float> lora_scales,  // [R / 16]
+        bool fuse_silu,
+        bool fp4,
+        float alpha,
+        Tensor wcscales,
+        Tensor out_q,          // packed attention [B, H, M, D]
+        Tensor out_k,          // packed attention [B, H, M, D]
+        Tensor out_v,          // packed attention [B, H, M, D]
+        int attn_tokens
+);
+
+// runs all problems at once on the CPU runtime (see cpu_runtime.h), each unpacks its operands and splits its tiles as a task
+void gemm_w4a4_cpu_grouped(const std::vector<GemmW4A4Args> &problems);
+
+// host implementation of quantize_w4a4_act_fuse_lora: GLU, LoRA down, smoothing and signed INT4 quantization in one pass
+// over each tile of 16 rows, writes act, ascales and lora_act in the packed layouts read by gemm_w4a4_cpu
+// with fp4 the activations are quantized to NVFP4 with e4m3 micro-scales [N / 16, M]
+void quantize_w4a4_act_fuse_lora_cpu(Tensor input, Tensor output, Tensor oscales, Tensor lora_down, Tensor lora_act_out, Tensor smooth, bool fuse_glu, bool fp4);
+
+// the same pass over LayerNorm(input) * scale + shift (LayerNorm without affine, the AdaLN modulation of kernels::mul_add),
+// so that the normalized activation is never written: the statistics of each tile of 16 rows are taken first and the
+// rows are then normalized group by group while they are still in L2
+// input is [M, N] or [B, tokens, N], scale / shift are [N] or [B, N] in the dtype of the input
+void quantize_w4a4_act_fuse_norm_cpu(Tensor input, Tensor scale, Tensor shift, float eps, Tensor output, Tensor oscales, Tensor lora_down, Tensor lora_act_out, Tensor smooth, bool fp4);
+
+// host implementation of linearattn_vk_mul_q: q [B, tokens, heads * 32] (relu already applied by the GEMM) is replaced
+// in place by (q vk[:32]^T) / (q vk[32]^T + 1e-6) per head, vk is [B, heads, 33, 32] in FP32
+void linearattn_vk_mul_q_cpu(Tensor q, Tensor vk);
+
+};  // namespace nunchaku::kernels
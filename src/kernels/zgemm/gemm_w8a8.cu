@@ -1,9 +1,14 @@
 #include "zgemm.h"
 #include "gemm_w8a8.cuh"
+#include "gemm_w8a8_cpu.h"
 
 namespace nunchaku::kernels {
 
 void quantize_w8a8_act(Tensor input, Tensor output, Tensor oscales, bool fuse_glu) {
+    if (input.device().type == Device::CPU) {
+        return quantize_w8a8_act_cpu(input, output, oscales, fuse_glu);
+    }
+
     using GEMM = GEMM_W8A8;
 
     int M = input.numel() / input.shape[-1];
@@ -53,6 +58,10 @@ void gemm_w8a8(Tensor act,      // [M, K]
                Tensor bias
                )
 {
+    if (act.device().type == Device::CPU) {
+        return gemm_w8a8_cpu(act, wgt, out, ascales, wscales, bias);
+    }
+
     using GEMM = GEMM_W8A8;
 
     int M = act.numel() / act.shape[-1];
@@ -0,0 +1,464 @@
+#include "gemm_w8a8_cpu.h"
+#include "kernels/cpu_plan.h"
+#include "kernels/cpu_common.h"
+
+namespace nunchaku::kernels {
+
+namespace {
+
+// tile sizes of GEMMConfig_W8A8, they define the packed layouts
+constexpr int BLOCK_M = 256;
+constexpr int BLOCK_N = 128;
+constexpr int WARP_M = 32;
+constexpr int WARP_K = 32;
+
+constexpr int TILE_M = 64;      // rows of an output tile of a task, its int32 accumulators stay in L1 / L2
+constexpr int TILE_N = BLOCK_N;
+constexpr int KC = 1024;        // depth swept per pass over a tile, keeps the A and B chunks in L2
+constexpr int K_ALIGN = 64;     // depth of an AMX tile row, the unpacked K is padded to it with zeros
+
+constexpr int QVALUE_MAX = 127;
+
+float gelu(float x) {
+    return x * (0.5f + 0.5f * std::tanh(0.79788456f * (x + 0.044715f * x * x * x)));
+}
+
+// uint32 word of a packed act [M, K] holding elements k .. k + 3 (k % 4 == 0) of row m
+size_t packedActWord(int m, int k, int K) {
+    const int mm = m % BLOCK_M;
+    const int r = mm % 16;
+    const int c = k % WARP_K / 4;
+    const int lane = r % 8 * 4 + c % 4;
+    const int reg = c / 4 * 2 + r / 8;
+    return (((((size_t)(m / BLOCK_M) * (K / WARP_K) + k / WARP_K) * 8 + mm / WARP_M) * 2 + mm % WARP_M / 16) * 32 + lane) * 4 + reg;
+}
+
+size_t packedWgtWord(int n, int k, int K) {
+    const int nn = n % BLOCK_N;
+    const int r = nn % 16;
+    const int c = k % WARP_K / 4;
+    const int lane = r % 8 * 4 + c % 4;
+    const int reg = r / 8 * 2 + c / 4;
+    return ((((size_t)(n / BLOCK_N) * (K / WARP_K) + k / WARP_K) * 8 + nn / 16) * 32 + lane) * 4 + reg;
+}
+
+// packed as [1, M]
+size_t packedAscaleIndex(int m) {
+    const int mm = m % BLOCK_M;
+    const int lane = mm % WARP_M / 16 * 8 + mm % 8;
+    const int elem = mm % 16 / 8;
+    return ((size_t)(m / BLOCK_M) * 8 + mm / WARP_M) * 32 + lane * 2 + elem;
+}
+
+// packed ws [N] (wscales, bias)
+size_t packedWscaleIndex(int n) {
+    const int nn = n % BLOCK_N;
+    return (size_t)(n / BLOCK_N) * BLOCK_N + (nn / 16 * 4 + nn % 8 / 2) * 4 + nn % 16 / 8 * 2 + nn % 2;
+}
+
+// operands unpacked into the layout of the int8 dot products
+struct Operands {
+    int M, N, K;                    // K padded to K_ALIGN
+    std::vector<int8_t> act;        // [M / 16, K / 64, 16, 64], blocks of 16 rows x 64 k are AMX tiles, see actRow
+    std::vector<int8_t> wgt;        // [N / 16, K / 4, 16, 4], 4 consecutive k of 16 channels per 64 bytes
+    std::vector<int32_t> wsum;      // [N], sum of the weights of a channel, corrects the unsigned activations of VNNI
+};
+
+// elements k .. k + 3 (k % 4 == 0) of row m in Operands::act
+inline const int8_t *actRow(const Operands &op, int m, int k) {
+    return op.act.data() + ((size_t)(m / 16) * (op.K / K_ALIGN) + k / K_ALIGN) * 16 * K_ALIGN + m % 16 * K_ALIGN + k % K_ALIGN;
+}
+
+// C[MR, NR] += act[m0 .., k0 .. k0 + kc) . wgt[n0 .., k0 .. k0 + kc)
+using MicroKernel = void (*)(const Operands &op, int m0, int n0, int k0, int kc, int32_t *C, int ldc);
+
+struct KernelInfo {
+    const char *name;
+    MicroKernel func;
+    int MR, NR;
+    int actOffset;  // added to the activations by the kernel, subtracted again as actOffset * wsum
+    bool amx;       // threads configure the tiles before running the kernel
+};
+
+void microKernelScalar(const Operands &op, int m0, int n0, int k0, int kc, int32_t *C, int ldc) {
+    constexpr int MR = 4;
+    constexpr int NR = 16;
+    const int8_t *B = op.wgt.data() + (size_t)(n0 / 16) * op.K * 16;
+
+    int32_t acc[MR][NR] = {};
+    for (int k = k0; k < k0 + kc; k += K_ALIGN) {
+        const int8_t *A = actRow(op, m0, k);
+        for (int kk = k / 4; kk < (k + K_ALIGN) / 4; kk++) {
+            const int8_t *b = B + kk * 64;
+            for (int i = 0; i < MR; i++) {
+                const int8_t *a = A + i * K_ALIGN + kk * 4 - k;
+                for (int j = 0; j < NR; j++) {
+                    acc[i][j] += a[0] * b[j * 4] + a[1] * b[j * 4 + 1] + a[2] * b[j * 4 + 2] + a[3] * b[j * 4 + 3];
+                }
+            }
+        }
+    }
+    for (int i = 0; i < MR; i++) {
+        for (int j = 0; j < NR; j++) {
+            C[i * ldc + j] += acc[i][j];
+        }
+    }
+}
+
+#if HOST_SIMD
+
+// maddubs would saturate int8 x int8, sign-extend to int16 and madd instead
+// each 32-bit lane sums 2 of the 4 products of a channel, the pairs are added when the tile is stored
+TARGET_AVX2
+void microKernelAVX2(const Operands &op, int m0, int n0, int k0, int kc, int32_t *C, int ldc) {
+    constexpr int MR = 2;
+    const int8_t *B = op.wgt.data() + (size_t)(n0 / 16) * op.K * 16;
+
+    __m256i acc[MR][4];
+    for (int i = 0; i < MR; i++) {
+        for (int q = 0; q < 4; q++) {
+            acc[i][q] = _mm256_setzero_si256();
+        }
+    }
+    for (int k = k0; k < k0 + kc; k += K_ALIGN) {
+        const int8_t *A = actRow(op, m0, k);
+        for (int kk = k / 4; kk < (k + K_ALIGN) / 4; kk++) {
+            __m256i b[4];
+            for (int q = 0; q < 4; q++) {
+                b[q] = _mm256_cvtepi8_epi16(_mm_loadu_si128((const __m128i *)(B + kk * 64 + q * 16)));
+            }
+            for (int i = 0; i < MR; i++) {
+                int32_t a4;
+                memcpy(&a4, A + i * K_ALIGN + kk * 4 - k, sizeof(a4));
+                const __m256i a = _mm256_broadcastq_epi64(_mm_cvtepi8_epi16(_mm_cvtsi32_si128(a4)));
+                for (int q = 0; q < 4; q++) {
+                    acc[i][q] = _mm256_add_epi32(acc[i][q], _mm256_madd_epi16(a, b[q]));
+                }
+            }
+        }
+    }
+    for (int i = 0; i < MR; i++) {
+        for (int h = 0; h < 2; h++) {
+            // [c0 c1 c4 c5 | c2 c3 c6 c7] -> [c0 .. c7]
+            const __m256i sum = _mm256_permute4x64_epi64(_mm256_hadd_epi32(acc[i][h * 2], acc[i][h * 2 + 1]), _MM_SHUFFLE(3, 1, 2, 0));
+            __m256i *c = (__m256i *)(C + i * ldc + h * 8);
+            _mm256_storeu_si256(c, _mm256_add_epi32(_mm256_loadu_si256(c), sum));
+        }
+    }
+}
+
+// dpbusd multiplies u8 x s8, the activations are flipped to act + 128 by the xor
+TARGET_AVX512_VNNI
+void microKernelAVX512VNNI(const Operands &op, int m0, int n0, int k0, int kc, int32_t *C, int ldc) {
+    constexpr int MR = 8;
+    const int8_t *B0 = op.wgt.data() + (size_t)(n0 / 16) * op.K * 16;
+    const int8_t *B1 = B0 + (size_t)op.K * 16;
+
+    __m512i acc[MR][2];
+    for (int i = 0; i < MR; i++) {
+        acc[i][0] = _mm512_setzero_si512();
+        acc[i][1] = _mm512_setzero_si512();
+    }
+    for (int k = k0; k < k0 + kc; k += K_ALIGN) {
+        const int8_t *A = actRow(op, m0, k);
+        for (int kk = k / 4; kk < (k + K_ALIGN) / 4; kk++) {
+            const __m512i b0 = _mm512_loadu_si512(B0 + kk * 64);
+            const __m512i b1 = _mm512_loadu_si512(B1 + kk * 64);
+            for (int i = 0; i < MR; i++) {
+                int32_t a4;
+                memcpy(&a4, A + i * K_ALIGN + kk * 4 - k, sizeof(a4));
+                const __m512i a = _mm512_set1_epi32(a4 ^ (int32_t)0x80808080);
+                acc[i][0] = _mm512_dpbusd_epi32(acc[i][0], a, b0);
+                acc[i][1] = _mm512_dpbusd_epi32(acc[i][1], a, b1);
+            }
+        }
+    }
+    for (int i = 0; i < MR; i++) {
+        int32_t *c = C + i * ldc;
+        _mm512_storeu_si512(c, _mm512_add_epi32(_mm512_loadu_si512(c), acc[i][0]));
+        _mm512_storeu_si512(c + 16, _mm512_add_epi32(_mm512_loadu_si512(c + 16), acc[i][1]));
+    }
+}
+
+// tiles 0 / 1: c [16, 16] int32 of two panels, tile 2: a [16, 64] int8, tiles 3 / 4: b [16, 16 x 4] int8 of two panels
+struct alignas(64) TileConfig {
+    uint8_t palette;
+    uint8_t startRow;
+    uint8_t reserved[14];
+    uint16_t colsb[16];
+    uint8_t rows[16];
+};
+
+// a static object: some compilers declare only its first bytes as read by ldtilecfg and drop stores to the rest
+constexpr TileConfig makeTileConfig() {
+    TileConfig cfg = {};
+    cfg.palette = 1;
+    for (int t = 0; t < 5; t++) {
+        cfg.rows[t] = 16;
+        cfg.colsb[t] = 64;
+    }
+    return cfg;
+}
+constexpr TileConfig TILE_CONFIG = makeTileConfig();
+
+TARGET_AMX_INT8
+void amxBegin() {
+    _tile_loadconfig(&TILE_CONFIG);
+}
+
+TARGET_AMX_INT8
+void amxEnd() {
+    _tile_release();
+}
+
+// 16 rows of 32 columns
+TARGET_AMX_INT8
+void microKernelAMX(const Operands &op, int m0, int n0, int k0, int kc, int32_t *C, int ldc) {
+    const int8_t *B0 = op.wgt.data() + (size_t)(n0 / 16) * op.K * 16;
+    const int8_t *B1 = B0 + (size_t)op.K * 16;
+    _tile_loadd(0, C, ldc * sizeof(int32_t));
+    _tile_loadd(1, C + 16, ldc * sizeof(int32_t));
+    for (int k = k0; k < k0 + kc; k += K_ALIGN) {
+        _tile_loadd(2, actRow(op, m0, k), K_ALIGN);
+        _tile_loadd(3, B0 + k * 16, 64);
+        _tile_loadd(4, B1 + k * 16, 64);
+        _tile_dpbssd(0, 2, 3);
+        _tile_dpbssd(1, 2, 4);
+    }
+    _tile_stored(0, C, ldc * sizeof(int32_t));
+    _tile_stored(1, C + 16, ldc * sizeof(int32_t));
+}
+
+#endif
+
+KernelInfo selectKernel() {
+    const std::string forced = forcedISA();
+#if HOST_SIMD
+    if ((forced.empty() || forced == "amx") && hasAMXInt8()) {
+        return KernelInfo{"amx", microKernelAMX, 16, 32, 0, true};
+    }
+    if ((forced.empty() || forced == "amx" || forced == "avx512vnni") && hasAVX512VNNI()) {
+        return KernelInfo{"avx512vnni", microKernelAVX512VNNI, 8, 32, 128, false};
+    }
+    if ((forced.empty() || forced == "amx" || forced == "avx512vnni" || forced == "avx2") && hasAVX2()) {
+        return KernelInfo{"avx2", microKernelAVX2, 2, 16, 0, false};
+    }
+#endif
+    return KernelInfo{"scalar", microKernelScalar, 4, 16, 0, false};
+}
+
+void unpackOperands(Operands &op, Tensor act, Tensor wgt, int M, int N, int K) {
+    op.M = M;
+    op.N = N;
+    op.K = ceilDiv(K, K_ALIGN) * K_ALIGN;
+    op.act.assign((size_t)op.M * op.K, 0);
+    op.wgt.assign((size_t)op.N * op.K, 0);
+    op.wsum.assign(op.N, 0);
+
+    const uint32_t *actWords = act.data_ptr<uint32_t>();
+    const uint32_t *wgtWords = wgt.data_ptr<uint32_t>();
+
+    parallelFor(M / BLOCK_M + N / BLOCK_N, [&](int begin, int end) {
+        for (int block = begin; block < end; block++) {
+            if (block < M / BLOCK_M) {
+                for (int m = block * BLOCK_M; m < (block + 1) * BLOCK_M; m++) {
+                    for (int k = 0; k < K; k += 4) {
+                        memcpy(const_cast<int8_t *>(actRow(op, m, k)), &actWords[packedActWord(m, k, K)], 4);
+                    }
+                }
+                continue;
+            }
+            const int bn = block - M / BLOCK_M;
+            for (int n = bn * BLOCK_N; n < (bn + 1) * BLOCK_N; n++) {
+                int8_t *dst = &op.wgt[(size_t)(n / 16) * op.K * 16 + n % 16 * 4];
+                int32_t sum = 0;
+                for (int k = 0; k < K; k += 4) {
+                    int8_t v[4];
+                    memcpy(v, &wgtWords[packedWgtWord(n, k, K)], 4);
+                    memcpy(dst + k / 4 * 64, v, 4);
+                    sum += v[0] + v[1] + v[2] + v[3];
+                }
+                op.wsum[n] = sum;
+            }
+        }
+    });
+}
+
+// packed ws [N] to float in channel order, empty if the tensor is not given
+std::vector<float> unpackVector(Tensor packed, int N) {
+    std::vector<float> result;
+    if (!packed.valid()) {
+        return result;
+    }
+    const uint16_t *data = packed.data_ptr<uint16_t>();
+    result.resize(N);
+    for (int n = 0; n < N; n++) {
+        result[n] = halfToFloat(data[packedWscaleIndex(n)], packed.dtype());
+    }
+    return result;
+}
+
+};  // namespace
+
+void gemm_w8a8_cpu(Tensor act, Tensor wgt, Tensor out, Tensor ascales, Tensor wscales, Tensor bias) {
+    CpuPlanStep step;
+    for (auto tensor : {act, wgt, out, ascales, wscales, bias}) {
+        if (tensor.valid() && (tensor.device().type != Device::CPU || !tensor.is_contiguous())) {
+            throw std::invalid_argument("All operands of gemm_w8a8_cpu must be contiguous CPU tensors");
+        }
+    }
+
+    const int M = act.numel() / act.shape[-1];
+    const int N = wgt.shape[0];
+    const int K = act.shape[-1];
+    if (K != wgt.shape[1] || M % BLOCK_M != 0 || N % BLOCK_N != 0 || K % WARP_K != 0) {
+        throw std::invalid_argument(spdlog::fmt_lib::format("Invalid gemm_w8a8 shape M={} N={} K={}", M, N, K));
+    }
+    if (!out.valid()) {
+        return;
+    }
+    const int actualM = out.numel() / out.shape[-1];
+    const int actualN = out.shape[-1];
+    assert(actualM <= M && M - actualM < BLOCK_M);
+    assert(actualN <= N && N - actualN < BLOCK_N);
+
+    const Tensor::ScalarType dtype = out.dtype();
+    assert(ascales.dtype() == dtype && ascales.numel() == (size_t)M);
+    assert(wscales.dtype() == dtype && wscales.numel() == (size_t)N);
+    assert(!bias.valid() || (bias.dtype() == dtype && bias.numel() == (size_t)N));
+
+    const KernelInfo kernel = selectKernel();
+    spdlog::trace("gemm_w8a8_cpu: M={} N={} K={} kernel={}", M, N, K, kernel.name);
+
+    auto run = [M, N, K, actualM, actualN, dtype, kernel](Tensor act, Tensor wgt, Tensor out, Tensor ascales, Tensor wscales, Tensor bias) {
+        Operands op;
+        unpackOperands(op, act, wgt, M, N, K);
+
+        std::vector<float> as(actualM);
+        const uint16_t *ascalesData = ascales.data_ptr<uint16_t>();
+        for (int m = 0; m < actualM; m++) {
+            as[m] = halfToFloat(ascalesData[packedAscaleIndex(m)], dtype);
+        }
+        const std::vector<float> ws = unpackVector(wscales, N);
+        const std::vector<float> biasValues = unpackVector(bias, N);
+        uint16_t *output = out.data_ptr<uint16_t>();
+
+        // consecutive tasks of a thread walk along M and share the weights of a block of 128 channels
+        const int tilesM = M / TILE_M;
+        const int tilesN = N / TILE_N;
+        parallelFor(tilesM * tilesN, [&](int begin, int end) {
+            std::vector<int32_t> C(TILE_M * TILE_N);
+#if HOST_SIMD
+            if (kernel.amx) {
+                amxBegin();
+            }
+#endif
+            for (int tile = begin; tile < end; tile++) {
+                const int m0 = tile % tilesM * TILE_M;
+                const int n0 = tile / tilesM * TILE_N;
+                if (m0 >= actualM || n0 >= actualN) {
+                    continue;
+                }
+                std::fill(C.begin(), C.end(), 0);
+                for (int k0 = 0; k0 < op.K; k0 += KC) {
+                    const int kc = std::min(KC, op.K - k0);
+                    for (int j = 0; j < TILE_N; j += kernel.NR) {
+                        for (int i = 0; i < TILE_M; i += kernel.MR) {
+                            kernel.func(op, m0 + i, n0 + j, k0, kc, &C[i * TILE_N + j], TILE_N);
+                        }
+                    }
+                }
+
+                // fsum = acc * (ascale * wscale) in FP32, rounded to half before and after the bias as the CUDA epilogues
+                for (int i = 0; i < TILE_M && m0 + i < actualM; i++) {
+                    const int m = m0 + i;
+                    for (int j = 0; j < TILE_N && n0 + j < actualN; j++) {
+                        const int n = n0 + j;
+                        const int32_t acc = C[i * TILE_N + j] - kernel.actOffset * op.wsum[n];
+                        float v = roundToHalf(float(acc) * (as[m] * ws[n]), dtype);
+                        if (!biasValues.empty()) {
+                            v += biasValues[n];
+                        }
+                        output[(size_t)m * actualN + n] = floatToHalf(v, dtype);
+                    }
+                }
+            }
+#if HOST_SIMD
+            if (kernel.amx) {
+                amxEnd();
+            }
+#endif
+        });
+    };
+    run(act, wgt, out, ascales, wscales, bias);
+    step.record(run, act, wgt, out, ascales, wscales, bias);
+}
+
+void quantize_w8a8_act_cpu(Tensor input, Tensor output, Tensor oscales, bool fuse_glu) {
+    CpuPlanStep step;
+    for (auto tensor : {input, output, oscales}) {
+        if (tensor.device().type != Device::CPU || !tensor.is_contiguous()) {
+            throw std::invalid_argument("All operands of quantize_w8a8_act_cpu must be contiguous CPU tensors");
+        }
+    }
+
+    const Tensor::ScalarType dtype = input.dtype();
+    const int actualM = input.numel() / input.shape[-1];
+    const int inputK = input.shape[-1];
+    const int K = fuse_glu ? inputK / 2 : inputK;
+    const int M = output.numel() / output.shape[-1];
+    if (M < actualM || M % BLOCK_M != 0 || K % WARP_K != 0 || output.shape[-1] != K) {
+        throw std::invalid_argument(spdlog::fmt_lib::format("Invalid quantize_w8a8_act shape M={} (input rows {}) K={}", M, actualM, K));
+    }
+    assert(output.dtype() == Tensor::INT8);
+    assert(oscales.dtype() == dtype && oscales.numel() == (size_t)M);
+
+    spdlog::trace("quantize_w8a8_act_cpu: M={} K={} fuse_glu={}", M, K, fuse_glu);
+
+    auto run = [M, K, actualM, inputK, dtype, fuse_glu](Tensor input, Tensor output, Tensor oscales) {
+        const uint16_t *in = input.data_ptr<uint16_t>();
+        uint32_t *words = output.data_ptr<uint32_t>();
+        uint16_t *scales = oscales.data_ptr<uint16_t>();
+
+        parallelFor(M / 16, [&](int begin, int end) {
+            std::vector<float> x(K);
+            for (int m = begin * 16; m < end * 16; m++) {
+                if (m >= actualM) {
+                    for (int k = 0; k < K; k += 4) {
+                        words[packedActWord(m, k, K)] = 0;
+                    }
+                    scales[packedAscaleIndex(m)] = 0;
+                    continue;
+                }
+
+                // the gated values are rounded to half as they are in the shared memory of the CUDA kernel
+                const uint16_t *row = in + (size_t)m * inputK;
+                float maxv = 0;
+                for (int k = 0; k < K; k++) {
+                    if (fuse_glu) {
+                        const float gate = roundToHalf(gelu(halfToFloat(row[k * 2 + 1], dtype)), dtype);
+                        x[k] = roundToHalf(halfToFloat(row[k * 2], dtype) * gate, dtype);
+                    } else {
+                        x[k] = halfToFloat(row[k], dtype);
+                    }
+                    maxv = std::max(maxv, std::fabs(x[k]));
+                }
+
+                const float oscale = roundToHalf(maxv / QVALUE_MAX, dtype);
+                const float rscale = oscale > 0 ? 1.0f / oscale : 0.0f;
+                scales[packedAscaleIndex(m)] = floatToHalf(oscale, dtype);
+                for (int k = 0; k < K; k += 4) {
+                    int8_t q[4];
+                    for (int i = 0; i < 4; i++) {
+                        q[i] = (int8_t)std::clamp(std::nearbyint(x[k + i] * rscale), -128.0f, 127.0f);
+                    }
+                    memcpy(&words[packedActWord(m, k, K)], q, 4);
+                }
+            }
+        });
+    };
+    run(input, output, oscales);
+    step.record(run, input, output, oscales);
+}
+
+};  // namespace nunchaku::kernels
@@ -0,0 +1,26 @@
+#pragma once
+
+#include "common.h"
+#include "Tensor.h"
+
+namespace nunchaku::kernels {
+
+// host implementation of gemm_w8a8 for operands in CPU memory, same packed layouts as the CUDA kernels
+// int8 x int8 products are accumulated exactly in int32 over all of K, then scaled by ascale * wscale and biased in FP32
+// AMX tiles or AVX-512 VNNI dot products where present, otherwise AVX2 int16 multiply-adds
+// NUNCHAKU_CPU_THREADS sets the number of threads (default: all cores)
+// NUNCHAKU_CPU_GEMM_ISA=scalar|avx2|avx512vnni|amx forces a code path (default: best supported)
+void gemm_w8a8_cpu(
+        Tensor act,      // packed act [M, K]
+        Tensor wgt,      // packed wgt [N, K]
+        Tensor out,      // linear     [M, N]
+        Tensor ascales,  // packed as  [1, M]
+        Tensor wscales,  // packed ws  [1, N]
+        Tensor bias      // packed ws  [N]
+);
+
+// host implementation of quantize_w8a8_act: one symmetric INT8 scale per row (max |x| / 127), with fuse_glu the
+// interleaved pairs of input are reduced to x * gelu(y) first; output may have more rows than input, they are zeroed
+void quantize_w8a8_act_cpu(Tensor input, Tensor output, Tensor oscales, bool fuse_glu);
+
+};  // namespace nunchaku::kernels
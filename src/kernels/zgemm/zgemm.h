@@ -36,9 +36,29 @@ void gemm_w4a4(
         Tensor out_v,          // packed attention [B, H, M, D]
         int attn_tokens
 );
+// arguments of one gemm_w4a4 call, see above for the layouts
+struct GemmW4A4Args {
+    Tensor act, wgt, out, qout, ascales, wscales, oscales, poolout;
+    Tensor lora_act_in, lora_up, lora_down, lora_act_out;
+    Tensor norm_q, norm_k, rotary_emb, bias, smooth_factor, out_vk, out_linearattn;
+    bool act_unsigned = false;
+    std::vector<float> lora_scales;
+    bool fuse_silu = false;
+    bool fp4 = false;
+    float alpha = 1.0f;
+    Tensor wcscales, out_q, out_k, out_v;
+    int attn_tokens = 0;
+};
+void gemm_w4a4(const GemmW4A4Args &args);
+// runs independent problems together: on CPU all tiles share one parallel region, on GPU each problem gets its own stream
+// joined back into the current one. Grouping is on by default on CPU and off on GPU, NUNCHAKU_GROUPED_GEMM=1 or 0
+// turns it on or off on both (off runs the problems one after another)
+void gemm_w4a4_grouped(const std::vector<GemmW4A4Args> &problems);
 void linearattn_vk_mul_q(Tensor q, Tensor vk);
 
 void quantize_w4a4_act_fuse_lora(Tensor input, Tensor output, Tensor oscales, Tensor lora_down, Tensor lora_act_out, Tensor smooth = {}, bool fuse_glu = false, bool fp4 = false);
+// quantize_w4a4_act_fuse_lora of LayerNorm(input) * scale + shift (no affine), CPU only (see gemm_w4a4_cpu.h)
+void quantize_w4a4_act_fuse_norm(Tensor input, Tensor scale, Tensor shift, float eps, Tensor output, Tensor oscales, Tensor lora_down, Tensor lora_act_out, Tensor smooth = {}, bool fp4 = false);
 void quantize_w4a4_act(Tensor input, Tensor output, Tensor oscales);
 void quantize_w4a4_wgt(Tensor input, Tensor output, Tensor oscales);
 
@@ -0,0 +1,44 @@
+import pytest
+import torch
+
+from nunchaku._C import CpuExecutionPlan
+from nunchaku.tools.bench_cpu_plan import forward, make_layers
+
+
+@pytest.mark.parametrize("m", [16, 256])
+def test_cpu_plan_replay(m: int):
+    torch.manual_seed(0)
+    rank = 32
+    layers = make_layers(m, 256, rank, 3, torch.bfloat16)
+    x = (torch.randn(m, 256) * 0.5).to(torch.bfloat16)
+    expected = forward(x, layers, rank).clone()
+
+    plan = CpuExecutionPlan()
+    plan.beginCapture([x])
+    output = forward(x, layers, rank)
+    plan.endCapture([output])
+    assert plan.numSteps() >= 6  # a quantization and a GEMM per layer
+
+    # new inputs go through the recorded kernels only, they must match an eager run exactly
+    x2 = (torch.randn(m, 256) * 0.5).to(torch.bfloat16)
+    assert torch.equal(plan.replay([x2])[0], forward(x2, layers, rank))
+    assert torch.equal(plan.replay([x])[0], expected)
+
+
+def test_cpu_plan_errors():
+    layers = make_layers(16, 256, 32, 1, torch.bfloat16)
+    x = torch.randn(16, 256).to(torch.bfloat16)
+
+    plan = CpuExecutionPlan()
+    with pytest.raises(RuntimeError):
+        plan.replay([x])
+    with pytest.raises(RuntimeError):
+        plan.endCapture([x])
+
+    plan.beginCapture([x])
+    output = forward(x, layers, 32)
+    plan.endCapture([output])
+    with pytest.raises(ValueError):
+        plan.replay([torch.randn(32, 256).to(torch.bfloat16)])
+    with pytest.raises(ValueError):
+        plan.replay([x, x])
@@ -0,0 +1,311 @@
+import pytest
+import torch
+import torch.nn.functional as F
+
+from nunchaku._C.ops import gemm_w4a4
+from nunchaku.lora.flux import packer
+from nunchaku.lora.flux.packer import NunchakuWeightPacker
+from nunchaku.tools.bench_qkv_epilogue_cpu import make_rotary
+
+# e2m1 value of each NVFP4 nibble
+E2M1 = torch.tensor([0, 0.5, 1, 1.5, 2, 3, 4, 6, 0, -0.5, -1, -1.5, -2, -3, -4, -6], dtype=torch.float64)
+SHIFT_GELU = 0.171875
+DTYPES = [torch.float16, torch.bfloat16]
+
+
+@pytest.fixture(autouse=True)
+def torch_packer(monkeypatch):
+    # the torch ops of the deepcompressor packer are the reference layout, not the native packer under test elsewhere
+    monkeypatch.setattr(packer, "USE_NATIVE_PACKER", False)
+
+
+# (view shape, permutation) of the packed activation layouts of gemm_base.cuh, applied to the logical [M, ...] tensor
+def act_layout(m: int, k: int):
+    # as pack_weight with warp_n = 256 and the two register halves of a lane swapped
+    return (m // 256, 16, 2, 8, k // 64, 2, 4, 8), (0, 4, 1, 3, 6, 5, 2, 7)
+
+
+def ascale_layout(m: int, groups: int):
+    return (m // 256, 8, 2, 2, 8, groups), (0, 5, 1, 2, 4, 3)
+
+
+def amscale_layout(m: int, blocks: int):
+    return (m // 256, 8, 2, 2, 8, blocks // 4, 4), (0, 5, 1, 4, 2, 3, 6)
+
+
+def lora_act_layout(m: int, rank: int):
+    return (m // 256, 8, 2, 2, 8, rank // 16, 2, 4, 2), (0, 5, 1, 2, 6, 3, 8, 4, 7)
+
+
+def pack(x: torch.Tensor, layout) -> torch.Tensor:
+    shape, perm = layout
+    return x.reshape(shape).permute(perm).contiguous()
+
+
+def unpack(x: torch.Tensor, layout) -> torch.Tensor:
+    shape, perm = layout
+    inverse = [perm.index(i) for i in range(len(perm))]
+    return x.reshape([shape[p] for p in perm]).permute(inverse).reshape(shape[0] * 256, -1)
+
+
+def pack_nibbles(codes: torch.Tensor) -> torch.Tensor:
+    """the 4-bit codes [M, K] as a packed act [M, K / 2]"""
+    m, k = codes.shape
+    shift = torch.arange(0, 32, 4, dtype=torch.int32)
+    words = pack(codes, act_layout(m, k)).reshape(-1, 8).bitwise_and(0xF).bitwise_left_shift(shift)
+    return words.sum(-1, dtype=torch.int32).view(torch.int8).view(m, k // 2)
+
+
+def unpack_nibbles(packed: torch.Tensor) -> torch.Tensor:
+    m, k = packed.shape[0], packed.shape[1] * 2
+    shift = torch.arange(0, 32, 4, dtype=torch.int32)
+    codes = packed.contiguous().view(torch.int32).reshape(-1, 1).bitwise_right_shift(shift).bitwise_and(0xF)
+    return unpack(codes, act_layout(m, k))
+
+
+def make_gemm(m: int, n: int, k: int, fp4: bool, dtype: torch.dtype, act_unsigned: bool = False) -> dict:
+    """random packed operands and the fp64 product of their logical values"""
+    group = 16 if fp4 else 64
+    wpacker = NunchakuWeightPacker(bits=4)
+    if fp4:
+        act, wgt = torch.randint(0, 16, (m, k), dtype=torch.int32), torch.randint(0, 16, (n, k), dtype=torch.int32)
+        act_values, wgt_values = E2M1[act.long()], E2M1[wgt.long()]
+        # the e4m3 scales are exact in half precision, pack_micro_scale converts them back
+        ascales = (torch.rand(m, k // group) * 0.15 + 0.05).to(torch.float8_e4m3fn)
+        wscales = (torch.rand(n, k // group) * 0.15 + 0.05).to(torch.float8_e4m3fn)
+        packed_ascales = pack(ascales, amscale_layout(m, k // group)).view(-1, m)
+        packed_wscales = wpacker.pack_scale(wscales.to(dtype), group_size=group)
+        alpha = 0.5
+    else:
+        low = 0 if act_unsigned else -8
+        act, wgt = torch.randint(low, low + 16, (m, k), dtype=torch.int32), torch.randint(-8, 8, (n, k), dtype=torch.int32)
+        act_values, wgt_values = act.double(), wgt.double()
+        ascales = (torch.rand(m, k // group) * 0.1 + 0.05).to(dtype)
+        wscales = (torch.rand(n, k // group) * 0.02 + 0.01).to(dtype)
+        packed_ascales = pack(ascales, ascale_layout(m, k // group)).view(-1, m)
+        packed_wscales = wpacker.pack_scale(wscales, group_size=group)
+        alpha = 1.0
+    a = act_values * ascales.double().repeat_interleave(group, dim=1)
+    w = wgt_values * wscales.double().repeat_interleave(group, dim=1)
+    return {
+        "act": pack_nibbles(act),
+        "wgt": wpacker.pack_weight(wgt),
+        "ascales": packed_ascales,
+        "wscales": packed_wscales,
+        "fp4": fp4,
+        "alpha": alpha,
+        "act_unsigned": act_unsigned,
+        "ref": alpha * a @ w.T,
+    }
+
+
+def pack_vector(x: torch.Tensor) -> torch.Tensor:
+    return NunchakuWeightPacker(bits=4).pack_scale(x, group_size=-1)
+
+
+def add_bias(ops: dict, dtype: torch.dtype, wcscales: bool = False):
+    n = ops["ref"].shape[1]
+    bias = torch.randn(n).to(dtype)
+    ops["bias"] = pack_vector(bias)
+    if wcscales:
+        scales = (torch.rand(n) + 0.5).to(dtype)
+        ops["wcscales"] = pack_vector(scales)
+        ops["ref"] = ops["ref"] * scales.double()
+    ops["ref"] = ops["ref"] + bias.double()
+
+
+def add_lora_up(ops: dict, rank: int, dtype: torch.dtype):
+    m, n = ops["ref"].shape
+    lora_act = torch.randn(m, rank)
+    up = (torch.randn(n, rank) * 0.1).to(dtype)
+    ops["lora_scales"] = [1.0, 0.5][: rank // 16]
+    ops["lora_act_in"] = pack(lora_act, lora_act_layout(m, rank)).view(m, rank)
+    ops["lora_up"] = NunchakuWeightPacker(bits=4).pack_lowrank_weight(up, down=False)
+    scales = torch.tensor(ops["lora_scales"], dtype=torch.float64).repeat_interleave(16)
+    ops["ref"] = ops["ref"] + (lora_act.double() * scales) @ up.double().T
+
+
+def run(ops: dict, out=None, qout=None, oscales=None, poolout=None, lora_act_out=None, rotary=None, smooth=None,
+        out_vk=None, out_linearattn=None, fuse_silu=False, packed=(None, None, None), attn_tokens=0):
+    get = ops.get
+    gemm_w4a4(
+        ops["act"], ops["wgt"], out, qout, ops["ascales"], ops["wscales"], oscales, poolout,
+        get("lora_act_in"), get("lora_up"), get("lora_down"), lora_act_out,
+        get("norm_q") if rotary is not None else None, get("norm_k") if rotary is not None else None, rotary,
+        get("bias"), smooth, out_vk, out_linearattn, ops["act_unsigned"], get("lora_scales", []), fuse_silu,
+        ops["fp4"], ops["alpha"], get("wcscales"), *packed, attn_tokens,
+    )
+
+
+def assert_close(actual: torch.Tensor, expected: torch.Tensor, dtype: torch.dtype, ulps: float = 2):
+    """within a few ulps of the output range, any layout mistake is off by the order of the values themselves"""
+    eps = torch.finfo(dtype).eps * ulps
+    torch.testing.assert_close(actual.double(), expected, rtol=eps, atol=eps * expected.abs().max().item())
+
+
+@pytest.mark.parametrize("dtype", DTYPES)
+@pytest.mark.parametrize("fp4", [False, True])
+@pytest.mark.parametrize("epilogue", ["plain", "bias", "lora", "silu"])
+def test_gemm_w4a4_cpu(epilogue: str, fp4: bool, dtype: torch.dtype):
+    torch.manual_seed(0)
+    ops = make_gemm(512, 256, 256, fp4, dtype)
+    if epilogue != "plain" or fp4:
+        # NVFP4 takes its output type from a half precision operand
+        add_bias(ops, dtype, wcscales=epilogue == "bias" and fp4)
+    if epilogue == "lora":
+        add_lora_up(ops, 32, dtype)
+    expected = F.silu(ops["ref"]) if epilogue == "silu" else ops["ref"]
+
+    # rows and columns past the end of out are computed but not written
+    out = torch.empty(500, 250, dtype=dtype)
+    run(ops, out=out, fuse_silu=epilogue == "silu")
+    assert_close(out, expected[:500, :250], dtype)
+
+
+@pytest.mark.parametrize("dtype", DTYPES)
+def test_gemm_w4a4_cpu_unsigned(dtype: torch.dtype):
+    torch.manual_seed(0)
+    ops = make_gemm(256, 128, 256, False, dtype, act_unsigned=True)
+    out = torch.empty(256, 128, dtype=dtype)
+    run(ops, out=out)
+    assert_close(out, ops["ref"], dtype)
+
+
+@pytest.mark.parametrize("dtype", DTYPES)
+@pytest.mark.parametrize("fp4", [False, True])
+def test_gemm_w4a4_cpu_quantize(fp4: bool, dtype: torch.dtype):
+    torch.manual_seed(0)
+    m, n, rank = 512, 256, 32
+    ops = make_gemm(m, n, 256, fp4, dtype)
+    add_bias(ops, dtype)
+    add_lora_up(ops, rank, dtype)
+    down = (torch.randn(n, rank) * 0.1).to(dtype)
+    ops["lora_down"] = NunchakuWeightPacker(bits=4).pack_lowrank_weight(down.T.contiguous(), down=True)
+    smooth = (torch.rand(n) + 0.5).to(dtype)
+
+    group = 16 if fp4 else 64
+    qout = torch.empty(m, n // 2, dtype=torch.int8)
+    oscales = torch.empty(n // group, m, dtype=torch.float8_e4m3fn if fp4 else dtype)
+    lora_act_out = torch.empty(m, rank, dtype=torch.float32)
+    run(ops, qout=qout, oscales=oscales, lora_act_out=lora_act_out, smooth=pack_vector(smooth))
+
+    eps = torch.finfo(dtype).eps
+    gelu = F.gelu(ops["ref"], approximate="tanh")
+    assert_close(unpack(lora_act_out, lora_act_layout(m, rank)), gelu @ down.double(), dtype)
+
+    # each value is within half a quantization step of the smoothed GELU output, plus its half precision roundings
+    codes = unpack_nibbles(qout)
+    if fp4:
+        values = gelu / smooth.double()
+        scales = values.view(m, -1, group).abs().amax(-1) / 6
+        omscales = unpack(oscales, amscale_layout(m, n // group)).double()
+        torch.testing.assert_close(omscales, scales, rtol=0.125, atol=0)
+        scales = scales.repeat_interleave(group, dim=1)
+        # e2m1 steps are 0.5 up to 2 and a quarter of the value above
+        bound = scales * (0.25 + 32 * eps) + values.abs() * 0.25
+        assert ((E2M1[codes.long()] * scales - values).abs() <= bound).all()
+    else:
+        values = (gelu + SHIFT_GELU) / smooth.double()
+        scales = values.view(m, -1, group).abs().amax(-1) / 15
+        torch.testing.assert_close(unpack(oscales, ascale_layout(m, n // group)).double(), scales, rtol=8 * eps, atol=0)
+        scales = scales.repeat_interleave(group, dim=1)
+        assert ((codes * scales - values).abs() <= scales * (0.5 + 32 * eps)).all()
+
+
+@pytest.mark.parametrize("dtype", DTYPES)
+@pytest.mark.parametrize("fp4", [False, True])
+def test_gemm_w4a4_cpu_linearattn(fp4: bool, dtype: torch.dtype):
+    torch.manual_seed(0)
+    batch, tokens, heads, head_dim = 2, 200, 4, 32
+    n = heads * head_dim * 3
+    ops = make_gemm(512, n, 256, fp4, dtype)
+    add_bias(ops, dtype)
+
+    out_vk = torch.empty(batch, heads, head_dim + 1, head_dim, dtype=torch.float32)
+    out_linearattn = torch.empty(batch, tokens, n // 3, dtype=dtype)
+    run(ops, out_vk=out_vk, out_linearattn=out_linearattn)
+
+    # the tiles of rows 0 .. 255 and 256 .. 511 both span the end of the first batch item
+    ref = ops["ref"][: batch * tokens].view(batch, tokens, n)
+    kv = ref[:, :, n // 3 :].reshape(batch, tokens, heads, 2, head_dim)
+    k, v = kv[:, :, :, 0].relu(), kv[:, :, :, 1]
+    vk = torch.cat([torch.einsum("bthi,bthj->bhij", v, k), k.sum(1).unsqueeze(2)], dim=2)
+    assert_close(out_linearattn, ref[:, :, : n // 3].relu(), dtype)
+    assert_close(out_vk, vk, dtype)
+
+
+def norm_rope(x: torch.Tensor, weight: torch.Tensor, sincos: torch.Tensor) -> torch.Tensor:
+    """RMSNorm and RoPE of the [M, H * 128] heads in fp64"""
+    x = x.unflatten(-1, (-1, 128))
+    x = x * torch.rsqrt(x.square().mean(-1, keepdim=True) + 1e-6) * weight.double()
+    x0, x1 = x.unflatten(-1, (64, 2)).unbind(-1)
+    sin, cos = sincos.double()[:, None].unbind(-1)
+    return torch.stack([x0 * cos - x1 * sin, x0 * sin + x1 * cos], dim=-1).flatten(1)
+
+
+@pytest.mark.parametrize("dtype", DTYPES)
+@pytest.mark.parametrize("fp4", [False, True])
+@pytest.mark.parametrize("packed", [False, True])
+def test_gemm_w4a4_cpu_norm_rope(packed: bool, fp4: bool, dtype: torch.dtype):
+    torch.manual_seed(0)
+    m, heads = 512, 2
+    n = heads * 128 * 3
+    ops = make_gemm(m, n, 256, fp4, dtype)
+    add_bias(ops, dtype)
+    ops["norm_q"] = (torch.rand(128) + 0.5).to(dtype)
+    ops["norm_k"] = (torch.rand(128) + 0.5).to(dtype)
+    sincos, rotary = make_rotary(m)
+
+    ref = ops["ref"]
+    q, k, v = ref.chunk(3, dim=1)
+    q, k = norm_rope(q, ops["norm_q"], sincos), norm_rope(k, ops["norm_k"], sincos)
+    if packed:
+        # two batch items of 256 tokens, the last 56 of each are masked
+        batch, tokens, attn_tokens = 2, 256, 200
+        outputs = tuple(torch.empty(batch, heads, tokens, 128, dtype=torch.float16) for _ in range(3))
+        run(ops, rotary=rotary, packed=outputs, attn_tokens=attn_tokens)
+        for output, expected, fill in zip(outputs, (q, k, v), (0, float("nan"), 0)):
+            expected = expected.view(batch, tokens, heads, 128).transpose(1, 2)
+            assert_close(output[:, :, :attn_tokens], expected[:, :, :attn_tokens], dtype)
+            torch.testing.assert_close(output[:, :, attn_tokens:], torch.full_like(output[:, :, attn_tokens:], fill), equal_nan=True)
+    else:
+        out = torch.empty(m, n, dtype=dtype)
+        poolout = torch.empty(m // 128, n, dtype=dtype)
+        run(ops, out=out, poolout=poolout, rotary=rotary)
+        assert_close(out, torch.cat([q, k, v], dim=1), dtype)
+        pooled = torch.cat([q, k], dim=1).view(m // 128, 128, -1).mean(1)
+        assert_close(poolout[:, : n // 3 * 2], pooled, dtype)
+
+
+@pytest.mark.parametrize("dtype", DTYPES)
+def test_gemm_w4a4_cpu_joint_pool(dtype: torch.dtype):
+    """the image and text qkv of a joint block go to row ranges of one concat and one pool, as in FluxModel"""
+    torch.manual_seed(0)
+    n = 2 * 128 * 3
+    sides = []
+    for m in (256, 512):
+        ops = make_gemm(m, n, 256, False, dtype)
+        ops["norm_q"] = (torch.rand(128) + 0.5).to(dtype)
+        ops["norm_k"] = (torch.rand(128) + 0.5).to(dtype)
+        ops["sincos"], ops["rotary"] = make_rotary(m)
+        sides.append(ops)
+
+    concat = torch.full((256 + 512, n), float("nan"), dtype=dtype)
+    pool = torch.full(((256 + 512) // 128, n), float("nan"), dtype=dtype)
+    begin = 0
+    for ops in sides:
+        m = ops["ref"].shape[0]
+        rows = slice(begin, begin + m)
+        run(ops, out=concat[rows], poolout=pool[begin // 128 : (begin + m) // 128], rotary=ops["rotary"])
+        begin += m
+
+    begin = 0
+    for ops in sides:
+        m = ops["ref"].shape[0]
+        rows = slice(begin, begin + m)
+        q, k, v = ops["ref"].chunk(3, dim=1)
+        q, k = norm_rope(q, ops["norm_q"], ops["sincos"]), norm_rope(k, ops["norm_k"], ops["sincos"])
+        assert_close(concat[rows], torch.cat([q, k, v], dim=1), dtype)
+        pooled = torch.cat([q, k], dim=1).view(m // 128, 128, -1).mean(1)
+        assert_close(pool[begin // 128 : (begin + m) // 128, : n // 3 * 2], pooled, dtype)
+        begin += m
@@ -0,0 +1,31 @@
+import pytest
+import torch
+
+from nunchaku._C import QuantizedGEMV
+from nunchaku.tools.bench_gemv_awq_cpu import make_operands, run
+
+
+@pytest.mark.parametrize("dtype", [torch.float16, torch.bfloat16])
+@pytest.mark.parametrize("bias", [False, True])
+def test_gemv_awq_module_cpu(bias: bool, dtype: torch.dtype):
+    """GEMV_AWQ::forward with host weights, the bias is added by the CPU kernel"""
+    torch.manual_seed(0)
+    m, n, k = 3, 256, 512
+    ops = make_operands(m, n, k, dtype)
+    weights = {"qweight": ops["kernel"], "wscales": ops["scales"], "wzeros": ops["zeros"]}
+    expected = run(ops, m, n, k).double()
+    if bias:
+        weights["bias"] = torch.randn(n).to(dtype)
+        expected = expected + weights["bias"].double()
+
+    module = QuantizedGEMV()
+    module.init(k, n, bias, dtype == torch.bfloat16, -1)
+    module.loadDict(weights)
+    out = module.forward(ops["in_feats"])
+    assert out.device.type == "cpu" and out.dtype == dtype and out.shape == (m, n)
+    if bias:
+        # one rounding of the biased sum against two of the reference
+        eps = torch.finfo(dtype).eps * 2
+        torch.testing.assert_close(out.double(), expected, rtol=eps, atol=eps * expected.abs().max().item())
+    else:
+        assert torch.equal(out.double(), expected)
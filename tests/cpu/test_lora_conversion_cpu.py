@@ -0,0 +1,22 @@
+import pytest
+import torch
+
+from nunchaku.lora.flux import packer, to_nunchaku
+from nunchaku.tools.bench_lora_conversion import make_base_model, make_lora
+
+
+@pytest.mark.parametrize("dtype", [torch.bfloat16, torch.float16])
+def test_to_nunchaku_native_packer(dtype: torch.dtype, monkeypatch):
+    torch.manual_seed(0)
+    base = make_base_model(16, dtype, num_double=1, num_single=1)
+    lora = make_lora(32, dtype, num_double=1, num_single=1)
+
+    # CPU tensors take the native packer by default, it must give what the torch packer gives
+    assert packer.use_native_packer(next(iter(lora.values())))
+    native = to_nunchaku(dict(lora), base, dtype=dtype)
+    monkeypatch.setattr(packer, "USE_NATIVE_PACKER", False)
+    reference = to_nunchaku(dict(lora), base, dtype=dtype)
+
+    assert native.keys() == reference.keys()
+    for key, value in reference.items():
+        assert torch.equal(native[key], value), key
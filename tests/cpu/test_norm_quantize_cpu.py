@@ -0,0 +1,36 @@
+import pytest
+import torch
+import torch.nn.functional as F
+
+from nunchaku._C.ops import quantize_w4a4_act_fuse_lora, quantize_w4a4_act_fuse_norm
+from nunchaku.tools.bench_norm_quantize_cpu import DIM, EPS
+from nunchaku.tools.bench_quantize_w4a4_cpu import make_operands
+
+
+def quantize(ops: dict, x: torch.Tensor, scale=None, shift=None) -> tuple:
+    output, oscales, lora_act_out = ops["output"].clone(), ops["oscales"].clone(), ops["lora_act_out"].clone()
+    if scale is None:
+        quantize_w4a4_act_fuse_lora(x, output, oscales, ops["lora_down"], lora_act_out, ops["smooth"], False, False)
+    else:
+        quantize_w4a4_act_fuse_norm(x, scale, shift, EPS, output, oscales, ops["lora_down"], lora_act_out, ops["smooth"], False)
+    return output, oscales, lora_act_out
+
+
+@pytest.mark.parametrize("dtype", [torch.bfloat16, torch.float16])
+@pytest.mark.parametrize("batch", [1, 2])  # one modulation for the batch, or one per sample as the Flux blocks give
+def test_quantize_w4a4_act_fuse_norm_cpu(batch: int, dtype: torch.dtype):
+    torch.manual_seed(0)
+    m = 512
+    ops = make_operands(m, DIM, False, 32, dtype)
+    x = (ops["input"] * 3 + 1).to(dtype).view(batch, m // batch, DIM)
+    scale = (1 + torch.randn(batch, DIM) * 0.3).to(dtype)
+    shift = (torch.randn(batch, DIM) * 0.5).to(dtype)
+
+    fused = quantize(ops, x, scale, shift)
+    normed = (F.layer_norm(x, (DIM,), eps=EPS) * scale[:, None] + shift[:, None]).view(m, DIM)
+    expected = quantize(ops, normed)
+
+    # the statistics are summed in a different order than torch, so a few values may round differently
+    assert (fused[0] != expected[0]).float().mean().item() < 1e-3
+    torch.testing.assert_close(fused[1].float(), expected[1].float(), rtol=2 * torch.finfo(dtype).eps, atol=0)
+    torch.testing.assert_close(fused[2], expected[2], rtol=0, atol=1e-2)
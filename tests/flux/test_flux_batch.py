@@ -0,0 +1,51 @@
+import pytest
+import torch
+
+from nunchaku import NunchakuFluxTransformer2dModel
+from nunchaku._C import BatchScheduler
+from nunchaku.utils import get_precision, is_turing
+
+
+def make_inputs(batch_size: int, img_tokens: int = 256, txt_tokens: int = 256) -> dict:
+    """Random inputs of `batch_size` requests of one resolution, each with its own prompt and timestep."""
+    generator = torch.Generator().manual_seed(1)
+    return dict(
+        hidden_states=torch.randn(batch_size, img_tokens, 64, generator=generator).to("cuda", torch.bfloat16),
+        encoder_hidden_states=torch.randn(batch_size, txt_tokens, 4096, generator=generator).to("cuda", torch.bfloat16),
+        pooled_projections=torch.randn(batch_size, 768, generator=generator).to("cuda", torch.bfloat16),
+        timestep=torch.linspace(1.0, 0.1, batch_size).to("cuda", torch.bfloat16),
+        img_ids=torch.zeros(img_tokens, 3, device="cuda"),
+        txt_ids=torch.zeros(txt_tokens, 3, device="cuda"),
+    )
+
+
+@pytest.mark.skipif(is_turing(), reason="Skip tests due to Turing GPUs")
+@pytest.mark.parametrize("batch_size", [2, 9])  # 9 runs the adaLN GEMV_AWQ in chunks of at most 7 rows
+def test_flux_batch_different_timesteps(batch_size: int):
+    transformer = NunchakuFluxTransformer2dModel.from_pretrained(f"mit-han-lab/svdq-{get_precision()}-flux.1-schnell")
+    inputs = make_inputs(batch_size)
+    with torch.inference_mode():
+        batched = transformer(**inputs, return_dict=False)[0].float()
+        singles = []
+        for i in range(batch_size):
+            single = {k: v if k.endswith("_ids") else v[i : i + 1] for k, v in inputs.items()}
+            singles.append(transformer(**single, return_dict=False)[0].float())
+    assert not torch.allclose(singles[0], singles[1])
+    torch.testing.assert_close(batched, torch.cat(singles), rtol=1e-2, atol=1e-2)
+
+
+def test_batch_scheduler_finish_step_rejects_bad_ids():
+    scheduler = BatchScheduler(max_batch=2)
+    a = scheduler.submit([256, 256], 2)
+    b = scheduler.submit([256, 256], 2)
+    assert sorted(scheduler.nextBatch()) == sorted([a, b])
+
+    # an unknown or repeated id leaves the whole batch in flight
+    for ids in ([a, b + 100], [a, a], [b, a, b]):
+        with pytest.raises(ValueError):
+            scheduler.finishStep(ids)
+        assert scheduler.step(a) == 0 and scheduler.step(b) == 0
+        assert scheduler.nextBatch() == []
+
+    assert scheduler.finishStep([a, b]) == []
+    assert scheduler.step(a) == 1 and scheduler.step(b) == 1
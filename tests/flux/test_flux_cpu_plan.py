@@ -0,0 +1,41 @@
+import torch
+
+from nunchaku import NunchakuFluxTransformer2dModel
+
+
+def make_inputs(seed: int, img_tokens: int = 256, txt_tokens: int = 256) -> dict:
+    generator = torch.Generator().manual_seed(seed)
+    return dict(
+        hidden_states=torch.randn(1, img_tokens, 64, generator=generator).to(torch.bfloat16),
+        encoder_hidden_states=torch.randn(1, txt_tokens, 4096, generator=generator).to(torch.bfloat16),
+        pooled_projections=torch.randn(1, 768, generator=generator).to(torch.bfloat16),
+        timestep=torch.rand(1, generator=generator).to(torch.bfloat16),
+        img_ids=torch.zeros(img_tokens, 3),
+        txt_ids=torch.zeros(txt_tokens, 3),
+    )
+
+
+def test_flux_cpu_plan(monkeypatch):
+    transformer = NunchakuFluxTransformer2dModel.from_pretrained(
+        "mit-han-lab/svdq-int4-flux.1-schnell", device="cpu", precision="int4"
+    )
+    inputs = [make_inputs(1), make_inputs(2)]
+    with torch.inference_mode():
+        eager = [transformer(**x, return_dict=False)[0] for x in inputs]
+
+        # the first forward records the plan of its shapes, the others replay it and must match the eager runs exactly
+        monkeypatch.setenv("NUNCHAKU_CPU_PLAN", "1")
+        planned = [transformer(**x, return_dict=False)[0] for x in inputs + inputs]
+
+        # a forward of other shapes records a plan of its own
+        other = make_inputs(3, img_tokens=512)
+        monkeypatch.delenv("NUNCHAKU_CPU_PLAN")
+        other_eager = transformer(**other, return_dict=False)[0]
+        monkeypatch.setenv("NUNCHAKU_CPU_PLAN", "1")
+        other_planned = [transformer(**other, return_dict=False)[0] for _ in range(2)]
+
+    assert not torch.equal(eager[0], eager[1])
+    for expected, output in zip(eager + eager, planned):
+        assert torch.equal(output, expected)
+    for output in other_planned:
+        assert torch.equal(output, other_eager)
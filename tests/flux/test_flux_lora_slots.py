@@ -0,0 +1,38 @@
+import pytest
+import torch
+
+from nunchaku import NunchakuFluxTransformer2dModel
+from nunchaku.utils import get_precision, is_turing
+from .utils import LORA_PATH_MAP, run_transformer
+
+
+@pytest.mark.skipif(is_turing(), reason="Skip tests due to Turing GPUs")
+@pytest.mark.parametrize("on_device,offload", [(False, False), (True, False), (False, True)])
+def test_flux_lora_slot_strength(on_device: bool, offload: bool):
+    transformer = NunchakuFluxTransformer2dModel.from_pretrained(
+        f"mit-han-lab/svdq-{get_precision()}-flux.1-dev", offload=offload
+    )
+
+    transformer.update_lora_params(LORA_PATH_MAP["realism"])
+    transformer.set_lora_strength(0.6)
+    reference = run_transformer(transformer)
+    transformer.save_lora_slot("realism", on_device=on_device)
+
+    transformer.update_lora_params(LORA_PATH_MAP["anime"])
+    transformer.set_lora_strength(1)
+    other = run_transformer(transformer)
+    transformer.save_lora_slot("anime", on_device=on_device)
+
+    # the slot brings back the LoRA at the strength it was saved with
+    transformer.activate_lora_slot("realism")
+    assert not torch.allclose(other, reference)
+    torch.testing.assert_close(run_transformer(transformer), reference, rtol=1e-3, atol=1e-3)
+
+    transformer.activate_lora_slot("anime")
+    torch.testing.assert_close(run_transformer(transformer), other, rtol=1e-3, atol=1e-3)
+
+    if offload:
+        # a slot covers the offloaded layers too, also after they were made resident
+        transformer.transformer_blocks[0].m.setResidentLayers([True] * (19 + 38))
+        transformer.activate_lora_slot("realism")
+        torch.testing.assert_close(run_transformer(transformer), reference, rtol=1e-3, atol=1e-3)
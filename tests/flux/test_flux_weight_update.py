@@ -0,0 +1,69 @@
+import os
+
+import pytest
+import torch
+from huggingface_hub import hf_hub_download
+from safetensors.torch import load_file, save_file
+
+from nunchaku import NunchakuFluxTransformer2dModel
+from nunchaku.utils import get_precision, is_turing
+from .utils import run_transformer
+
+NUM_LAYERS = 19 + 38
+# layers whose weights differ in the new checkpoint, one resident and one offloaded after the update
+CHANGED_PREFIXES = ("transformer_blocks.1.", "single_transformer_blocks.0.")
+
+
+def make_checkpoint(repo: str, dirname: str, plain: bool) -> str:
+    """Write a copy of the checkpoint of `repo` to `dirname` with new weights in CHANGED_PREFIXES.
+
+    With `plain` the W4A4 layers there get an unquantized `weight` instead of qweight / wscales.
+    """
+    sd = load_file(hf_hub_download(repo, "transformer_blocks.safetensors"))
+    generator = torch.Generator().manual_seed(0)
+    for k in [k for k in sd if k.startswith(CHANGED_PREFIXES) and k.endswith(".qweight")]:
+        prefix = k.removesuffix("qweight")
+        if prefix + "smooth" not in sd:
+            # AWQ layer
+            continue
+        if plain:
+            out_features, in_features = sd[k].shape[0], sd[k].shape[1] * 2
+            for key in ("qweight", "wscales", "wtscale"):
+                sd.pop(prefix + key, None)
+            weight = torch.randn(out_features, in_features, generator=generator) * 0.02
+            sd[prefix + "weight"] = weight.to(torch.bfloat16)
+        else:
+            sd[k] = torch.bitwise_not(sd[k])
+    save_file(sd, os.path.join(dirname, "transformer_blocks.safetensors"))
+    unquantized_part_path = hf_hub_download(repo, "unquantized_layers.safetensors")
+    os.symlink(unquantized_part_path, os.path.join(dirname, "unquantized_layers.safetensors"))
+    return os.path.join(dirname, "transformer_blocks.safetensors")
+
+
+@pytest.mark.skipif(is_turing(), reason="Skip tests due to Turing GPUs")
+@pytest.mark.parametrize("plain", [False, True])
+def test_flux_weight_update_resident_layers(plain: bool, tmp_path):
+    repo = f"mit-han-lab/svdq-{get_precision()}-flux.1-schnell"
+    path = make_checkpoint(repo, str(tmp_path), plain)
+
+    # every layer resident while the update is committed, then all but the first offloaded
+    transformer = NunchakuFluxTransformer2dModel.from_pretrained(repo, offload=True)
+    transformer.transformer_blocks[0].m.setResidentLayers([True] * NUM_LAYERS)
+    before = run_transformer(transformer)
+
+    transformer.prepare_weight_update(path)
+    # the staging thread reads the lazy-load state, it must not change under it
+    with pytest.raises(RuntimeError):
+        transformer.transformer_blocks[0].m.setResidentLayers([True] * NUM_LAYERS)
+    result = transformer.commit_weight_update()
+    assert result.num_changed > 0
+    # compared against the sources recorded at load, so the untouched layers are skipped on the first update
+    assert result.num_unchanged > 0
+    transformer.transformer_blocks[0].m.setResidentLayers([True] + [False] * (NUM_LAYERS - 1))
+    updated = run_transformer(transformer)
+    del transformer
+    torch.cuda.empty_cache()
+
+    reference = run_transformer(NunchakuFluxTransformer2dModel.from_pretrained(str(tmp_path)))
+    assert not torch.allclose(before, reference)
+    torch.testing.assert_close(updated, reference, rtol=1e-3, atol=1e-3)
@@ -270,3 +270,20 @@ def run_test(
     lpips = compute_lpips(save_dir_16bit, save_dir_4bit)
     print(f"lpips: {lpips}")
     assert lpips < expected_lpips * 1.05
+
+
+def run_transformer(transformer: NunchakuFluxTransformer2dModel) -> torch.Tensor:
+    """One forward of the transformer on fixed random inputs of 256 image and 256 text tokens."""
+    generator = torch.Generator().manual_seed(1)
+    img_tokens, txt_tokens = 256, 256
+    with torch.inference_mode():
+        return transformer(
+            hidden_states=torch.randn(1, img_tokens, 64, generator=generator).to("cuda", torch.bfloat16),
+            encoder_hidden_states=torch.randn(1, txt_tokens, 4096, generator=generator).to("cuda", torch.bfloat16),
+            pooled_projections=torch.randn(1, 768, generator=generator).to("cuda", torch.bfloat16),
+            timestep=torch.tensor([0.5], device="cuda", dtype=torch.bfloat16),
+            img_ids=torch.zeros(img_tokens, 3, device="cuda"),
+            txt_ids=torch.zeros(txt_tokens, 3, device="cuda"),
+            guidance=torch.tensor([3.5], device="cuda") if transformer.config.guidance_embeds else None,
+            return_dict=False,
+        )[0].float()